@@ -0,0 +1,321 @@
+/* Copyright 2012 William Woodall and John Harrison
+ *
+ * Benchmarks of the protocol modules: CRC throughput, NMEA parsing and
+ * Modbus RTU transaction rates.
+ */
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+#include "benchmark/benchmark.h"
+
+#include "serial/crc.h"
+#include "serial/modbus.h"
+#include "serial/nmea.h"
+#include "pty_peer.h"
+
+using std::string;
+using std::vector;
+
+using serial::Serial;
+using serial::Timeout;
+
+using serial_bench::Peer;
+using serial_bench::Pty;
+using serial_bench::write_all;
+
+namespace {
+
+// CRC
+
+typedef uint32_t (*crc_fn) (const uint8_t *data, size_t size);
+
+uint32_t crc8 (const uint8_t *d, size_t n) { return serial::crc::crc8 (d, n); }
+uint32_t crc16_modbus (const uint8_t *d, size_t n) { return serial::crc::crc16_modbus (d, n); }
+uint32_t crc16_ccitt (const uint8_t *d, size_t n) { return serial::crc::crc16_ccitt (d, n); }
+uint32_t crc32 (const uint8_t *d, size_t n) { return serial::crc::crc32 (d, n); }
+uint32_t crc32c (const uint8_t *d, size_t n) { return serial::crc::crc32c (d, n); }
+
+void
+run_crc (benchmark::State &state, crc_fn fn, const char *implementation)
+{
+  vector<uint8_t> data (state.range (0));
+  for (size_t i = 0; i < data.size (); ++i) {
+    data[i] = static_cast<uint8_t> (i * 131 + 7);
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize (fn (&data[0], data.size ()));
+  }
+  state.SetBytesProcessed (state.iterations () * data.size ());
+  state.SetLabel (implementation);
+}
+
+void BM_Crc8 (benchmark::State &state) { run_crc (state, crc8, "table"); }
+void BM_Crc16Modbus (benchmark::State &state) { run_crc (state, crc16_modbus, "table"); }
+void BM_Crc16Ccitt (benchmark::State &state) { run_crc (state, crc16_ccitt, "table"); }
+
+void
+BM_Crc32 (benchmark::State &state)
+{
+  run_crc (state, crc32, serial::crc::crc32Implementation ());
+}
+
+void
+BM_Crc32c (benchmark::State &state)
+{
+  run_crc (state, crc32c, serial::crc::crc32cImplementation ());
+}
+
+BENCHMARK (BM_Crc8)->Arg (64)->Arg (4096)->Arg (1 << 20);
+BENCHMARK (BM_Crc16Modbus)->Arg (64)->Arg (4096)->Arg (1 << 20);
+BENCHMARK (BM_Crc16Ccitt)->Arg (64)->Arg (4096)->Arg (1 << 20);
+BENCHMARK (BM_Crc32)->Arg (64)->Arg (4096)->Arg (1 << 20);
+BENCHMARK (BM_Crc32c)->Arg (64)->Arg (4096)->Arg (1 << 20);
+
+// NMEA
+
+string
+nmea_sentence (const string &body)
+{
+  uint8_t checksum = 0;
+  for (size_t i = 0; i < body.size (); ++i) {
+    checksum ^= static_cast<uint8_t> (body[i]);
+  }
+  char trailer[8];
+  snprintf (trailer, sizeof (trailer), "*%02X\r\n", checksum);
+  return "$" + body + trailer;
+}
+
+// One epoch of a multi-constellation receiver (GPS, GLONASS, Galileo and
+// BeiDou), as sent 10 times a second.
+string
+nmea_epoch (size_t &sentences)
+{
+  const char *talkers[] = { "GP", "GL", "GA", "GB" };
+  string epoch;
+  epoch += nmea_sentence ("GNRMC,123519.00,A,4807.03812,N,01131.00012,E,"
+                          "0.022,,230394,,,A,V");
+  epoch += nmea_sentence ("GNGGA,123519.00,4807.03812,N,01131.00012,E,1,32,"
+                          "0.55,545.4,M,46.9,M,,");
+  for (int system = 1; system <= 4; ++system) {
+    char body[96];
+    snprintf (body, sizeof (body),
+              "GNGSA,A,3,02,05,07,09,13,15,18,20,,,,,0.98,0.55,0.81,%d",
+              system);
+    epoch += nmea_sentence (body);
+  }
+  sentences = 6;
+  for (int t = 0; t < 4; ++t) {
+    for (int part = 1; part <= 3; ++part) {
+      string body = string (talkers[t]) + "GSV,3,";
+      char fields[96];
+      snprintf (fields, sizeof (fields), "%d,12", part);
+      body += fields;
+      for (int sv = 0; sv < 4; ++sv) {
+        int prn = (part - 1) * 4 + sv + 1;
+        snprintf (fields, sizeof (fields), ",%02d,%02d,%03d,%02d",
+                  prn, 10 + prn * 3, prn * 29 % 360, 30 + prn);
+        body += fields;
+      }
+      epoch += nmea_sentence (body + ",1");
+      ++sentences;
+    }
+  }
+  epoch += nmea_sentence ("GNVTG,,T,,M,0.022,N,0.041,K,A");
+  epoch += nmea_sentence ("GNZDA,123519.00,23,03,1994,00,00");
+  sentences += 2;
+  return epoch;
+}
+
+class FieldCounter : public serial::nmea::Handler {
+public:
+  FieldCounter () : sentences (0), fields (0) {}
+
+  virtual void onSentence (const serial::nmea::Sentence &sentence) {
+    ++sentences;
+    fields += sentence.fields.size ();
+  }
+
+  size_t sentences;
+  size_t fields;
+};
+
+void
+run_nmea_parse (benchmark::State &state, const string &input)
+{
+  serial::nmea::Parser parser;
+  FieldCounter counter;
+  const uint8_t *data = reinterpret_cast<const uint8_t *> (input.data ());
+  for (auto _ : state) {
+    parser.parse (data, input.size (), counter);
+  }
+  benchmark::DoNotOptimize (counter.fields);
+  state.SetItemsProcessed (counter.sentences);
+  state.SetBytesProcessed (state.iterations () * input.size ());
+}
+
+// Parsing an epoch from memory.
+void
+BM_NmeaParse (benchmark::State &state)
+{
+  size_t sentences;
+  run_nmea_parse (state, nmea_epoch (sentences));
+}
+BENCHMARK (BM_NmeaParse);
+
+// Latency of an epoch through a pty, from the write on the master side to
+// the last sentence delivered.  At 10 Hz this has to stay well below 100ms.
+void
+BM_NmeaSerialEpoch (benchmark::State &state)
+{
+  size_t sentences;
+  string epoch = nmea_epoch (sentences);
+  Pty pty;
+  Serial port (pty.name (), 115200, Timeout::simpleTimeout (1000));
+  serial::nmea::Parser parser;
+  FieldCounter counter;
+  for (auto _ : state) {
+    size_t target = counter.sentences + sentences;
+    write_all (pty.master (), epoch.data (), epoch.size ());
+    // Every read consumes at least one byte unless it times out.
+    for (size_t reads = 0; counter.sentences < target; ++reads) {
+      if (reads > epoch.size ()) {
+        state.SkipWithError ("epoch lost");
+        break;
+      }
+      parser.read (port, counter);
+    }
+  }
+  state.SetItemsProcessed (counter.sentences);
+  state.SetBytesProcessed (state.iterations () * epoch.size ());
+}
+BENCHMARK (BM_NmeaSerialEpoch)->UseRealTime ();
+
+void
+BM_NmeaReplay (benchmark::State &state, const string &input)
+{
+  run_nmea_parse (state, input);
+}
+
+// Modbus
+
+// RTU slave on the master side of a pty answering read holding registers
+// requests from any unit.
+class Slave : public Peer {
+public:
+  explicit Slave (int fd) : Peer (fd, POLLIN) { start (); }
+
+  ~Slave () { stop (); }
+
+protected:
+  virtual void step (int fd) {
+    uint8_t buffer[256];
+    ssize_t n = ::read (fd, buffer, sizeof (buffer));
+    if (n <= 0) {
+      return;
+    }
+    request_.insert (request_.end (), buffer, buffer + n);
+    if (request_.size () < 8) {
+      return;
+    }
+    uint16_t count = static_cast<uint16_t> ((request_[4] << 8) | request_[5]);
+    response_.assign (request_.begin (), request_.begin () + 2);
+    response_.push_back (static_cast<uint8_t> (2 * count));
+    for (uint16_t i = 0; i < count; ++i) {
+      response_.push_back (0x12);
+      response_.push_back (static_cast<uint8_t> (i));
+    }
+    uint16_t crc = serial::crc::crc16_modbus (&response_[0], response_.size ());
+    response_.push_back (static_cast<uint8_t> (crc & 0xFF));
+    response_.push_back (static_cast<uint8_t> (crc >> 8));
+    request_.clear ();
+    write_all (fd, &response_[0], response_.size ());
+  }
+
+private:
+  vector<uint8_t> request_;
+  vector<uint8_t> response_;
+};
+
+// Transactions per second reading range(0) holding registers.  The pty
+// ignores the baudrate, but the master still waits t3.5 between frames.
+void
+BM_ModbusReadRegisters (benchmark::State &state)
+{
+  Pty pty;
+  Serial port (pty.name (), 115200);
+  Slave slave (pty.master ());
+  serial::modbus::RtuMaster master (port, 100);
+  uint16_t count = static_cast<uint16_t> (state.range (0));
+  for (auto _ : state) {
+    try {
+      benchmark::DoNotOptimize (master.readHoldingRegisters (1, 0, count));
+    } catch (const std::exception &e) {
+      state.SkipWithError (e.what ());
+      break;
+    }
+  }
+  state.SetItemsProcessed (state.iterations ());
+}
+BENCHMARK (BM_ModbusReadRegisters)->Arg (1)->Arg (125)->UseRealTime ();
+
+// Transactions per second over range(0) ports driven by an RtuScheduler,
+// one transaction per port per iteration.
+void
+BM_ModbusScheduler (benchmark::State &state)
+{
+  size_t ports = static_cast<size_t> (state.range (0));
+  vector<Pty*> ptys;
+  vector<Serial*> serials;
+  vector<Slave*> slaves;
+  vector<serial::modbus::RtuMaster*> masters;
+  serial::modbus::RtuScheduler scheduler;
+  vector<serial::modbus::Transaction> batch;
+  for (size_t i = 0; i < ports; ++i) {
+    ptys.push_back (new Pty);
+    serials.push_back (new Serial (ptys[i]->name (), 115200));
+    slaves.push_back (new Slave (ptys[i]->master ()));
+    masters.push_back (new serial::modbus::RtuMaster (*serials[i], 100));
+    serial::modbus::Transaction t (scheduler.addMaster (masters[i]), 1);
+    const uint8_t request[] = { 0x03, 0x00, 0x00, 0x00, 0x0A };
+    t.request.assign (request, request + sizeof (request));
+    batch.push_back (t);
+  }
+  for (auto _ : state) {
+    scheduler.execute (batch);
+    for (size_t i = 0; i < batch.size (); ++i) {
+      if (!batch[i].ok) {
+        state.SkipWithError (batch[i].error.c_str ());
+        break;
+      }
+    }
+  }
+  state.SetItemsProcessed (state.iterations () * ports);
+  for (size_t i = 0; i < ports; ++i) {
+    delete masters[i];
+    delete slaves[i];
+    delete serials[i];
+    delete ptys[i];
+  }
+}
+BENCHMARK (BM_ModbusScheduler)->Arg (1)->Arg (4)->Arg (16)->UseRealTime ();
+
+} // namespace
+
+void
+register_nmea_replay (const char *path)
+{
+  std::ifstream file (path, std::ios::binary);
+  if (!file) {
+    fprintf (stderr, "Cannot read NMEA replay file %s\n", path);
+    exit (1);
+  }
+  std::stringstream contents;
+  contents << file.rdbuf ();
+  benchmark::RegisterBenchmark ("BM_NmeaReplay", BM_NmeaReplay,
+                                contents.str ());
+}
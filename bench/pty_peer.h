@@ -0,0 +1,188 @@
+/* Copyright 2012 William Woodall and John Harrison
+ *
+ * Pseudo terminals and the threads driving their master side, shared by
+ * the benchmarks.  The Serial under test opens the slave side by name.
+ */
+
+#ifndef SERIAL_BENCH_PTY_PEER_H
+#define SERIAL_BENCH_PTY_PEER_H
+
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <pty.h>
+#else
+#include <util.h>
+#endif
+
+#include "serial/serial.h"
+
+namespace serial_bench {
+
+/*! A pty pair, the slave stays open so the pty survives Serial::close. */
+class Pty {
+public:
+  Pty () {
+    char name[100];
+    if (openpty (&master_, &slave_, name, NULL, NULL) == -1) {
+      perror ("openpty");
+      exit (127);
+    }
+    name_ = name;
+  }
+
+  ~Pty () {
+    close (master_);
+    close (slave_);
+  }
+
+  int master () const { return master_; }
+
+  const std::string &name () const { return name_; }
+
+private:
+  Pty (const Pty&);
+  Pty& operator= (const Pty&);
+
+  int master_;
+  int slave_;
+  std::string name_;
+};
+
+/*!
+ * Thread running on the master side of a pty until it is destroyed.
+ * Subclasses implement step, which is called whenever poll reports the
+ * requested events.
+ */
+class Peer {
+public:
+  Peer (int fd, short events) : fd_ (fd), events_ (events), running_ (true) {}
+
+  virtual ~Peer () {}
+
+  void start () {
+    pthread_create (&thread_, NULL, &Peer::run, this);
+  }
+
+  void stop () {
+    if (running_) {
+      running_ = false;
+      pthread_join (thread_, NULL);
+    }
+  }
+
+protected:
+  virtual void step (int fd) = 0;
+
+private:
+  Peer (const Peer&);
+  Peer& operator= (const Peer&);
+
+  static void * run (void *arg) {
+    Peer *self = static_cast<Peer*> (arg);
+    while (self->running_) {
+      pollfd pfd = { self->fd_, self->events_, 0 };
+      if (poll (&pfd, 1, 10) > 0) {
+        self->step (self->fd_);
+      }
+    }
+    return NULL;
+  }
+
+  int fd_;
+  short events_;
+  volatile bool running_;
+  pthread_t thread_;
+};
+
+/*! Writes a repeating pattern as fast as the pty accepts it. */
+class Pump : public Peer {
+public:
+  Pump (int fd, const std::string &pattern)
+  : Peer (fd, POLLOUT), pattern_ (pattern + pattern), offset_ (0) {
+    // Non blocking, so the pump notices stop while the reader is gone.
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    start ();
+  }
+
+  ~Pump () { stop (); }
+
+protected:
+  virtual void step (int fd) {
+    // The doubled pattern lets every write start at the current offset.
+    size_t size = pattern_.size () / 2;
+    ssize_t n = ::write (fd, pattern_.data () + offset_, size);
+    if (n > 0) {
+      offset_ = (offset_ + n) % size;
+    }
+  }
+
+private:
+  std::string pattern_;
+  size_t offset_;
+};
+
+/*! Reads and discards everything. */
+class Drain : public Peer {
+public:
+  explicit Drain (int fd) : Peer (fd, POLLIN) { start (); }
+
+  ~Drain () { stop (); }
+
+protected:
+  virtual void step (int fd) {
+    char buffer[65536];
+    ssize_t n = ::read (fd, buffer, sizeof (buffer));
+    (void) n;
+  }
+};
+
+/*! Writes back everything it reads. */
+class Echo : public Peer {
+public:
+  explicit Echo (int fd) : Peer (fd, POLLIN) { start (); }
+
+  ~Echo () { stop (); }
+
+protected:
+  virtual void step (int fd) {
+    char buffer[4096];
+    ssize_t n = ::read (fd, buffer, sizeof (buffer));
+    for (ssize_t done = 0; n > 0 && done < n; ) {
+      ssize_t written = ::write (fd, buffer + done, n - done);
+      if (written <= 0) {
+        break;
+      }
+      done += written;
+    }
+  }
+};
+
+/*! Writes all of size bytes to fd, waiting while the pty is full. */
+inline void
+write_all (int fd, const void *data, size_t size)
+{
+  const char *p = static_cast<const char *> (data);
+  while (size > 0) {
+    ssize_t n = ::write (fd, p, size);
+    if (n > 0) {
+      p += n;
+      size -= n;
+    } else {
+      pollfd pfd = { fd, POLLOUT, 0 };
+      poll (&pfd, 1, 10);
+    }
+  }
+}
+
+} // namespace serial_bench
+
+#endif
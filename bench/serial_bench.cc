@@ -0,0 +1,249 @@
+/* Copyright 2012 William Woodall and John Harrison
+ *
+ * Benchmarks of Serial over pseudo terminals.  Run with
+ *
+ *   serial_bench --benchmark_out=results.json --benchmark_out_format=json
+ *
+ * to keep machine readable results, and add --nmea_replay=<file> to also
+ * measure the NMEA parser on a recorded log.
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+#include "benchmark/benchmark.h"
+
+#include "serial/serial.h"
+#include "pty_peer.h"
+
+using std::string;
+using std::vector;
+
+using serial::Serial;
+using serial::Timeout;
+
+using serial_bench::Drain;
+using serial_bench::Echo;
+using serial_bench::Pty;
+using serial_bench::Pump;
+using serial_bench::write_all;
+
+void register_nmea_replay (const char *path);
+
+namespace {
+
+double
+now_us ()
+{
+  timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// A pty has no line rate, so the streaming benchmarks set an inter-byte
+// timeout, which skips the wait read does for the rest of a fixed length
+// read to come in at the configured baudrate.
+Timeout
+stream_timeout ()
+{
+  return Timeout (10, 1000, 0, 1000, 0);
+}
+
+string
+make_lines (size_t line_size, size_t count)
+{
+  string lines;
+  for (size_t i = 0; i < count; ++i) {
+    string line (line_size - 1, static_cast<char> ('a' + i % 26));
+    lines += line + "\n";
+  }
+  return lines;
+}
+
+// Bulk reads of range(0) bytes while a pump keeps the pty full.
+void
+BM_Read (benchmark::State &state)
+{
+  Pty pty;
+  Serial port (pty.name (), 115200, stream_timeout ());
+  Pump pump (pty.master (), string (4096, 'x'));
+  vector<uint8_t> buffer (state.range (0));
+  for (auto _ : state) {
+    size_t n = port.read (&buffer[0], buffer.size ());
+    if (n != buffer.size ()) {
+      state.SkipWithError ("short read");
+      break;
+    }
+  }
+  state.SetBytesProcessed (state.iterations () * buffer.size ());
+}
+BENCHMARK (BM_Read)->Arg (64)->Arg (1024)->Arg (4096)->Arg (65536)->UseRealTime ();
+
+// Bulk writes of range(0) bytes while a drain empties the pty.
+void
+BM_Write (benchmark::State &state)
+{
+  Pty pty;
+  Serial port (pty.name (), 115200, stream_timeout ());
+  Drain drain (pty.master ());
+  vector<uint8_t> buffer (state.range (0), 'x');
+  for (auto _ : state) {
+    size_t n = port.write (&buffer[0], buffer.size ());
+    if (n != buffer.size ()) {
+      state.SkipWithError ("short write");
+      break;
+    }
+  }
+  state.SetBytesProcessed (state.iterations () * buffer.size ());
+}
+BENCHMARK (BM_Write)->Arg (64)->Arg (1024)->Arg (4096)->Arg (65536)->UseRealTime ();
+
+// One readline call per iteration on lines of range(0) bytes.
+void
+BM_Readline (benchmark::State &state)
+{
+  Pty pty;
+  Serial port (pty.name (), 115200, stream_timeout ());
+  Pump pump (pty.master (), make_lines (state.range (0), 64));
+  string line;
+  for (auto _ : state) {
+    line.clear ();
+    if (port.readline (line) != static_cast<size_t> (state.range (0))) {
+      state.SkipWithError ("short line");
+      break;
+    }
+  }
+  state.SetItemsProcessed (state.iterations ());
+  state.SetBytesProcessed (state.iterations () * state.range (0));
+}
+BENCHMARK (BM_Readline)->Arg (16)->Arg (80)->Arg (512)->UseRealTime ();
+
+// One readlines call per iteration, returning 64 lines of range(0) bytes.
+void
+BM_Readlines (benchmark::State &state)
+{
+  Pty pty;
+  Serial port (pty.name (), 115200, stream_timeout ());
+  Pump pump (pty.master (), make_lines (state.range (0), 64));
+  size_t lines = 0;
+  for (auto _ : state) {
+    vector<string> result = port.readlines (64 * state.range (0));
+    lines += result.size ();
+  }
+  state.SetItemsProcessed (lines);
+  state.SetBytesProcessed (lines * state.range (0));
+}
+BENCHMARK (BM_Readlines)->Arg (16)->Arg (80)->Arg (512)->UseRealTime ();
+
+// Round trip of range(0) bytes through an echo on the master side.
+void
+BM_PingPong (benchmark::State &state)
+{
+  Pty pty;
+  Serial port (pty.name (), 115200, stream_timeout ());
+  Echo echo (pty.master ());
+  vector<uint8_t> request (state.range (0), 'p'), response (state.range (0));
+  for (auto _ : state) {
+    port.write (&request[0], request.size ());
+    if (port.read (&response[0], response.size ()) != response.size ()) {
+      state.SkipWithError ("short response");
+      break;
+    }
+  }
+  state.SetBytesProcessed (state.iterations () * request.size () * 2);
+}
+BENCHMARK (BM_PingPong)->Arg (1)->Arg (64)->Arg (1024)->UseRealTime ();
+
+// range(0) ports served round robin by one thread, one 64 byte message
+// per port per iteration.
+void
+BM_ManyPorts (benchmark::State &state)
+{
+  const size_t message = 64;
+  vector<Pty*> ptys;
+  vector<Serial*> ports;
+  for (int64_t i = 0; i < state.range (0); ++i) {
+    ptys.push_back (new Pty);
+    ports.push_back (new Serial (ptys.back ()->name (), 115200,
+                                 stream_timeout ()));
+  }
+  vector<uint8_t> out (message, 'm'), in (message);
+  for (auto _ : state) {
+    for (size_t i = 0; i < ptys.size (); ++i) {
+      write_all (ptys[i]->master (), &out[0], out.size ());
+    }
+    for (size_t i = 0; i < ports.size (); ++i) {
+      if (ports[i]->read (&in[0], in.size ()) != in.size ()) {
+        state.SkipWithError ("short read");
+        break;
+      }
+    }
+  }
+  state.SetItemsProcessed (state.iterations () * ports.size ());
+  state.SetBytesProcessed (state.iterations () * ports.size () * message);
+  for (size_t i = 0; i < ports.size (); ++i) {
+    delete ports[i];
+    delete ptys[i];
+  }
+}
+BENCHMARK (BM_ManyPorts)->Arg (1)->Arg (8)->Arg (32)->Arg (128)->UseRealTime ();
+
+// Reads that time out after range(0) ms.  The iteration time is the time
+// the read took, the counters report how late it returned, negative if it
+// returned early.
+void
+BM_TimeoutAccuracy (benchmark::State &state)
+{
+  Pty pty;
+  uint32_t timeout = static_cast<uint32_t> (state.range (0));
+  Serial port (pty.name (), 115200, Timeout::simpleTimeout (timeout));
+  uint8_t byte;
+  double total_late_us = 0, max_late_us = -1e9;
+  for (auto _ : state) {
+    double start = now_us ();
+    size_t n = port.read (&byte, 1);
+    double elapsed = now_us () - start;
+    if (n != 0) {
+      state.SkipWithError ("unexpected data");
+      break;
+    }
+    state.SetIterationTime (elapsed / 1e6);
+    double late = elapsed - timeout * 1e3;
+    total_late_us += late;
+    max_late_us = std::max (max_late_us, late);
+  }
+  state.counters["late_us"] = benchmark::Counter (
+    total_late_us, benchmark::Counter::kAvgIterations);
+  state.counters["max_late_us"] = max_late_us;
+}
+BENCHMARK (BM_TimeoutAccuracy)->Arg (1)->Arg (10)->Arg (50)->UseManualTime ();
+
+} // namespace
+
+int
+main (int argc, char **argv)
+{
+  // Take our own flags out before Google Benchmark sees them.
+  const string replay_flag = "--nmea_replay=";
+  int kept = 1;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare (0, replay_flag.size (), replay_flag) == 0) {
+      register_nmea_replay (argv[i] + replay_flag.size ());
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  argc = kept;
+
+  benchmark::Initialize (&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments (argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks ();
+  benchmark::Shutdown ();
+  return 0;
+}
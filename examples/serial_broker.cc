@@ -0,0 +1,66 @@
+/***
+ * This example serves a serial port to any number of processes.
+ *
+ * Run it with the port, the baudrate and a segment name, e.g.
+ *
+ * <pre>
+ *   serial_broker /dev/ttyUSB0 115200 /gps
+ * </pre>
+ *
+ * and other processes can then read and write the port through
+ * serial::broker::SharedSerial ("/gps").  It prints the clients attached
+ * every few seconds and stops when the port fails.
+ */
+
+#include <string>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "serial/broker.h"
+
+using std::string;
+using std::exception;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::vector;
+
+int run(int argc, char **argv)
+{
+  if (argc < 4) {
+    cerr << "Usage: serial_broker <serial port address> <baudrate> "
+         << "<segment name>" << endl;
+    return 1;
+  }
+  unsigned long baud = 0;
+  sscanf(argv[2], "%lu", &baud);
+
+  serial::Serial port(argv[1], baud, serial::Timeout::simpleTimeout(100));
+  serial::broker::Broker broker(port, argv[3]);
+  cout << "Serving " << argv[1] << " as " << argv[3] << endl;
+
+  while (broker.isRunning()) {
+    sleep(5);
+    vector<serial::broker::ConsumerInfo> consumers = broker.getConsumers();
+    cout << broker.getBytesPublished() << " bytes published, "
+         << consumers.size() << " clients" << endl;
+    for (size_t i = 0; i < consumers.size(); ++i) {
+      cout << "  pid " << consumers[i].pid << ": " << consumers[i].lag
+           << " bytes behind, " << consumers[i].dropped << " dropped" << endl;
+    }
+  }
+  cerr << "The port failed, stopping." << endl;
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  try {
+    return run(argc, argv);
+  } catch (exception &e) {
+    cerr << "Unhandled Exception: " << e.what() << endl;
+  }
+  return 1;
+}
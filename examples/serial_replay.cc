@@ -0,0 +1,64 @@
+/***
+ * This example replays a capture made with serial::capture::Writer into a
+ * pseudo terminal, for an application to open as its serial port.
+ *
+ * <pre>
+ *   serial_replay field.cap 1      # original timing
+ *   serial_replay field.cap 10     # ten times faster
+ *   serial_replay field.cap 0      # as fast as possible
+ * </pre>
+ *
+ * It prints the device to open, waits for Enter, replays the received
+ * bytes of the capture and reports the throughput.
+ */
+
+#include <string>
+#include <iostream>
+#include <cstdio>
+
+#include "serial/replay.h"
+
+using std::string;
+using std::exception;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+int run(int argc, char **argv)
+{
+  if (argc < 2) {
+    cerr << "Usage: serial_replay <capture file> [speed]" << endl;
+    return 1;
+  }
+  double speed = 1.0;
+  if (argc > 2) {
+    sscanf(argv[2], "%lf", &speed);
+  }
+
+  serial::capture::Reader reader(argv[1]);
+  serial::replay::Replayer replayer(reader);
+  replayer.setSpeed(speed);
+  cout << "Open " << replayer.getPortName()
+       << " and press Enter to start the replay." << endl;
+  string line;
+  std::getline(std::cin, line);
+
+  serial::replay::ReplayStats stats = replayer.run();
+  cout << stats.chunks << " chunks, " << stats.bytes << " bytes in "
+       << stats.elapsed_ns / 1e6 << " ms, "
+       << stats.bytesPerSecond() << " bytes/s" << endl;
+  if (stats.chunks > 0 && speed > 0) {
+    cout << "lateness: max " << stats.max_lateness_ns / 1e3 << " us, mean "
+         << stats.total_lateness_ns / 1e3 / stats.chunks << " us" << endl;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  try {
+    return run(argc, argv);
+  } catch (exception &e) {
+    cerr << "Unhandled Exception: " << e.what() << endl;
+  }
+  return 1;
+}
@@ -0,0 +1,273 @@
+/*!
+ * \file serial/broker.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This lets several processes share one serial port.  A Broker owns the
+ * port and publishes the received bytes into a POSIX shared memory
+ * segment, and SharedSerial reads them from there with the read and
+ * readline calls of Serial.  Writes of the clients are queued in the same
+ * segment and written to the port by the broker.  Only available on Unix.
+ */
+
+#ifndef SERIAL_BROKER_H
+#define SERIAL_BROKER_H
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "serial/serial.h"
+
+namespace serial {
+namespace broker {
+
+// Layout of the shared memory segment, private to the implementation.
+struct Segment;
+
+/*!
+ * Structure describing a SharedSerial attached to a broker.
+ */
+struct ConsumerInfo {
+  /*! Process id of the client. */
+  uint32_t pid;
+  /*! Bytes published which the client has not read yet. */
+  uint64_t lag;
+  /*! Bytes the client lost because they were overwritten unread. */
+  uint64_t dropped;
+
+  ConsumerInfo () : pid(0), lag(0), dropped(0) {}
+};
+
+/*!
+ * Class that serves a serial port to SharedSerial clients in any process.
+ *
+ * Received bytes go into a ring in shared memory which every client reads
+ * at its own pace.  The broker never waits for a client: one that falls a
+ * whole ring behind loses the oldest bytes, and counts them.  Writes from
+ * the clients are queued in the segment and written to the port in order,
+ * each write of up to half the queue as a whole.
+ */
+class Broker {
+public:
+  /*!
+   * Creates the shared memory segment and starts serving the port.  A
+   * segment left behind by a broker which stopped or died is replaced.
+   *
+   * \param port An open port, which must outlive the broker.  It should
+   * not be read by anything else.
+   * \param name Name of the segment as for shm_open, e.g. "/imu".
+   * \param rx_capacity Size in bytes of the receive ring, a power of two.
+   * \param tx_capacity Size in bytes of the write queue, a power of two.
+   * \param mode Permissions of the segment as for shm_open.  The default
+   * only lets processes of the same user attach.
+   *
+   * \throw std::invalid_argument if a capacity is not a power of two of
+   * at least 4096.
+   * \throw serial::SerialException if a running broker owns the segment,
+   * or if it cannot be created.
+   */
+  Broker (Serial &port, const std::string &name,
+          size_t rx_capacity = 1 << 20, size_t tx_capacity = 1 << 16,
+          mode_t mode = 0600);
+
+  /*! Stops serving the port and removes the segment. */
+  virtual ~Broker ();
+
+  /*! Stops the threads serving the port.  Clients then read no more data
+   * and their writes fail.  Returns within about 100 milliseconds.
+   */
+  void
+  stop ();
+
+  /*! Returns false once stopped, or if the port failed. */
+  bool
+  isRunning () const;
+
+  /*! Returns the clients attached to the segment. */
+  std::vector<ConsumerInfo>
+  getConsumers () const;
+
+  /*! Returns the number of bytes received from the port and published. */
+  uint64_t
+  getBytesPublished () const;
+
+private:
+  // Disable copy constructors
+  Broker(const Broker&);
+  Broker& operator=(const Broker&);
+
+  static void *
+  readThread_ (void *arg);
+
+  void
+  read_ ();
+
+  static void *
+  writeThread_ (void *arg);
+
+  void
+  write_ ();
+
+  void
+  publish_ (const uint8_t *data, size_t size);
+
+  Serial &port_;
+  std::string name_;
+  Segment *segment_;
+  size_t segment_size_;
+  uint8_t *rx_ring_;
+  uint8_t *tx_ring_;
+
+  volatile bool stopping_;
+  bool started_;
+  pthread_t read_thread_;
+  pthread_t write_thread_;
+};
+
+/*!
+ * Class that reads and writes a serial port served by a Broker.
+ *
+ * Reading copies from shared memory and makes no system call unless it
+ * has to wait for data.  A client sees the bytes received after it was
+ * created.  A SharedSerial is not thread safe, each thread should create
+ * its own.
+ */
+class SharedSerial {
+public:
+  /*!
+   * Attaches to the segment of a broker.
+   *
+   * \param name Name of the segment given to the Broker.
+   * \param timeout The read and write timeouts, as for Serial.
+   *
+   * \throw serial::SerialException if there is no such segment or no free
+   * client slot in it.
+   */
+  explicit SharedSerial (const std::string &name,
+                         Timeout timeout = Timeout ());
+
+  /*! Detaches from the segment. */
+  virtual ~SharedSerial ();
+
+  /*! Return the number of bytes ready to be read. */
+  size_t
+  available ();
+
+  /*! Read a given amount of bytes, see Serial::read.
+   *
+   * \return A size_t representing the number of bytes read.
+   */
+  size_t
+  read (uint8_t *buffer, size_t size);
+
+  /*! Read a given amount of bytes into a std::vector, see Serial::read. */
+  size_t
+  read (std::vector<uint8_t> &buffer, size_t size = 1);
+
+  /*! Read a given amount of bytes into a std::string, see Serial::read. */
+  size_t
+  read (std::string &buffer, size_t size = 1);
+
+  /*! Read a given amount of bytes and return them, see Serial::read. */
+  std::string
+  read (size_t size = 1);
+
+  /*! Reads until a line has been read, see Serial::readline. */
+  size_t
+  readline (std::string &buffer, size_t size = 65536, std::string eol = "\n");
+
+  /*! Reads until a line has been read, see Serial::readline. */
+  std::string
+  readline (size_t size = 65536, std::string eol = "\n");
+
+  /*! Queues bytes for the broker to write to the port.
+   *
+   * Returns once the bytes are queued, or when the write timeout passes
+   * with the queue full.
+   *
+   * \return A size_t representing the number of bytes queued.
+   *
+   * \throw serial::SerialException if the broker is not running.
+   */
+  size_t
+  write (const uint8_t *data, size_t size);
+
+  /*! Queues the bytes of a std::vector, see write (const uint8_t *, size_t). */
+  size_t
+  write (const std::vector<uint8_t> &data);
+
+  /*! Queues the bytes of a std::string, see write (const uint8_t *, size_t). */
+  size_t
+  write (const std::string &data);
+
+  /*! Sets the timeout for reads and writes, see Serial::setTimeout. */
+  void
+  setTimeout (const Timeout &timeout);
+
+  /*! Gets the timeout for reads and writes. */
+  Timeout
+  getTimeout () const;
+
+  /*! Returns the number of bytes overwritten before they were read. */
+  uint64_t
+  getDroppedBytes () const;
+
+private:
+  // Disable copy constructors
+  SharedSerial(const SharedSerial&);
+  SharedSerial& operator=(const SharedSerial&);
+
+  // Copies up to size published bytes, returns the number copied.
+  size_t
+  copy_ (uint8_t *buffer, size_t size);
+
+  // Waits until bytes past the cursor are published or deadline_ns.
+  void
+  waitPublished_ (uint64_t deadline_ns);
+
+  // Queues one record of at most half the queue.
+  bool
+  queue_ (const uint8_t *data, size_t size, uint64_t deadline_ns);
+
+  Segment *segment_;
+  size_t segment_size_;
+  const uint8_t *rx_ring_;
+  uint8_t *tx_ring_;
+  size_t slot_;             // Index of the consumer slot of this client
+
+  Timeout timeout_;
+  uint64_t cursor_;         // Next byte to read
+  uint64_t dropped_;
+};
+
+} // namespace broker
+} // namespace serial
+
+#endif // SERIAL_BROKER_H
@@ -0,0 +1,245 @@
+/*!
+ * \file serial/capture.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * \section DESCRIPTION
+ *
+ * This records serial traffic into a compact binary capture file and reads
+ * it back.  The file is a page holding the file header followed by fixed
+ * size segments.  Each segment starts with a header holding the times of
+ * its first and last chunk, so a reader finds a time with a binary search
+ * over the segments.  A chunk is a 16 byte header (monotonic timestamp,
+ * payload size, port id and direction) followed by the payload, padded to
+ * 8 bytes.  Only available on Unix.
+ */
+
+#ifndef SERIAL_CAPTURE_H
+#define SERIAL_CAPTURE_H
+
+#include <string>
+
+#include <pthread.h>
+
+#include "serial/serial.h"
+
+namespace serial {
+namespace capture {
+
+/*! Direction of the bytes of a chunk. */
+typedef enum {
+  direction_rx = 1,
+  direction_tx = 2
+} direction_t;
+
+/*!
+ * A chunk of a capture, as returned by Reader::next.
+ */
+struct Chunk {
+  /*! Time of the chunk in nanoseconds, on the monotonic clock. */
+  uint64_t timestamp_ns;
+  /*! Port id given to Writer::append. */
+  uint16_t port;
+  /*! Whether the bytes were received or written. */
+  direction_t direction;
+  /*! The payload, in the mapping of the Reader. */
+  const uint8_t *data;
+  /*! Size of the payload in bytes. */
+  size_t size;
+
+  Chunk () : timestamp_ns(0), port(0), direction(direction_rx), data(NULL),
+             size(0) {}
+};
+
+/*!
+ * Class that appends chunks to a new capture file.
+ *
+ * Appending copies into a mapping of the file and makes no system call.
+ * A background thread maps and faults in the next segment ahead of time,
+ * and unmaps the finished ones.  append is thread safe, so the reading and
+ * writing threads of several ports can share one writer.
+ */
+class Writer {
+public:
+  /*!
+   * Creates the capture file, replacing any file at path.
+   *
+   * \param path Path of the capture file.
+   * \param segment_size Size in bytes of the segments, a multiple of the
+   * page size.  Chunks larger than a segment are split.
+   *
+   * \throw std::invalid_argument if segment_size is not a multiple of the
+   * page size.
+   * \throw serial::IOException if the file cannot be created.
+   */
+  explicit Writer (const std::string &path, size_t segment_size = 1 << 22);
+
+  /*! Closes the capture. */
+  virtual ~Writer ();
+
+  /*!
+   * Appends a chunk.
+   *
+   * \param direction Whether the bytes were received or written.
+   * \param port Id of the port, for captures of several ports.
+   * \param data The bytes.
+   * \param size Number of bytes.
+   * \param timestamp_ns Time of the chunk on the monotonic clock, or 0 for
+   * now.  Reader::seek expects the times of a capture not to decrease.
+   *
+   * \throw serial::IOException if the file could not be extended, or the
+   * writer is closed.
+   */
+  void
+  append (direction_t direction, uint16_t port, const uint8_t *data,
+          size_t size, uint64_t timestamp_ns = 0);
+
+  /*! Appends the bytes of a std::string, see append. */
+  void
+  append (direction_t direction, uint16_t port, const std::string &data,
+          uint64_t timestamp_ns = 0);
+
+  /*! Unmaps the file and drops the segment prepared ahead.  Further
+   * appends throw.
+   */
+  void
+  close ();
+
+  /*! Returns the number of payload bytes appended. */
+  uint64_t
+  getBytesWritten () const;
+
+private:
+  // Disable copy constructors
+  Writer(const Writer&);
+  Writer& operator=(const Writer&);
+
+  static void *
+  prepareThread_ (void *arg);
+
+  void
+  prepare_ ();
+
+  // Maps segment index, growing the file to hold it.
+  uint8_t *
+  map_ (uint32_t index);
+
+  // Moves on to the segment prepared ahead.
+  void
+  rollover_ ();
+
+  int fd_;
+  size_t data_offset_;      // Offset of the first segment in the file
+  size_t segment_size_;
+  uint8_t *segment_;
+  uint32_t segment_index_;
+  size_t offset_;           // Next chunk within segment_
+  uint64_t bytes_written_;
+  bool closed_;
+  mutable pthread_mutex_t mutex_;
+
+  // Shared with the prepare thread under prepare_mutex_.
+  uint8_t *next_;           // Segment segment_index_ + 1, once mapped
+  uint8_t *retired_;        // Segment to unmap
+  int prepare_error_;
+  bool stopping_;
+  pthread_t prepare_thread_;
+  pthread_mutex_t prepare_mutex_;
+  pthread_cond_t prepare_cond_;
+};
+
+/*!
+ * Class that iterates over the chunks of a capture file.
+ *
+ * The file is mapped read only and the chunks point into the mapping, so
+ * nothing is copied.  The reader sees the file as it was when opened.
+ */
+class Reader {
+public:
+  /*!
+   * Opens and maps a capture file.
+   *
+   * \throw serial::IOException if the file cannot be opened or mapped.
+   * \throw serial::SerialException if it is not a capture file.
+   */
+  explicit Reader (const std::string &path);
+
+  /*! Unmaps the file.  Chunks returned before are then invalid. */
+  virtual ~Reader ();
+
+  /*!
+   * Returns the next chunk.
+   *
+   * \param chunk The chunk, valid as long as the reader.
+   *
+   * \return false at the end of the capture.
+   */
+  bool
+  next (Chunk &chunk);
+
+  /*! Goes to the first chunk at or after timestamp_ns, on the monotonic
+   * clock, looking only at the segment which may hold it.
+   */
+  void
+  seek (uint64_t timestamp_ns);
+
+  /*! Goes back to the first chunk. */
+  void
+  rewind ();
+
+  /*! Returns the number of segments in the file. */
+  size_t
+  getSegmentCount () const;
+
+  /*! Returns the wall clock time, in nanoseconds since the epoch, at which
+   * the capture was created.  Together with getStartMonotonic it converts
+   * chunk timestamps to wall clock times.
+   */
+  uint64_t
+  getStartRealtime () const;
+
+  /*! Returns the monotonic time at which the capture was created. */
+  uint64_t
+  getStartMonotonic () const;
+
+private:
+  // Disable copy constructors
+  Reader(const Reader&);
+  Reader& operator=(const Reader&);
+
+  const uint8_t *mapping_;
+  size_t mapping_size_;
+  size_t data_offset_;
+  size_t segment_size_;
+  size_t segment_count_;
+  size_t segment_;          // Segment of the next chunk
+  size_t offset_;           // Next chunk within the segment
+};
+
+} // namespace capture
+} // namespace serial
+
+#endif // SERIAL_CAPTURE_H
@@ -0,0 +1,121 @@
+/*!
+ * \file serial/clock.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ *
+ * \section DESCRIPTION
+ *
+ * This lets the clock which timeouts and deadlines are measured on be
+ * replaced, so a test can run a port on a VirtualClock and exercise a five
+ * second timeout without waiting five seconds.
+ */
+
+#ifndef SERIAL_CLOCK_H
+#define SERIAL_CLOCK_H
+
+#include "serial/serial.h"
+
+namespace serial {
+
+/*!
+ * Interface of the clock timeouts and deadlines are measured on.
+ *
+ * \see serial::setClock
+ */
+class Clock {
+public:
+  virtual ~Clock () {}
+
+  /*! Returns the current time in nanoseconds.  It must never go back. */
+  virtual uint64_t
+  now () = 0;
+
+  /*! Returns once now() reads deadline_ns or later. */
+  virtual void
+  sleepUntil (uint64_t deadline_ns) = 0;
+};
+
+/*!
+ * Class of a clock which only moves when told to.
+ *
+ * A sleep does not block, it moves the clock forward to its deadline, so
+ * a wait for a timeout returns at once with the timeout passed.  The clock
+ * may be read, moved and slept on from several threads, every sleep moves
+ * it for everyone.
+ */
+class VirtualClock : public Clock {
+public:
+  /*! Creates a clock reading start_ns. */
+  explicit VirtualClock (uint64_t start_ns = 0);
+
+  virtual uint64_t
+  now ();
+
+  /*! Moves the clock forward to deadline_ns, unless it is already later. */
+  virtual void
+  sleepUntil (uint64_t deadline_ns);
+
+  /*! Moves the clock forward by ns nanoseconds. */
+  void
+  advance (uint64_t ns);
+
+  /*! Returns the number of sleeps which moved the clock. */
+  uint64_t
+  getSleeps () const;
+
+private:
+  uint64_t now_ns_;  // Atomic
+  uint64_t sleeps_;  // Atomic
+};
+
+/*!
+ * Replaces the clock timeouts and deadlines are measured on, for all
+ * ports and for serial::Deadline.
+ *
+ * With a clock set, a port waits for data and for room to write by
+ * checking once, sleeping on the clock until the wait would time out, and
+ * checking again, so bytes arriving during a wait are seen when it ends.
+ * The byte times, write pacing and modem line sequences sleep on the clock
+ * too.  The drain notification and the line monitor stay on the system
+ * clock, and so do the waits of ports on Windows.
+ *
+ * The clock should be set, and reset, while no port is reading or
+ * writing.
+ *
+ * \param clock The clock, which must outlive its use, or NULL for the
+ * monotonic clock of the system.
+ */
+void
+setClock (Clock *clock);
+
+/*! Returns the clock set with setClock, NULL for the system clock. */
+Clock *
+getClock ();
+
+} // namespace serial
+
+#endif // SERIAL_CLOCK_H
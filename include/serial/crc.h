@@ -0,0 +1,108 @@
+/*!
+ * \file serial/crc.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the checksums commonly used by protocols on top of serial
+ * ports.
+ *
+ * Every function takes the value returned for the previous chunk of data,
+ * so a checksum can be computed incrementally as chunks come in from
+ * Serial::read:
+ *
+ * <pre>
+ *   uint32_t crc = 0;
+ *   while ((bytes_read = my_serial.read(buffer, sizeof(buffer))) > 0) {
+ *     crc = serial::crc::crc32(buffer, bytes_read, crc);
+ *   }
+ * </pre>
+ *
+ * The lookup tables are built once, on first use.  CRC-32 and CRC-32C use
+ * slicing-by-8 in software, and hardware support is picked at runtime when
+ * available: PCLMULQDQ folding for CRC-32 and the SSE4.2 crc32 instruction
+ * for CRC-32C on x86, the ARMv8 CRC32 instructions for both on AArch64
+ * Linux.
+ */
+
+#ifndef SERIAL_CRC_H
+#define SERIAL_CRC_H
+
+#include "serial/serial.h"
+
+namespace serial {
+namespace crc {
+
+/*!
+ * CRC-8, polynomial 0x07, initial value 0x00, e.g. SMBus PEC.
+ */
+uint8_t
+crc8 (const uint8_t *data, size_t size, uint8_t crc = 0x00);
+
+/*!
+ * CRC-16/MODBUS, polynomial 0x8005 reflected, initial value 0xFFFF.  The
+ * result is sent low byte first.
+ */
+uint16_t
+crc16_modbus (const uint8_t *data, size_t size, uint16_t crc = 0xFFFF);
+
+/*!
+ * CRC-16/CCITT-FALSE, polynomial 0x1021, initial value 0xFFFF, e.g. XMODEM
+ * style protocols and many sensor frames.
+ */
+uint16_t
+crc16_ccitt (const uint8_t *data, size_t size, uint16_t crc = 0xFFFF);
+
+/*!
+ * CRC-32 as used by Ethernet, zlib and PNG, polynomial 0x04C11DB7.
+ */
+uint32_t
+crc32 (const uint8_t *data, size_t size, uint32_t crc = 0);
+
+/*!
+ * CRC-32C (Castagnoli), polynomial 0x1EDC6F41, as used by iSCSI and SCTP.
+ */
+uint32_t
+crc32c (const uint8_t *data, size_t size, uint32_t crc = 0);
+
+/*!
+ * Returns the name of the implementation crc32 uses on this machine,
+ * "pclmul", "armv8" or "slicing-by-8".
+ */
+const char *
+crc32Implementation ();
+
+/*!
+ * Returns the name of the implementation crc32c uses on this machine,
+ * "sse4.2", "armv8" or "slicing-by-8".
+ */
+const char *
+crc32cImplementation ();
+
+} // namespace crc
+} // namespace serial
+
+#endif
@@ -0,0 +1,407 @@
+/*!
+ * \file serial/framing.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides COBS and SLIP framing for binary protocols on top of
+ * serial::Serial, with streaming decoders that work on whole chunks as
+ * returned by Serial::read, and a reader for length prefixed frames which
+ * start with a sync pattern.
+ */
+
+#ifndef SERIAL_FRAMING_H
+#define SERIAL_FRAMING_H
+
+#include <vector>
+
+#include "serial/serial.h"
+
+namespace serial {
+namespace framing {
+
+/*! A decoded frame. */
+typedef std::vector<uint8_t> Frame;
+
+/*!
+ * Class that recycles frame buffers, so steady state decoding does not
+ * allocate.
+ *
+ * Frames handed out by acquire are owned by the caller until they are
+ * given back with release.  The pool is not thread safe.
+ */
+class FramePool {
+public:
+  /*!
+   * Creates an empty pool.
+   *
+   * \param frame_capacity Number of bytes reserved in each new frame.
+   */
+  explicit FramePool (size_t frame_capacity = 256);
+
+  /*! Destructor, frees the frames in the pool. */
+  virtual ~FramePool ();
+
+  /*! Returns an empty frame, reusing a released one if possible. */
+  Frame *
+  acquire ();
+
+  /*! Gives a frame back to the pool. */
+  void
+  release (Frame *frame);
+
+  /*! Releases every frame in the given list and clears the list. */
+  void
+  release (std::vector<Frame*> &frames);
+
+private:
+  // Disable copy constructors
+  FramePool(const FramePool&);
+  FramePool& operator=(const FramePool&);
+
+  size_t frame_capacity_;
+  std::vector<Frame*> free_;
+};
+
+/*!
+ * Interface of the framing encoders.
+ */
+class Encoder {
+public:
+  virtual ~Encoder () {}
+
+  /*! Largest possible encoded size, delimiters included, of size bytes. */
+  virtual size_t
+  maxEncodedSize (size_t size) const = 0;
+
+  /*! Encodes a frame including its delimiters.
+   *
+   * \param data The frame payload.
+   * \param size Number of bytes in the payload.
+   * \param out Buffer of at least maxEncodedSize(size) bytes.
+   *
+   * \return The number of bytes written to out.
+   */
+  virtual size_t
+  encode (const uint8_t *data, size_t size, uint8_t *out) const = 0;
+};
+
+/*!
+ * Interface of the streaming framing decoders.
+ *
+ * Chunks of any size may be fed to decode, frames split across chunks are
+ * reassembled.  Corrupt frames are dropped and counted.
+ */
+class Decoder {
+public:
+  /*!
+   * \param pool The pool the decoded frames are taken from.
+   * \param max_frame_size Frames decoding to more bytes are dropped.
+   */
+  Decoder (FramePool &pool, size_t max_frame_size);
+
+  virtual ~Decoder ();
+
+  /*! Decodes a chunk of encoded bytes.
+   *
+   * \param data The encoded bytes.
+   * \param size Number of encoded bytes.
+   * \param frames Complete frames are appended here, the caller owns them
+   * and should give them back to the pool when done.
+   *
+   * \return The number of frames appended.
+   */
+  virtual size_t
+  decode (const uint8_t *data, size_t size, std::vector<Frame*> &frames) = 0;
+
+  /*! Reads what is available from the port and decodes it.
+   *
+   * If no data is available the call blocks for at most the read timeout
+   * of the port waiting for the first byte.
+   *
+   * \return The number of frames appended.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  size_t
+  read (Serial &port, std::vector<Frame*> &frames, size_t size = 4096);
+
+  /*! Drops a partially decoded frame. */
+  virtual void
+  reset ();
+
+  /*! Number of frames dropped because they were corrupt or too long. */
+  uint64_t
+  getErrorCount () const { return errors_; }
+
+protected:
+  // Finishes the current frame, appending it to frames if it is valid.
+  size_t
+  finish_ (std::vector<Frame*> &frames, bool valid);
+
+  // Appends decoded bytes to the current frame, dropping it on overflow.
+  void
+  append_ (const uint8_t *data, size_t size);
+
+  FramePool &pool_;
+  size_t max_frame_size_;
+  Frame *frame_;            // Frame being decoded
+  bool overflow_;           // Current frame exceeded max_frame_size_
+  uint64_t errors_;
+
+private:
+  // Disable copy constructors
+  Decoder(const Decoder&);
+  Decoder& operator=(const Decoder&);
+
+  std::vector<uint8_t> read_buffer_;
+};
+
+/*!
+ * Consistent Overhead Byte Stuffing encoder, frames end with a 0x00.
+ */
+class CobsEncoder : public Encoder {
+public:
+  virtual size_t
+  maxEncodedSize (size_t size) const;
+
+  virtual size_t
+  encode (const uint8_t *data, size_t size, uint8_t *out) const;
+};
+
+/*!
+ * Consistent Overhead Byte Stuffing decoder.
+ */
+class CobsDecoder : public Decoder {
+public:
+  CobsDecoder (FramePool &pool, size_t max_frame_size = 65536);
+
+  virtual size_t
+  decode (const uint8_t *data, size_t size, std::vector<Frame*> &frames);
+
+  virtual void
+  reset ();
+
+private:
+  uint8_t code_;            // Code byte of the current block
+  uint8_t remaining_;       // Data bytes left in the current block
+};
+
+/*!
+ * SLIP (RFC 1055) encoder.  Frames are preceded and followed by END, the
+ * leading END flushes any line noise received before the frame.
+ */
+class SlipEncoder : public Encoder {
+public:
+  virtual size_t
+  maxEncodedSize (size_t size) const;
+
+  virtual size_t
+  encode (const uint8_t *data, size_t size, uint8_t *out) const;
+};
+
+/*!
+ * SLIP (RFC 1055) decoder.
+ */
+class SlipDecoder : public Decoder {
+public:
+  SlipDecoder (FramePool &pool, size_t max_frame_size = 65536);
+
+  virtual size_t
+  decode (const uint8_t *data, size_t size, std::vector<Frame*> &frames);
+
+  virtual void
+  reset ();
+
+private:
+  bool escaped_;            // Last byte was an ESC
+  bool corrupt_;            // Invalid escape sequence in the current frame
+};
+
+/*!
+ * Enumeration defines the checksums FrameReader can validate.
+ */
+typedef enum {
+  crc_none = 0,
+  crc_8,            // Polynomial 0x07, initial value 0x00
+  crc_16_modbus,    // Polynomial 0x8005 reflected, initial value 0xFFFF
+  crc_16_ccitt,     // Polynomial 0x1021, initial value 0xFFFF
+  crc_32            // IEEE 802.3, as used by zlib
+} crc_t;
+
+/*!
+ * Structure describing the layout of a length prefixed frame.
+ *
+ * A frame starts with the sync pattern and its total size is the value of
+ * the length field plus length_adjust.  E.g. for frames laid out as
+ * [0xAA 0x55][length][payload][CRC-16] with a one byte length field which
+ * counts the payload:
+ *
+ * <pre>
+ *   FrameFormat format;
+ *   format.sync.push_back(0xAA);
+ *   format.sync.push_back(0x55);
+ *   format.length_offset = 2;
+ *   format.length_width = 1;
+ *   format.length_adjust = 5;
+ *   format.crc = serial::framing::crc_16_ccitt;
+ * </pre>
+ */
+struct FrameFormat {
+  /*! Bytes every frame starts with. */
+  std::vector<uint8_t> sync;
+  /*! Offset of the length field from the start of the frame. */
+  size_t length_offset;
+  /*! Size of the length field in bytes, 1, 2 or 4. */
+  size_t length_width;
+  /*! True if the length field is big endian. */
+  bool length_big_endian;
+  /*! Number of bytes in the frame that the length field does not count. */
+  int length_adjust;
+  /*! Checksum at the end of the frame. */
+  crc_t crc;
+  /*! Offset of the first byte covered by the checksum. */
+  size_t crc_offset;
+  /*! True if the checksum is sent big endian. */
+  bool crc_big_endian;
+  /*! Frames longer than this are treated as corrupt. */
+  size_t max_frame_size;
+
+  FrameFormat ()
+  : length_offset(0), length_width(1), length_big_endian(false),
+    length_adjust(0), crc(crc_none), crc_offset(0), crc_big_endian(false),
+    max_frame_size(4096)
+  {}
+};
+
+/*!
+ * Interface receiving the frames found by a FrameReader.
+ */
+class FrameHandler {
+public:
+  virtual ~FrameHandler () {}
+
+  /*! Called for every frame with a valid length and checksum.
+   *
+   * The frame, sync pattern and checksum included, points into the buffer
+   * of the reader and is only valid during the call.
+   */
+  virtual void
+  onFrame (const uint8_t *frame, size_t size) = 0;
+};
+
+/*!
+ * Class that extracts length prefixed frames from a byte stream.
+ *
+ * The sync pattern is searched with Boyer-Moore-Horspool (memchr for a
+ * single byte pattern).  When a candidate frame has an impossible length
+ * or a bad checksum the reader resumes the search one byte after that
+ * candidate's sync pattern, so a real frame hiding inside garbage is still
+ * found.
+ */
+class FrameReader {
+public:
+  /*!
+   * \throw std::invalid_argument if the format is inconsistent.
+   */
+  explicit FrameReader (const FrameFormat &format);
+
+  virtual ~FrameReader ();
+
+  /*! Buffers a chunk of bytes and delivers the complete frames in it.
+   *
+   * \return The number of frames delivered.
+   */
+  size_t
+  feed (const uint8_t *data, size_t size, FrameHandler &handler);
+
+  /*! Reads what is available from the port and feeds it.
+   *
+   * If no data is available the call blocks for at most the read timeout
+   * of the port waiting for the first byte.
+   *
+   * \return The number of frames delivered.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  size_t
+  read (Serial &port, FrameHandler &handler, size_t size = 4096);
+
+  /*! Drops all buffered data. */
+  void
+  reset ();
+
+  /*! Number of frames delivered so far. */
+  uint64_t
+  getFrameCount () const { return frames_; }
+
+  /*! Number of candidate frames rejected because of their checksum. */
+  uint64_t
+  getCrcErrors () const { return crc_errors_; }
+
+  /*! Number of candidate frames rejected because of their length. */
+  uint64_t
+  getLengthErrors () const { return length_errors_; }
+
+  /*! Number of bytes skipped while hunting for the sync pattern. */
+  uint64_t
+  getSkippedBytes () const { return skipped_bytes_; }
+
+private:
+  // Disable copy constructors
+  FrameReader(const FrameReader&);
+  FrameReader& operator=(const FrameReader&);
+
+  // Makes room for size more bytes at the end of the buffer.
+  void
+  reserve_ (size_t size);
+
+  // Returns the offset of the next sync pattern at or after start_, or the
+  // start of a tail which may hold a partial pattern.
+  size_t
+  findSync_ () const;
+
+  FrameFormat format_;
+  size_t header_size_;        // Bytes needed to know the frame length
+  size_t crc_size_;
+  size_t skip_[256];          // Horspool bad character shifts
+
+  std::vector<uint8_t> buffer_;
+  size_t start_;              // First unprocessed byte in buffer_
+  size_t end_;                // One past the last buffered byte
+
+  uint64_t frames_;
+  uint64_t crc_errors_;
+  uint64_t length_errors_;
+  uint64_t skipped_bytes_;
+};
+
+} // namespace framing
+} // namespace serial
+
+#endif
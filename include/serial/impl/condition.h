@@ -0,0 +1,105 @@
+/*!
+ * \file serial/impl/condition.h
+ * \author  William Woodall <wjwwood@gmail.com>
+ * \author  John Harrison <ash@greaterthaninfinity.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall, John Harrison
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the timed waits on condition variables of the unix
+ * implementation and the helpers built on it.  Deadlines are on the clock
+ * of stats::now_ns on every platform, whichever clock the condition
+ * variable waits on.
+ */
+
+#ifndef SERIAL_IMPL_CONDITION_H
+#define SERIAL_IMPL_CONDITION_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "serial/impl/stats.h"
+
+namespace serial {
+namespace condition {
+
+/*! Initializes cond for wait_until, on the monotonic clock where
+ * pthread_condattr_setclock is available.
+ */
+inline void
+init (pthread_cond_t &cond)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init (&attr);
+#if defined(__linux__)
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+#endif
+  pthread_cond_init (&cond, &attr);
+  pthread_condattr_destroy (&attr);
+}
+
+/*!
+ * Waits on cond, initialized with init, until it is signalled or
+ * deadline_ns on the clock of stats::now_ns.  mutex must be locked.
+ *
+ * \return ETIMEDOUT once the deadline has passed, 0 otherwise, even for a
+ * wake-up which was not signalled.
+ */
+inline int
+wait_until (pthread_cond_t &cond, pthread_mutex_t &mutex,
+            uint64_t deadline_ns)
+{
+  uint64_t now_ns = stats::now_ns ();
+  if (deadline_ns <= now_ns) {
+    return ETIMEDOUT;
+  }
+  timespec expiry;
+#if defined(__linux__)
+  uint64_t expiry_ns = deadline_ns;
+#else
+  // Without pthread_condattr_setclock the wait is on the realtime clock,
+  // for an hour at most so the expiry stays in range.
+  uint64_t wait_ns = std::min (deadline_ns - now_ns,
+                               static_cast<uint64_t> (3600000000000ULL));
+  clock_gettime (CLOCK_REALTIME, &expiry);
+  uint64_t expiry_ns = expiry.tv_sec * 1000000000ULL + expiry.tv_nsec
+                       + wait_ns;
+#endif
+  expiry.tv_sec = static_cast<time_t> (expiry_ns / 1000000000);
+  expiry.tv_nsec = static_cast<long> (expiry_ns % 1000000000);
+  pthread_cond_timedwait (&cond, &mutex, &expiry);
+  // Setting the realtime clock moves its expiry, go by stats::now_ns.
+  return stats::now_ns () >= deadline_ns ? ETIMEDOUT : 0;
+}
+
+} // namespace condition
+} // namespace serial
+
+#endif // SERIAL_IMPL_CONDITION_H
@@ -0,0 +1,121 @@
+/*!
+ * \file serial/impl/pacer.h
+ * \author  William Woodall <wjwwood@gmail.com>
+ * \author  John Harrison <ash@greaterthaninfinity.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall, John Harrison
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the token bucket pacing writes, shared by the unix and
+ * windows implementations.
+ */
+
+#ifndef SERIAL_IMPL_PACER_H
+#define SERIAL_IMPL_PACER_H
+
+#include "serial/serial.h"
+
+namespace serial {
+
+/*!
+ * Token bucket releasing the bytes of writes at a serial::WriteRate.
+ *
+ * Times are in nanoseconds on a monotonic clock and are passed in, the
+ * implementations use stats::now_ns.  The bucket is kept as the time at
+ * which it will be full again, so no refill has to be scheduled and the
+ * rate does not drift with the time the writes take.
+ */
+class WritePacer {
+public:
+  WritePacer () : ns_per_byte_ (0), burst_ (1), full_at_ns_ (0) {}
+
+  /*! Applies rate, byte_time_ns being the time one byte takes on the
+   * line, and fills the bucket.
+   */
+  void
+  configure (const WriteRate &rate, uint64_t byte_time_ns)
+  {
+    if (rate.bytes_per_second > 0) {
+      ns_per_byte_ = (1000000000ULL + rate.bytes_per_second / 2)
+                     / rate.bytes_per_second;
+    } else if (rate.line_fraction > 0) {
+      ns_per_byte_ = static_cast<uint64_t> (
+        static_cast<double> (byte_time_ns) / rate.line_fraction + 0.5);
+    } else {
+      ns_per_byte_ = 0;
+    }
+    burst_ = rate.burst > 0 ? rate.burst : 1;
+    full_at_ns_ = 0;
+  }
+
+  /*! Returns false when writes are not paced. */
+  bool
+  enabled () const
+  {
+    return ns_per_byte_ != 0;
+  }
+
+  /*! Returns how many of size bytes to hand to the driver at once. */
+  size_t
+  chunk (size_t size) const
+  {
+    return size < burst_ ? size : burst_;
+  }
+
+  /*! Returns the time from which count bytes, at most one chunk, may be
+   * sent, which is now if the bucket holds enough.
+   */
+  uint64_t
+  readyAt (size_t count, uint64_t now) const
+  {
+    // The bucket holds (now - (full_at_ns_ - burst_ * ns_per_byte_)) /
+    // ns_per_byte_ bytes, capped at burst_.
+    uint64_t needed = full_at_ns_ + count * ns_per_byte_;
+    uint64_t capacity = burst_ * ns_per_byte_;
+    if (needed <= now + capacity) {
+      return now;
+    }
+    return needed - capacity;
+  }
+
+  /*! Takes count bytes out of the bucket, sent at time sent. */
+  void
+  sent (size_t count, uint64_t sent)
+  {
+    full_at_ns_ = (full_at_ns_ > sent ? full_at_ns_ : sent)
+                  + count * ns_per_byte_;
+  }
+
+private:
+  uint64_t ns_per_byte_;  // Time to earn one byte, 0 when not pacing
+  uint64_t burst_;        // Capacity of the bucket in bytes
+  uint64_t full_at_ns_;   // Time at which the bucket is full again
+};
+
+} // namespace serial
+
+#endif // SERIAL_IMPL_PACER_H
@@ -0,0 +1,225 @@
+/*!
+ * \file serial/impl/recorder.h
+ * \author  William Woodall <wjwwood@gmail.com>
+ * \author  John Harrison <ash@greaterthaninfinity.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall, John Harrison
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the flight recorder keeping the recent traffic of a port,
+ * shared by the unix and windows implementations.
+ */
+
+#ifndef SERIAL_IMPL_RECORDER_H
+#define SERIAL_IMPL_RECORDER_H
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "serial/serial.h"
+#include "serial/impl/stats.h"
+
+namespace serial {
+
+/*!
+ * Overwrite rings holding the last bytes read and written, each chunk with
+ * the time its read or write returned.
+ *
+ * Each direction has a single writer, the thread holding the read or the
+ * write lock of the port, and recording is a copy and a few stores.  A
+ * snapshot can be taken from any thread without stopping the I/O: it
+ * copies the rings and then discards what was overwritten meanwhile.
+ */
+class FlightRecorder {
+public:
+  /*! Keeps the last capacity bytes of each direction. */
+  explicit FlightRecorder (size_t capacity)
+  {
+    // Chunks average at least 64 bytes before their times are dropped.
+    size_t entries = capacity / 64 > 16 ? capacity / 64 : 16;
+    for (int i = 0; i < 2; ++i) {
+      lanes_[i].bytes.resize (capacity > 0 ? capacity : 1);
+      lanes_[i].entries.resize (entries);
+    }
+  }
+
+  /*! Returns the bytes kept for each direction. */
+  size_t
+  capacity () const
+  {
+    return lanes_[0].bytes.size ();
+  }
+
+  /*! Records the bytes returned by a read or accepted by a write. */
+  void
+  record (bool written, const uint8_t *data, size_t size)
+  {
+    if (size == 0) {
+      return;
+    }
+    Lane &lane = lanes_[written ? 1 : 0];
+    size_t capacity = lane.bytes.size ();
+    uint64_t head = lane.head;
+    // Snapshots check reserve after copying, it must change first.
+    stats::store (lane.reserve, head + size);
+    stats::fence ();
+    size_t skip = size > capacity ? size - capacity : 0;
+    size_t offset = static_cast<size_t> ((head + skip) % capacity);
+    size_t count = size - skip;
+    size_t first = capacity - offset < count ? capacity - offset : count;
+    std::memcpy (&lane.bytes[offset], data + skip, first);
+    std::memcpy (&lane.bytes[0], data + skip + first, count - first);
+    stats::fence ();
+    stats::store (lane.head, head + size);
+
+    uint64_t index = lane.count;
+    Entry &entry = lane.entries[static_cast<size_t> (
+      index % lane.entries.size ())];
+    stats::store (lane.entry_reserve, index + 1);
+    stats::fence ();
+    stats::store (entry.end, head + size);
+    stats::store (entry.timestamp_ns, coarse_now_ns ());
+    stats::fence ();
+    stats::store (lane.count, index + 1);
+  }
+
+  /*! Returns the recorded chunks of both directions, oldest first. */
+  std::vector<RecordedChunk>
+  snapshot () const
+  {
+    std::vector<RecordedChunk> chunks;
+    snapshot_ (lanes_[0], false, chunks);
+    size_t received = chunks.size ();
+    snapshot_ (lanes_[1], true, chunks);
+    std::inplace_merge (chunks.begin (), chunks.begin () + received,
+                        chunks.end (), earlier);
+    return chunks;
+  }
+
+private:
+  struct Entry {
+    uint64_t end;             // Position after the last byte of the chunk
+    uint64_t timestamp_ns;
+
+    Entry () : end (0), timestamp_ns (0) {}
+  };
+
+  // Positions count every byte ever recorded, the ring holds the last.
+  struct Lane {
+    std::vector<uint8_t> bytes;
+    std::vector<Entry> entries;
+    uint64_t head;            // Bytes recorded
+    uint64_t reserve;         // Bytes being recorded, ahead of head
+    uint64_t count;           // Chunks recorded
+    uint64_t entry_reserve;   // Chunks being recorded, ahead of count
+
+    Lane () : head (0), reserve (0), count (0), entry_reserve (0) {}
+  };
+
+  // The times of a few milliseconds resolution which are enough here cost
+  // less than stats::now_ns on Linux, and are on the same clock.
+  static uint64_t
+  coarse_now_ns ()
+  {
+#if defined(CLOCK_MONOTONIC_COARSE)
+    timespec now;
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &now);
+    return static_cast<uint64_t> (now.tv_sec) * 1000000000ULL
+         + static_cast<uint64_t> (now.tv_nsec);
+#else
+    return stats::now_ns ();
+#endif
+  }
+
+  static bool
+  earlier (const RecordedChunk &a, const RecordedChunk &b)
+  {
+    return a.timestamp_ns < b.timestamp_ns;
+  }
+
+  static void
+  snapshot_ (const Lane &lane, bool written,
+             std::vector<RecordedChunk> &chunks)
+  {
+    size_t capacity = lane.bytes.size ();
+    size_t entry_capacity = lane.entries.size ();
+    // Every chunk below count ends at or before head.
+    uint64_t count = stats::load (lane.count);
+    stats::fence ();
+    uint64_t head = stats::load (lane.head);
+    uint64_t first_entry = count > entry_capacity ? count - entry_capacity : 0;
+    std::vector<Entry> entries;
+    for (uint64_t i = first_entry; i < count; ++i) {
+      const Entry &entry = lane.entries[static_cast<size_t> (
+        i % entry_capacity)];
+      Entry copy;
+      copy.end = stats::load (entry.end);
+      copy.timestamp_ns = stats::load (entry.timestamp_ns);
+      entries.push_back (copy);
+    }
+    uint64_t start = head > capacity ? head - capacity : 0;
+    std::vector<uint8_t> bytes (static_cast<size_t> (head - start));
+    if (!bytes.empty ()) {
+      size_t offset = static_cast<size_t> (start % capacity);
+      size_t first = capacity - offset < bytes.size ()
+                     ? capacity - offset : bytes.size ();
+      std::memcpy (&bytes[0], &lane.bytes[offset], first);
+      std::memcpy (&bytes[first], &lane.bytes[0], bytes.size () - first);
+    }
+    // Drop what the recording thread overwrote while this copied.
+    stats::fence ();
+    uint64_t reserve = stats::load (lane.reserve);
+    uint64_t entry_reserve = stats::load (lane.entry_reserve);
+    uint64_t valid = reserve > capacity ? reserve - capacity : 0;
+    valid = valid > start ? valid : start;
+    uint64_t valid_entry = entry_reserve > entry_capacity
+                           ? entry_reserve - entry_capacity : 0;
+    valid_entry = valid_entry > first_entry ? valid_entry : first_entry;
+
+    uint64_t begin = valid;
+    for (uint64_t i = valid_entry; i < count; ++i) {
+      const Entry &entry = entries[static_cast<size_t> (i - first_entry)];
+      if (entry.end > begin) {
+        RecordedChunk chunk;
+        chunk.timestamp_ns = entry.timestamp_ns;
+        chunk.written = written;
+        chunk.data.assign (
+          reinterpret_cast<const char *> (&bytes[0]) + (begin - start),
+          static_cast<size_t> (entry.end - begin));
+        chunks.push_back (chunk);
+        begin = entry.end;
+      }
+    }
+  }
+
+  Lane lanes_[2];
+};
+
+} // namespace serial
+
+#endif // SERIAL_IMPL_RECORDER_H
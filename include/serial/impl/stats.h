@@ -0,0 +1,239 @@
+/*!
+ * \file serial/impl/stats.h
+ * \author  William Woodall <wjwwood@gmail.com>
+ * \author  John Harrison <ash@greaterthaninfinity.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall, John Harrison
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the lock free updates of serial::Stats shared by the unix
+ * and windows implementations.  Statements wrapped in SERIAL_STATS are
+ * compiled out when SERIAL_DISABLE_STATS is defined.
+ */
+
+#ifndef SERIAL_IMPL_STATS_H
+#define SERIAL_IMPL_STATS_H
+
+#include "serial/serial.h"
+
+#if defined(_WIN32)
+#include "windows.h"
+#else
+#include <time.h>
+#ifdef __MACH__
+#include <mach/mach_time.h>
+#endif
+#endif
+
+#if defined(SERIAL_DISABLE_STATS)
+# define SERIAL_STATS(statement)
+#else
+# define SERIAL_STATS(statement) statement
+#endif
+
+namespace serial {
+namespace stats {
+
+inline uint64_t
+load (const uint64_t &value)
+{
+#if defined(_WIN32)
+  return static_cast<uint64_t> (InterlockedCompareExchange64 (
+    reinterpret_cast<volatile LONG64 *> (const_cast<uint64_t *> (&value)),
+    0, 0));
+#else
+  return __atomic_load_n (&value, __ATOMIC_RELAXED);
+#endif
+}
+
+inline void
+store (uint64_t &value, uint64_t new_value)
+{
+#if defined(_WIN32)
+  InterlockedExchange64 (reinterpret_cast<volatile LONG64 *> (&value),
+                         static_cast<LONG64> (new_value));
+#else
+  __atomic_store_n (&value, new_value, __ATOMIC_RELAXED);
+#endif
+}
+
+inline void
+add (uint64_t &value, uint64_t delta)
+{
+#if defined(_WIN32)
+  InterlockedExchangeAdd64 (reinterpret_cast<volatile LONG64 *> (&value),
+                            static_cast<LONG64> (delta));
+#else
+  __atomic_fetch_add (&value, delta, __ATOMIC_RELAXED);
+#endif
+}
+
+inline void
+sub (uint64_t &value, uint64_t delta)
+{
+#if defined(_WIN32)
+  InterlockedExchangeAdd64 (reinterpret_cast<volatile LONG64 *> (&value),
+                            -static_cast<LONG64> (delta));
+#else
+  __atomic_fetch_sub (&value, delta, __ATOMIC_RELAXED);
+#endif
+}
+
+inline void
+store_max (uint64_t &value, uint64_t candidate)
+{
+  uint64_t current = load (value);
+  while (candidate > current) {
+#if defined(_WIN32)
+    uint64_t previous = static_cast<uint64_t> (InterlockedCompareExchange64 (
+      reinterpret_cast<volatile LONG64 *> (&value),
+      static_cast<LONG64> (candidate), static_cast<LONG64> (current)));
+    if (previous == current) {
+      break;
+    }
+    current = previous;
+#else
+    if (__atomic_compare_exchange_n (&value, &current, candidate, true,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      break;
+    }
+#endif
+  }
+}
+
+/*! Orders the loads and stores before it with those after it. */
+inline void
+fence ()
+{
+#if defined(_WIN32)
+  MemoryBarrier ();
+#else
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+#endif
+}
+
+/*! Monotonic time in nanoseconds, for measuring latencies. */
+inline uint64_t
+now_ns ()
+{
+#if defined(_WIN32)
+  static LARGE_INTEGER frequency = { 0 };
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency (&frequency);
+  }
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter (&counter);
+  return static_cast<uint64_t> (counter.QuadPart / frequency.QuadPart)
+         * 1000000000ULL
+       + static_cast<uint64_t> (counter.QuadPart % frequency.QuadPart)
+         * 1000000000ULL / static_cast<uint64_t> (frequency.QuadPart);
+#elif defined(__MACH__) && !defined(CLOCK_MONOTONIC)
+  static mach_timebase_info_data_t timebase = { 0, 0 };
+  if (timebase.denom == 0) {
+    mach_timebase_info (&timebase);
+  }
+  return mach_absolute_time () * timebase.numer / timebase.denom;
+#else
+  timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t> (now.tv_sec) * 1000000000ULL
+       + static_cast<uint64_t> (now.tv_nsec);
+#endif
+}
+
+/*! Records the time since start, as returned by now_ns. */
+inline void
+record (LatencyHistogram &histogram, uint64_t start)
+{
+  uint64_t ns = now_ns () - start;
+  add (histogram.buckets[LatencyHistogram::bucketIndex (ns)], 1);
+  add (histogram.count, 1);
+  add (histogram.total_ns, ns);
+  store_max (histogram.max_ns, ns);
+}
+
+inline void
+copy (const LatencyHistogram &from, LatencyHistogram &to)
+{
+  for (size_t i = 0; i < LatencyHistogram::bucket_count; ++i) {
+    to.buckets[i] = load (from.buckets[i]);
+  }
+  to.count = load (from.count);
+  to.total_ns = load (from.total_ns);
+  to.max_ns = load (from.max_ns);
+}
+
+/*! Copies the statistics field by field while they are being updated. */
+inline Stats
+snapshot (const Stats &from)
+{
+  Stats to;
+  to.bytes_read = load (from.bytes_read);
+  to.bytes_written = load (from.bytes_written);
+  to.read_calls = load (from.read_calls);
+  to.write_calls = load (from.write_calls);
+  to.syscalls = load (from.syscalls);
+  to.timeouts = load (from.timeouts);
+  to.partial_writes = load (from.partial_writes);
+  to.eintr_retries = load (from.eintr_retries);
+  to.disconnects = load (from.disconnects);
+  copy (from.read_wait, to.read_wait);
+  copy (from.write_completion, to.write_completion);
+  return to;
+}
+
+inline void
+clear (LatencyHistogram &histogram)
+{
+  for (size_t i = 0; i < LatencyHistogram::bucket_count; ++i) {
+    store (histogram.buckets[i], 0);
+  }
+  store (histogram.count, 0);
+  store (histogram.total_ns, 0);
+  store (histogram.max_ns, 0);
+}
+
+inline void
+reset (Stats &stats)
+{
+  store (stats.bytes_read, 0);
+  store (stats.bytes_written, 0);
+  store (stats.read_calls, 0);
+  store (stats.write_calls, 0);
+  store (stats.syscalls, 0);
+  store (stats.timeouts, 0);
+  store (stats.partial_writes, 0);
+  store (stats.eintr_retries, 0);
+  store (stats.disconnects, 0);
+  clear (stats.read_wait);
+  clear (stats.write_completion);
+}
+
+} // namespace stats
+} // namespace serial
+
+#endif // SERIAL_IMPL_STATS_H
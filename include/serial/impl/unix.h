@@ -41,8 +41,11 @@
 #define SERIAL_IMPL_UNIX_H
 
 #include "serial/serial.h"
+#include "serial/impl/pacer.h"
+#include "serial/impl/recorder.h"
 
 #include <pthread.h>
+#include <sys/types.h>
 
 namespace serial {
 
@@ -53,14 +56,49 @@ using std::invalid_argument;
 using serial::SerialException;
 using serial::IOException;
 
-class MillisecondTimer {
+/*!
+ * A deadline on the clock of serial::Deadline, the monotonic clock unless
+ * serial::setClock replaced it, with nanosecond resolution.
+ *
+ * The expiry is absolute, so waits computed from it do not add up errors
+ * however many there are before it passes.
+ */
+class DeadlineTimer {
 public:
-  MillisecondTimer(const uint32_t millis);         
-  int64_t remaining();
+  /*! Creates a deadline nanos nanoseconds from now, clamped like at. */
+  explicit DeadlineTimer (uint64_t nanos);
+
+  /*! Creates a deadline at monotonic_ns on the clock of timespec_now,
+   * clamped so remaining does not overflow.
+   */
+  static DeadlineTimer
+  at (uint64_t monotonic_ns);
+
+  /*! Returns the nanoseconds left, negative once the deadline passed. */
+  int64_t
+  remaining () const;
+
+  /*! Returns the time left for a relative wait like pselect, zero once
+   * the deadline passed.
+   */
+  timespec
+  remaining_timespec () const;
+
+  /*! Returns the absolute deadline, on the clock of timespec_now. */
+  const timespec &
+  expiry () const
+  {
+    return expiry_;
+  }
+
+  /*! Returns the current time of the clock of serial::Deadline::now. */
+  static timespec
+  timespec_now ();
 
 private:
-  static timespec timespec_now();
-  timespec expiry;
+  DeadlineTimer () {}
+
+  timespec expiry_;
 };
 
 class serial::Serial::SerialImpl {
@@ -72,6 +110,8 @@ public:
               stopbits_t stopbits,
               flowcontrol_t flowcontrol);
 
+  explicit SerialImpl (Transport &transport);
+
   virtual ~SerialImpl ();
 
   void
@@ -83,11 +123,14 @@ public:
   bool
   isOpen () const;
 
+  int
+  getFileDescriptor () const;
+
   size_t
   available ();
 
   bool
-  waitReadable (uint32_t timeout);
+  waitReadable (uint64_t timeout_ns);
 
   void
   waitByteTimes (size_t count);
@@ -95,9 +138,23 @@ public:
   size_t
   read (uint8_t *buf, size_t size = 1);
 
+  size_t
+  read (uint8_t *buf, size_t size, uint64_t deadline_ns);
+
+  size_t
+  readTimestamped (uint8_t *buf, size_t size,
+                   std::vector<TimestampedChunk> *chunks);
+
+  size_t
+  readTimestamped (uint8_t *buf, size_t size, uint64_t deadline_ns,
+                   std::vector<TimestampedChunk> *chunks);
+
   size_t
   write (const uint8_t *data, size_t length);
 
+  size_t
+  write (const uint8_t *data, size_t length, uint64_t deadline_ns);
+
   void
   flush ();
 
@@ -107,6 +164,18 @@ public:
   void
   flushOutput ();
 
+  size_t
+  outputQueueBytes ();
+
+  bool
+  waitDrained (uint32_t timeout);
+
+  void
+  onDrained (DrainHandler &handler);
+
+  void
+  cancelDrained ();
+
   void
   sendBreak (int duration);
 
@@ -119,6 +188,12 @@ public:
   void
   setDTR (bool level);
 
+  void
+  setModemLines (uint32_t mask, uint32_t values);
+
+  void
+  runLineSequence (const std::vector<ModemLineStep> &steps);
+
   bool
   waitForChange ();
 
@@ -134,6 +209,33 @@ public:
   bool
   getCD ();
 
+  Stats
+  getStats () const;
+
+  void
+  resetStats ();
+
+  void
+  enableFlightRecorder (size_t capacity);
+
+  void
+  disableFlightRecorder ();
+
+  std::vector<RecordedChunk>
+  getFlightRecord () const;
+
+  void
+  setFlightRecordHandler (FlightRecordHandler *handler);
+
+  LineCounters
+  getLineCounters (LineCounters &delta);
+
+  void
+  startLineMonitor (LineMonitorHandler &handler, uint32_t period_ms);
+
+  void
+  stopLineMonitor ();
+
   void
   setPort (const string &port);
 
@@ -176,6 +278,24 @@ public:
   flowcontrol_t
   getFlowcontrol () const;
 
+  void
+  setWriteRate (const WriteRate &rate);
+
+  WriteRate
+  getWriteRate () const;
+
+  void
+  setBulkLatency (uint32_t microseconds);
+
+  uint32_t
+  getBulkLatency () const;
+
+  size_t
+  bulkChunkSize () const;
+
+  void
+  waitOutputBelow (size_t bytes);
+
   void
   readLock ();
 
@@ -183,7 +303,7 @@ public:
   readUnlock ();
 
   void
-  writeLock ();
+  writeLock (priority_t priority = priority_normal);
 
   void
   writeUnlock ();
@@ -191,9 +311,87 @@ public:
 protected:
   void reconfigurePort ();
 
+  // Derives byte_time_ns_ from the settings and reconfigures the pacer.
+  void
+  updateByteTime_ ();
+
+  // Sets up the locks and condition variables, for both constructors.
+  void
+  init_ ();
+
+  bool
+  higherLaneWaiting_ (priority_t priority) const;
+
+  // Every read and write goes through read_ and write_, which feed the
+  // flight recorder around readPort_ and writePort_.
+  size_t
+  read_ (uint8_t *buf, size_t size, const DeadlineTimer &total_timeout,
+         uint64_t inter_byte_timeout_ns,
+         std::vector<TimestampedChunk> *chunks = NULL);
+
+  // Appends the chunks read to chunks, unless it is NULL.
+  size_t
+  readPort_ (uint8_t *buf, size_t size, const DeadlineTimer &total_timeout,
+             uint64_t inter_byte_timeout_ns,
+             std::vector<TimestampedChunk> *chunks);
+
+  size_t
+  write_ (const uint8_t *data, size_t length, DeadlineTimer total_timeout,
+          bool pacing_extends_timeout);
+
+  size_t
+  writePort_ (const uint8_t *data, size_t length, DeadlineTimer total_timeout,
+              bool pacing_extends_timeout);
+
+  void
+  flightRecordError_ (const std::exception &error);
+
+  // Wait on fd_ or transport_ for up to timeout_ns, whatever the clock.
+  bool
+  pollReadable_ (uint64_t timeout_ns);
+
+  // Returns like pselect, errno tells an interrupted wait from an error.
+  int
+  pollWritable_ (uint64_t timeout_ns);
+
+  // Waits like waitReadable, and returns like pollWritable_.
+  int
+  waitWritable_ (uint64_t timeout_ns);
+
+  // Reads or writes what can be, without waiting, on fd_ or transport_.
+  ssize_t
+  readSome_ (uint8_t *buf, size_t size);
+
+  ssize_t
+  writeSome_ (const uint8_t *data, size_t length);
+
+  // Throws for the operations a transport does not provide.
+  void
+  requirePort_ (const char *operation) const;
+
+  static void *
+  lineMonitorThread_ (void *arg);
+
+  void
+  lineMonitor_ ();
+
+  int64_t
+  drainIntervalNs_ (size_t queued) const;
+
+  static void *
+  drainThread_ (void *arg);
+
+  bool
+  onDrainThread_ () const;
+
+  void
+  drain_ ();
+
 private:
   string port_;               // Path to the file descriptor
   int fd_;                    // The current file descriptor
+  Transport *transport_;      // Used in place of fd_ unless NULL
+  bool owns_transport_;       // transport_ was opened from a url in port_
 
   bool is_open_;
   bool xonxoff_;
@@ -208,10 +406,42 @@ private:
   stopbits_t stopbits_;       // Stop Bits
   flowcontrol_t flowcontrol_; // Flow Control
 
+  WriteRate write_rate_;      // Pacing of writes
+  WritePacer pacer_;          // Token bucket applying write_rate_
+  uint32_t bulk_latency_us_;   // Longest wait behind a bulk write
+  uint32_t lane_waiting_[3];   // Writers waiting in each lane
+  bool write_held_;            // A writer holds the write lock
+
+  Stats stats_;               // I/O statistics, updated without locks
+
+  FlightRecorder *recorder_;  // Recent traffic, NULL unless enabled
+  FlightRecordHandler *record_handler_;
+
+  LineCounters line_counters_;    // Counters at the last getLineCounters
+  LineCounters monitor_counters_; // Counters at the last monitor sample
+  LineMonitorHandler *monitor_handler_;
+  uint32_t monitor_period_ms_;
+  bool monitor_running_;          // Guarded by monitor_mutex_
+  bool monitor_started_;          // The monitor thread needs joining
+  pthread_t monitor_thread_;
+  pthread_mutex_t monitor_mutex_;
+  pthread_cond_t monitor_cond_;   // Signalled to stop the monitor
+
+  DrainHandler *drain_handler_;
+  uint32_t drain_generation_;     // Bumped by onDrained, by drain_mutex_
+  bool drain_pending_;            // Guarded by drain_mutex_
+  bool drain_started_;            // The drain thread needs joining
+  pthread_t drain_thread_;
+  pthread_mutex_t drain_mutex_;
+  pthread_cond_t drain_cond_;     // Signalled to cancel the notification
+
   // Mutex used to lock the read functions
   pthread_mutex_t read_mutex;
-  // Mutex used to lock the write functions
+  // Mutex guarding write_held_ and lane_waiting_, which make up the lock
+  // of the write functions
   pthread_mutex_t write_mutex;
+  // Signalled when the write lock is released
+  pthread_cond_t write_cond_;
 };
 
 }
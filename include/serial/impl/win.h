@@ -40,6 +40,8 @@
 #define SERIAL_IMPL_WINDOWS_H
 
 #include "serial/serial.h"
+#include "serial/impl/pacer.h"
+#include "serial/impl/recorder.h"
 
 #include "windows.h"
 
@@ -61,6 +63,8 @@ public:
               stopbits_t stopbits,
               flowcontrol_t flowcontrol);
 
+  explicit SerialImpl (Transport &transport);
+
   virtual ~SerialImpl ();
 
   void
@@ -72,11 +76,14 @@ public:
   bool
   isOpen () const;
 
+  int
+  getFileDescriptor () const;
+
   size_t
   available ();
   
   bool
-  waitReadable (uint32_t timeout);
+  waitReadable (uint64_t timeout_ns);
 
   void
   waitByteTimes (size_t count);
@@ -84,9 +91,23 @@ public:
   size_t
   read (uint8_t *buf, size_t size = 1);
 
+  size_t
+  read (uint8_t *buf, size_t size, uint64_t deadline_ns);
+
+  size_t
+  readTimestamped (uint8_t *buf, size_t size,
+                   std::vector<TimestampedChunk> *chunks);
+
+  size_t
+  readTimestamped (uint8_t *buf, size_t size, uint64_t deadline_ns,
+                   std::vector<TimestampedChunk> *chunks);
+
   size_t
   write (const uint8_t *data, size_t length);
 
+  size_t
+  write (const uint8_t *data, size_t length, uint64_t deadline_ns);
+
   void
   flush ();
 
@@ -96,6 +117,18 @@ public:
   void
   flushOutput ();
 
+  size_t
+  outputQueueBytes ();
+
+  bool
+  waitDrained (uint32_t timeout);
+
+  void
+  onDrained (DrainHandler &handler);
+
+  void
+  cancelDrained ();
+
   void
   sendBreak (int duration);
 
@@ -108,6 +141,12 @@ public:
   void
   setDTR (bool level);
 
+  void
+  setModemLines (uint32_t mask, uint32_t values);
+
+  void
+  runLineSequence (const std::vector<ModemLineStep> &steps);
+
   bool
   waitForChange ();
 
@@ -123,6 +162,33 @@ public:
   bool
   getCD ();
 
+  Stats
+  getStats () const;
+
+  void
+  resetStats ();
+
+  void
+  enableFlightRecorder (size_t capacity);
+
+  void
+  disableFlightRecorder ();
+
+  std::vector<RecordedChunk>
+  getFlightRecord () const;
+
+  void
+  setFlightRecordHandler (FlightRecordHandler *handler);
+
+  LineCounters
+  getLineCounters (LineCounters &delta);
+
+  void
+  startLineMonitor (LineMonitorHandler &handler, uint32_t period_ms);
+
+  void
+  stopLineMonitor ();
+
   void
   setPort (const string &port);
 
@@ -165,6 +231,24 @@ public:
   flowcontrol_t
   getFlowcontrol () const;
 
+  void
+  setWriteRate (const WriteRate &rate);
+
+  WriteRate
+  getWriteRate () const;
+
+  void
+  setBulkLatency (uint32_t microseconds);
+
+  uint32_t
+  getBulkLatency () const;
+
+  size_t
+  bulkChunkSize () const;
+
+  void
+  waitOutputBelow (size_t bytes);
+
   void
   readLock ();
 
@@ -172,7 +256,7 @@ public:
   readUnlock ();
 
   void
-  writeLock ();
+  writeLock (priority_t priority = priority_normal);
 
   void
   writeUnlock ();
@@ -180,6 +264,24 @@ public:
 protected:
   void reconfigurePort ();
 
+  bool
+  higherLaneWaiting_ (priority_t priority) const;
+
+  // read and write feed the flight recorder around readPort_ and
+  // writePort_, the deadline variants go through them.
+  size_t
+  readPort_ (uint8_t *buf, size_t size);
+
+  size_t
+  writePort_ (const uint8_t *data, size_t length);
+
+  void
+  flightRecordError_ (const std::exception &error);
+
+  // Appends the bytes_read just read to chunks, unless it is NULL.
+  void
+  timestampChunk_ (size_t bytes_read, std::vector<TimestampedChunk> *chunks);
+
 private:
   wstring port_;               // Path to the file descriptor
   HANDLE fd_;
@@ -188,16 +290,31 @@ private:
 
   Timeout timeout_;           // Timeout for read operations
   unsigned long baudrate_;    // Baudrate
+  uint32_t byte_time_ns_;     // Nanoseconds to transmit/receive a single byte
 
   parity_t parity_;           // Parity
   bytesize_t bytesize_;       // Size of the bytes
   stopbits_t stopbits_;       // Stop Bits
   flowcontrol_t flowcontrol_; // Flow Control
 
+  WriteRate write_rate_;      // Pacing of writes
+  WritePacer pacer_;          // Token bucket applying write_rate_
+  uint32_t bulk_latency_us_;   // Longest wait behind a bulk write
+  uint32_t lane_waiting_[3];   // Writers waiting in each lane
+  bool write_held_;            // A writer holds the write lock
+
+  Stats stats_;               // I/O statistics, updated without locks
+
+  FlightRecorder *recorder_;  // Recent traffic, NULL unless enabled
+  FlightRecordHandler *record_handler_;
+
   // Mutex used to lock the read functions
   HANDLE read_mutex;
-  // Mutex used to lock the write functions
-  HANDLE write_mutex;
+  // Guards write_held_ and lane_waiting_, which make up the lock of the
+  // write functions
+  CRITICAL_SECTION write_mutex;
+  // Signalled when the write lock is released
+  CONDITION_VARIABLE write_cond_;
 };
 
 }
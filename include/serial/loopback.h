@@ -0,0 +1,119 @@
+/*!
+ * \file serial/loopback.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a pair of transports connected to each other in memory,
+ * like two serial ports joined by a null modem cable, to test protocols
+ * without a device, a pseudo terminal or the timing of a kernel.  Only
+ * available on Unix.
+ */
+
+#ifndef SERIAL_LOOPBACK_H
+#define SERIAL_LOOPBACK_H
+
+#include <pthread.h>
+
+#include "serial/transport.h"
+
+namespace serial {
+
+/*!
+ * Class holding two transports connected to each other.
+ *
+ * What is written to one end is read from the other, and the lines are
+ * wired like a null modem: the RTS of one end is the CTS of the other,
+ * and its DTR is the DSR and the CD of the other.  RI is never set.
+ *
+ * \code
+ * serial::LoopbackPair pair;
+ * serial::Serial host(pair.first(), serial::Timeout::simpleTimeout(100));
+ * serial::Serial device(pair.second(), serial::Timeout::simpleTimeout(100));
+ * host.write("ping\n");
+ * device.readline(); // "ping\n"
+ * \endcode
+ */
+class LoopbackPair {
+public:
+  /*!
+   * Creates a connected pair.
+   *
+   * \param capacity How many bytes each end buffers before writes to it
+   * wait for reads, at least 1.
+   *
+   * \throw std::invalid_argument if capacity is 0.
+   */
+  explicit LoopbackPair (size_t capacity = 4096);
+
+  /*! Destructor, the Serial objects using the ends must be destroyed
+   * first. */
+  virtual ~LoopbackPair ();
+
+  /*! Returns the first end. */
+  Transport &
+  first ();
+
+  /*! Returns the second end. */
+  Transport &
+  second ();
+
+  /*! Disconnects the ends.  Bytes already buffered can still be read,
+   * after that reads and writes fail like on an unplugged device.
+   */
+  void
+  hangup ();
+
+  /*! Returns false once hung up. */
+  bool
+  isConnected () const;
+
+private:
+  class End;
+  friend class End;
+
+  // Disable copy constructors
+  LoopbackPair(const LoopbackPair&);
+  LoopbackPair& operator=(const LoopbackPair&);
+
+  // Waits on cond_ until deadline_ns at the latest, on the clock of
+  // stats::now_ns.  Returns false once the deadline passed.
+  bool
+  wait_ (uint64_t deadline_ns);
+
+  End *first_;
+  End *second_;
+  size_t capacity_;
+  bool connected_;
+  mutable pthread_mutex_t mutex_;
+  pthread_cond_t cond_;       // Broadcast on every change to either end
+};
+
+} // namespace serial
+
+#endif // SERIAL_LOOPBACK_H
@@ -0,0 +1,270 @@
+/*!
+ * \file serial/modbus.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a Modbus RTU master on top of serial::Serial.  It relies on
+ * Serial::waitByteTimes for the silent intervals of the RTU framing and is
+ * therefore only available on Unix.
+ */
+
+#ifndef SERIAL_MODBUS_H
+#define SERIAL_MODBUS_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <exception>
+
+#include "serial/serial.h"
+
+namespace serial {
+namespace modbus {
+
+/*! Function codes of the requests issued by RtuMaster. */
+typedef enum {
+  read_coils = 0x01,
+  read_discrete_inputs = 0x02,
+  read_holding_registers = 0x03,
+  read_input_registers = 0x04,
+  write_single_coil = 0x05,
+  write_single_register = 0x06,
+  write_multiple_coils = 0x0F,
+  write_multiple_registers = 0x10
+} function_code_t;
+
+/*!
+ * Computes the Modbus CRC-16 (polynomial 0xA001 reflected, initial value
+ * 0xFFFF) of the given data.  The result is sent low byte first.
+ */
+uint16_t
+crc16 (const uint8_t *data, size_t length);
+
+/*!
+ * Class that implements a Modbus RTU master on a serial port.
+ *
+ * The master bounds its reads and writes with deadlines from the response
+ * timeout and leaves the timeout of the port alone.  The port should not
+ * be read by anything else while the master is alive.
+ *
+ * Frames are delimited as the RTU specification describes: the request is
+ * sent after at least 3.5 character times of silence on the line, and a
+ * response ends either when its length is known from the header or after
+ * 3.5 character times of silence.  Above 19200 baud the fixed 750us and
+ * 1750us intervals of the specification are used instead of 1.5 and 3.5
+ * character times.
+ */
+class RtuMaster {
+public:
+  /*!
+   * Creates a master on an already configured port.
+   *
+   * \param port The serial port the slaves are connected to.
+   * \param response_timeout Milliseconds to wait for the first byte of a
+   * response after the request has been transmitted, and at most for the
+   * request to be written.
+   */
+  RtuMaster (Serial &port, uint32_t response_timeout = 1000);
+
+  virtual ~RtuMaster ();
+
+  /*! Sets the number of milliseconds to wait for a response. */
+  void
+  setResponseTimeout (uint32_t response_timeout);
+
+  /*! Gets the number of milliseconds to wait for a response. */
+  uint32_t
+  getResponseTimeout () const;
+
+  /*! Sends a request PDU to a unit and receives the response PDU.
+   *
+   * The unit address and CRC are added to the request and stripped from
+   * the response.  Requests to the broadcast address 0 return without
+   * waiting for a response.
+   *
+   * \param unit The slave address, 0 to broadcast.
+   * \param request The request PDU, starting with the function code.
+   * \param response Replaced with the response PDU.
+   *
+   * \throw serial::modbus::ModbusException
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   * \throw serial::IOException
+   */
+  void
+  transact (uint8_t unit, const std::vector<uint8_t> &request,
+            std::vector<uint8_t> &response);
+
+  /*! Reads count coils starting at address. */
+  std::vector<bool>
+  readCoils (uint8_t unit, uint16_t address, uint16_t count);
+
+  /*! Reads count discrete inputs starting at address. */
+  std::vector<bool>
+  readDiscreteInputs (uint8_t unit, uint16_t address, uint16_t count);
+
+  /*! Reads count holding registers starting at address. */
+  std::vector<uint16_t>
+  readHoldingRegisters (uint8_t unit, uint16_t address, uint16_t count);
+
+  /*! Reads count input registers starting at address. */
+  std::vector<uint16_t>
+  readInputRegisters (uint8_t unit, uint16_t address, uint16_t count);
+
+  /*! Writes a single coil. */
+  void
+  writeSingleCoil (uint8_t unit, uint16_t address, bool value);
+
+  /*! Writes a single holding register. */
+  void
+  writeSingleRegister (uint8_t unit, uint16_t address, uint16_t value);
+
+  /*! Writes consecutive holding registers starting at address. */
+  void
+  writeMultipleRegisters (uint8_t unit, uint16_t address,
+                          const std::vector<uint16_t> &values);
+
+private:
+  // Disable copy constructors
+  RtuMaster(const RtuMaster&);
+  RtuMaster& operator=(const RtuMaster&);
+
+  void
+  updateFrameTiming_ ();
+
+  void
+  receiveFrame_ (std::vector<uint8_t> &frame);
+
+  std::vector<bool>
+  readBits_ (uint8_t unit, uint8_t function, uint16_t address,
+             uint16_t count);
+
+  std::vector<uint16_t>
+  readRegisters_ (uint8_t unit, uint8_t function, uint16_t address,
+                  uint16_t count);
+
+  Serial &port_;
+  uint32_t response_timeout_;
+
+  uint32_t t15_chars_;        // Inter-character gap that breaks a frame
+  uint32_t t35_chars_;        // Inter-frame gap
+  bool gap_pending_;          // True until t3.5 has passed after a frame
+
+  std::vector<uint8_t> adu_;  // Reusable request/response buffer
+};
+
+/*!
+ * Structure describing one transaction handed to RtuScheduler.
+ */
+struct Transaction {
+  /*! Index of the master, as returned by RtuScheduler::addMaster. */
+  size_t master;
+  /*! The slave address. */
+  uint8_t unit;
+  /*! The request PDU, starting with the function code. */
+  std::vector<uint8_t> request;
+  /*! The response PDU, filled in on success. */
+  std::vector<uint8_t> response;
+  /*! True if the transaction completed without an error. */
+  bool ok;
+  /*! Description of the error if ok is false. */
+  std::string error;
+
+  explicit Transaction (size_t master_=0, uint8_t unit_=0)
+  : master(master_), unit(unit_), ok(false)
+  {}
+};
+
+/*!
+ * Runs batches of transactions on several masters at once.
+ *
+ * RTU only allows one outstanding request per bus, so transactions for the
+ * same master are issued in order while the masters, each on its own port,
+ * work in parallel.  The scheduler does not own the masters.
+ */
+class RtuScheduler {
+public:
+  RtuScheduler ();
+
+  virtual ~RtuScheduler ();
+
+  /*! Adds a master and returns its index for Transaction::master. */
+  size_t
+  addMaster (RtuMaster *master);
+
+  /*! Executes the transactions and blocks until all have finished.
+   *
+   * Errors do not stop the batch, they are reported in the ok and error
+   * members of each transaction.
+   *
+   * \throw std::invalid_argument if a transaction refers to an unknown
+   * master.
+   */
+  void
+  execute (std::vector<Transaction> &transactions);
+
+private:
+  // Disable copy constructors
+  RtuScheduler(const RtuScheduler&);
+  RtuScheduler& operator=(const RtuScheduler&);
+
+  std::vector<RtuMaster*> masters_;
+};
+
+class ModbusException : public std::exception
+{
+  // Disable copy constructors
+  ModbusException& operator=(const ModbusException&);
+  std::string e_what_;
+  uint8_t exception_code_;
+public:
+  ModbusException (const char *description, uint8_t exception_code = 0)
+    : exception_code_(exception_code) {
+      std::stringstream ss;
+      ss << "ModbusException " << description;
+      if (exception_code_ != 0) {
+        ss << " (exception code " << static_cast<int> (exception_code_) << ")";
+      }
+      ss << ".";
+      e_what_ = ss.str();
+  }
+  ModbusException (const ModbusException& other)
+    : e_what_(other.e_what_), exception_code_(other.exception_code_) {}
+  virtual ~ModbusException() throw() {}
+
+  /*! Exception code returned by the slave, 0 for local errors. */
+  uint8_t getExceptionCode () const { return exception_code_; }
+
+  virtual const char* what () const throw () {
+    return e_what_.c_str();
+  }
+};
+
+} // namespace modbus
+} // namespace serial
+
+#endif
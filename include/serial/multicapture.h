@@ -0,0 +1,193 @@
+/*!
+ * \file serial/multicapture.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * \section DESCRIPTION
+ *
+ * This captures several serial ports at once into one stream, in the order
+ * the bytes arrived.  A MultiCapture reads every port from one thread,
+ * waiting for all of them with a single poll, and merges the chunks of
+ * the ports by the estimated arrival of their first byte.  The stream
+ * goes to a capture::Writer, a ChunkHandler or both.  Only available on
+ * Unix.
+ */
+
+#ifndef SERIAL_MULTICAPTURE_H
+#define SERIAL_MULTICAPTURE_H
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+#include "serial/serial.h"
+#include "serial/capture.h"
+
+namespace serial {
+namespace capture {
+
+/*!
+ * Interface receiving the merged stream of a MultiCapture.
+ */
+class ChunkHandler {
+public:
+  virtual ~ChunkHandler () {}
+
+  /*! Called on the thread of the MultiCapture for every chunk, in the
+   * order of their timestamps.  The data of the chunk is only valid
+   * during the call, and the ports are not read until it returns.
+   */
+  virtual void
+  onChunk (const Chunk &chunk) = 0;
+};
+
+/*!
+ * Class that captures the bytes received on several ports into one stream
+ * ordered by time.
+ *
+ * The timestamp of a chunk is the estimated arrival of its first byte,
+ * see Serial::readTimestamped.  A chunk is passed on once no port can
+ * still produce an earlier one, which is after the next wake-up of the
+ * capture thread, so within about 10 milliseconds.  Each port has a
+ * buffer of its own, and reads only as much as fits into it.  Should a
+ * port fill its buffer while another port holds the merge back, its
+ * oldest chunk is passed on regardless, and the stream may go slightly
+ * out of order.
+ *
+ * Ports opened on a serial::Transport have no descriptor to wait for,
+ * they are checked on every wake-up instead.
+ */
+class MultiCapture {
+public:
+  /*!
+   * Starts capturing.
+   *
+   * \param ports The open ports, which must outlive the capture.  They
+   * should not be read by anything else.  The id of a port in the stream
+   * is its index.
+   * \param writer A Writer to append the stream to, or NULL.
+   * \param handler A ChunkHandler to pass the stream to, or NULL.
+   * \param capacity Size in bytes of the buffer of each port, at least 1.
+   *
+   * \throw std::invalid_argument if there are no ports, more than 65536,
+   * or capacity is 0.
+   * \throw serial::IOException if the capture thread cannot be started.
+   */
+  MultiCapture (const std::vector<Serial *> &ports, Writer *writer,
+                ChunkHandler *handler = NULL, size_t capacity = 65536);
+
+  /*! Stops capturing. */
+  virtual ~MultiCapture ();
+
+  /*! Stops capturing, after passing on the chunks read so far.  Returns
+   * within about 10 milliseconds.
+   */
+  void
+  stop ();
+
+  /*! Returns false once stopped, or if appending to the writer failed. */
+  bool
+  isRunning () const;
+
+  /*! Returns false once reading the port with the given id failed. */
+  bool
+  isPortRunning (uint16_t port) const;
+
+  /*! Returns the number of bytes passed on. */
+  uint64_t
+  getBytesCaptured () const;
+
+private:
+  // Disable copy constructors
+  MultiCapture(const MultiCapture&);
+  MultiCapture& operator=(const MultiCapture&);
+
+  // A chunk read into the buffer of a port and not yet passed on.
+  struct Pending {
+    uint64_t timestamp_ns;
+    size_t offset;
+    size_t size;
+  };
+
+  struct Port {
+    Serial *serial;
+    int fd;                   // -1 for ports checked on every wake-up
+    std::vector<uint8_t> buffer;
+    size_t head;              // Where the next chunk goes into buffer
+    std::deque<Pending> pending;
+    uint64_t floor_ns;        // Least timestamp the port can still produce
+    bool running;
+  };
+
+  // The head of the pending chunks of a port, in the merge heap.
+  struct Head {
+    uint64_t timestamp_ns;
+    uint16_t port;
+
+    // Orders the heap by the earliest timestamp, then by port.
+    bool operator< (const Head &other) const {
+      return timestamp_ns != other.timestamp_ns
+             ? timestamp_ns > other.timestamp_ns : port > other.port;
+    }
+  };
+
+  static void *
+  captureThread_ (void *arg);
+
+  void
+  capture_ ();
+
+  // Reads what the port has received, as far as its buffer has room.
+  void
+  read_ (uint16_t index, uint64_t poll_ns);
+
+  // Returns the room for a chunk in the buffer of the port, and its offset.
+  size_t
+  room_ (const Port &port, size_t &offset) const;
+
+  // Passes on the pending chunks up to timestamp_ns, in order.
+  void
+  merge_ (uint64_t timestamp_ns);
+
+  std::vector<Port> ports_;
+  std::vector<Head> heap_;
+  std::vector<TimestampedChunk> chunks_;  // Reused by read_
+  Writer *writer_;
+  ChunkHandler *handler_;
+
+  volatile bool stopping_;
+  bool running_;
+  bool started_;
+  uint64_t bytes_captured_;
+  pthread_t capture_thread_;
+  mutable pthread_mutex_t mutex_;
+};
+
+} // namespace capture
+} // namespace serial
+
+#endif // SERIAL_MULTICAPTURE_H
@@ -0,0 +1,185 @@
+/*!
+ * \file serial/network.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a transport reaching a serial port through a serial device
+ * server, either as a raw TCP byte stream or with the Telnet Com Port
+ * Control Option of RFC 2217, which also carries the line settings and the
+ * modem lines.  Serial uses it for port names like rfc2217://host:port and
+ * tcp://host:port.  Only available on Unix.
+ */
+
+#ifndef SERIAL_NETWORK_H
+#define SERIAL_NETWORK_H
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "serial/transport.h"
+
+namespace serial {
+
+/*!
+ * Class of a transport over a TCP connection to a serial device server.
+ *
+ * Nagle's algorithm is disabled, and every write goes out in a single
+ * send with the commands queued before it, so a short request is neither
+ * held back nor split.  Writes the socket cannot take at once wait in a
+ * buffer of the transport and go out on the next call.
+ *
+ * Over raw TCP the line settings are ignored, RTS and DTR do nothing, and
+ * CTS, DSR and CD read as set for as long as the connection is up.  Over
+ * RFC 2217 the settings are sent to the server whenever they change, and
+ * the lines reflect the last modem state the server notified.
+ *
+ * \code
+ * serial::Serial port("rfc2217://192.168.1.20:4001", 115200,
+ *                     serial::Timeout::simpleTimeout(1000));
+ * \endcode
+ */
+class NetworkTransport : public Transport {
+public:
+  /*!
+   * Connects to a device server.
+   *
+   * \param url The server, as rfc2217://host:port or tcp://host:port.  The
+   * host can be a name, an IPv4 address, or an IPv6 address in brackets.
+   *
+   * \throw std::invalid_argument if the url is not one of those.
+   * \throw serial::IOException if the connection fails.
+   */
+  explicit NetworkTransport (const std::string &url);
+
+  /*! Closes the connection. */
+  virtual ~NetworkTransport ();
+
+  /*! Returns true if the port name is the url of a device server. */
+  static bool
+  isUrl (const std::string &port);
+
+  virtual size_t
+  available ();
+
+  virtual bool
+  waitReadable (uint64_t timeout_ns);
+
+  virtual bool
+  waitWritable (uint64_t timeout_ns);
+
+  virtual size_t
+  read (uint8_t *buffer, size_t size);
+
+  virtual size_t
+  write (const uint8_t *data, size_t size);
+
+  virtual void
+  configure (unsigned long baudrate, bytesize_t bytesize, parity_t parity,
+             stopbits_t stopbits, flowcontrol_t flowcontrol);
+
+  virtual void
+  flushInput ();
+
+  virtual void
+  flushOutput ();
+
+  virtual void
+  setRTS (bool level);
+
+  virtual void
+  setDTR (bool level);
+
+  virtual bool
+  waitForChange ();
+
+  virtual bool
+  getCTS ();
+
+  virtual bool
+  getDSR ();
+
+  virtual bool
+  getRI ();
+
+  virtual bool
+  getCD ();
+
+private:
+  // Disable copy constructors
+  NetworkTransport(const NetworkTransport&);
+  NetworkTransport& operator=(const NetworkTransport&);
+
+  // Receives what the socket has, without waiting unless timeout_ns is
+  // not 0.  Takes rx_mutex_.
+  void
+  receive_ (uint64_t timeout_ns);
+
+  // Sorts received bytes into data and Telnet commands.  Needs rx_mutex_.
+  void
+  parse_ (const uint8_t *data, size_t size);
+
+  // Acts on a complete subnegotiation.  Needs rx_mutex_.
+  void
+  subnegotiation_ ();
+
+  // Queues a Com Port Control command in tx_.  Needs tx_mutex_.
+  void
+  command_ (uint8_t command, const uint8_t *data, size_t size);
+
+  // Sends what the socket takes of tx_.  Needs tx_mutex_.
+  void
+  send_ ();
+
+  // Returns the modem state bit, or whether connected over raw TCP.
+  bool
+  modemLine_ (uint8_t bit);
+
+  int fd_;
+  bool rfc2217_;
+  bool connected_;                // Guarded by rx_mutex_
+
+  std::vector<uint8_t> rx_;       // Data received and not read
+  size_t rx_offset_;              // Start of the unread data in rx_
+  int parse_state_;
+  uint8_t negotiation_;           // WILL, WONT, DO or DONT being parsed
+  std::vector<uint8_t> sub_;      // Subnegotiation being parsed
+  uint8_t modem_state_;
+  uint64_t modem_changes_;
+  pthread_mutex_t rx_mutex_;
+
+  std::vector<uint8_t> tx_;       // Escaped data and commands not sent
+  bool send_failed_;              // Guarded by tx_mutex_
+  pthread_mutex_t tx_mutex_;
+};
+
+} // namespace serial
+
+#endif // SERIAL_NETWORK_H
@@ -0,0 +1,202 @@
+/*!
+ * \file serial/nmea.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a streaming NMEA 0183 sentence parser which can be fed
+ * directly from serial::Serial::read.
+ */
+
+#ifndef SERIAL_NMEA_H
+#define SERIAL_NMEA_H
+
+#include <vector>
+#include <string>
+
+#include "serial/serial.h"
+
+namespace serial {
+namespace nmea {
+
+/*!
+ * Structure referring to one field of a sentence inside the parser buffer.
+ *
+ * The data fields of a sentence are NUL terminated, so they can be handed
+ * to strtod and friends directly.  Fields are only valid during the
+ * Handler::onSentence call.
+ */
+struct Field {
+  /*! Pointer to the first character of the field. */
+  const char *data;
+  /*! Number of characters in the field. */
+  size_t size;
+
+  Field () : data(""), size(0) {}
+  Field (const char *data_, size_t size_) : data(data_), size(size_) {}
+
+  /*! Returns true if the field has no characters. */
+  bool empty () const { return size == 0; }
+
+  /*! Compares the field against a NUL terminated string. */
+  bool operator== (const char *other) const {
+    return std::strncmp (data, other, size) == 0 && other[size] == '\0';
+  }
+
+  /*! Copies the field into a std::string. */
+  std::string str () const { return std::string (data, size); }
+};
+
+/*!
+ * Structure describing a parsed sentence.
+ *
+ * For "$GPGGA,123519,4807.038,N*47" the talker is "GP", the type is "GGA"
+ * and the fields are "123519", "4807.038" and "N".  Proprietary sentences,
+ * whose address starts with 'P', have an empty talker and the whole
+ * address as their type.
+ */
+struct Sentence {
+  /*! The start delimiter, '$' or '!' for encapsulated sentences. */
+  char start;
+  /*! The talker identifier. */
+  Field talker;
+  /*! The sentence formatter. */
+  Field type;
+  /*! The data fields following the address field. */
+  std::vector<Field> fields;
+  /*! True if the sentence carried a (valid) checksum. */
+  bool has_checksum;
+};
+
+/*!
+ * Interface receiving the sentences found by a Parser.
+ */
+class Handler {
+public:
+  virtual ~Handler () {}
+
+  /*! Called for every complete sentence which passed validation. */
+  virtual void
+  onSentence (const Sentence &sentence) = 0;
+};
+
+/*!
+ * Class that splits a byte stream into NMEA 0183 sentences.
+ *
+ * Bytes may be fed in chunks of any size.  The checksum is accumulated as
+ * the bytes arrive and fields are recorded as offsets into a fixed buffer,
+ * so once the parser is warmed up no memory is allocated per sentence.
+ */
+class Parser {
+public:
+  /*!
+   * Creates a parser.
+   *
+   * \param require_checksum If true, sentences without a checksum are
+   * dropped, otherwise they are delivered with has_checksum false.
+   */
+  explicit Parser (bool require_checksum = true);
+
+  virtual ~Parser ();
+
+  /*! Parses a chunk of bytes, calling the handler for each sentence.
+   *
+   * \return The number of sentences delivered.
+   */
+  size_t
+  parse (const uint8_t *data, size_t size, Handler &handler);
+
+  /*! Reads what is available from the port and parses it.
+   *
+   * If no data is available the call blocks for at most the read timeout
+   * of the port waiting for the first byte.
+   *
+   * \param port The port to read from.
+   * \param handler The handler receiving the sentences.
+   * \param size The maximum number of bytes to read.
+   *
+   * \return The number of sentences delivered.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  size_t
+  read (Serial &port, Handler &handler, size_t size = 4096);
+
+  /*! Drops a partially received sentence. */
+  void
+  reset ();
+
+  /*! Number of sentences delivered so far. */
+  uint64_t
+  getSentenceCount () const { return sentences_; }
+
+  /*! Number of sentences dropped because of a bad or missing checksum. */
+  uint64_t
+  getChecksumErrors () const { return checksum_errors_; }
+
+  /*! Number of sentences dropped because they were too long. */
+  uint64_t
+  getOverflowErrors () const { return overflow_errors_; }
+
+private:
+  // Disable copy constructors
+  Parser(const Parser&);
+  Parser& operator=(const Parser&);
+
+  typedef enum {
+    hunting,      // Waiting for '$' or '!'
+    body,         // Address and data fields
+    checksum_hi,  // First checksum digit
+    checksum_lo   // Second checksum digit
+  } state_t;
+
+  void
+  deliver_ (Handler &handler);
+
+  // Room for the 82 characters of the standard plus proprietary extensions.
+  static const size_t max_sentence_ = 256;
+
+  bool require_checksum_;
+  state_t state_;
+  char buffer_[max_sentence_ + 1];
+  size_t length_;
+  uint8_t checksum_;
+  uint8_t received_checksum_;
+  bool has_checksum_;
+  std::vector<size_t> commas_;
+  Sentence sentence_;
+  std::vector<uint8_t> read_buffer_;
+
+  uint64_t sentences_;
+  uint64_t checksum_errors_;
+  uint64_t overflow_errors_;
+};
+
+} // namespace nmea
+} // namespace serial
+
+#endif
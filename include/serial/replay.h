@@ -0,0 +1,166 @@
+/*!
+ * \file serial/replay.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * \section DESCRIPTION
+ *
+ * This replays a capture made with serial::capture::Writer into the master
+ * side of a pseudo terminal, so that a Serial opened on the slave side sees
+ * the captured traffic as if it came from a device.  The chunks can be
+ * replayed with their original timing, faster or slower, or as fast as
+ * possible.  Only available on Unix.
+ */
+
+#ifndef SERIAL_REPLAY_H
+#define SERIAL_REPLAY_H
+
+#include <string>
+
+#include "serial/serial.h"
+#include "serial/capture.h"
+
+namespace serial {
+namespace replay {
+
+/*!
+ * Structure reporting what Replayer::run replayed.
+ */
+struct ReplayStats {
+  /*! Number of chunks written. */
+  uint64_t chunks;
+  /*! Number of bytes written. */
+  uint64_t bytes;
+  /*! Time taken by the replay in nanoseconds. */
+  uint64_t elapsed_ns;
+  /*! Largest delay of a chunk behind its schedule, in nanoseconds. */
+  uint64_t max_lateness_ns;
+  /*! Sum of the delays of the chunks behind their schedule. */
+  uint64_t total_lateness_ns;
+
+  ReplayStats () : chunks(0), bytes(0), elapsed_ns(0), max_lateness_ns(0),
+                   total_lateness_ns(0) {}
+
+  /*! Returns the bytes written per second of the replay. */
+  double
+  bytesPerSecond () const
+  {
+    return elapsed_ns == 0 ? 0.0 : bytes * 1e9 / elapsed_ns;
+  }
+};
+
+/*!
+ * Class that writes the chunks of a capture into a pseudo terminal.
+ */
+class Replayer {
+public:
+  /*!
+   * Creates the pseudo terminal, in raw mode.
+   *
+   * \param reader The capture to replay, from its current chunk, see
+   * capture::Reader::seek.  It must outlive the replayer.
+   *
+   * \throw serial::IOException if the pseudo terminal cannot be created.
+   */
+  explicit Replayer (capture::Reader &reader);
+
+  /*! Closes the pseudo terminal. */
+  virtual ~Replayer ();
+
+  /*! Returns the device of the slave side, to open with Serial. */
+  std::string
+  getPortName () const;
+
+  /*! Sets the speed of the replay relative to the capture, e.g. 1.0 for
+   * the original timing or 10.0 for ten times faster.  0 replays as fast
+   * as the pseudo terminal takes the bytes.  Defaults to 1.0.
+   *
+   * \throw std::invalid_argument if speed is negative.
+   */
+  void
+  setSpeed (double speed);
+
+  /*! Returns the speed of the replay. */
+  double
+  getSpeed () const;
+
+  /*! Selects the chunks to replay by direction, direction_rx by default,
+   * which is what the captured application received.
+   */
+  void
+  setDirection (capture::direction_t direction);
+
+  /*! Selects the chunks to replay by port id, or all ports with -1, the
+   * default.
+   */
+  void
+  setPort (int port);
+
+  /*!
+   * Replays the selected chunks until the end of the capture or stop.
+   * The first chunk is written at once and the others at their times
+   * relative to it, divided by the speed.  Writing blocks while the
+   * pseudo terminal is full, the delay then shows as lateness.
+   *
+   * \return What was replayed.
+   *
+   * \throw serial::IOException if writing to the pseudo terminal fails.
+   */
+  ReplayStats
+  run ();
+
+  /*! Makes run return before its next chunk.  Can be called from any
+   * thread.
+   */
+  void
+  stop ();
+
+private:
+  // Disable copy constructors
+  Replayer(const Replayer&);
+  Replayer& operator=(const Replayer&);
+
+  // Sleeps until the monotonic time deadline_ns, or stop.
+  void
+  sleepUntil_ (uint64_t deadline_ns);
+
+  void
+  write_ (const uint8_t *data, size_t size);
+
+  capture::Reader &reader_;
+  int master_fd_;
+  int slave_fd_;
+  std::string port_name_;
+  double speed_;
+  capture::direction_t direction_;
+  int port_;
+  volatile bool stopping_;
+};
+
+} // namespace replay
+} // namespace serial
+
+#endif // SERIAL_REPLAY_H
@@ -45,11 +45,22 @@
 #include <stdexcept>
 #include <serial/v8stdint.h>
 
+#if __cplusplus >= 201103L
+#include <algorithm>
+#include <chrono>
+#endif
+
 #define THROW(exceptionClass, message) throw exceptionClass(__FILE__, \
 __LINE__, (message) )
 
 namespace serial {
 
+namespace framing {
+class Encoder;
+}
+
+class Transport;
+
 /*!
  * Enumeration defines the possible bytesizes for the serial port.
  */
@@ -89,9 +100,28 @@ typedef enum {
   flowcontrol_hardware
 } flowcontrol_t;
 
+/*!
+ * Enumeration defines the modem control lines driven by the host, values
+ * can be or'ed together to form a bit mask.
+ */
+typedef enum {
+  modemline_rts = 0x1,
+  modemline_dtr = 0x2
+} modemline_t;
+
+/*!
+ * Enumeration defines the write lanes.  A write waiting in a lane goes
+ * before the writes waiting in the lanes below it.
+ */
+typedef enum {
+  priority_high = 0,
+  priority_normal,
+  priority_bulk
+} priority_t;
+
 /*!
  * Structure for setting the timeout of the serial port, times are
- * in milliseconds.
+ * in milliseconds unless unit_ns says otherwise.
  *
  * In order to disable the interbyte timeout, set it to Timeout::max().
  */
@@ -113,31 +143,480 @@ struct Timeout {
     return Timeout(max(), timeout, 0, timeout, 0);
   }
 
-  /*! Number of milliseconds between bytes received to timeout on. */
+#if __cplusplus >= 201103L
+  /*!
+   * Like simpleTimeout(uint32_t), for a timeout given as a std::chrono
+   * duration, e.g. std::chrono::microseconds(500).
+   */
+  static Timeout simpleTimeout(std::chrono::nanoseconds timeout) {
+    return Timeout(std::chrono::nanoseconds::max(), timeout,
+                   std::chrono::nanoseconds::zero(), timeout,
+                   std::chrono::nanoseconds::zero());
+  }
+#endif
+
+  /*! Number of units between bytes received to timeout on. */
   uint32_t inter_byte_timeout;
-  /*! A constant number of milliseconds to wait after calling read. */
+  /*! A constant number of units to wait after calling read. */
   uint32_t read_timeout_constant;
   /*! A multiplier against the number of requested bytes to wait after
    *  calling read.
    */
   uint32_t read_timeout_multiplier;
-  /*! A constant number of milliseconds to wait after calling write. */
+  /*! A constant number of units to wait after calling write. */
   uint32_t write_timeout_constant;
   /*! A multiplier against the number of requested bytes to wait after
    *  calling write.
    */
   uint32_t write_timeout_multiplier;
+  /*! Length of the unit of the other members in nanoseconds, 1000000 for
+   *  milliseconds.  Windows rounds the timeouts up to milliseconds.
+   */
+  uint32_t unit_ns;
 
   explicit Timeout (uint32_t inter_byte_timeout_=0,
                     uint32_t read_timeout_constant_=0,
                     uint32_t read_timeout_multiplier_=0,
                     uint32_t write_timeout_constant_=0,
-                    uint32_t write_timeout_multiplier_=0)
+                    uint32_t write_timeout_multiplier_=0,
+                    uint32_t unit_ns_=1000000)
   : inter_byte_timeout(inter_byte_timeout_),
     read_timeout_constant(read_timeout_constant_),
     read_timeout_multiplier(read_timeout_multiplier_),
     write_timeout_constant(write_timeout_constant_),
-    write_timeout_multiplier(write_timeout_multiplier_)
+    write_timeout_multiplier(write_timeout_multiplier_),
+    unit_ns(unit_ns_)
+  {}
+
+#if __cplusplus >= 201103L
+  /*!
+   * Creates a Timeout from std::chrono durations, kept in the finest of
+   * nanoseconds, microseconds and milliseconds which holds all of them.
+   * An inter_byte_timeout of std::chrono::nanoseconds::max() disables the
+   * interbyte timeout.
+   */
+  Timeout (std::chrono::nanoseconds inter_byte_timeout_,
+           std::chrono::nanoseconds read_timeout_constant_,
+           std::chrono::nanoseconds read_timeout_multiplier_,
+           std::chrono::nanoseconds write_timeout_constant_,
+           std::chrono::nanoseconds write_timeout_multiplier_)
+  : unit_ns(1)
+  {
+    const bool disabled =
+      inter_byte_timeout_ == std::chrono::nanoseconds::max();
+    const std::chrono::nanoseconds::rep longest = std::max({
+      disabled ? 0 : inter_byte_timeout_.count(),
+      read_timeout_constant_.count(), read_timeout_multiplier_.count(),
+      write_timeout_constant_.count(), write_timeout_multiplier_.count()});
+    // Leave max() free, it disables the interbyte timeout.
+    while (unit_ns < 1000000 && (longest + unit_ns - 1) / unit_ns >= max()) {
+      unit_ns *= 1000;
+    }
+    inter_byte_timeout = disabled ? max() : units(inter_byte_timeout_);
+    read_timeout_constant = units(read_timeout_constant_);
+    read_timeout_multiplier = units(read_timeout_multiplier_);
+    write_timeout_constant = units(write_timeout_constant_);
+    write_timeout_multiplier = units(write_timeout_multiplier_);
+  }
+
+private:
+  // Rounds up, so a timeout never expires early, and saturates at max().
+  uint32_t units(std::chrono::nanoseconds duration) const {
+    std::chrono::nanoseconds::rep count =
+      (duration.count() + unit_ns - 1) / unit_ns;
+    return count <= 0 ? 0 : count >= max() ? max() - 1
+                                           : static_cast<uint32_t>(count);
+  }
+#endif
+};
+
+/*!
+ * An absolute point in time on the monotonic clock of the library, which
+ * bounds a single read, readline or write call in place of the Timeout of
+ * the port.
+ *
+ * Unlike Serial::setTimeout, passing a Deadline changes nothing shared, so
+ * one thread can bound a request and its response while another reads
+ * with the port's timeout.
+ */
+struct Deadline {
+  /*! A deadline which never passes. */
+  static Deadline never() {
+    return Deadline(std::numeric_limits<uint64_t>::max());
+  }
+
+  /*! A deadline milliseconds from now. */
+  static Deadline fromNow(uint32_t milliseconds);
+
+  /*! A deadline nanoseconds from now. */
+  static Deadline fromNowNs(uint64_t nanoseconds);
+
+#if __cplusplus >= 201103L
+  /*! A deadline after a std::chrono duration from now. */
+  static Deadline fromNow(std::chrono::nanoseconds duration) {
+    return fromNowNs(duration.count() > 0
+                     ? static_cast<uint64_t>(duration.count()) : 0);
+  }
+#endif
+
+  /*! The current time of the clock deadlines are on, in nanoseconds. */
+  static uint64_t now();
+
+  /*! Returns true once the deadline has passed. */
+  bool expired() const {
+    return now() >= ns;
+  }
+
+  /*! The deadline in nanoseconds on the clock of now(). */
+  uint64_t ns;
+
+  explicit Deadline (uint64_t ns_) : ns(ns_) {}
+};
+
+/*!
+ * Structure describing the rate at which writes are handed to the driver.
+ *
+ * Writes are paced with a token bucket: up to burst bytes go out at once,
+ * after that bytes are released at the rate.  The rate is either a number
+ * of bytes per second, or a fraction of the line rate, which follows the
+ * baudrate, bytesize, parity and stopbits of the port.  With neither set
+ * writes are not paced.
+ *
+ * \see Serial::setWriteRate
+ */
+struct WriteRate {
+  /*! Writes are not paced. */
+  static WriteRate unlimited() {
+    return WriteRate();
+  }
+
+  /*!
+   * Paces writes to rate bytes per second.
+   *
+   * \param rate Bytes per second.
+   * \param burst Bytes which may be sent back to back, e.g. the size of the
+   * receive FIFO of the device.
+   */
+  static WriteRate bytesPerSecond(uint32_t rate, uint32_t burst = 1) {
+    return WriteRate(rate, 0, burst);
+  }
+
+  /*!
+   * Paces writes to a fraction of the line rate.
+   *
+   * \param fraction Fraction of the line rate, between 0 and 1.
+   * \param burst Bytes which may be sent back to back.
+   */
+  static WriteRate lineFraction(double fraction, uint32_t burst = 1) {
+    return WriteRate(0, fraction, burst);
+  }
+
+  /*! Bytes per second, or 0 to use line_fraction. */
+  uint32_t bytes_per_second;
+  /*! Fraction of the line rate, used when bytes_per_second is 0. */
+  double line_fraction;
+  /*! Bytes which may be sent back to back, at least 1. */
+  uint32_t burst;
+
+  explicit WriteRate (uint32_t bytes_per_second_=0,
+                      double line_fraction_=0,
+                      uint32_t burst_=1)
+  : bytes_per_second(bytes_per_second_),
+    line_fraction(line_fraction_),
+    burst(burst_)
+  {}
+};
+
+/*!
+ * Structure describing a single step of a modem line sequence.
+ *
+ * \see Serial::runLineSequence
+ */
+struct ModemLineStep {
+  /*! Bit mask of the modemline_t lines changed by this step. */
+  uint32_t mask;
+  /*! Levels of the lines in mask, a set bit asserts the line. */
+  uint32_t values;
+  /*! Number of microseconds to hold this state before the next step. */
+  uint32_t hold_us;
+
+  explicit ModemLineStep (uint32_t mask_=0, uint32_t values_=0,
+                          uint32_t hold_us_=0)
+  : mask(mask_), values(values_), hold_us(hold_us_)
+  {}
+};
+
+/*!
+ * Structure holding a histogram of latencies in nanoseconds.
+ *
+ * Buckets are logarithmic: every power of two range is split into eight
+ * linear sub-buckets, so a latency is known to within 12.5% wherever it
+ * falls.  Latencies of 2^40ns (about 18 minutes) and more are counted in
+ * the last bucket.
+ */
+struct LatencyHistogram {
+  /*! Number of buckets. */
+  static const size_t bucket_count = 304;
+
+  /*! Number of latencies counted in each bucket. */
+  uint64_t buckets[bucket_count];
+  /*! Number of latencies recorded. */
+  uint64_t count;
+  /*! Sum of the recorded latencies. */
+  uint64_t total_ns;
+  /*! Largest recorded latency. */
+  uint64_t max_ns;
+
+  LatencyHistogram ();
+
+  /*! Returns the index of the bucket counting a latency. */
+  static size_t
+  bucketIndex (uint64_t ns);
+
+  /*! Returns the smallest latency counted in a bucket. */
+  static uint64_t
+  bucketLowerBound (size_t index);
+
+  /*!
+   * Returns the latency that the given fraction, between 0 and 1, of the
+   * recorded latencies do not exceed.  The value is the upper bound of the
+   * bucket the percentile falls in, or 0 if nothing was recorded.
+   */
+  uint64_t
+  percentile (double fraction) const;
+
+  /*! Returns the mean latency, or 0 if nothing was recorded. */
+  uint64_t
+  mean () const;
+};
+
+/*!
+ * Structure holding the I/O statistics of a port.
+ *
+ * \see Serial::getStats
+ */
+struct Stats {
+  /*! Bytes returned by read calls. */
+  uint64_t bytes_read;
+  /*! Bytes accepted by write calls. */
+  uint64_t bytes_written;
+  /*! Number of reads, readline and readlines make one per byte. */
+  uint64_t read_calls;
+  /*! Number of calls to write. */
+  uint64_t write_calls;
+  /*! Number of system calls made by the read and write paths. */
+  uint64_t syscalls;
+  /*! Number of reads and writes which ended because of their timeout. */
+  uint64_t timeouts;
+  /*! Number of times the OS took only part of the data given to write. */
+  uint64_t partial_writes;
+  /*! Number of system calls restarted after a signal interrupted them. */
+  uint64_t eintr_retries;
+  /*! Number of exceptions thrown because the device seems disconnected. */
+  uint64_t disconnects;
+  /*! Time from the start of a read until the first byte was available. */
+  LatencyHistogram read_wait;
+  /*! Time from the start of a write until it returned. */
+  LatencyHistogram write_completion;
+
+  Stats ()
+  : bytes_read(0), bytes_written(0), read_calls(0), write_calls(0),
+    syscalls(0), timeouts(0), partial_writes(0), eintr_retries(0),
+    disconnects(0)
+  {}
+};
+
+/*!
+ * Structure holding the counters kept by the UART driver.
+ *
+ * The driver counts from when it was loaded, with 32 bit counters which
+ * wrap around.
+ *
+ * \see Serial::getLineCounters
+ */
+struct LineCounters {
+  /*! Characters received. */
+  uint32_t rx;
+  /*! Characters transmitted. */
+  uint32_t tx;
+  /*! Framing errors. */
+  uint32_t frame;
+  /*! Characters lost because the UART FIFO overflowed. */
+  uint32_t overrun;
+  /*! Parity errors. */
+  uint32_t parity;
+  /*! Breaks received. */
+  uint32_t brk;
+  /*! Characters dropped because the tty buffer was full. */
+  uint32_t buf_overrun;
+
+  LineCounters ()
+  : rx(0), tx(0), frame(0), overrun(0), parity(0), brk(0), buf_overrun(0)
+  {}
+
+  /*! Returns the counts since earlier, allowing for wrap around. */
+  LineCounters
+  since (const LineCounters &earlier) const;
+};
+
+/*!
+ * Interface receiving overrun reports from Serial::startLineMonitor.
+ */
+class LineMonitorHandler {
+public:
+  virtual ~LineMonitorHandler () {}
+
+  /*! Called from the monitor thread when the overrun or buf_overrun
+   * counter increased.  It must not throw.
+   *
+   * \param counters The counters sampled.
+   * \param delta The change since the previous sample.
+   */
+  virtual void
+  onOverrun (const LineCounters &counters, const LineCounters &delta) = 0;
+};
+
+/*!
+ * Interface receiving the notification requested with Serial::onDrained.
+ */
+class DrainHandler {
+public:
+  virtual ~DrainHandler () {}
+
+  /*! Called from the drain thread once the output queue is empty.  It
+   * must not throw.
+   */
+  virtual void
+  onDrained () = 0;
+};
+
+/*!
+ * Structure holding a chunk of the traffic kept by the flight recorder.
+ *
+ * \see Serial::getFlightRecord
+ */
+struct RecordedChunk {
+  /*! Time the read or write returned, in nanoseconds on the monotonic
+   * clock.  On Linux the resolution is that of the scheduler tick.
+   */
+  uint64_t timestamp_ns;
+  /*! Whether the bytes were written, rather than read. */
+  bool written;
+  /*! The bytes. */
+  std::string data;
+
+  RecordedChunk () : timestamp_ns(0), written(false) {}
+};
+
+/*!
+ * Structure telling when a chunk of the bytes of Serial::readTimestamped
+ * arrived.
+ *
+ * \see Serial::readTimestamped
+ */
+struct TimestampedChunk {
+  /*! Offset of the chunk in the buffer given to readTimestamped. */
+  size_t offset;
+  /*! Number of bytes in the chunk. */
+  size_t size;
+  /*! Time, in nanoseconds on the clock of serial::Deadline, taken right
+   * after the read woke up for the chunk, or after the read itself for
+   * bytes which were waiting already.
+   */
+  uint64_t timestamp_ns;
+  /*! Estimated arrival of the first byte of the chunk: timestamp_ns less
+   * one byte time for every byte received by then.
+   */
+  uint64_t first_byte_ns;
+  /*! Whether the read waited for the chunk.  If not, the bytes may have
+   * been waiting for a long time and first_byte_ns is only a bound on
+   * their arrival.
+   */
+  bool waited;
+
+  TimestampedChunk ()
+    : offset(0), size(0), timestamp_ns(0), first_byte_ns(0), waited(false) {}
+};
+
+/*!
+ * Interface receiving the flight record when a read or write throws.
+ *
+ * \see Serial::setFlightRecordHandler
+ */
+class FlightRecordHandler {
+public:
+  virtual ~FlightRecordHandler () {}
+
+  /*! Called by the failing read or write before its exception propagates.
+   * It must not throw.
+   *
+   * \param record The recent traffic, oldest first.
+   * \param error The exception about to be thrown.
+   */
+  virtual void
+  onFlightRecord (const std::vector<RecordedChunk> &record,
+                  const std::exception &error) = 0;
+};
+
+/*!
+ * Interface telling Serial::transact where a reply ends and which request
+ * it answers.
+ *
+ * Requests and replies are matched by tag.  The default tags are all 0, so
+ * replies answer the outstanding requests in the order they were sent.
+ */
+class ReplyMatcher {
+public:
+  virtual ~ReplyMatcher () {}
+
+  /*! Returns the size of the reply at the start of data, or 0 if data
+   * does not hold a complete reply yet.
+   */
+  virtual size_t
+  replySize (const uint8_t *data, size_t size) const = 0;
+
+  /*! Returns the tag of a request. */
+  virtual uint32_t
+  requestTag (const uint8_t * /*request*/, size_t /*size*/) const
+  {
+    return 0;
+  }
+
+  /*! Returns the tag of a complete reply. */
+  virtual uint32_t
+  replyTag (const uint8_t * /*reply*/, size_t /*size*/) const
+  {
+    return 0;
+  }
+};
+
+/*!
+ * ReplyMatcher for replies which end with an end of line sequence.
+ */
+class LineMatcher : public ReplyMatcher {
+public:
+  explicit LineMatcher (const std::string &eol = "\n") : eol_(eol) {}
+
+  virtual size_t
+  replySize (const uint8_t *data, size_t size) const;
+
+private:
+  std::string eol_;
+};
+
+/*!
+ * Structure describing one request/response exchange of Serial::transact.
+ */
+struct Exchange {
+  /*! The bytes to write. */
+  std::string request;
+  /*! The reply, filled in when one arrived before the deadline. */
+  std::string reply;
+  /*! True if the reply arrived. */
+  bool done;
+
+  explicit Exchange (const std::string &request_ = std::string ())
+  : request(request_), done(false)
   {}
 };
 
@@ -152,7 +631,9 @@ public:
    *
    * \param port A std::string containing the address of the serial port,
    *        which would be something like 'COM1' on Windows and '/dev/ttyS0'
-   *        on Linux.
+   *        on Linux.  On Unix it can also be the url of a serial device
+   *        server, 'rfc2217://host:port' or 'tcp://host:port', see
+   *        serial::NetworkTransport.
    *
    * \param baudrate An unsigned 32-bit integer that represents the baudrate
    *
@@ -185,6 +666,26 @@ public:
           stopbits_t stopbits = stopbits_one,
           flowcontrol_t flowcontrol = flowcontrol_none);
 
+  /*!
+   * Creates a Serial object reading and writing through a transport in
+   * place of a serial port, for instance one end of a
+   * serial::LoopbackPair.  The object is open from the start.
+   *
+   * The line settings are kept but have no effect: bytes move as fast as
+   * the transport moves them, and nothing is ever left in the output
+   * queue.  Breaks and the line counters are not available, and throw
+   * serial::IOException.
+   *
+   * \param transport The transport, which must outlive the Serial object.
+   *
+   * \param timeout A serial::Timeout struct that defines the timeout
+   * conditions for the serial port. \see serial::Timeout
+   *
+   * \throw serial::IOException on Windows, where transports are not
+   * supported yet.
+   */
+  explicit Serial (Transport &transport, Timeout timeout = Timeout());
+
   /*! Destructor */
   virtual ~Serial ();
 
@@ -211,6 +712,16 @@ public:
   bool
   isOpen () const;
 
+  /*! Gets the file descriptor of the open port, to wait for several ports
+   * at once with poll or select.  Reading the descriptor directly takes
+   * the bytes from under the reads of this object.
+   *
+   * \return The descriptor, or -1 if the port is closed, opened on a
+   * serial::Transport, or on Windows.
+   */
+  int
+  getFileDescriptor () const;
+
   /*! Closes the serial port. */
   void
   close ();
@@ -264,6 +775,64 @@ public:
   size_t
   read (uint8_t *buffer, size_t size);
 
+  /*! Read a given amount of bytes from the serial port into a given buffer,
+   * returning when they were read or the deadline passed.
+   *
+   * The deadline takes the place of the read timeouts and the inter byte
+   * timeout of the port, which are not used.
+   *
+   * \param buffer An uint8_t array of at least the requested size.
+   * \param size A size_t defining how many bytes to be read.
+   * \param deadline A serial::Deadline after which read returns what it got.
+   *
+   * \return A size_t representing the number of bytes read.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  size_t
+  read (uint8_t *buffer, size_t size, const Deadline &deadline);
+
+  /*! Read like read (uint8_t *, size_t), telling when the bytes arrived.
+   *
+   * Every chunk read from the port is appended to chunks with the time the
+   * read woke up for it.  The arrival of its first byte is estimated from
+   * that time, the number of bytes received by then and the byte time of
+   * the present serial settings, so it is only as good as the baudrate is
+   * true to the line, and it lags behind by the latency of the driver.
+   *
+   * \param buffer An uint8_t array of at least the requested size.
+   * \param size A size_t defining how many bytes to be read.
+   * \param chunks A std::vector the chunks are appended to.
+   *
+   * \return A size_t representing the number of bytes read.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  size_t
+  readTimestamped (uint8_t *buffer, size_t size,
+                   std::vector<TimestampedChunk> &chunks);
+
+  /*! Read like read (uint8_t *, size_t, const Deadline &), telling when
+   * the bytes arrived as readTimestamped (uint8_t *, size_t,
+   * std::vector<TimestampedChunk> &) does.
+   *
+   * \param buffer An uint8_t array of at least the requested size.
+   * \param size A size_t defining how many bytes to be read.
+   * \param chunks A std::vector the chunks are appended to.
+   * \param deadline A serial::Deadline after which read returns what it got.
+   *
+   * \return A size_t representing the number of bytes read.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  size_t
+  readTimestamped (uint8_t *buffer, size_t size,
+                   std::vector<TimestampedChunk> &chunks,
+                   const Deadline &deadline);
+
   /*! Read a given amount of bytes from the serial port into a give buffer.
    *
    * \param buffer A reference to a std::vector of uint8_t.
@@ -278,6 +847,12 @@ public:
   size_t
   read (std::vector<uint8_t> &buffer, size_t size = 1);
 
+  /*! Like read (std::vector<uint8_t> &, size_t), bounded by a deadline.
+   * \see Serial::read (uint8_t *, size_t, const Deadline &)
+   */
+  size_t
+  read (std::vector<uint8_t> &buffer, size_t size, const Deadline &deadline);
+
   /*! Read a given amount of bytes from the serial port into a give buffer.
    *
    * \param buffer A reference to a std::string.
@@ -292,6 +867,12 @@ public:
   size_t
   read (std::string &buffer, size_t size = 1);
 
+  /*! Like read (std::string &, size_t), bounded by a deadline.
+   * \see Serial::read (uint8_t *, size_t, const Deadline &)
+   */
+  size_t
+  read (std::string &buffer, size_t size, const Deadline &deadline);
+
   /*! Read a given amount of bytes from the serial port and return a string
    *  containing the data.
    *
@@ -321,6 +902,19 @@ public:
   size_t
   readline (std::string &buffer, size_t size = 65536, std::string eol = "\n");
 
+  /*! Reads a line like readline (std::string &, size_t, std::string), but
+   * the whole line must arrive before the deadline rather than each byte
+   * within the read timeout.
+   *
+   * \return A size_t representing the number of bytes read.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  size_t
+  readline (std::string &buffer, size_t size, std::string eol,
+            const Deadline &deadline);
+
   /*! Reads in a line or until a given delimiter has been processed.
    *
    * Reads from the serial port until a single line has been read.
@@ -371,6 +965,25 @@ public:
   size_t
   write (const uint8_t *data, size_t size);
 
+  /*! Write bytes to the serial port, returning when they were written or
+   * the deadline passed.
+   *
+   * The deadline takes the place of the write timeouts of the port, and
+   * time spent pacing writes counts against it.
+   *
+   * \param data A const reference containing the data to be written.
+   * \param size A size_t that indicates how many bytes should be written.
+   * \param deadline A serial::Deadline after which write gives up.
+   *
+   * \return A size_t representing the number of bytes actually written.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   * \throw serial::IOException
+   */
+  size_t
+  write (const uint8_t *data, size_t size, const Deadline &deadline);
+
   /*! Write a string to the serial port.
    *
    * \param data A const reference containing the data to be written
@@ -386,6 +999,12 @@ public:
   size_t
   write (const std::vector<uint8_t> &data);
 
+  /*! Like write (const std::vector<uint8_t> &), bounded by a deadline.
+   * \see Serial::write (const uint8_t *, size_t, const Deadline &)
+   */
+  size_t
+  write (const std::vector<uint8_t> &data, const Deadline &deadline);
+
   /*! Write a string to the serial port.
    *
    * \param data A const reference containing the data to be written
@@ -401,6 +1020,119 @@ public:
   size_t
   write (const std::string &data);
 
+  /*! Like write (const std::string &), bounded by a deadline.
+   * \see Serial::write (const uint8_t *, size_t, const Deadline &)
+   */
+  size_t
+  write (const std::string &data, const Deadline &deadline);
+
+  /*! Encodes a frame and writes it to the serial port.
+   *
+   * The frame is encoded straight into a buffer which is handed to the
+   * port in a single write, so there is no intermediate copy.  Frames
+   * encoding to at most 1024 bytes use a buffer on the stack, larger ones
+   * allocate it.
+   *
+   * \param data A const pointer to the frame payload.
+   * \param size A size_t that indicates how many bytes are in the payload.
+   * \param encoder The framing to apply, e.g. serial::framing::CobsEncoder.
+   *
+   * \return A size_t representing the number of encoded bytes actually
+   * written to the serial port.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   * \throw serial::IOException
+   */
+  size_t
+  writeFrame (const uint8_t *data, size_t size,
+              const framing::Encoder &encoder);
+
+  /*! Write bytes to the serial port in the given lane.
+   *
+   * Writes in the high lane go before waiting normal and bulk writes, and
+   * normal writes before waiting bulk writes.  Bulk writes are split into
+   * chunks which take half the bulk latency on the line, and the driver is
+   * let drain to one chunk before the next, so a high or normal write
+   * waits at most about the bulk latency behind a bulk transfer.  Each
+   * chunk gets the write timeout of its size.  A stream of frames should
+   * be written a frame per call, so other writes only come between frames.
+   *
+   * \param data The data to be written.
+   * \param size A size_t that indicates how many bytes should be written.
+   * \param priority The lane, one of priority_high, priority_normal and
+   * priority_bulk.
+   *
+   * \return A size_t representing the number of bytes actually written.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   * \throw serial::IOException
+   *
+   * \see Serial::setBulkLatency
+   */
+  size_t
+  write (const uint8_t *data, size_t size, priority_t priority);
+
+  /*! Like write (const std::vector<uint8_t> &), in the given lane.
+   * \see Serial::write (const uint8_t *, size_t, priority_t)
+   */
+  size_t
+  write (const std::vector<uint8_t> &data, priority_t priority);
+
+  /*! Like write (const std::string &), in the given lane.
+   * \see Serial::write (const uint8_t *, size_t, priority_t)
+   */
+  size_t
+  write (const std::string &data, priority_t priority);
+
+  /*! Writes a request and reads its reply, bounded by a deadline.
+   *
+   * Both the read and the write locks are held for the whole exchange, so
+   * no other thread can write in between or take the reply.  Whatever the
+   * port has available is read at once, so bytes which arrive right after
+   * the reply are read with it and dropped.
+   *
+   * \param request The bytes to write.
+   * \param matcher Decides where the reply ends.
+   * \param deadline A serial::Deadline bounding the whole exchange.
+   *
+   * \return The reply, or an empty string if none arrived in time.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   * \throw serial::IOException
+   */
+  std::string
+  transact (const std::string &request, const ReplyMatcher &matcher,
+            const Deadline &deadline);
+
+  /*! Runs several exchanges with up to window requests in flight at once.
+   *
+   * Requests are written in order while fewer than window are waiting for
+   * their reply, and each reply completes the oldest outstanding request
+   * with the same tag, so replies may arrive in any order.  Whatever the
+   * port has available is read at once.  Replies that answer no
+   * outstanding request are dropped without notice, like the bytes read
+   * after the last reply; the return value tells how many exchanges got
+   * theirs.
+   *
+   * \param exchanges The exchanges, their reply and done members are set.
+   * \param matcher Decides where replies end and what they answer.
+   * \param deadline A serial::Deadline bounding all the exchanges.
+   * \param window Most requests outstanding at once, 1 for stop and wait.
+   *
+   * \return The number of exchanges that got their reply.
+   *
+   * \throw std::invalid_argument if window is 0.
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   * \throw serial::IOException
+   */
+  size_t
+  transact (std::vector<Exchange> &exchanges, const ReplyMatcher &matcher,
+            const Deadline &deadline, size_t window = 8);
+
   /*! Sets the serial port identifier.
    *
    * \param port A const std::string reference containing the address of the
@@ -586,6 +1318,43 @@ public:
   flowcontrol_t
   getFlowcontrol () const;
 
+  /*! Sets the rate at which write hands bytes to the driver.
+   *
+   * For devices with small receive buffers and no flow control, which
+   * silently drop bytes sent in bursts.  Pacing is timed on the monotonic
+   * clock to the microsecond, and the time write spends pacing does not
+   * count against the write timeout.
+   *
+   * \param rate The rate, WriteRate::unlimited() turns pacing off.
+   *
+   * \see serial::WriteRate
+   */
+  void
+  setWriteRate (const WriteRate &rate);
+
+  /*! Gets the rate at which write hands bytes to the driver.
+   *
+   * \see Serial::setWriteRate
+   */
+  WriteRate
+  getWriteRate () const;
+
+  /*! Sets how long a high or normal write may wait behind a bulk write,
+   * which sets the size of the bulk chunks from the time a byte takes at
+   * the current settings.  Defaults to 10000 microseconds.
+   *
+   * \see Serial::write (const uint8_t *, size_t, priority_t)
+   */
+  void
+  setBulkLatency (uint32_t microseconds);
+
+  /*! Gets how long a high or normal write may wait behind a bulk write.
+   *
+   * \see Serial::setBulkLatency
+   */
+  uint32_t
+  getBulkLatency () const;
+
   /*! Flush the input and output buffers */
   void
   flush ();
@@ -598,6 +1367,62 @@ public:
   void
   flushOutput ();
 
+  /*!
+   * Returns the number of bytes written but not yet transmitted, read with
+   * TIOCOUTQ on Unix and from ClearCommError on Windows.
+   *
+   * Bytes already in the UART FIFO are not counted, so a few may still be
+   * on their way when this returns zero.  Writing only while the queue is
+   * below one frame keeps a command from waiting behind bulk data on a
+   * slow link.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  size_t
+  outputQueueBytes ();
+
+  /*!
+   * Waits until the output queue is empty, or for at most timeout
+   * milliseconds.  Unlike flush, the wait is bounded.
+   *
+   * The queue is polled about when the queued bytes should have been sent
+   * at the current baudrate.
+   *
+   * \param timeout Milliseconds to wait at most.
+   *
+   * \return true if the queue drained, false if the timeout expired.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  bool
+  waitDrained (uint32_t timeout);
+
+  /*!
+   * Returns immediately and calls the handler from a separate thread once
+   * the output queue is empty.
+   *
+   * The handler is called at most once.  A notification still pending is
+   * cancelled first, and closing the port cancels it as well.  Called
+   * from the handler, it requests the next notification, e.g. to queue
+   * the next block of data once the last one is out.
+   *
+   * \param handler Receives the notification, it must outlive it.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::IOException on Windows.
+   */
+  void
+  onDrained (DrainHandler &handler);
+
+  /*!
+   * Cancels the notification requested with onDrained, waiting for a
+   * running handler call to return unless called from the handler.
+   */
+  void
+  cancelDrained ();
+
   /*! Sends the RS-232 break signal.  See tcsendbreak(3). */
   void
   sendBreak (int duration);
@@ -614,6 +1439,49 @@ public:
   void
   setDTR (bool level = true);
 
+  /*! Sets any combination of the RTS and DTR lines at once.
+   *
+   * On Unix the lines change with a single ioctl (TIOCMBIS, TIOCMBIC or
+   * TIOCMSET), so there is no gap between the edges of the lines.  On
+   * Windows, and on a serial::Transport, the lines are set one after the
+   * other, RTS first, so the other end may see the state in between.
+   *
+   * \param mask Bit mask of modemline_t values selecting the lines to change.
+   * \param values Bit mask of modemline_t values, lines in mask which are set
+   * here are asserted, the others in mask are cleared.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  void
+  setModemLines (uint32_t mask, uint32_t values);
+
+  /*! Plays back a timed sequence of modem line states.
+   *
+   * Each step is applied with setModemLines and then held for its hold_us
+   * before the next step.  Steps are scheduled against absolute deadlines on
+   * the monotonic clock, so the time spent in the ioctls does not accumulate
+   * over the sequence.  This is useful for bootloader reset sequences, e.g.
+   * the ESP32 one:
+   *
+   * <pre>
+   *   std::vector<serial::ModemLineStep> steps;
+   *   steps.push_back(ModemLineStep(modemline_dtr | modemline_rts,
+   *                                 modemline_rts, 100000));
+   *   steps.push_back(ModemLineStep(modemline_dtr | modemline_rts,
+   *                                 modemline_dtr, 50000));
+   *   steps.push_back(ModemLineStep(modemline_dtr, 0));
+   *   my_serial.runLineSequence(steps);
+   * </pre>
+   *
+   * \param steps The states to apply, in order.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException
+   */
+  void
+  runLineSequence (const std::vector<ModemLineStep> &steps);
+
   /*!
    * Blocks until CTS, DSR, RI, CD changes or something interrupts it.
    *
@@ -647,6 +1515,111 @@ public:
   bool
   getCD ();
 
+  /*!
+   * Returns a snapshot of the I/O statistics of the port.
+   *
+   * The statistics are collected without locks and can be read while other
+   * threads read and write, each value is consistent on its own.  They are
+   * kept from the construction of the Serial object or the last call to
+   * resetStats, across close and open.
+   *
+   * When the library is built with SERIAL_DISABLE_STATS defined nothing is
+   * collected and all the values are zero.
+   */
+  Stats
+  getStats () const;
+
+  /*! Sets all the I/O statistics back to zero. */
+  void
+  resetStats ();
+
+  /*!
+   * Returns the error and traffic counters of the UART driver, read with
+   * TIOCGICOUNT.
+   *
+   * Overruns and buffer overruns are the first symptom of a reader which
+   * falls behind: the characters are lost before read could see them.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException if the driver does not keep counters,
+   * e.g. for USB adapters without support and pseudo terminals.
+   * \throw serial::IOException on platforms without TIOCGICOUNT.
+   */
+  LineCounters
+  getLineCounters ();
+
+  /*!
+   * Returns the UART driver counters like getLineCounters() and sets
+   * delta to the change since the previous call.  The first delta covers
+   * everything counted before.
+   */
+  LineCounters
+  getLineCounters (LineCounters &delta);
+
+  /*!
+   * Starts a thread which samples the UART driver counters every
+   * period_ms milliseconds and calls the handler when the overrun or
+   * buf_overrun counter increased.
+   *
+   * A monitor which is already running is stopped first.  The monitor
+   * stops when the port is closed, or by itself if reading the counters
+   * fails.
+   *
+   * \param handler Receives the reports, it must outlive the monitor.
+   * \param period_ms Milliseconds between samples.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::SerialException if the driver does not keep counters.
+   * \throw serial::IOException on platforms without TIOCGICOUNT.
+   */
+  void
+  startLineMonitor (LineMonitorHandler &handler, uint32_t period_ms = 100);
+
+  /*!
+   * Stops the monitor started by startLineMonitor, waiting for a running
+   * handler call to return.  Must not be called from the handler.
+   */
+  void
+  stopLineMonitor ();
+
+  /*!
+   * Starts keeping the last bytes read and written in memory, to look at
+   * after something went wrong.
+   *
+   * Each read and write then copies its bytes into an overwrite ring, with
+   * a coarse timestamp, and makes no extra system call.  Enabling again
+   * with another capacity discards what was recorded.  Must not be called
+   * while another thread calls getFlightRecord.
+   *
+   * \param capacity Bytes kept for each direction.
+   */
+  void
+  enableFlightRecorder (size_t capacity = 1 << 21);
+
+  /*! Stops the flight recorder and frees what it recorded.  Must not be
+   * called while another thread calls getFlightRecord.
+   */
+  void
+  disableFlightRecorder ();
+
+  /*!
+   * Returns the traffic kept by the flight recorder, oldest first.  Can
+   * be called while other threads read and write.  Chunks of the two
+   * directions with the same coarse timestamp may be out of order.
+   *
+   * \return The chunks, empty if the recorder is not enabled.
+   */
+  std::vector<RecordedChunk>
+  getFlightRecord () const;
+
+  /*!
+   * Sets the handler receiving the flight record whenever a read or write
+   * throws, e.g. when the device was disconnected.  The handler must
+   * outlive the port, or be replaced with NULL.
+   */
+  void
+  setFlightRecordHandler (FlightRecordHandler *handler);
+
 private:
   // Disable copy constructors
   Serial(const Serial&);
@@ -663,6 +1636,8 @@ private:
   // Read common function
   size_t
   read_ (uint8_t *buffer, size_t size);
+  size_t
+  read_ (uint8_t *buffer, size_t size, const Deadline &deadline);
   // Write common function
   size_t
   write_ (const uint8_t *data, size_t length);
@@ -0,0 +1,229 @@
+/*!
+ * \file serial/tee.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ * \section DESCRIPTION
+ *
+ * This lets several consumers in one process read every byte received on
+ * a serial port.  A Tee drains the port into one buffer, and each
+ * TeeReader reads from that buffer at its own cursor with the read and
+ * readline calls of Serial.  Only available on Unix.
+ */
+
+#ifndef SERIAL_TEE_H
+#define SERIAL_TEE_H
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "serial/serial.h"
+
+namespace serial {
+
+class TeeReader;
+
+/*!
+ * What a Tee does when a TeeReader has not read a whole buffer of bytes.
+ */
+typedef enum {
+  /*! The Tee stops draining the port until the reader catches up, so
+   * the reader loses nothing but the port may overrun. */
+  tee_block = 0,
+  /*! The reader loses its oldest bytes, see TeeReader::getDroppedBytes. */
+  tee_drop_oldest
+} tee_policy_t;
+
+/*!
+ * Class that drains a serial port into a buffer shared by TeeReaders.
+ *
+ * The port is read straight into the buffer, and every reader copies out
+ * of it once, so adding a reader costs no copy and no memory.  A reader
+ * sees the bytes received after it was created.
+ */
+class Tee {
+public:
+  /*!
+   * Starts draining the port.
+   *
+   * \param port An open port, which must outlive the tee.  It should not
+   * be read by anything else.
+   * \param capacity Size in bytes of the buffer, at least 1.
+   *
+   * \throw std::invalid_argument if capacity is 0.
+   * \throw serial::IOException if the drain thread cannot be started.
+   */
+  explicit Tee (Serial &port, size_t capacity = 65536);
+
+  /*! Stops draining the port.  The readers must be destroyed first. */
+  virtual ~Tee ();
+
+  /*! Stops draining the port.  Reads then return what is buffered and
+   * time out after that.  Returns within about 100 milliseconds.
+   */
+  void
+  stop ();
+
+  /*! Returns false once stopped, or if reading the port failed. */
+  bool
+  isRunning () const;
+
+  /*! Returns the number of bytes drained from the port. */
+  uint64_t
+  getBytesReceived () const;
+
+private:
+  friend class TeeReader;
+
+  // Disable copy constructors
+  Tee(const Tee&);
+  Tee& operator=(const Tee&);
+
+  static void *
+  drainThread_ (void *arg);
+
+  void
+  drain_ ();
+
+  // Appends one byte, waiting for room if a blocking reader is behind.
+  void
+  publish_ (uint8_t byte);
+
+  // Returns how many bytes may be read into the buffer at head_ without
+  // overwriting unread bytes of a blocking reader, at most want and no
+  // further than the end of the buffer.  Drops the bytes of the other
+  // readers which that many bytes overwrite.
+  size_t
+  reserve_ (size_t want);
+
+  // Waits on data_cond_ or space_cond_ until deadline_ns at the latest.
+  void
+  wait_ (pthread_cond_t &cond, uint64_t deadline_ns);
+
+  Serial &port_;
+  std::vector<uint8_t> buffer_;
+  uint64_t head_;           // Bytes drained, buffer_ holds the last ones
+  std::vector<TeeReader *> readers_;
+
+  volatile bool stopping_;
+  bool running_;
+  bool started_;
+  pthread_t drain_thread_;
+  mutable pthread_mutex_t mutex_;
+  pthread_cond_t data_cond_;
+  pthread_cond_t space_cond_;
+};
+
+/*!
+ * Class that reads the bytes drained by a Tee.
+ *
+ * A TeeReader is not thread safe, each consumer should create its own.
+ */
+class TeeReader {
+public:
+  /*!
+   * Attaches to a tee.
+   *
+   * \param tee The Tee to read from, which must outlive the reader.
+   * \param policy What to do when the reader falls a buffer behind.
+   * \param timeout The read timeouts, as for Serial.
+   */
+  explicit TeeReader (Tee &tee, tee_policy_t policy = tee_drop_oldest,
+                      Timeout timeout = Timeout ());
+
+  /*! Detaches from the tee. */
+  virtual ~TeeReader ();
+
+  /*! Return the number of bytes ready to be read. */
+  size_t
+  available ();
+
+  /*! Read a given amount of bytes, see Serial::read.
+   *
+   * \return A size_t representing the number of bytes read.
+   */
+  size_t
+  read (uint8_t *buffer, size_t size);
+
+  /*! Read a given amount of bytes into a std::vector, see Serial::read. */
+  size_t
+  read (std::vector<uint8_t> &buffer, size_t size = 1);
+
+  /*! Read a given amount of bytes into a std::string, see Serial::read. */
+  size_t
+  read (std::string &buffer, size_t size = 1);
+
+  /*! Read a given amount of bytes and return them, see Serial::read. */
+  std::string
+  read (size_t size = 1);
+
+  /*! Reads until a line has been read, see Serial::readline. */
+  size_t
+  readline (std::string &buffer, size_t size = 65536, std::string eol = "\n");
+
+  /*! Reads until a line has been read, see Serial::readline. */
+  std::string
+  readline (size_t size = 65536, std::string eol = "\n");
+
+  /*! Sets the timeout for reads, see Serial::setTimeout. */
+  void
+  setTimeout (const Timeout &timeout);
+
+  /*! Gets the timeout for reads. */
+  Timeout
+  getTimeout () const;
+
+  /*! Returns the policy given to the constructor. */
+  tee_policy_t
+  getPolicy () const;
+
+  /*! Returns the number of bytes dropped before they were read. */
+  uint64_t
+  getDroppedBytes () const;
+
+private:
+  friend class Tee;
+
+  // Disable copy constructors
+  TeeReader(const TeeReader&);
+  TeeReader& operator=(const TeeReader&);
+
+  // Copies up to size buffered bytes, the mutex of the tee held.
+  size_t
+  copy_ (uint8_t *buffer, size_t size);
+
+  Tee &tee_;
+  tee_policy_t policy_;
+  Timeout timeout_;
+  uint64_t cursor_;         // Next byte to read, guarded by the tee
+  uint64_t dropped_;        // Guarded by the tee
+};
+
+} // namespace serial
+
+#endif // SERIAL_TEE_H
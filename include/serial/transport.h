@@ -0,0 +1,151 @@
+/*!
+ * \file serial/transport.h
+ *
+ * \section LICENSE
+ *
+ * The MIT License
+ *
+ * Copyright (c) 2012 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ *
+ *
+ * \section DESCRIPTION
+ *
+ * This defines the interface a Serial object uses in place of an operating
+ * system port when it is constructed with a Transport, so the byte stream
+ * and the modem lines can come from anywhere.  serial/loopback.h has an
+ * implementation connecting two Serial objects in memory, and
+ * serial/network.h one reaching a port through a serial device server.
+ */
+
+#ifndef SERIAL_TRANSPORT_H
+#define SERIAL_TRANSPORT_H
+
+#include "serial/serial.h"
+
+namespace serial {
+
+/*!
+ * Interface of a byte stream with modem lines, which a Serial object reads
+ * and writes through in place of a serial port.
+ *
+ * Serial keeps its locking, timeouts, pacing and statistics, and calls
+ * the transport only to move bytes and to wait.  The reads and writes of
+ * a transport never block, the waits do.  Calls come from the reading
+ * and the writing thread at the same time, so a transport must be thread
+ * safe.
+ *
+ * \see Serial::Serial(Transport &, Timeout)
+ */
+class Transport {
+public:
+  virtual ~Transport () {}
+
+  /*! Returns the number of bytes which can be read without waiting. */
+  virtual size_t
+  available () = 0;
+
+  /*! Waits until a byte can be read, or the transport was disconnected.
+   *
+   * \return false if timeout_ns nanoseconds passed first.
+   */
+  virtual bool
+  waitReadable (uint64_t timeout_ns) = 0;
+
+  /*! Waits until a byte can be written, or the transport was
+   * disconnected.
+   *
+   * \return false if timeout_ns nanoseconds passed first.
+   */
+  virtual bool
+  waitWritable (uint64_t timeout_ns) = 0;
+
+  /*! Reads up to size bytes without waiting.
+   *
+   * \return The number of bytes read, 0 once the transport was
+   * disconnected and nothing is left to read.
+   */
+  virtual size_t
+  read (uint8_t *buffer, size_t size) = 0;
+
+  /*! Writes up to size bytes without waiting.
+   *
+   * \return The number of bytes written, 0 once the transport was
+   * disconnected.
+   */
+  virtual size_t
+  write (const uint8_t *data, size_t size) = 0;
+
+  /*! Applies the line settings of the Serial object, when it opens and
+   * whenever they change.  The default ignores them.
+   */
+  virtual void
+  configure (unsigned long baudrate, bytesize_t bytesize, parity_t parity,
+             stopbits_t stopbits, flowcontrol_t flowcontrol)
+  {
+    (void) baudrate; (void) bytesize; (void) parity; (void) stopbits;
+    (void) flowcontrol;
+  }
+
+  /*! Discards the bytes received but not read. */
+  virtual void
+  flushInput () = 0;
+
+  /*! Discards the bytes written but not sent. */
+  virtual void
+  flushOutput () = 0;
+
+  /*! Sets the RTS handshaking line to the given level. */
+  virtual void
+  setRTS (bool level) = 0;
+
+  /*! Sets the DTR handshaking line to the given level. */
+  virtual void
+  setDTR (bool level) = 0;
+
+  /*! Blocks until CTS, DSR, RI or CD changes, or the transport was
+   * disconnected.
+   *
+   * \return false if the transport was disconnected.
+   */
+  virtual bool
+  waitForChange () = 0;
+
+  /*! Returns the current status of the CTS line. */
+  virtual bool
+  getCTS () = 0;
+
+  /*! Returns the current status of the DSR line. */
+  virtual bool
+  getDSR () = 0;
+
+  /*! Returns the current status of the RI line. */
+  virtual bool
+  getRI () = 0;
+
+  /*! Returns the current status of the CD line. */
+  virtual bool
+  getCD () = 0;
+};
+
+} // namespace serial
+
+#endif // SERIAL_TRANSPORT_H
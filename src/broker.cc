@@ -0,0 +1,772 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+#include <sstream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+
+#include "serial/broker.h"
+#include "serial/impl/stats.h"
+
+using std::invalid_argument;
+using std::min;
+using std::string;
+using std::stringstream;
+using std::vector;
+
+using serial::Deadline;
+using serial::SerialException;
+using serial::Timeout;
+using serial::broker::Broker;
+using serial::broker::ConsumerInfo;
+using serial::broker::SharedSerial;
+
+namespace serial {
+namespace broker {
+
+const uint32_t segment_magic = 0x53424b31;   // "SBK1"
+const size_t max_consumers = 32;
+
+struct ConsumerSlot {
+  uint32_t pid;             // 0 while the slot is free
+  uint32_t reserved;
+  uint64_t cursor;          // Next byte the client reads
+  uint64_t dropped;
+};
+
+// Every counter only grows, positions in the rings are the counters modulo
+// the capacity.  The receive and write sides are kept on separate cache
+// lines, so the broker and the clients do not fight over them.
+struct Segment {
+  uint32_t magic;           // Set last, once the segment is initialized
+  uint32_t running;         // Cleared when the broker stops
+  uint64_t rx_capacity;
+  uint64_t tx_capacity;
+  uint32_t broker_pid;      // Process of the broker
+  uint32_t reserved;
+  uint8_t pad0[32];
+
+  uint64_t rx_head;         // Bytes published
+  uint64_t rx_reserve;      // Bytes being published, ahead of rx_head
+  uint32_t rx_seq;          // Futex word, bumped after every publish
+  uint32_t rx_waiters;      // Clients waiting on rx_seq
+  uint8_t pad1[40];
+
+  uint64_t tx_reserve;      // Bytes reserved by writing clients
+  uint64_t tx_read;         // Bytes consumed by the broker
+  uint32_t tx_seq;          // Futex word, bumped after every queued record
+  uint32_t tx_waiters;      // The broker waiting on tx_seq
+  uint32_t tx_space_seq;    // Futex word, bumped when the broker frees space
+  uint32_t tx_space_waiters;
+  uint8_t pad2[32];
+
+  ConsumerSlot consumers[max_consumers];
+};
+
+} // namespace broker
+} // namespace serial
+
+using serial::broker::ConsumerSlot;
+using serial::broker::Segment;
+using serial::broker::max_consumers;
+using serial::broker::segment_magic;
+
+namespace {
+
+// Records in the write queue start with a 64 bit header holding the
+// payload size, 0 until the record is complete, or tx_padding for the
+// unused end of the queue when a record did not fit there.
+const uint64_t tx_padding = 1ULL << 63;
+const size_t tx_header_size = 8;
+
+// Longest a waiting thread sleeps before checking for a stopped broker.
+const uint64_t max_wait_ns = 100000000;
+
+template <typename T> inline T
+load_acquire (const T &value)
+{
+  return __atomic_load_n (&value, __ATOMIC_ACQUIRE);
+}
+
+template <typename T> inline void
+store_release (T &value, T new_value)
+{
+  __atomic_store_n (&value, new_value, __ATOMIC_RELEASE);
+}
+
+inline size_t
+record_size (size_t payload)
+{
+  return (tx_header_size + payload + 7) & ~static_cast<size_t> (7);
+}
+
+inline uint64_t
+segment_size (size_t rx_capacity, size_t tx_capacity)
+{
+  return sizeof (Segment) + rx_capacity + tx_capacity;
+}
+
+string
+errno_message (const char *what, const char *call)
+{
+  stringstream ss;
+  ss << what << " failed on a call to " << call << ": "
+     << errno << " " << strerror (errno);
+  return ss.str ();
+}
+
+#if defined(__linux__)
+void
+futex_wait (uint32_t *word, uint32_t value, uint64_t timeout_ns)
+{
+  timespec timeout;
+  timeout.tv_sec = static_cast<time_t> (timeout_ns / 1000000000);
+  timeout.tv_nsec = static_cast<long> (timeout_ns % 1000000000);
+  syscall (SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+void
+futex_wake (uint32_t *word)
+{
+  syscall (SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#else
+// Without futexes waiters poll, with a short sleep.
+void
+futex_wait (uint32_t *word, uint32_t value, uint64_t timeout_ns)
+{
+  timespec sleep_time;
+  sleep_time.tv_sec = 0;
+  sleep_time.tv_nsec = static_cast<long> (min (timeout_ns,
+                                               static_cast<uint64_t> (100000)));
+  if (load_acquire (*word) == value) {
+    nanosleep (&sleep_time, NULL);
+  }
+}
+
+void
+futex_wake (uint32_t *)
+{
+}
+#endif
+
+// Waits until seq moves on from seen, or for timeout_ns.  Callers read
+// seen before checking the state seq guards, so no change is missed.
+void
+wait_on (uint32_t &seq, uint32_t &waiters, uint32_t seen, uint64_t timeout_ns)
+{
+  __atomic_fetch_add (&waiters, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&seq, __ATOMIC_SEQ_CST) == seen) {
+    futex_wait (&seq, seen, timeout_ns);
+  }
+  __atomic_fetch_sub (&waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+void
+notify (uint32_t &seq, uint32_t &waiters)
+{
+  __atomic_fetch_add (&seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&waiters, __ATOMIC_SEQ_CST) > 0) {
+    futex_wake (&seq);
+  }
+}
+
+// Whether the segment called name belongs to a broker which is running.
+bool
+owned_by_live_broker (const string &name)
+{
+  int fd = shm_open (name.c_str (), O_RDONLY, 0);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat info;
+  void *memory = MAP_FAILED;
+  if (fstat (fd, &info) == 0
+      && static_cast<size_t> (info.st_size) >= sizeof (Segment)) {
+    memory = mmap (NULL, sizeof (Segment), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close (fd);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  const Segment *segment = static_cast<const Segment*> (memory);
+  pid_t pid = static_cast<pid_t> (load_acquire (segment->broker_pid));
+  bool live = load_acquire (segment->magic) == segment_magic
+              && load_acquire (segment->running) != 0 && pid != 0
+              && (kill (pid, 0) == 0 || errno != ESRCH);
+  munmap (memory, sizeof (Segment));
+  return live;
+}
+
+bool
+power_of_two (size_t value)
+{
+  return value >= 4096 && (value & (value - 1)) == 0;
+}
+
+} // namespace
+
+Broker::Broker (Serial &port, const string &name,
+                size_t rx_capacity, size_t tx_capacity, mode_t mode)
+  : port_ (port), name_ (name), segment_ (NULL), segment_size_ (0),
+    rx_ring_ (NULL), tx_ring_ (NULL), stopping_ (false), started_ (false)
+{
+  if (!power_of_two (rx_capacity) || !power_of_two (tx_capacity)) {
+    throw invalid_argument ("the capacities of the broker must be powers "
+                            "of two of at least 4096");
+  }
+  if (owned_by_live_broker (name_)) {
+    throw SerialException ("Broker: the segment is in use by a running "
+                           "broker.");
+  }
+  // Replace the segment of a broker which did not clean up.
+  shm_unlink (name_.c_str ());
+  int fd = shm_open (name_.c_str (), O_RDWR | O_CREAT | O_EXCL, mode);
+  if (fd == -1) {
+    throw SerialException (errno_message ("Broker", "shm_open").c_str ());
+  }
+  segment_size_ = segment_size (rx_capacity, tx_capacity);
+  if (ftruncate (fd, static_cast<off_t> (segment_size_)) == -1) {
+    string message = errno_message ("Broker", "ftruncate");
+    ::close (fd);
+    shm_unlink (name_.c_str ());
+    throw SerialException (message.c_str ());
+  }
+  void *memory = mmap (NULL, segment_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  ::close (fd);
+  if (memory == MAP_FAILED) {
+    string message = errno_message ("Broker", "mmap");
+    shm_unlink (name_.c_str ());
+    throw SerialException (message.c_str ());
+  }
+  // A new segment is zero filled.
+  segment_ = static_cast<Segment*> (memory);
+  rx_ring_ = static_cast<uint8_t*> (memory) + sizeof (Segment);
+  tx_ring_ = rx_ring_ + rx_capacity;
+  segment_->rx_capacity = rx_capacity;
+  segment_->tx_capacity = tx_capacity;
+  segment_->broker_pid = static_cast<uint32_t> (getpid ());
+  segment_->running = 1;
+  store_release (segment_->magic, segment_magic);
+
+  if (pthread_create (&read_thread_, NULL, &Broker::readThread_, this) != 0) {
+    string message = errno_message ("Broker", "pthread_create");
+    munmap (segment_, segment_size_);
+    shm_unlink (name_.c_str ());
+    throw SerialException (message.c_str ());
+  }
+  if (pthread_create (&write_thread_, NULL, &Broker::writeThread_, this)
+      != 0) {
+    string message = errno_message ("Broker", "pthread_create");
+    stopping_ = true;
+    pthread_join (read_thread_, NULL);
+    munmap (segment_, segment_size_);
+    shm_unlink (name_.c_str ());
+    throw SerialException (message.c_str ());
+  }
+  started_ = true;
+}
+
+Broker::~Broker ()
+{
+  stop ();
+  munmap (segment_, segment_size_);
+  shm_unlink (name_.c_str ());
+}
+
+void
+Broker::stop ()
+{
+  store_release (segment_->running, 0u);
+  if (!started_) {
+    return;
+  }
+  stopping_ = true;
+  notify (segment_->tx_seq, segment_->tx_waiters);
+  pthread_join (read_thread_, NULL);
+  pthread_join (write_thread_, NULL);
+  started_ = false;
+  // Let waiting clients see that the broker is gone.
+  notify (segment_->rx_seq, segment_->rx_waiters);
+  notify (segment_->tx_space_seq, segment_->tx_space_waiters);
+}
+
+bool
+Broker::isRunning () const
+{
+  return load_acquire (segment_->running) != 0;
+}
+
+vector<ConsumerInfo>
+Broker::getConsumers () const
+{
+  vector<ConsumerInfo> consumers;
+  uint64_t head = load_acquire (segment_->rx_head);
+  for (size_t i = 0; i < max_consumers; ++i) {
+    const ConsumerSlot &slot = segment_->consumers[i];
+    ConsumerInfo info;
+    info.pid = load_acquire (slot.pid);
+    if (info.pid == 0) {
+      continue;
+    }
+    info.lag = head - load_acquire (slot.cursor);
+    info.dropped = load_acquire (slot.dropped);
+    consumers.push_back (info);
+  }
+  return consumers;
+}
+
+uint64_t
+Broker::getBytesPublished () const
+{
+  return load_acquire (segment_->rx_head);
+}
+
+void *
+Broker::readThread_ (void *arg)
+{
+  static_cast<Broker*> (arg)->read_ ();
+  return NULL;
+}
+
+void
+Broker::read_ ()
+{
+  vector<uint8_t> buffer (min (static_cast<size_t> (segment_->rx_capacity),
+                               static_cast<size_t> (4096)));
+  try {
+    while (!stopping_) {
+      // Take what is there, or wait briefly for a byte to check stopping_.
+      size_t size = min (port_.available (), buffer.size ());
+      size_t bytes_read = port_.read (&buffer[0], size > 0 ? size : 1,
+                                      Deadline::fromNow (100));
+      if (bytes_read > 0) {
+        publish_ (&buffer[0], bytes_read);
+      }
+    }
+  } catch (const std::exception &) {
+    // The port failed, clients see the broker stopped.
+    store_release (segment_->running, 0u);
+    notify (segment_->rx_seq, segment_->rx_waiters);
+  }
+}
+
+void
+Broker::publish_ (const uint8_t *data, size_t size)
+{
+  uint64_t capacity = segment_->rx_capacity;
+  uint64_t head = segment_->rx_head;
+  // Readers check rx_reserve after copying, so they notice bytes
+  // overwritten under them.  It must be visible before any byte changes.
+  __atomic_store_n (&segment_->rx_reserve, head + size, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  size_t offset = static_cast<size_t> (head & (capacity - 1));
+  size_t first = min (size, static_cast<size_t> (capacity) - offset);
+  memcpy (rx_ring_ + offset, data, first);
+  memcpy (rx_ring_, data + first, size - first);
+  store_release (segment_->rx_head, head + size);
+  notify (segment_->rx_seq, segment_->rx_waiters);
+}
+
+void *
+Broker::writeThread_ (void *arg)
+{
+  static_cast<Broker*> (arg)->write_ ();
+  return NULL;
+}
+
+void
+Broker::write_ ()
+{
+  uint64_t capacity = segment_->tx_capacity;
+  try {
+    while (!stopping_) {
+      uint32_t seen = __atomic_load_n (&segment_->tx_seq, __ATOMIC_SEQ_CST);
+      uint64_t read = segment_->tx_read;
+      size_t offset = static_cast<size_t> (read & (capacity - 1));
+      uint64_t *header = reinterpret_cast<uint64_t*> (tx_ring_ + offset);
+      uint64_t payload = 0;
+      if (read == load_acquire (segment_->tx_reserve)
+          || (payload = load_acquire (*header)) == 0) {
+        // Nothing queued, or the next record is still being copied.
+        wait_on (segment_->tx_seq, segment_->tx_waiters, seen, max_wait_ns);
+        continue;
+      }
+      size_t size;
+      if (payload == tx_padding) {
+        size = static_cast<size_t> (capacity) - offset;
+      } else {
+        // The port takes what fits in its buffer, write the rest as it
+        // drains, waking to check stopping_.
+        const uint8_t *data = tx_ring_ + offset + tx_header_size;
+        size_t written = 0;
+        while (written < payload && !stopping_) {
+          written += port_.write (data + written,
+                                  static_cast<size_t> (payload) - written,
+                                  Deadline::fromNow (100));
+        }
+        if (written < payload) {
+          break; // Stopped part way through the record
+        }
+        size = record_size (static_cast<size_t> (payload));
+      }
+      // Headers must read 0 until written again, whatever the offsets of
+      // the records next time around.
+      memset (tx_ring_ + offset, 0, size);
+      store_release (segment_->tx_read, read + size);
+      notify (segment_->tx_space_seq, segment_->tx_space_waiters);
+    }
+  } catch (const std::exception &) {
+    store_release (segment_->running, 0u);
+    notify (segment_->tx_space_seq, segment_->tx_space_waiters);
+  }
+}
+
+SharedSerial::SharedSerial (const string &name, Timeout timeout)
+  : segment_ (NULL), segment_size_ (0), rx_ring_ (NULL), tx_ring_ (NULL),
+    slot_ (0), timeout_ (timeout), cursor_ (0), dropped_ (0)
+{
+  int fd = shm_open (name.c_str (), O_RDWR, 0);
+  if (fd == -1) {
+    throw SerialException (errno_message ("SharedSerial",
+                                          "shm_open").c_str ());
+  }
+  struct stat info;
+  if (fstat (fd, &info) == -1) {
+    string message = errno_message ("SharedSerial", "fstat");
+    ::close (fd);
+    throw SerialException (message.c_str ());
+  }
+  segment_size_ = static_cast<size_t> (info.st_size);
+  void *memory = MAP_FAILED;
+  if (segment_size_ >= sizeof (Segment)) {
+    memory = mmap (NULL, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+  }
+  ::close (fd);
+  if (memory == MAP_FAILED) {
+    throw SerialException ("SharedSerial could not map the segment of the "
+                           "broker.");
+  }
+  segment_ = static_cast<Segment*> (memory);
+  if (load_acquire (segment_->magic) != segment_magic
+      || segment_size (static_cast<size_t> (segment_->rx_capacity),
+                       static_cast<size_t> (segment_->tx_capacity))
+         != segment_size_) {
+    munmap (segment_, segment_size_);
+    throw SerialException ("SharedSerial found no broker segment.");
+  }
+  rx_ring_ = static_cast<const uint8_t*> (memory) + sizeof (Segment);
+  tx_ring_ = static_cast<uint8_t*> (memory) + sizeof (Segment)
+             + segment_->rx_capacity;
+
+  // Take a free slot, or the slot of a client which died.
+  uint32_t pid = static_cast<uint32_t> (getpid ());
+  bool claimed = false;
+  for (int pass = 0; pass < 2 && !claimed; ++pass) {
+    for (slot_ = 0; slot_ < max_consumers; ++slot_) {
+      uint32_t owner = load_acquire (segment_->consumers[slot_].pid);
+      if (owner != 0 && (pass == 0 || kill (static_cast<pid_t> (owner), 0) == 0
+                         || errno != ESRCH)) {
+        continue;
+      }
+      if (__atomic_compare_exchange_n (&segment_->consumers[slot_].pid,
+                                       &owner, pid, false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE)) {
+        claimed = true;
+        break;
+      }
+    }
+  }
+  if (!claimed) {
+    munmap (segment_, segment_size_);
+    throw SerialException ("SharedSerial found no free client slot.");
+  }
+  cursor_ = load_acquire (segment_->rx_head);
+  ConsumerSlot &slot = segment_->consumers[slot_];
+  store_release (slot.dropped, static_cast<uint64_t> (0));
+  store_release (slot.cursor, cursor_);
+}
+
+SharedSerial::~SharedSerial ()
+{
+  store_release (segment_->consumers[slot_].pid, 0u);
+  munmap (segment_, segment_size_);
+}
+
+size_t
+SharedSerial::available ()
+{
+  uint64_t pending = load_acquire (segment_->rx_head) - cursor_;
+  return static_cast<size_t> (min (pending, segment_->rx_capacity));
+}
+
+size_t
+SharedSerial::copy_ (uint8_t *buffer, size_t size)
+{
+  uint64_t capacity = segment_->rx_capacity;
+  while (true) {
+    uint64_t head = load_acquire (segment_->rx_head);
+    if (head - cursor_ > capacity) {
+      // Fell a whole ring behind, skip to the oldest byte still there.
+      dropped_ += head - capacity - cursor_;
+      cursor_ = head - capacity;
+    }
+    size_t count = static_cast<size_t> (min (static_cast<uint64_t> (size),
+                                             head - cursor_));
+    if (count == 0) {
+      return 0;
+    }
+    size_t offset = static_cast<size_t> (cursor_ & (capacity - 1));
+    size_t first = min (count, static_cast<size_t> (capacity) - offset);
+    memcpy (buffer, rx_ring_ + offset, first);
+    memcpy (buffer + first, rx_ring_, count - first);
+    // If the broker started overwriting what was copied, copy again.
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    uint64_t reserve = __atomic_load_n (&segment_->rx_reserve,
+                                        __ATOMIC_RELAXED);
+    if (reserve - cursor_ > capacity) {
+      dropped_ += reserve - capacity - cursor_;
+      cursor_ = reserve - capacity;
+      continue;
+    }
+    cursor_ += count;
+    ConsumerSlot &slot = segment_->consumers[slot_];
+    store_release (slot.cursor, cursor_);
+    store_release (slot.dropped, dropped_);
+    return count;
+  }
+}
+
+void
+SharedSerial::waitPublished_ (uint64_t deadline_ns)
+{
+  while (true) {
+    uint32_t seen = __atomic_load_n (&segment_->rx_seq, __ATOMIC_SEQ_CST);
+    if (load_acquire (segment_->rx_head) != cursor_
+        || load_acquire (segment_->running) == 0) {
+      return;
+    }
+    uint64_t now_ns = serial::stats::now_ns ();
+    if (now_ns >= deadline_ns) {
+      return;
+    }
+    wait_on (segment_->rx_seq, segment_->rx_waiters, seen,
+             min (deadline_ns - now_ns, max_wait_ns));
+  }
+}
+
+size_t
+SharedSerial::read (uint8_t *buffer, size_t size)
+{
+  size_t bytes_read = copy_ (buffer, size);
+  if (bytes_read == size) {
+    return bytes_read;
+  }
+  // Only compute deadlines once there is something to wait for.
+  uint64_t now_ns = serial::stats::now_ns ();
+  uint64_t total_timeout_ns = timeout_.read_timeout_constant;
+  total_timeout_ns += static_cast<uint64_t> (timeout_.read_timeout_multiplier)
+                      * size;
+  uint64_t deadline_ns = now_ns + total_timeout_ns * timeout_.unit_ns;
+  uint64_t inter_byte_timeout_ns =
+    timeout_.inter_byte_timeout == Timeout::max ()
+    ? 0 : static_cast<uint64_t> (timeout_.inter_byte_timeout)
+          * timeout_.unit_ns;
+  while (bytes_read < size) {
+    uint64_t wait_until = deadline_ns;
+    if (inter_byte_timeout_ns > 0 && bytes_read > 0) {
+      wait_until = min (wait_until, now_ns + inter_byte_timeout_ns);
+    }
+    waitPublished_ (wait_until);
+    size_t copied = copy_ (buffer + bytes_read, size - bytes_read);
+    now_ns = serial::stats::now_ns ();
+    if (copied == 0 && now_ns >= wait_until) {
+      break;
+    }
+    if (copied == 0 && load_acquire (segment_->running) == 0) {
+      break;
+    }
+    bytes_read += copied;
+  }
+  return bytes_read;
+}
+
+size_t
+SharedSerial::read (vector<uint8_t> &buffer, size_t size)
+{
+  size_t offset = buffer.size ();
+  buffer.resize (offset + size);
+  size_t bytes_read = size > 0 ? read (&buffer[offset], size) : 0;
+  buffer.resize (offset + bytes_read);
+  return bytes_read;
+}
+
+size_t
+SharedSerial::read (string &buffer, size_t size)
+{
+  vector<uint8_t> bytes;
+  size_t bytes_read = read (bytes, size);
+  if (bytes_read > 0) {
+    buffer.append (reinterpret_cast<const char*> (&bytes[0]), bytes_read);
+  }
+  return bytes_read;
+}
+
+string
+SharedSerial::read (size_t size)
+{
+  string buffer;
+  read (buffer, size);
+  return buffer;
+}
+
+size_t
+SharedSerial::readline (string &buffer, size_t size, string eol)
+{
+  size_t eol_len = eol.length ();
+  size_t read_so_far = 0;
+  string line;
+  while (read_so_far < size) {
+    uint8_t byte;
+    if (read (&byte, 1) == 0) {
+      break; // Timeout occured on reading 1 byte
+    }
+    line.push_back (static_cast<char> (byte));
+    ++read_so_far;
+    if (read_so_far >= eol_len
+        && line.compare (read_so_far - eol_len, eol_len, eol) == 0) {
+      break; // EOL found
+    }
+  }
+  buffer.append (line);
+  return read_so_far;
+}
+
+string
+SharedSerial::readline (size_t size, string eol)
+{
+  string buffer;
+  readline (buffer, size, eol);
+  return buffer;
+}
+
+bool
+SharedSerial::queue_ (const uint8_t *data, size_t size, uint64_t deadline_ns)
+{
+  uint64_t capacity = segment_->tx_capacity;
+  size_t needed = record_size (size);
+  uint64_t reserve;
+  size_t padding;
+  while (true) {
+    uint32_t seen = __atomic_load_n (&segment_->tx_space_seq,
+                                     __ATOMIC_SEQ_CST);
+    if (load_acquire (segment_->running) == 0) {
+      throw SerialException ("SharedSerial::write: the broker is not "
+                             "running.");
+    }
+    reserve = load_acquire (segment_->tx_reserve);
+    size_t offset = static_cast<size_t> (reserve & (capacity - 1));
+    // Records are contiguous, one that does not fit starts over at 0.
+    padding = static_cast<size_t> (capacity) - offset < needed
+              ? static_cast<size_t> (capacity) - offset : 0;
+    if (reserve + padding + needed - load_acquire (segment_->tx_read)
+        <= capacity) {
+      if (__atomic_compare_exchange_n (&segment_->tx_reserve, &reserve,
+                                       reserve + padding + needed, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      continue;
+    }
+    uint64_t now_ns = serial::stats::now_ns ();
+    if (now_ns >= deadline_ns) {
+      return false;
+    }
+    wait_on (segment_->tx_space_seq, segment_->tx_space_waiters, seen,
+             min (deadline_ns - now_ns, max_wait_ns));
+  }
+  if (padding > 0) {
+    size_t offset = static_cast<size_t> (reserve & (capacity - 1));
+    store_release (*reinterpret_cast<uint64_t*> (tx_ring_ + offset),
+                   tx_padding);
+    reserve += padding;
+  }
+  size_t offset = static_cast<size_t> (reserve & (capacity - 1));
+  memcpy (tx_ring_ + offset + tx_header_size, data, size);
+  store_release (*reinterpret_cast<uint64_t*> (tx_ring_ + offset),
+                 static_cast<uint64_t> (size));
+  notify (segment_->tx_seq, segment_->tx_waiters);
+  return true;
+}
+
+size_t
+SharedSerial::write (const uint8_t *data, size_t size)
+{
+  uint64_t total_timeout_ns = timeout_.write_timeout_constant;
+  total_timeout_ns += static_cast<uint64_t> (timeout_.write_timeout_multiplier)
+                      * size;
+  uint64_t deadline_ns = serial::stats::now_ns ()
+                         + total_timeout_ns * timeout_.unit_ns;
+  // Half the queue, so a record always fits once the queue is empty.
+  size_t max_record = static_cast<size_t> (segment_->tx_capacity) / 2
+                      - tx_header_size;
+  size_t bytes_written = 0;
+  while (bytes_written < size) {
+    size_t chunk = min (size - bytes_written, max_record);
+    if (!queue_ (data + bytes_written, chunk, deadline_ns)) {
+      break; // Timed out
+    }
+    bytes_written += chunk;
+  }
+  return bytes_written;
+}
+
+size_t
+SharedSerial::write (const vector<uint8_t> &data)
+{
+  return data.empty () ? 0 : write (&data[0], data.size ());
+}
+
+size_t
+SharedSerial::write (const string &data)
+{
+  return write (reinterpret_cast<const uint8_t*> (data.data ()),
+                data.length ());
+}
+
+void
+SharedSerial::setTimeout (const Timeout &timeout)
+{
+  timeout_ = timeout;
+}
+
+Timeout
+SharedSerial::getTimeout () const
+{
+  return timeout_;
+}
+
+uint64_t
+SharedSerial::getDroppedBytes () const
+{
+  return dropped_;
+}
+
+#endif // !defined(_WIN32)
@@ -0,0 +1,460 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "serial/capture.h"
+#include "serial/impl/stats.h"
+
+using std::invalid_argument;
+using std::min;
+using std::string;
+
+using serial::IOException;
+using serial::SerialException;
+using serial::capture::Chunk;
+using serial::capture::Reader;
+using serial::capture::Writer;
+using serial::capture::direction_t;
+
+namespace {
+
+const uint64_t file_magic = 0x3130504143524553ULL;    // "SERCAP01"
+const uint32_t file_version = 1;
+const uint32_t segment_magic = 0x31474553;            // "SEG1"
+const uint8_t direction_padding = 0xFF;
+
+struct FileHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t data_offset;       // Page aligned offset of the first segment
+  uint64_t segment_size;
+  uint64_t start_realtime_ns;
+  uint64_t start_monotonic_ns;
+};
+
+struct SegmentHeader {
+  uint32_t magic;             // 0 in a segment never written
+  uint32_t index;
+  uint64_t first_ns;          // Time of the first chunk, 0 while empty
+  uint64_t last_ns;
+  uint64_t reserved;
+};
+
+// The direction is stored last, a chunk with direction 0 is not there yet.
+struct ChunkHeader {
+  uint64_t timestamp_ns;
+  uint32_t size;
+  uint16_t port;
+  uint8_t direction;
+  uint8_t flags;
+};
+
+inline size_t
+chunk_space (size_t size)
+{
+  return sizeof (ChunkHeader) + ((size + 7) & ~static_cast<size_t> (7));
+}
+
+class ScopedLock {
+public:
+  ScopedLock(pthread_mutex_t &mutex) : mutex_(mutex) {
+    pthread_mutex_lock(&mutex_);
+  }
+  ~ScopedLock() {
+    pthread_mutex_unlock(&mutex_);
+  }
+private:
+  // Disable copy constructors
+  ScopedLock(const ScopedLock&);
+  const ScopedLock& operator=(ScopedLock);
+
+  pthread_mutex_t &mutex_;
+};
+
+} // namespace
+
+Writer::Writer (const string &path, size_t segment_size)
+  : fd_ (-1), data_offset_ (0), segment_size_ (segment_size),
+    segment_ (NULL), segment_index_ (0), offset_ (sizeof (SegmentHeader)),
+    bytes_written_ (0), closed_ (false), next_ (NULL), retired_ (NULL),
+    prepare_error_ (0), stopping_ (false)
+{
+  size_t page_size = static_cast<size_t> (sysconf (_SC_PAGESIZE));
+  if (segment_size == 0 || segment_size % page_size != 0
+      || segment_size > 0xFFFFFFFFu) {
+    throw invalid_argument ("the segment size of a capture must be a "
+                            "multiple of the page size");
+  }
+  data_offset_ = page_size;
+  fd_ = ::open (path.c_str (), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ == -1) {
+    THROW (IOException, errno);
+  }
+  FileHeader header;
+  memset (&header, 0, sizeof (header));
+  header.magic = file_magic;
+  header.version = file_version;
+  header.data_offset = data_offset_;
+  header.segment_size = segment_size_;
+  timespec realtime;
+  clock_gettime (CLOCK_REALTIME, &realtime);
+  header.start_realtime_ns = realtime.tv_sec * 1000000000ULL
+                             + realtime.tv_nsec;
+  header.start_monotonic_ns = serial::stats::now_ns ();
+  if (pwrite (fd_, &header, sizeof (header), 0)
+      != static_cast<ssize_t> (sizeof (header))
+      || (segment_ = map_ (0)) == NULL) {
+    int error = errno;
+    ::close (fd_);
+    THROW (IOException, error);
+  }
+  reinterpret_cast<SegmentHeader *> (segment_)->magic = segment_magic;
+
+  pthread_mutex_init (&mutex_, NULL);
+  pthread_mutex_init (&prepare_mutex_, NULL);
+  pthread_cond_init (&prepare_cond_, NULL);
+  int result = pthread_create (&prepare_thread_, NULL,
+                               &Writer::prepareThread_, this);
+  if (result) {
+    munmap (segment_, segment_size_);
+    ::close (fd_);
+    pthread_cond_destroy (&prepare_cond_);
+    pthread_mutex_destroy (&prepare_mutex_);
+    pthread_mutex_destroy (&mutex_);
+    THROW (IOException, result);
+  }
+}
+
+Writer::~Writer ()
+{
+  close ();
+  pthread_cond_destroy (&prepare_cond_);
+  pthread_mutex_destroy (&prepare_mutex_);
+  pthread_mutex_destroy (&mutex_);
+}
+
+uint8_t *
+Writer::map_ (uint32_t index)
+{
+  off_t offset = static_cast<off_t> (data_offset_)
+                 + static_cast<off_t> (index) * segment_size_;
+  if (ftruncate (fd_, offset + static_cast<off_t> (segment_size_)) == -1) {
+    return NULL;
+  }
+  void *segment = mmap (NULL, segment_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd_, offset);
+  if (segment == MAP_FAILED) {
+    return NULL;
+  }
+  // Fault the pages in now rather than on the appending thread.
+  size_t page_size = static_cast<size_t> (sysconf (_SC_PAGESIZE));
+  for (size_t i = 0; i < segment_size_; i += page_size) {
+    static_cast<volatile uint8_t *> (segment)[i] = 0;
+  }
+  return static_cast<uint8_t *> (segment);
+}
+
+void *
+Writer::prepareThread_ (void *arg)
+{
+  static_cast<Writer *> (arg)->prepare_ ();
+  return NULL;
+}
+
+void
+Writer::prepare_ ()
+{
+  pthread_mutex_lock (&prepare_mutex_);
+  while (!stopping_) {
+    if (retired_ != NULL) {
+      uint8_t *segment = retired_;
+      retired_ = NULL;
+      pthread_mutex_unlock (&prepare_mutex_);
+      munmap (segment, segment_size_);
+      pthread_mutex_lock (&prepare_mutex_);
+    } else if (next_ == NULL && prepare_error_ == 0) {
+      uint32_t index = segment_index_ + 1;
+      pthread_mutex_unlock (&prepare_mutex_);
+      uint8_t *segment = map_ (index);
+      int error = errno;
+      pthread_mutex_lock (&prepare_mutex_);
+      next_ = segment;
+      prepare_error_ = segment == NULL ? error : 0;
+      pthread_cond_broadcast (&prepare_cond_);
+    } else {
+      pthread_cond_wait (&prepare_cond_, &prepare_mutex_);
+    }
+  }
+  pthread_mutex_unlock (&prepare_mutex_);
+}
+
+void
+Writer::rollover_ ()
+{
+  ScopedLock lock (prepare_mutex_);
+  while (next_ == NULL && prepare_error_ == 0) {
+    // Only when appending outpaces mapping and faulting in a segment.
+    pthread_cond_wait (&prepare_cond_, &prepare_mutex_);
+  }
+  if (next_ == NULL) {
+    THROW (IOException, prepare_error_);
+  }
+  retired_ = segment_;
+  segment_ = next_;
+  next_ = NULL;
+  ++segment_index_;
+  pthread_cond_broadcast (&prepare_cond_);
+  SegmentHeader *header = reinterpret_cast<SegmentHeader *> (segment_);
+  header->index = segment_index_;
+  header->magic = segment_magic;
+  offset_ = sizeof (SegmentHeader);
+}
+
+void
+Writer::append (direction_t direction, uint16_t port, const uint8_t *data,
+                size_t size, uint64_t timestamp_ns)
+{
+  ScopedLock lock (mutex_);
+  if (closed_) {
+    THROW (IOException, "Writer::append: the capture is closed");
+  }
+  if (timestamp_ns == 0) {
+    // Taken under the lock, so the times of a capture never decrease.
+    timestamp_ns = serial::stats::now_ns ();
+  }
+  size_t max_chunk = segment_size_ - sizeof (SegmentHeader)
+                     - sizeof (ChunkHeader);
+  size_t appended = 0;
+  do {
+    size_t chunk = min (size - appended, max_chunk);
+    size_t space = chunk_space (chunk);
+    if (offset_ + space > segment_size_) {
+      // Chunks do not cross segments, pad out the rest of this one.
+      if (segment_size_ - offset_ >= sizeof (ChunkHeader)) {
+        ChunkHeader *padding = reinterpret_cast<ChunkHeader *> (segment_
+                                                                + offset_);
+        padding->size = static_cast<uint32_t> (segment_size_ - offset_
+                                               - sizeof (ChunkHeader));
+        __atomic_store_n (&padding->direction, direction_padding,
+                          __ATOMIC_RELEASE);
+      }
+      rollover_ ();
+    }
+    ChunkHeader *header = reinterpret_cast<ChunkHeader *> (segment_
+                                                           + offset_);
+    header->timestamp_ns = timestamp_ns;
+    header->size = static_cast<uint32_t> (chunk);
+    header->port = port;
+    header->flags = 0;
+    memcpy (header + 1, data + appended, chunk);
+    SegmentHeader *segment = reinterpret_cast<SegmentHeader *> (segment_);
+    if (segment->first_ns == 0) {
+      segment->first_ns = timestamp_ns;
+    }
+    segment->last_ns = timestamp_ns;
+    __atomic_store_n (&header->direction, static_cast<uint8_t> (direction),
+                      __ATOMIC_RELEASE);
+    offset_ += space;
+    appended += chunk;
+  } while (appended < size);
+  bytes_written_ += size;
+}
+
+void
+Writer::append (direction_t direction, uint16_t port, const string &data,
+                uint64_t timestamp_ns)
+{
+  append (direction, port, reinterpret_cast<const uint8_t *> (data.data ()),
+          data.length (), timestamp_ns);
+}
+
+void
+Writer::close ()
+{
+  ScopedLock lock (mutex_);
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  pthread_mutex_lock (&prepare_mutex_);
+  stopping_ = true;
+  pthread_cond_broadcast (&prepare_cond_);
+  pthread_mutex_unlock (&prepare_mutex_);
+  pthread_join (prepare_thread_, NULL);
+  munmap (segment_, segment_size_);
+  if (retired_ != NULL) {
+    munmap (retired_, segment_size_);
+  }
+  if (next_ != NULL) {
+    munmap (next_, segment_size_);
+  }
+  // Drop the segment prepared ahead, if any.
+  ftruncate (fd_, static_cast<off_t> (data_offset_)
+                  + static_cast<off_t> (segment_index_ + 1) * segment_size_);
+  ::close (fd_);
+}
+
+uint64_t
+Writer::getBytesWritten () const
+{
+  ScopedLock lock (mutex_);
+  return bytes_written_;
+}
+
+Reader::Reader (const string &path)
+  : mapping_ (NULL), mapping_size_ (0), data_offset_ (0), segment_size_ (0),
+    segment_count_ (0), segment_ (0), offset_ (sizeof (SegmentHeader))
+{
+  int fd = ::open (path.c_str (), O_RDONLY);
+  if (fd == -1) {
+    THROW (IOException, errno);
+  }
+  struct stat info;
+  if (fstat (fd, &info) == -1) {
+    int error = errno;
+    ::close (fd);
+    THROW (IOException, error);
+  }
+  mapping_size_ = static_cast<size_t> (info.st_size);
+  if (mapping_size_ < sizeof (FileHeader)) {
+    ::close (fd);
+    throw SerialException ("Reader: not a capture file.");
+  }
+  void *mapping = mmap (NULL, mapping_size_, PROT_READ, MAP_SHARED, fd, 0);
+  int error = errno;
+  ::close (fd);
+  if (mapping == MAP_FAILED) {
+    THROW (IOException, error);
+  }
+  mapping_ = static_cast<const uint8_t *> (mapping);
+  const FileHeader *header = reinterpret_cast<const FileHeader *> (mapping_);
+  if (header->magic != file_magic || header->version != file_version
+      || header->segment_size < sizeof (SegmentHeader) + sizeof (ChunkHeader)
+      || header->data_offset < sizeof (FileHeader)
+      || header->data_offset > mapping_size_) {
+    munmap (mapping, mapping_size_);
+    throw SerialException ("Reader: not a capture file.");
+  }
+  data_offset_ = static_cast<size_t> (header->data_offset);
+  segment_size_ = static_cast<size_t> (header->segment_size);
+  segment_count_ = (mapping_size_ - data_offset_) / segment_size_;
+}
+
+Reader::~Reader ()
+{
+  munmap (const_cast<uint8_t *> (mapping_), mapping_size_);
+}
+
+bool
+Reader::next (Chunk &chunk)
+{
+  while (segment_ < segment_count_) {
+    const uint8_t *segment = mapping_ + data_offset_
+                             + segment_ * segment_size_;
+    if (offset_ == sizeof (SegmentHeader)) {
+      uint32_t magic = reinterpret_cast<const SegmentHeader *> (segment)->magic;
+      if (magic == 0) {
+        return false; // Never written
+      }
+      if (magic != segment_magic) {
+        throw SerialException ("Reader: corrupt capture segment.");
+      }
+    }
+    if (offset_ + sizeof (ChunkHeader) > segment_size_) {
+      ++segment_;
+      offset_ = sizeof (SegmentHeader);
+      continue;
+    }
+    const ChunkHeader *header = reinterpret_cast<const ChunkHeader *> (
+                                  segment + offset_);
+    uint8_t direction = __atomic_load_n (&header->direction,
+                                         __ATOMIC_ACQUIRE);
+    if (direction == 0) {
+      return false; // End of the capture
+    }
+    size_t space = chunk_space (header->size);
+    if (offset_ + space > segment_size_) {
+      throw SerialException ("Reader: corrupt capture chunk.");
+    }
+    offset_ += space;
+    if (direction == direction_padding) {
+      continue;
+    }
+    chunk.timestamp_ns = header->timestamp_ns;
+    chunk.port = header->port;
+    chunk.direction = static_cast<direction_t> (direction);
+    chunk.data = reinterpret_cast<const uint8_t *> (header + 1);
+    chunk.size = header->size;
+    return true;
+  }
+  return false;
+}
+
+void
+Reader::seek (uint64_t timestamp_ns)
+{
+  // Number of segments starting at or before timestamp_ns.  Empty
+  // segments are all at the end.
+  size_t low = 0;
+  size_t high = segment_count_;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    const SegmentHeader *header = reinterpret_cast<const SegmentHeader *> (
+      mapping_ + data_offset_ + middle * segment_size_);
+    if (header->first_ns != 0 && header->first_ns <= timestamp_ns) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  segment_ = low > 0 ? low - 1 : 0;
+  offset_ = sizeof (SegmentHeader);
+  while (true) {
+    size_t segment = segment_;
+    size_t offset = offset_;
+    Chunk chunk;
+    if (!next (chunk) || chunk.timestamp_ns >= timestamp_ns) {
+      segment_ = segment;
+      offset_ = offset;
+      return;
+    }
+  }
+}
+
+void
+Reader::rewind ()
+{
+  segment_ = 0;
+  offset_ = sizeof (SegmentHeader);
+}
+
+size_t
+Reader::getSegmentCount () const
+{
+  return segment_count_;
+}
+
+uint64_t
+Reader::getStartRealtime () const
+{
+  return reinterpret_cast<const FileHeader *> (mapping_)->start_realtime_ns;
+}
+
+uint64_t
+Reader::getStartMonotonic () const
+{
+  return reinterpret_cast<const FileHeader *> (mapping_)->start_monotonic_ns;
+}
+
+#endif // !defined(_WIN32)
@@ -0,0 +1,57 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#include "serial/clock.h"
+#include "serial/impl/stats.h"
+
+using serial::Clock;
+using serial::VirtualClock;
+
+namespace {
+
+Clock *clock_ = NULL;
+
+} // namespace
+
+VirtualClock::VirtualClock (uint64_t start_ns)
+  : now_ns_ (start_ns), sleeps_ (0)
+{
+}
+
+uint64_t
+VirtualClock::now ()
+{
+  return serial::stats::load (now_ns_);
+}
+
+void
+VirtualClock::sleepUntil (uint64_t deadline_ns)
+{
+  if (deadline_ns > serial::stats::load (now_ns_)) {
+    serial::stats::store_max (now_ns_, deadline_ns);
+    serial::stats::add (sleeps_, 1);
+  }
+}
+
+void
+VirtualClock::advance (uint64_t ns)
+{
+  serial::stats::add (now_ns_, ns);
+}
+
+uint64_t
+VirtualClock::getSleeps () const
+{
+  return serial::stats::load (sleeps_);
+}
+
+void
+serial::setClock (Clock *clock)
+{
+  clock_ = clock;
+}
+
+Clock *
+serial::getClock ()
+{
+  return clock_;
+}
@@ -0,0 +1,412 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#include <cstring>
+
+#include "serial/crc.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) \
+ && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+# define SERIAL_CRC_X86
+# define SERIAL_CRC_TARGET(features) __attribute__ ((target (features)))
+# include <cpuid.h>
+# include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+# define SERIAL_CRC_X86
+# define SERIAL_CRC_TARGET(features)
+# include <intrin.h>
+#elif defined(__aarch64__) && !defined(__AARCH64EB__) && defined(__linux__) \
+   && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 9))
+# define SERIAL_CRC_ARMV8
+# if defined(__clang__)
+#  define SERIAL_CRC_TARGET(features) __attribute__ ((target ("crc")))
+# else
+#  define SERIAL_CRC_TARGET(features) __attribute__ ((target ("+crc")))
+# endif
+# include <arm_acle.h>
+# include <sys/auxv.h>
+# ifndef HWCAP_CRC32
+#  define HWCAP_CRC32 (1 << 7)
+# endif
+#endif
+
+namespace {
+
+// CRC-32 and CRC-32C implementations work on the inverted register, the
+// public functions do the inversion.
+typedef uint32_t (*crc32_fn) (uint32_t crc, const uint8_t *data, size_t size);
+
+struct Tables {
+  uint8_t crc8[256];
+  uint16_t crc16_modbus[256];
+  uint16_t crc16_ccitt[256];
+  uint32_t crc32[8][256];
+  uint32_t crc32c[8][256];
+
+  Tables ()
+  {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c8 = i, modbus = i, ccitt = i << 8, c32 = i, c32c = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        c8 = (c8 & 0x80) ? ((c8 << 1) ^ 0x07) : (c8 << 1);
+        modbus = (modbus & 1) ? ((modbus >> 1) ^ 0xA001) : (modbus >> 1);
+        ccitt = (ccitt & 0x8000) ? ((ccitt << 1) ^ 0x1021) : (ccitt << 1);
+        c32 = (c32 & 1) ? ((c32 >> 1) ^ 0xEDB88320) : (c32 >> 1);
+        c32c = (c32c & 1) ? ((c32c >> 1) ^ 0x82F63B78) : (c32c >> 1);
+      }
+      crc8[i] = static_cast<uint8_t> (c8);
+      crc16_modbus[i] = static_cast<uint16_t> (modbus);
+      crc16_ccitt[i] = static_cast<uint16_t> (ccitt);
+      crc32[0][i] = c32;
+      crc32c[0][i] = c32c;
+    }
+    // Slice k holds the CRC of a byte followed by k zero bytes.
+    for (int k = 1; k < 8; ++k) {
+      for (int i = 0; i < 256; ++i) {
+        uint32_t c32 = crc32[k - 1][i], c32c = crc32c[k - 1][i];
+        crc32[k][i] = (c32 >> 8) ^ crc32[0][c32 & 0xFF];
+        crc32c[k][i] = (c32c >> 8) ^ crc32c[0][c32c & 0xFF];
+      }
+    }
+  }
+};
+
+const Tables &
+tables ()
+{
+  static const Tables instance;
+  return instance;
+}
+
+// Build the tables during static initialization rather than in the middle
+// of the first frame.
+const Tables &tables_init = tables ();
+
+inline uint32_t
+load_le32 (const uint8_t *p)
+{
+  return static_cast<uint32_t> (p[0])
+       | (static_cast<uint32_t> (p[1]) << 8)
+       | (static_cast<uint32_t> (p[2]) << 16)
+       | (static_cast<uint32_t> (p[3]) << 24);
+}
+
+uint32_t
+slicing_by_8 (const uint32_t (*t)[256], uint32_t crc,
+              const uint8_t *data, size_t size)
+{
+  while (size > 0 && (reinterpret_cast<size_t> (data) & 7) != 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    --size;
+  }
+  while (size >= 8) {
+    uint32_t lo = load_le32 (data) ^ crc;
+    uint32_t hi = load_le32 (data + 4);
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF]
+        ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+        ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF]
+        ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    data += 8;
+    size -= 8;
+  }
+  while (size-- > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+  }
+  return crc;
+}
+
+uint32_t
+crc32_software (uint32_t crc, const uint8_t *data, size_t size)
+{
+  return slicing_by_8 (tables ().crc32, crc, data, size);
+}
+
+uint32_t
+crc32c_software (uint32_t crc, const uint8_t *data, size_t size)
+{
+  return slicing_by_8 (tables ().crc32c, crc, data, size);
+}
+
+#if defined(SERIAL_CRC_X86)
+
+// Folds size bytes, a multiple of 16 and at least 64, with carry-less
+// multiplication and reduces the result with Barrett reduction.  The
+// constants are those of the bit reflected CRC-32 from Intel's "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+SERIAL_CRC_TARGET ("pclmul,sse4.1") uint32_t
+crc32_pclmul_fold (uint32_t crc, const uint8_t *data, size_t size)
+{
+  static const uint64_t k1k2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+  static const uint64_t k3k4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+  static const uint64_t k5k0[2] = { 0x0163cd6124ULL, 0x0000000000ULL };
+  static const uint64_t poly[2] = { 0x01db710641ULL, 0x01f7011641ULL };
+
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (data + 0x00));
+  x2 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (data + 0x10));
+  x3 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (data + 0x20));
+  x4 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (data + 0x30));
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 (static_cast<int> (crc)));
+  x0 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (k1k2));
+  data += 64;
+  size -= 64;
+
+  // Fold four 128 bit lanes in parallel.
+  while (size >= 64) {
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128 (x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128 (x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128 (x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128 (x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128 (x4, x0, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), _mm_loadu_si128 (
+           reinterpret_cast<const __m128i *> (data + 0x00)));
+    x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), _mm_loadu_si128 (
+           reinterpret_cast<const __m128i *> (data + 0x10)));
+    x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), _mm_loadu_si128 (
+           reinterpret_cast<const __m128i *> (data + 0x20)));
+    x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), _mm_loadu_si128 (
+           reinterpret_cast<const __m128i *> (data + 0x30)));
+    data += 64;
+    size -= 64;
+  }
+
+  // Fold the lanes into one.
+  x0 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (k3k4));
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+  // Fold the remaining 16 byte blocks.
+  while (size >= 16) {
+    x2 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (data));
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+    data += 16;
+    size -= 16;
+  }
+
+  // Fold 128 bits down to 64.
+  x2 = _mm_clmulepi64_si128 (x1, x0, 0x10);
+  x3 = _mm_setr_epi32 (~0, 0, ~0, 0);
+  x1 = _mm_srli_si128 (x1, 8);
+  x1 = _mm_xor_si128 (x1, x2);
+  x0 = _mm_loadl_epi64 (reinterpret_cast<const __m128i *> (k5k0));
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_and_si128 (x1, x3);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  // Barrett reduction to 32 bits.
+  x0 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (poly));
+  x2 = _mm_and_si128 (x1, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x10);
+  x2 = _mm_and_si128 (x2, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+  return static_cast<uint32_t> (_mm_extract_epi32 (x1, 1));
+}
+
+uint32_t
+crc32_pclmul (uint32_t crc, const uint8_t *data, size_t size)
+{
+  if (size >= 64) {
+    size_t folded = size & ~static_cast<size_t> (15);
+    crc = crc32_pclmul_fold (crc, data, folded);
+    data += folded;
+    size -= folded;
+  }
+  return crc32_software (crc, data, size);
+}
+
+SERIAL_CRC_TARGET ("sse4.2") uint32_t
+crc32c_sse42 (uint32_t crc, const uint8_t *data, size_t size)
+{
+  while (size > 0 && (reinterpret_cast<size_t> (data) & 7) != 0) {
+    crc = _mm_crc32_u8 (crc, *data++);
+    --size;
+  }
+#if defined(__x86_64__) || defined(_M_X64)
+  uint64_t crc64 = crc;
+  while (size >= 8) {
+    uint64_t word;
+    std::memcpy (&word, data, 8);
+    crc64 = _mm_crc32_u64 (crc64, word);
+    data += 8;
+    size -= 8;
+  }
+  crc = static_cast<uint32_t> (crc64);
+#endif
+  while (size >= 4) {
+    uint32_t word;
+    std::memcpy (&word, data, 4);
+    crc = _mm_crc32_u32 (crc, word);
+    data += 4;
+    size -= 4;
+  }
+  while (size-- > 0) {
+    crc = _mm_crc32_u8 (crc, *data++);
+  }
+  return crc;
+}
+
+#elif defined(SERIAL_CRC_ARMV8)
+
+SERIAL_CRC_TARGET ("crc") uint32_t
+crc32_armv8 (uint32_t crc, const uint8_t *data, size_t size)
+{
+  while (size > 0 && (reinterpret_cast<size_t> (data) & 7) != 0) {
+    crc = __crc32b (crc, *data++);
+    --size;
+  }
+  while (size >= 8) {
+    uint64_t word;
+    std::memcpy (&word, data, 8);
+    crc = __crc32d (crc, word);
+    data += 8;
+    size -= 8;
+  }
+  while (size-- > 0) {
+    crc = __crc32b (crc, *data++);
+  }
+  return crc;
+}
+
+SERIAL_CRC_TARGET ("crc") uint32_t
+crc32c_armv8 (uint32_t crc, const uint8_t *data, size_t size)
+{
+  while (size > 0 && (reinterpret_cast<size_t> (data) & 7) != 0) {
+    crc = __crc32cb (crc, *data++);
+    --size;
+  }
+  while (size >= 8) {
+    uint64_t word;
+    std::memcpy (&word, data, 8);
+    crc = __crc32cd (crc, word);
+    data += 8;
+    size -= 8;
+  }
+  while (size-- > 0) {
+    crc = __crc32cb (crc, *data++);
+  }
+  return crc;
+}
+
+#endif
+
+// The implementations picked for the CPU we run on.
+struct Dispatch {
+  crc32_fn crc32;
+  const char *crc32_name;
+  crc32_fn crc32c;
+  const char *crc32c_name;
+
+  Dispatch ()
+  : crc32 (crc32_software), crc32_name ("slicing-by-8"),
+    crc32c (crc32c_software), crc32c_name ("slicing-by-8")
+  {
+#if defined(SERIAL_CRC_X86)
+    unsigned int ecx = 0;
+# if defined(_MSC_VER)
+    int info[4];
+    __cpuid (info, 1);
+    ecx = static_cast<unsigned int> (info[2]);
+# else
+    unsigned int eax, ebx, edx;
+    if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx)) {
+      ecx = 0;
+    }
+# endif
+    const unsigned int pclmul = 1 << 1, sse41 = 1 << 19, sse42 = 1 << 20;
+    if ((ecx & pclmul) && (ecx & sse41)) {
+      crc32 = crc32_pclmul;
+      crc32_name = "pclmul";
+    }
+    if (ecx & sse42) {
+      crc32c = crc32c_sse42;
+      crc32c_name = "sse4.2";
+    }
+#elif defined(SERIAL_CRC_ARMV8)
+    if (getauxval (AT_HWCAP) & HWCAP_CRC32) {
+      crc32 = crc32_armv8;
+      crc32_name = "armv8";
+      crc32c = crc32c_armv8;
+      crc32c_name = "armv8";
+    }
+#endif
+  }
+};
+
+const Dispatch &
+dispatch ()
+{
+  static const Dispatch instance;
+  return instance;
+}
+
+const Dispatch &dispatch_init = dispatch ();
+
+} // namespace
+
+uint8_t
+serial::crc::crc8 (const uint8_t *data, size_t size, uint8_t crc)
+{
+  const uint8_t *t = tables ().crc8;
+  for (size_t i = 0; i < size; ++i) {
+    crc = t[crc ^ data[i]];
+  }
+  return crc;
+}
+
+uint16_t
+serial::crc::crc16_modbus (const uint8_t *data, size_t size, uint16_t crc)
+{
+  const uint16_t *t = tables ().crc16_modbus;
+  for (size_t i = 0; i < size; ++i) {
+    crc = static_cast<uint16_t> ((crc >> 8) ^ t[(crc ^ data[i]) & 0xFF]);
+  }
+  return crc;
+}
+
+uint16_t
+serial::crc::crc16_ccitt (const uint8_t *data, size_t size, uint16_t crc)
+{
+  const uint16_t *t = tables ().crc16_ccitt;
+  for (size_t i = 0; i < size; ++i) {
+    crc = static_cast<uint16_t> ((crc << 8) ^ t[((crc >> 8) ^ data[i]) & 0xFF]);
+  }
+  return crc;
+}
+
+uint32_t
+serial::crc::crc32 (const uint8_t *data, size_t size, uint32_t crc)
+{
+  return ~dispatch ().crc32 (~crc, data, size);
+}
+
+uint32_t
+serial::crc::crc32c (const uint8_t *data, size_t size, uint32_t crc)
+{
+  return ~dispatch ().crc32c (~crc, data, size);
+}
+
+const char *
+serial::crc::crc32Implementation ()
+{
+  return dispatch ().crc32_name;
+}
+
+const char *
+serial::crc::crc32cImplementation ()
+{
+  return dispatch ().crc32c_name;
+}
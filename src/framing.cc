@@ -0,0 +1,522 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#include <algorithm>
+#include <cstring>
+
+#include "serial/framing.h"
+#include "serial/crc.h"
+
+using std::invalid_argument;
+using std::max;
+using std::min;
+using std::vector;
+
+using serial::Serial;
+using serial::framing::Frame;
+using serial::framing::FramePool;
+using serial::framing::Decoder;
+using serial::framing::CobsEncoder;
+using serial::framing::CobsDecoder;
+using serial::framing::SlipEncoder;
+using serial::framing::SlipDecoder;
+using serial::framing::FrameFormat;
+using serial::framing::FrameHandler;
+using serial::framing::FrameReader;
+
+namespace {
+
+const uint8_t slip_end = 0xC0;
+const uint8_t slip_esc = 0xDB;
+const uint8_t slip_esc_end = 0xDC;
+const uint8_t slip_esc_esc = 0xDD;
+
+size_t
+crc_size (serial::framing::crc_t crc)
+{
+  switch (crc) {
+  case serial::framing::crc_8: return 1;
+  case serial::framing::crc_16_modbus: return 2;
+  case serial::framing::crc_16_ccitt: return 2;
+  case serial::framing::crc_32: return 4;
+  default: return 0;
+  }
+}
+
+uint32_t
+compute_crc (serial::framing::crc_t crc, const uint8_t *data, size_t size)
+{
+  switch (crc) {
+  case serial::framing::crc_8: return serial::crc::crc8 (data, size);
+  case serial::framing::crc_16_modbus: return serial::crc::crc16_modbus (data, size);
+  case serial::framing::crc_16_ccitt: return serial::crc::crc16_ccitt (data, size);
+  case serial::framing::crc_32: return serial::crc::crc32 (data, size);
+  default: return 0;
+  }
+}
+
+uint32_t
+get_uint (const uint8_t *data, size_t width, bool big_endian)
+{
+  uint32_t value = 0;
+  for (size_t i = 0; i < width; ++i) {
+    size_t shift = big_endian ? 8 * (width - 1 - i) : 8 * i;
+    value |= static_cast<uint32_t> (data[i]) << shift;
+  }
+  return value;
+}
+
+} // namespace
+
+FramePool::FramePool (size_t frame_capacity)
+  : frame_capacity_ (frame_capacity)
+{
+}
+
+FramePool::~FramePool ()
+{
+  for (size_t i = 0; i < free_.size (); ++i) {
+    delete free_[i];
+  }
+}
+
+Frame *
+FramePool::acquire ()
+{
+  if (free_.empty ()) {
+    Frame *frame = new Frame ();
+    frame->reserve (frame_capacity_);
+    return frame;
+  }
+  Frame *frame = free_.back ();
+  free_.pop_back ();
+  frame->clear ();
+  return frame;
+}
+
+void
+FramePool::release (Frame *frame)
+{
+  if (frame != NULL) {
+    free_.push_back (frame);
+  }
+}
+
+void
+FramePool::release (vector<Frame*> &frames)
+{
+  free_.insert (free_.end (), frames.begin (), frames.end ());
+  frames.clear ();
+}
+
+Decoder::Decoder (FramePool &pool, size_t max_frame_size)
+  : pool_ (pool), max_frame_size_ (max_frame_size), frame_ (pool.acquire ()),
+    overflow_ (false), errors_ (0)
+{
+}
+
+Decoder::~Decoder ()
+{
+  pool_.release (frame_);
+}
+
+void
+Decoder::reset ()
+{
+  frame_->clear ();
+  overflow_ = false;
+}
+
+size_t
+Decoder::read (Serial &port, vector<Frame*> &frames, size_t size)
+{
+  if (read_buffer_.size () < size) {
+    read_buffer_.resize (size);
+  }
+  size_t bytes_to_read = min (max (port.available (), size_t (1)), size);
+  size_t bytes_read = port.read (&read_buffer_[0], bytes_to_read);
+  return decode (&read_buffer_[0], bytes_read, frames);
+}
+
+size_t
+Decoder::finish_ (vector<Frame*> &frames, bool valid)
+{
+  if (valid && !overflow_) {
+    frames.push_back (frame_);
+    frame_ = pool_.acquire ();
+    return 1;
+  }
+  ++errors_;
+  frame_->clear ();
+  overflow_ = false;
+  return 0;
+}
+
+void
+Decoder::append_ (const uint8_t *data, size_t size)
+{
+  if (overflow_ || size == 0) {
+    return;
+  }
+  if (frame_->size () + size > max_frame_size_) {
+    overflow_ = true;
+    frame_->clear ();
+    return;
+  }
+  frame_->insert (frame_->end (), data, data + size);
+}
+
+size_t
+CobsEncoder::maxEncodedSize (size_t size) const
+{
+  // One code byte per 254 data bytes, plus the first and the delimiter.
+  return size + size / 254 + 2;
+}
+
+size_t
+CobsEncoder::encode (const uint8_t *data, size_t size, uint8_t *out) const
+{
+  uint8_t *code = out;
+  uint8_t *o = out + 1;
+  const uint8_t *p = data;
+  const uint8_t *end = data + size;
+  while (true) {
+    // Copy up to the next zero, or a full block of 254 bytes.
+    size_t block = min (static_cast<size_t> (end - p), size_t (254));
+    const uint8_t *zero =
+      static_cast<const uint8_t*> (memchr (p, 0, block));
+    size_t run = zero ? static_cast<size_t> (zero - p) : block;
+    memcpy (o, p, run);
+    o += run;
+    p += run;
+    *code = static_cast<uint8_t> (run + 1);
+    if (zero == NULL && run < 254) {
+      break; // End of data
+    }
+    if (zero != NULL) {
+      ++p; // The zero is implied by the code byte
+    }
+    code = o++;
+  }
+  *o++ = 0;
+  return static_cast<size_t> (o - out);
+}
+
+CobsDecoder::CobsDecoder (FramePool &pool, size_t max_frame_size)
+  : Decoder (pool, max_frame_size), code_ (0), remaining_ (0)
+{
+}
+
+void
+CobsDecoder::reset ()
+{
+  Decoder::reset ();
+  code_ = 0;
+  remaining_ = 0;
+}
+
+size_t
+CobsDecoder::decode (const uint8_t *data, size_t size, vector<Frame*> &frames)
+{
+  static const uint8_t zero = 0;
+  size_t decoded = 0;
+  const uint8_t *p = data;
+  const uint8_t *end = data + size;
+  while (p < end) {
+    if (remaining_ == 0) {
+      uint8_t c = *p++;
+      if (c == 0) {
+        // Delimiter at a block boundary, the frame is complete.  Runs of
+        // delimiters are skipped.
+        if (code_ != 0) {
+          decoded += finish_ (frames, true);
+        }
+        code_ = 0;
+        continue;
+      }
+      // Blocks shorter than 254 bytes stand for a zero, except the last.
+      if (code_ != 0 && code_ != 0xFF) {
+        append_ (&zero, 1);
+      }
+      code_ = c;
+      remaining_ = static_cast<uint8_t> (c - 1);
+      continue;
+    }
+    // Copy the rest of the block in one go, unless a delimiter shows up.
+    size_t chunk = min (static_cast<size_t> (remaining_),
+                        static_cast<size_t> (end - p));
+    const uint8_t *delimiter =
+      static_cast<const uint8_t*> (memchr (p, 0, chunk));
+    if (delimiter != NULL) {
+      // Truncated block, drop the frame and resynchronize.
+      p = delimiter + 1;
+      finish_ (frames, false);
+      code_ = 0;
+      remaining_ = 0;
+      continue;
+    }
+    append_ (p, chunk);
+    p += chunk;
+    remaining_ = static_cast<uint8_t> (remaining_ - chunk);
+  }
+  return decoded;
+}
+
+size_t
+SlipEncoder::maxEncodedSize (size_t size) const
+{
+  return 2 * size + 2;
+}
+
+size_t
+SlipEncoder::encode (const uint8_t *data, size_t size, uint8_t *out) const
+{
+  uint8_t *o = out;
+  *o++ = slip_end;
+  for (size_t i = 0; i < size; ++i) {
+    if (data[i] == slip_end) {
+      *o++ = slip_esc;
+      *o++ = slip_esc_end;
+    } else if (data[i] == slip_esc) {
+      *o++ = slip_esc;
+      *o++ = slip_esc_esc;
+    } else {
+      *o++ = data[i];
+    }
+  }
+  *o++ = slip_end;
+  return static_cast<size_t> (o - out);
+}
+
+SlipDecoder::SlipDecoder (FramePool &pool, size_t max_frame_size)
+  : Decoder (pool, max_frame_size), escaped_ (false), corrupt_ (false)
+{
+}
+
+void
+SlipDecoder::reset ()
+{
+  Decoder::reset ();
+  escaped_ = false;
+  corrupt_ = false;
+}
+
+size_t
+SlipDecoder::decode (const uint8_t *data, size_t size, vector<Frame*> &frames)
+{
+  static const uint8_t end_byte = slip_end;
+  static const uint8_t esc_byte = slip_esc;
+  size_t decoded = 0;
+  const uint8_t *p = data;
+  const uint8_t *end = data + size;
+  while (p < end) {
+    if (escaped_) {
+      escaped_ = false;
+      if (*p == slip_esc_end) {
+        append_ (&end_byte, 1);
+      } else if (*p == slip_esc_esc) {
+        append_ (&esc_byte, 1);
+      } else {
+        // Invalid escape, an END is left for the frame handling below.
+        corrupt_ = true;
+        if (*p == slip_end) {
+          continue;
+        }
+      }
+      ++p;
+      continue;
+    }
+    // Everything up to the next END belongs to the current frame, copy
+    // the runs between escapes in bulk.
+    const uint8_t *stop =
+      static_cast<const uint8_t*> (memchr (p, slip_end, end - p));
+    const uint8_t *segment_end = stop ? stop : end;
+    while (p < segment_end) {
+      const uint8_t *esc = static_cast<const uint8_t*>
+        (memchr (p, slip_esc, segment_end - p));
+      if (esc == NULL) {
+        append_ (p, segment_end - p);
+        p = segment_end;
+        break;
+      }
+      append_ (p, esc - p);
+      p = esc + 1;
+      if (p == segment_end) {
+        // ESC right before END is invalid, at the end of the chunk the
+        // escaped byte comes with the next one.
+        if (stop) {
+          corrupt_ = true;
+        } else {
+          escaped_ = true;
+        }
+        break;
+      }
+      if (*p == slip_esc_end) {
+        append_ (&end_byte, 1);
+      } else if (*p == slip_esc_esc) {
+        append_ (&esc_byte, 1);
+      } else {
+        corrupt_ = true;
+      }
+      ++p;
+    }
+    if (stop) {
+      p = stop + 1;
+      // Back to back ENDs delimit empty frames, which are skipped.
+      if (!frame_->empty () || corrupt_ || overflow_) {
+        decoded += finish_ (frames, !corrupt_);
+      }
+      corrupt_ = false;
+    }
+  }
+  return decoded;
+}
+
+FrameReader::FrameReader (const FrameFormat &format)
+  : format_ (format), crc_size_ (crc_size (format.crc)), start_ (0), end_ (0),
+    frames_ (0), crc_errors_ (0), length_errors_ (0), skipped_bytes_ (0)
+{
+  if (format_.sync.empty ()) {
+    throw invalid_argument ("empty sync pattern");
+  }
+  if (format_.length_width != 1 && format_.length_width != 2
+   && format_.length_width != 4) {
+    throw invalid_argument ("invalid length field width");
+  }
+  header_size_ = max (format_.sync.size (),
+                      format_.length_offset + format_.length_width);
+  if (format_.max_frame_size < header_size_ + crc_size_) {
+    throw invalid_argument ("max frame size smaller than the header");
+  }
+
+  size_t m = format_.sync.size ();
+  for (size_t i = 0; i < 256; ++i) {
+    skip_[i] = m;
+  }
+  for (size_t i = 0; i + 1 < m; ++i) {
+    skip_[format_.sync[i]] = m - 1 - i;
+  }
+  buffer_.resize (2 * format_.max_frame_size);
+}
+
+FrameReader::~FrameReader ()
+{
+}
+
+void
+FrameReader::reset ()
+{
+  start_ = 0;
+  end_ = 0;
+}
+
+void
+FrameReader::reserve_ (size_t size)
+{
+  // Move the unprocessed bytes to the front before growing the buffer.
+  if (end_ + size > buffer_.size () && start_ > 0) {
+    memmove (&buffer_[0], &buffer_[start_], end_ - start_);
+    end_ -= start_;
+    start_ = 0;
+  }
+  if (end_ + size > buffer_.size ()) {
+    buffer_.resize (end_ + size);
+  }
+}
+
+size_t
+FrameReader::findSync_ () const
+{
+  const uint8_t *data = &buffer_[0];
+  const uint8_t *sync = &format_.sync[0];
+  size_t m = format_.sync.size ();
+  if (m == 1) {
+    const uint8_t *found = static_cast<const uint8_t*>
+      (memchr (data + start_, sync[0], end_ - start_));
+    return found ? static_cast<size_t> (found - data) : end_;
+  }
+  // Boyer-Moore-Horspool, shifting on the byte under the pattern's end.
+  size_t pos = start_;
+  while (pos + m <= end_) {
+    uint8_t last = data[pos + m - 1];
+    if (last == sync[m - 1] && memcmp (data + pos, sync, m - 1) == 0) {
+      return pos;
+    }
+    pos += skip_[last];
+  }
+  // Keep a tail which may hold the beginning of a pattern.
+  return max (start_, end_ >= m - 1 ? end_ - (m - 1) : 0);
+}
+
+size_t
+FrameReader::feed (const uint8_t *data, size_t size, FrameHandler &handler)
+{
+  reserve_ (size);
+  if (size > 0) {
+    memcpy (&buffer_[end_], data, size);
+    end_ += size;
+  }
+
+  size_t delivered = 0;
+  while (true) {
+    size_t sync = findSync_ ();
+    skipped_bytes_ += sync - start_;
+    start_ = sync;
+    if (end_ - start_ < header_size_) {
+      break;
+    }
+    const uint8_t *frame = &buffer_[start_];
+
+    int64_t total = get_uint (frame + format_.length_offset,
+                              format_.length_width,
+                              format_.length_big_endian);
+    total += format_.length_adjust;
+    int64_t min_size = max (header_size_, format_.crc_offset) + crc_size_;
+    if (total < min_size
+     || total > static_cast<int64_t> (format_.max_frame_size)) {
+      // Not a frame, hunt again from the next byte.
+      ++length_errors_;
+      ++skipped_bytes_;
+      ++start_;
+      continue;
+    }
+    if (end_ - start_ < static_cast<size_t> (total)) {
+      break; // Wait for the rest of the frame
+    }
+
+    size_t frame_size = static_cast<size_t> (total);
+    if (crc_size_ > 0) {
+      size_t crc_at = frame_size - crc_size_;
+      uint32_t expected = get_uint (frame + crc_at, crc_size_,
+                                    format_.crc_big_endian);
+      uint32_t actual = compute_crc (format_.crc, frame + format_.crc_offset,
+                                     crc_at - format_.crc_offset);
+      if (expected != actual) {
+        ++crc_errors_;
+        ++skipped_bytes_;
+        ++start_;
+        continue;
+      }
+    }
+
+    ++frames_;
+    ++delivered;
+    start_ += frame_size;
+    handler.onFrame (frame, frame_size);
+  }
+  if (start_ == end_) {
+    start_ = 0;
+    end_ = 0;
+  }
+  return delivered;
+}
+
+size_t
+FrameReader::read (Serial &port, FrameHandler &handler, size_t size)
+{
+  // The port reads straight into the buffer, saving the copy in feed.
+  reserve_ (size);
+  size_t bytes_to_read = min (max (port.available (), size_t (1)), size);
+  size_t bytes_read = port.read (&buffer_[end_], bytes_to_read);
+  end_ += bytes_read;
+  return feed (NULL, 0, handler);
+}
@@ -28,11 +28,14 @@
 #include <time.h>
 #ifdef __MACH__
 #include <AvailabilityMacros.h>
-#include <mach/clock.h>
-#include <mach/mach.h>
 #endif
 
 #include "serial/impl/unix.h"
+#include "serial/impl/condition.h"
+#include "serial/impl/stats.h"
+#include "serial/clock.h"
+#include "serial/network.h"
+#include "serial/transport.h"
 
 #ifndef TIOCINQ
 #ifdef FIONREAD
@@ -42,6 +45,10 @@
 #endif
 #endif
 
+#ifndef TIOCOUTQ
+#define TIOCOUTQ 0x5411
+#endif
+
 #if defined(MAC_OS_X_VERSION_10_3) && (MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_3)
 #include <IOKit/serial/ioss.h>
 #endif
@@ -49,92 +56,267 @@
 using std::string;
 using std::stringstream;
 using std::invalid_argument;
-using serial::MillisecondTimer;
+using serial::DeadlineTimer;
 using serial::Serial;
 using serial::SerialException;
 using serial::PortNotOpenedException;
 using serial::IOException;
+using serial::Stats;
+using serial::LineCounters;
+using serial::LineMonitorHandler;
+using serial::DrainHandler;
+using serial::WriteRate;
+using serial::FlightRecorder;
+using serial::FlightRecordHandler;
+using serial::RecordedChunk;
+using serial::TimestampedChunk;
+using serial::Transport;
+using serial::NetworkTransport;
+using serial::Clock;
+
+
+static timespec
+timespec_from_ns (uint64_t nsec)
+{
+  timespec time;
+  time.tv_sec = static_cast<time_t> (nsec / 1000000000);
+  time.tv_nsec = static_cast<long> (nsec % 1000000000);
+  return time;
+}
 
+static void
+timespec_add_ns (timespec &time, uint64_t nsec)
+{
+  uint64_t tv_nsec = static_cast<uint64_t> (time.tv_nsec) + nsec;
+  time.tv_sec += static_cast<time_t> (tv_nsec / 1000000000);
+  time.tv_nsec = static_cast<long> (tv_nsec % 1000000000);
+}
 
-MillisecondTimer::MillisecondTimer (const uint32_t millis)
-  : expiry(timespec_now())
+// The time on the clock of serial::setClock.
+static uint64_t
+clock_now_ns ()
 {
-  int64_t tv_nsec = expiry.tv_nsec + (millis * 1e6);
-  if (tv_nsec >= 1e9) {
-    int64_t sec_diff = tv_nsec / static_cast<int> (1e9);
-    expiry.tv_nsec = tv_nsec % static_cast<int>(1e9);
-    expiry.tv_sec += sec_diff;
-  } else {
-    expiry.tv_nsec = tv_nsec;
+  Clock *clock = serial::getClock ();
+  return clock != NULL ? clock->now () : serial::stats::now_ns ();
+}
+
+// Far enough for any wait, near enough for remaining to fit an int64_t.
+static const uint64_t max_wait_ns = static_cast<uint64_t> (1) << 62;
+
+// Calculates a total timeout in nanoseconds, (t_c + (t_m * N)) * unit,
+// limited to max_wait_ns rather than wrapped around by a large N.
+static uint64_t
+total_timeout (uint32_t constant, uint32_t multiplier, size_t count,
+               uint32_t unit_ns)
+{
+  if (unit_ns == 0) {
+    return 0;
+  }
+  uint64_t max_units = max_wait_ns / unit_ns;
+  if (constant >= max_units
+      || (multiplier > 0 && count > (max_units - constant) / multiplier)) {
+    return max_wait_ns;
   }
+  return (constant + static_cast<uint64_t> (multiplier) * count) * unit_ns;
+}
+
+// Describes a chunk read at timestamp_ns, when count bytes had arrived
+// one byte time apart, the last of them just before.
+static TimestampedChunk
+timestamped_chunk (size_t offset, size_t size, uint64_t timestamp_ns,
+                   size_t count, uint32_t byte_time_ns, bool waited)
+{
+  TimestampedChunk chunk;
+  chunk.offset = offset;
+  chunk.size = size;
+  chunk.timestamp_ns = timestamp_ns;
+  uint64_t arrival_ns = static_cast<uint64_t> (byte_time_ns) * count;
+  chunk.first_byte_ns = arrival_ns < timestamp_ns
+                        ? timestamp_ns - arrival_ns : 0;
+  chunk.waited = waited;
+  return chunk;
+}
+
+DeadlineTimer::DeadlineTimer (uint64_t nanos)
+  : expiry_ (timespec_from_ns (clock_now_ns () + std::min (nanos,
+                                                           max_wait_ns)))
+{
+}
+
+DeadlineTimer
+DeadlineTimer::at (uint64_t monotonic_ns)
+{
+  DeadlineTimer deadline;
+  deadline.expiry_ = timespec_from_ns (
+    std::min (monotonic_ns, clock_now_ns () + max_wait_ns));
+  return deadline;
 }
 
 int64_t
-MillisecondTimer::remaining ()
+DeadlineTimer::remaining () const
 {
-  timespec now(timespec_now());
-  int64_t millis = (expiry.tv_sec - now.tv_sec) * 1e3;
-  millis += (expiry.tv_nsec - now.tv_nsec) / 1e6;
-  return millis;
+  timespec now (timespec_now ());
+  return (expiry_.tv_sec - now.tv_sec) * 1000000000LL
+         + (expiry_.tv_nsec - now.tv_nsec);
 }
 
 timespec
-MillisecondTimer::timespec_now ()
+DeadlineTimer::remaining_timespec () const
 {
-  timespec time;
-# ifdef __MACH__ // OS X does not have clock_gettime, use clock_get_time
-  clock_serv_t cclock;
-  mach_timespec_t mts;
-  host_get_clock_service(mach_host_self(), SYSTEM_CLOCK, &cclock);
-  clock_get_time(cclock, &mts);
-  mach_port_deallocate(mach_task_self(), cclock);
-  time.tv_sec = mts.tv_sec;
-  time.tv_nsec = mts.tv_nsec;
-# else
-  clock_gettime(CLOCK_MONOTONIC, &time);
-# endif
-  return time;
+  int64_t nsec = remaining ();
+  return timespec_from_ns (nsec > 0 ? static_cast<uint64_t> (nsec) : 0);
 }
 
 timespec
-timespec_from_ms (const uint32_t millis)
+DeadlineTimer::timespec_now ()
 {
-  timespec time;
-  time.tv_sec = millis / 1e3;
-  time.tv_nsec = (millis - (time.tv_sec * 1e3)) * 1e6;
-  return time;
+  return timespec_from_ns (clock_now_ns ());
+}
+
+static LineCounters
+read_line_counters (int fd)
+{
+#if defined(TIOCGICOUNT)
+  struct serial_icounter_struct icount;
+  if (-1 == ioctl (fd, TIOCGICOUNT, &icount)) {
+    stringstream ss;
+    ss << "getLineCounters failed on a call to ioctl(TIOCGICOUNT): "
+       << errno << " " << strerror(errno);
+    throw(SerialException(ss.str().c_str()));
+  }
+  LineCounters counters;
+  counters.rx = static_cast<uint32_t> (icount.rx);
+  counters.tx = static_cast<uint32_t> (icount.tx);
+  counters.frame = static_cast<uint32_t> (icount.frame);
+  counters.overrun = static_cast<uint32_t> (icount.overrun);
+  counters.parity = static_cast<uint32_t> (icount.parity);
+  counters.brk = static_cast<uint32_t> (icount.brk);
+  counters.buf_overrun = static_cast<uint32_t> (icount.buf_overrun);
+  return counters;
+#else
+  (void) fd;
+  THROW (IOException, "getLineCounters is not supported on this platform.");
+#endif
+}
+
+static void
+sleep_until (const timespec &deadline)
+{
+  Clock *clock = serial::getClock ();
+  if (clock != NULL) {
+    clock->sleepUntil (static_cast<uint64_t> (deadline.tv_sec) * 1000000000ULL
+                       + static_cast<uint64_t> (deadline.tv_nsec));
+    return;
+  }
+#if defined(__linux__)
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)
+         == EINTR) {}
+#else
+  // No absolute sleep on this platform, sleep for the remaining interval
+  // and recheck the clock in case the sleep was cut short.
+  while (true) {
+    timespec now(DeadlineTimer::timespec_now ());
+    int64_t nsec = (deadline.tv_sec - now.tv_sec) * 1000000000LL;
+    nsec += deadline.tv_nsec - now.tv_nsec;
+    if (nsec <= 0) {
+      return;
+    }
+    timespec wait_time;
+    wait_time.tv_sec = static_cast<time_t> (nsec / 1000000000);
+    wait_time.tv_nsec = static_cast<long> (nsec % 1000000000);
+    nanosleep (&wait_time, NULL);
+  }
+#endif
+}
+
+// Sleeps until deadline_ns on the clock of stats::now_ns.
+static void
+sleep_until_ns (uint64_t deadline_ns)
+{
+  sleep_until (timespec_from_ns (deadline_ns));
 }
 
 Serial::SerialImpl::SerialImpl (const string &port, unsigned long baudrate,
                                 bytesize_t bytesize,
                                 parity_t parity, stopbits_t stopbits,
                                 flowcontrol_t flowcontrol)
-  : port_ (port), fd_ (-1), is_open_ (false), xonxoff_ (false), rtscts_ (false),
-    baudrate_ (baudrate), parity_ (parity),
-    bytesize_ (bytesize), stopbits_ (stopbits), flowcontrol_ (flowcontrol)
+  : port_ (port), fd_ (-1), transport_ (NULL), owns_transport_ (false),
+    is_open_ (false), xonxoff_ (false), rtscts_ (false),
+    baudrate_ (baudrate), byte_time_ns_ (0), parity_ (parity),
+    bytesize_ (bytesize), stopbits_ (stopbits), flowcontrol_ (flowcontrol),
+    bulk_latency_us_ (10000), recorder_ (NULL), record_handler_ (NULL),
+    monitor_handler_ (NULL), monitor_period_ms_ (0),
+    monitor_running_ (false), monitor_started_ (false),
+    drain_handler_ (NULL), drain_generation_ (0), drain_pending_ (false),
+    drain_started_ (false)
 {
-  pthread_mutex_init(&this->read_mutex, NULL);
-  pthread_mutex_init(&this->write_mutex, NULL);
+  init_ ();
   if (port_.empty () == false)
     open ();
 }
 
+Serial::SerialImpl::SerialImpl (Transport &transport)
+  : fd_ (-1), transport_ (&transport), owns_transport_ (false),
+    is_open_ (true), xonxoff_ (false), rtscts_ (false), baudrate_ (9600), byte_time_ns_ (0),
+    parity_ (parity_none), bytesize_ (eightbits), stopbits_ (stopbits_one),
+    flowcontrol_ (flowcontrol_none),
+    bulk_latency_us_ (10000), recorder_ (NULL), record_handler_ (NULL),
+    monitor_handler_ (NULL), monitor_period_ms_ (0),
+    monitor_running_ (false), monitor_started_ (false),
+    drain_handler_ (NULL), drain_generation_ (0), drain_pending_ (false),
+    drain_started_ (false)
+{
+  init_ ();
+  updateByteTime_ ();
+}
+
+void
+Serial::SerialImpl::init_ ()
+{
+  lane_waiting_[priority_high] = 0;
+  lane_waiting_[priority_normal] = 0;
+  lane_waiting_[priority_bulk] = 0;
+  write_held_ = false;
+  pthread_mutex_init(&this->read_mutex, NULL);
+  pthread_mutex_init(&this->write_mutex, NULL);
+  pthread_cond_init(&this->write_cond_, NULL);
+  pthread_mutex_init(&this->monitor_mutex_, NULL);
+  serial::condition::init(this->monitor_cond_);
+  pthread_mutex_init(&this->drain_mutex_, NULL);
+  serial::condition::init(this->drain_cond_);
+}
+
 Serial::SerialImpl::~SerialImpl ()
 {
   close();
+  delete recorder_;
   pthread_mutex_destroy(&this->read_mutex);
   pthread_mutex_destroy(&this->write_mutex);
+  pthread_cond_destroy(&this->write_cond_);
+  pthread_mutex_destroy(&this->monitor_mutex_);
+  pthread_cond_destroy(&this->monitor_cond_);
+  pthread_mutex_destroy(&this->drain_mutex_);
+  pthread_cond_destroy(&this->drain_cond_);
 }
 
 void
 Serial::SerialImpl::open ()
 {
-  if (port_.empty ()) {
+  if (port_.empty () && transport_ == NULL) {
     throw invalid_argument ("Empty port is invalid.");
   }
   if (is_open_ == true) {
     throw SerialException ("Serial port already open.");
   }
+  if (transport_ == NULL && NetworkTransport::isUrl (port_)) {
+    transport_ = new NetworkTransport (port_);
+    owns_transport_ = true;
+  }
+  if (transport_ != NULL) {
+    reconfigurePort ();
+    is_open_ = true;
+    return;
+  }
 
   fd_ = ::open (port_.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
 
@@ -159,6 +341,14 @@ Serial::SerialImpl::open ()
 void
 Serial::SerialImpl::reconfigurePort ()
 {
+  if (transport_ != NULL) {
+    // The far end of a transport is a line like any other, so the byte
+    // time and the pace follow the settings here as well.
+    transport_->configure (baudrate_, bytesize_, parity_, stopbits_,
+                           flowcontrol_);
+    updateByteTime_ ();
+    return;
+  }
   if (fd_ == -1) {
     // Can only operate on a valid file descriptor
     THROW (IOException, "Invalid file descriptor, is the serial port open?");
@@ -448,6 +638,12 @@ Serial::SerialImpl::reconfigurePort ()
 #endif
   }
 
+  updateByteTime_ ();
+}
+
+void
+Serial::SerialImpl::updateByteTime_ ()
+{
   // Update byte_time_ based on the new settings.
   uint32_t bit_time_ns = 1e9 / baudrate_;
   byte_time_ns_ = bit_time_ns * (1 + bytesize_ + parity_ + stopbits_);
@@ -457,12 +653,19 @@ Serial::SerialImpl::reconfigurePort ()
   if (stopbits_ == stopbits_one_point_five) {
     byte_time_ns_ += ((1.5 - stopbits_one_point_five) * bit_time_ns);
   }
+
+  // A pace given as a fraction of the line rate follows the new settings.
+  pacer_.configure (write_rate_, byte_time_ns_);
 }
 
 void
 Serial::SerialImpl::close ()
 {
   if (is_open_ == true) {
+    // The monitor and the drain thread use fd_, stop them before the
+    // descriptor goes away.
+    stopLineMonitor ();
+    cancelDrained ();
     if (fd_ != -1) {
       int ret;
       ret = ::close (fd_);
@@ -472,6 +675,11 @@ Serial::SerialImpl::close ()
         THROW (IOException, errno);
       }
     }
+    if (owns_transport_) {
+      delete transport_;
+      transport_ = NULL;
+      owns_transport_ = false;
+    }
     is_open_ = false;
   }
 }
@@ -482,13 +690,23 @@ Serial::SerialImpl::isOpen () const
   return is_open_;
 }
 
+int
+Serial::SerialImpl::getFileDescriptor () const
+{
+  return is_open_ && transport_ == NULL ? fd_ : -1;
+}
+
 size_t
 Serial::SerialImpl::available ()
 {
   if (!is_open_) {
     return 0;
   }
+  if (transport_ != NULL) {
+    return transport_->available ();
+  }
   int count = 0;
+  SERIAL_STATS (stats::add (stats_.syscalls, 1));
   if (-1 == ioctl (fd_, TIOCINQ, &count)) {
       THROW (IOException, errno);
   } else {
@@ -496,19 +714,47 @@ Serial::SerialImpl::available ()
   }
 }
 
+// A clock set with serial::setClock decides how long waits take: check,
+// sleep on the clock for the whole timeout, and check again.
+static uint64_t
+clock_wait_deadline (Clock *clock, uint64_t timeout_ns)
+{
+  uint64_t now_ns = clock->now ();
+  return now_ns + std::min (timeout_ns, max_wait_ns);
+}
+
+bool
+Serial::SerialImpl::waitReadable (uint64_t timeout_ns)
+{
+  Clock *clock = serial::getClock ();
+  if (clock == NULL || timeout_ns == 0) {
+    return pollReadable_ (timeout_ns);
+  }
+  if (pollReadable_ (0)) {
+    return true;
+  }
+  clock->sleepUntil (clock_wait_deadline (clock, timeout_ns));
+  return pollReadable_ (0);
+}
+
 bool
-Serial::SerialImpl::waitReadable (uint32_t timeout)
+Serial::SerialImpl::pollReadable_ (uint64_t timeout_ns)
 {
+  if (transport_ != NULL) {
+    return transport_->waitReadable (timeout_ns);
+  }
   // Setup a select call to block for serial data or a timeout
   fd_set readfds;
   FD_ZERO (&readfds);
   FD_SET (fd_, &readfds);
-  timespec timeout_ts (timespec_from_ms (timeout));
+  timespec timeout_ts (timespec_from_ns (timeout_ns));
+  SERIAL_STATS (stats::add (stats_.syscalls, 1));
   int r = pselect (fd_ + 1, &readfds, NULL, NULL, &timeout_ts, NULL);
 
   if (r < 0) {
     // Select was interrupted
     if (errno == EINTR) {
+      SERIAL_STATS (stats::add (stats_.eintr_retries, 1));
       return false;
     }
     // Otherwise there was some error
@@ -527,69 +773,205 @@ Serial::SerialImpl::waitReadable (uint32_t timeout)
   return true;
 }
 
+int
+Serial::SerialImpl::waitWritable_ (uint64_t timeout_ns)
+{
+  Clock *clock = serial::getClock ();
+  if (clock == NULL || timeout_ns == 0) {
+    return pollWritable_ (timeout_ns);
+  }
+  int r = pollWritable_ (0);
+  if (r != 0) {
+    return r;
+  }
+  clock->sleepUntil (clock_wait_deadline (clock, timeout_ns));
+  return pollWritable_ (0);
+}
+
+int
+Serial::SerialImpl::pollWritable_ (uint64_t timeout_ns)
+{
+  if (transport_ != NULL) {
+    return transport_->waitWritable (timeout_ns) ? 1 : 0;
+  }
+  fd_set writefds;
+  FD_ZERO (&writefds);
+  FD_SET (fd_, &writefds);
+  timespec timeout (timespec_from_ns (timeout_ns));
+
+  // Do the select
+  SERIAL_STATS (stats::add (stats_.syscalls, 1));
+  int r = pselect (fd_ + 1, NULL, &writefds, NULL, &timeout, NULL);
+  // This shouldn't happen, if r > 0 our fd has to be in the list!
+  if (r > 0 && !FD_ISSET (fd_, &writefds)) {
+    THROW (IOException, "select reports ready to write, but our fd isn't"
+                        " in the list, this shouldn't happen!");
+  }
+  return r;
+}
+
 void
 Serial::SerialImpl::waitByteTimes (size_t count)
 {
-  timespec wait_time = { 0, static_cast<long>(byte_time_ns_ * count)};
-  pselect (0, NULL, NULL, NULL, &wait_time, NULL);
+  SERIAL_STATS (stats::add (stats_.syscalls, 1));
+  sleep_until_ns (clock_now_ns ()
+                  + static_cast<uint64_t> (byte_time_ns_) * count);
 }
 
 size_t
 Serial::SerialImpl::read (uint8_t *buf, size_t size)
+{
+  return readTimestamped (buf, size, NULL);
+}
+
+size_t
+Serial::SerialImpl::readTimestamped (uint8_t *buf, size_t size,
+                                     std::vector<TimestampedChunk> *chunks)
+{
+  uint64_t total_timeout_ns = total_timeout (timeout_.read_timeout_constant,
+                                             timeout_.read_timeout_multiplier,
+                                             size, timeout_.unit_ns);
+  uint64_t inter_byte_timeout_ns =
+    timeout_.inter_byte_timeout == Timeout::max()
+    ? std::numeric_limits<uint64_t>::max ()
+    : static_cast<uint64_t> (timeout_.inter_byte_timeout) * timeout_.unit_ns;
+  return read_ (buf, size, DeadlineTimer (total_timeout_ns),
+                inter_byte_timeout_ns, chunks);
+}
+
+size_t
+Serial::SerialImpl::read (uint8_t *buf, size_t size, uint64_t deadline_ns)
+{
+  return readTimestamped (buf, size, deadline_ns, NULL);
+}
+
+size_t
+Serial::SerialImpl::readTimestamped (uint8_t *buf, size_t size,
+                                     uint64_t deadline_ns,
+                                     std::vector<TimestampedChunk> *chunks)
+{
+  return read_ (buf, size, DeadlineTimer::at (deadline_ns),
+                std::numeric_limits<uint64_t>::max (), chunks);
+}
+
+size_t
+Serial::SerialImpl::read_ (uint8_t *buf, size_t size,
+                           const DeadlineTimer &total_timeout,
+                           uint64_t inter_byte_timeout_ns,
+                           std::vector<TimestampedChunk> *chunks)
+{
+  if (recorder_ == NULL) {
+    return readPort_ (buf, size, total_timeout, inter_byte_timeout_ns,
+                      chunks);
+  }
+  try {
+    size_t bytes_read = readPort_ (buf, size, total_timeout,
+                                   inter_byte_timeout_ns, chunks);
+    recorder_->record (false, buf, bytes_read);
+    return bytes_read;
+  } catch (const std::exception &error) {
+    flightRecordError_ (error);
+    throw;
+  }
+}
+
+size_t
+Serial::SerialImpl::readPort_ (uint8_t *buf, size_t size,
+                               const DeadlineTimer &total_timeout,
+                               uint64_t inter_byte_timeout_ns,
+                               std::vector<TimestampedChunk> *chunks)
 {
   // If the port is not open, throw
   if (!is_open_) {
     throw PortNotOpenedException ("Serial::read");
   }
   size_t bytes_read = 0;
-
-  // Calculate total timeout in milliseconds t_c + (t_m * N)
-  long total_timeout_ms = timeout_.read_timeout_constant;
-  total_timeout_ms += timeout_.read_timeout_multiplier * static_cast<long> (size);
-  MillisecondTimer total_timeout(total_timeout_ms);
+  SERIAL_STATS (uint64_t start_ns = stats::now_ns ());
+  SERIAL_STATS (stats::add (stats_.read_calls, 1));
 
   // Pre-fill buffer with available bytes
   {
-    ssize_t bytes_read_now = ::read (fd_, buf, size);
+    SERIAL_STATS (stats::add (stats_.syscalls, 1));
+    ssize_t bytes_read_now = readSome_ (buf, size);
     if (bytes_read_now > 0) {
       bytes_read = bytes_read_now;
+      SERIAL_STATS (stats::record (stats_.read_wait, start_ns));
+      if (chunks != NULL) {
+        // These were waiting already, so they arrived before this at most.
+        uint64_t now_ns = clock_now_ns ();
+        chunks->push_back (timestamped_chunk (0, bytes_read, now_ns,
+                                              bytes_read, byte_time_ns_,
+                                              false));
+      }
     }
   }
 
   while (bytes_read < size) {
-    int64_t timeout_remaining_ms = total_timeout.remaining();
-    if (timeout_remaining_ms <= 0) {
+    int64_t timeout_remaining_ns = total_timeout.remaining();
+    if (timeout_remaining_ns <= 0) {
       // Timed out
+      SERIAL_STATS (stats::add (stats_.timeouts, 1));
       break;
     }
     // Timeout for the next select is whichever is less of the remaining
     // total read timeout and the inter-byte timeout.
-    uint32_t timeout = std::min(static_cast<uint32_t> (timeout_remaining_ms),
-                                timeout_.inter_byte_timeout);
+    uint64_t timeout_ns = std::min(static_cast<uint64_t> (timeout_remaining_ns),
+                                   inter_byte_timeout_ns);
     // Wait for the device to be readable, and then attempt to read.
-    if (waitReadable(timeout)) {
+    if (waitReadable(timeout_ns)) {
+      // The last of the bytes ready at the wake-up arrived just before it.
+      uint64_t wake_ns = 0;
+      size_t bytes_at_wake = 0;
+      if (chunks != NULL) {
+        wake_ns = clock_now_ns ();
+        bytes_at_wake = available ();
+      }
       // If it's a fixed-length multi-byte read, insert a wait here so that
       // we can attempt to grab the whole thing in a single IO call. Skip
       // this wait if a non-max inter_byte_timeout is specified.
-      if (size > 1 && timeout_.inter_byte_timeout == Timeout::max()) {
+      if (size > 1
+          && inter_byte_timeout_ns == std::numeric_limits<uint64_t>::max ()) {
         size_t bytes_available = available();
         if (bytes_available + bytes_read < size) {
-          waitByteTimes(size - (bytes_available + bytes_read));
+          // Like waitByteTimes, but not past the total timeout.
+          DeadlineTimer bytes_due (static_cast<uint64_t> (byte_time_ns_)
+                                   * (size - (bytes_available + bytes_read)));
+          SERIAL_STATS (stats::add (stats_.syscalls, 1));
+          sleep_until (bytes_due.remaining () < total_timeout.remaining ()
+                       ? bytes_due.expiry () : total_timeout.expiry ());
         }
       }
       // This should be non-blocking returning only what is available now
       //  Then returning so that select can block again.
-      ssize_t bytes_read_now =
-        ::read (fd_, buf + bytes_read, size - bytes_read);
+      SERIAL_STATS (stats::add (stats_.syscalls, 1));
+      ssize_t bytes_read_now = readSome_ (buf + bytes_read,
+                                          size - bytes_read);
+      // Like write, retry if a signal interrupted the read.
+      if (bytes_read_now == -1 && errno == EINTR) {
+        SERIAL_STATS (stats::add (stats_.eintr_retries, 1));
+        continue;
+      }
       // read should always return some data as select reported it was
       // ready to read when we get to this point.
       if (bytes_read_now < 1) {
         // Disconnected devices, at least on Linux, show the
         // behavior that they are always ready to read immediately
         // but reading returns nothing.
+        SERIAL_STATS (stats::add (stats_.disconnects, 1));
         throw SerialException ("device reports readiness to read but "
                                "returned no data (device disconnected?)");
       }
+#if !defined(SERIAL_DISABLE_STATS)
+      if (bytes_read == 0) {
+        stats::record (stats_.read_wait, start_ns);
+      }
+#endif
+      if (chunks != NULL) {
+        chunks->push_back (timestamped_chunk (
+          bytes_read, static_cast<size_t> (bytes_read_now), wake_ns,
+          std::max (bytes_at_wake, static_cast<size_t> (1)), byte_time_ns_,
+          true));
+      }
       // Update bytes_read
       bytes_read += static_cast<size_t> (bytes_read_now);
       // If bytes_read == size then we have read everything we need
@@ -608,47 +990,106 @@ Serial::SerialImpl::read (uint8_t *buf, size_t size)
       }
     }
   }
+  SERIAL_STATS (stats::add (stats_.bytes_read, bytes_read));
   return bytes_read;
 }
 
 size_t
 Serial::SerialImpl::write (const uint8_t *data, size_t length)
+{
+  uint64_t total_timeout_ns = total_timeout (timeout_.write_timeout_constant,
+                                             timeout_.write_timeout_multiplier,
+                                             length, timeout_.unit_ns);
+  return write_ (data, length, DeadlineTimer (total_timeout_ns), true);
+}
+
+size_t
+Serial::SerialImpl::write (const uint8_t *data, size_t length,
+                           uint64_t deadline_ns)
+{
+  return write_ (data, length, DeadlineTimer::at (deadline_ns), false);
+}
+
+size_t
+Serial::SerialImpl::write_ (const uint8_t *data, size_t length,
+                            DeadlineTimer total_timeout,
+                            bool pacing_extends_timeout)
+{
+  if (recorder_ == NULL) {
+    return writePort_ (data, length, total_timeout, pacing_extends_timeout);
+  }
+  try {
+    size_t bytes_written = writePort_ (data, length, total_timeout,
+                                       pacing_extends_timeout);
+    recorder_->record (true, data, bytes_written);
+    return bytes_written;
+  } catch (const std::exception &error) {
+    flightRecordError_ (error);
+    throw;
+  }
+}
+
+size_t
+Serial::SerialImpl::writePort_ (const uint8_t *data, size_t length,
+                                DeadlineTimer total_timeout,
+                                bool pacing_extends_timeout)
 {
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::write");
   }
-  fd_set writefds;
   size_t bytes_written = 0;
-
-  // Calculate total timeout in milliseconds t_c + (t_m * N)
-  long total_timeout_ms = timeout_.write_timeout_constant;
-  total_timeout_ms += timeout_.write_timeout_multiplier * static_cast<long> (length);
-  MillisecondTimer total_timeout(total_timeout_ms);
+  SERIAL_STATS (uint64_t start_ns = stats::now_ns ());
+  SERIAL_STATS (stats::add (stats_.write_calls, 1));
 
   bool first_iteration = true;
   while (bytes_written < length) {
-    int64_t timeout_remaining_ms = total_timeout.remaining();
+    size_t chunk = length - bytes_written;
+    uint64_t release_ns = 0;
+    if (pacer_.enabled ()) {
+      chunk = pacer_.chunk (chunk);
+      uint64_t now_ns = clock_now_ns ();
+      release_ns = pacer_.readyAt (chunk, now_ns);
+      if (release_ns > now_ns) {
+        // Time spent pacing does not count against the write timeout, but
+        // does against a deadline given by the caller.
+        int64_t timeout_remaining_ns = total_timeout.remaining ();
+        if (!pacing_extends_timeout
+            && static_cast<int64_t> (release_ns - now_ns)
+               > timeout_remaining_ns) {
+          SERIAL_STATS (stats::add (stats_.timeouts, 1));
+          break;
+        }
+        sleep_until_ns (release_ns);
+        if (pacing_extends_timeout) {
+          total_timeout = DeadlineTimer (static_cast<uint64_t> (
+            std::max (timeout_remaining_ns, static_cast<int64_t> (0))));
+        }
+      }
+      // Every chunk gets the attempt an unpaced write gets for the whole
+      // buffer, even with a timeout of 0.
+      if (pacing_extends_timeout) {
+        first_iteration = true;
+      }
+    }
+    int64_t timeout_remaining_ns = total_timeout.remaining();
     // Only consider the timeout if it's not the first iteration of the loop
     // otherwise a timeout of 0 won't be allowed through
-    if (!first_iteration && (timeout_remaining_ms <= 0)) {
+    if (!first_iteration && (timeout_remaining_ns <= 0)) {
       // Timed out
+      SERIAL_STATS (stats::add (stats_.timeouts, 1));
       break;
     }
     first_iteration = false;
 
-    timespec timeout(timespec_from_ms(timeout_remaining_ms));
-
-    FD_ZERO (&writefds);
-    FD_SET (fd_, &writefds);
-
-    // Do the select
-    int r = pselect (fd_ + 1, NULL, &writefds, NULL, &timeout, NULL);
+    int64_t wait_ns = total_timeout.remaining ();
+    int r = waitWritable_ (wait_ns > 0 ? static_cast<uint64_t> (wait_ns) : 0);
 
     // Figure out what happened by looking at select's response 'r'
     /** Error **/
     if (r < 0) {
       // Select was interrupted, try again
       if (errno == EINTR) {
+        SERIAL_STATS (stats::add (stats_.eintr_retries, 1));
         continue;
       }
       // Otherwise there was some error
@@ -656,59 +1097,64 @@ Serial::SerialImpl::write (const uint8_t *data, size_t length)
     }
     /** Timeout **/
     if (r == 0) {
+      SERIAL_STATS (stats::add (stats_.timeouts, 1));
       break;
     }
     /** Port ready to write **/
     if (r > 0) {
-      // Make sure our file descriptor is in the ready to write list
-      if (FD_ISSET (fd_, &writefds)) {
-        // This will write some
-        ssize_t bytes_written_now =
-          ::write (fd_, data + bytes_written, length - bytes_written);
-
-        // even though pselect returned readiness the call might still be 
-        // interrupted. In that case simply retry.
-        if (bytes_written_now == -1 && errno == EINTR) {
-          continue;
-        }
+      // This will write some
+      SERIAL_STATS (stats::add (stats_.syscalls, 1));
+      ssize_t bytes_written_now = writeSome_ (data + bytes_written, chunk);
+
+      // even though pselect returned readiness the call might still be 
+      // interrupted. In that case simply retry.
+      if (bytes_written_now == -1 && errno == EINTR) {
+        SERIAL_STATS (stats::add (stats_.eintr_retries, 1));
+        continue;
+      }
 
-        // write should always return some data as select reported it was
-        // ready to write when we get to this point.
-        if (bytes_written_now < 1) {
-          // Disconnected devices, at least on Linux, show the
-          // behavior that they are always ready to write immediately
-          // but writing returns nothing.
-          std::stringstream strs;
-          strs << "device reports readiness to write but "
-            "returned no data (device disconnected?)";
-          strs << " errno=" << errno;
-          strs << " bytes_written_now= " << bytes_written_now;
-          strs << " bytes_written=" << bytes_written;
-          strs << " length=" << length;
-          throw SerialException(strs.str().c_str());
-        }
-        // Update bytes_written
-        bytes_written += static_cast<size_t> (bytes_written_now);
-        // If bytes_written == size then we have written everything we need to
-        if (bytes_written == length) {
-          break;
-        }
-        // If bytes_written < size then we have more to write
-        if (bytes_written < length) {
-          continue;
-        }
-        // If bytes_written > size then we have over written, which shouldn't happen
-        if (bytes_written > length) {
-          throw SerialException ("write over wrote, too many bytes where "
-                                 "written, this shouldn't happen, might be "
-                                 "a logical error!");
-        }
+      // write should always return some data as select reported it was
+      // ready to write when we get to this point.
+      if (bytes_written_now < 1) {
+        // Disconnected devices, at least on Linux, show the
+        // behavior that they are always ready to write immediately
+        // but writing returns nothing.
+        std::stringstream strs;
+        strs << "device reports readiness to write but "
+          "returned no data (device disconnected?)";
+        strs << " errno=" << errno;
+        strs << " bytes_written_now= " << bytes_written_now;
+        strs << " bytes_written=" << bytes_written;
+        strs << " length=" << length;
+        SERIAL_STATS (stats::add (stats_.disconnects, 1));
+        throw SerialException(strs.str().c_str());
+      }
+      if (static_cast<size_t> (bytes_written_now) < chunk) {
+        SERIAL_STATS (stats::add (stats_.partial_writes, 1));
+      }
+      if (pacer_.enabled ()) {
+        pacer_.sent (static_cast<size_t> (bytes_written_now), release_ns);
+      }
+      // Update bytes_written
+      bytes_written += static_cast<size_t> (bytes_written_now);
+      // If bytes_written == size then we have written everything we need to
+      if (bytes_written == length) {
+        break;
+      }
+      // If bytes_written < size then we have more to write
+      if (bytes_written < length) {
+        continue;
+      }
+      // If bytes_written > size then we have over written, which shouldn't happen
+      if (bytes_written > length) {
+        throw SerialException ("write over wrote, too many bytes where "
+                               "written, this shouldn't happen, might be "
+                               "a logical error!");
       }
-      // This shouldn't happen, if r > 0 our fd has to be in the list!
-      THROW (IOException, "select reports ready to write, but our fd isn't"
-                          " in the list, this shouldn't happen!");
     }
   }
+  SERIAL_STATS (stats::add (stats_.bytes_written, bytes_written));
+  SERIAL_STATS (stats::record (stats_.write_completion, start_ns));
   return bytes_written;
 }
 
@@ -806,12 +1252,71 @@ Serial::SerialImpl::getFlowcontrol () const
   return flowcontrol_;
 }
 
+void
+Serial::SerialImpl::setWriteRate (const WriteRate &rate)
+{
+  write_rate_ = rate;
+  if (is_open_) {
+    pacer_.configure (write_rate_, byte_time_ns_);
+  }
+}
+
+WriteRate
+Serial::SerialImpl::getWriteRate () const
+{
+  return write_rate_;
+}
+
+void
+Serial::SerialImpl::setBulkLatency (uint32_t microseconds)
+{
+  bulk_latency_us_ = microseconds;
+}
+
+uint32_t
+Serial::SerialImpl::getBulkLatency () const
+{
+  return bulk_latency_us_;
+}
+
+size_t
+Serial::SerialImpl::bulkChunkSize () const
+{
+  // The chunk being written and the one left queued take the latency.
+  uint64_t chunk_time_ns = static_cast<uint64_t> (bulk_latency_us_) * 500;
+  if (byte_time_ns_ == 0 || chunk_time_ns <= byte_time_ns_) {
+    return 1;
+  }
+  return static_cast<size_t> (chunk_time_ns / byte_time_ns_);
+}
+
+void
+Serial::SerialImpl::waitOutputBelow (size_t bytes)
+{
+  // Nothing is ever queued in a transport.
+  while (is_open_ && transport_ == NULL) {
+    int queued = 0;
+    SERIAL_STATS (stats::add (stats_.syscalls, 1));
+    if (-1 == ioctl (fd_, TIOCOUTQ, &queued)
+        || static_cast<size_t> (queued) <= bytes) {
+      return;
+    }
+    timespec wait_time (timespec_from_ns (static_cast<uint64_t> (
+      drainIntervalNs_ (static_cast<size_t> (queued) - bytes))));
+    nanosleep (&wait_time, NULL);
+  }
+}
+
 void
 Serial::SerialImpl::flush ()
 {
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::flush");
   }
+  if (transport_ != NULL) {
+    // Written bytes are already with the transport.
+    return;
+  }
   tcdrain (fd_);
 }
 
@@ -821,6 +1326,10 @@ Serial::SerialImpl::flushInput ()
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::flushInput");
   }
+  if (transport_ != NULL) {
+    transport_->flushInput ();
+    return;
+  }
   tcflush (fd_, TCIFLUSH);
 }
 
@@ -830,15 +1339,167 @@ Serial::SerialImpl::flushOutput ()
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::flushOutput");
   }
+  if (transport_ != NULL) {
+    transport_->flushOutput ();
+    return;
+  }
   tcflush (fd_, TCOFLUSH);
 }
 
+size_t
+Serial::SerialImpl::outputQueueBytes ()
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException ("Serial::outputQueueBytes");
+  }
+  if (transport_ != NULL) {
+    return 0;
+  }
+  int count = 0;
+  SERIAL_STATS (stats::add (stats_.syscalls, 1));
+  if (-1 == ioctl (fd_, TIOCOUTQ, &count)) {
+    stringstream ss;
+    ss << "outputQueueBytes failed on a call to ioctl(TIOCOUTQ): "
+       << errno << " " << strerror(errno);
+    throw(SerialException(ss.str().c_str()));
+  }
+  return static_cast<size_t> (count);
+}
+
+int64_t
+Serial::SerialImpl::drainIntervalNs_ (size_t queued) const
+{
+  // Check again when the queued bytes should be out, but not more often
+  // than every 100us, which is about a byte at 115200 baud.
+  int64_t interval = static_cast<int64_t> (queued) * byte_time_ns_;
+  return interval < 100000 ? 100000 : interval;
+}
+
+bool
+Serial::SerialImpl::waitDrained (uint32_t timeout)
+{
+  DeadlineTimer deadline (timeout * 1000000ULL);
+  while (true) {
+    size_t queued = outputQueueBytes ();
+    if (queued == 0) {
+      return true;
+    }
+    int64_t remaining = deadline.remaining ();
+    if (remaining <= 0) {
+      return false;
+    }
+    int64_t interval = std::min (drainIntervalNs_ (queued), remaining);
+    sleep_until_ns (clock_now_ns () + static_cast<uint64_t> (interval));
+  }
+}
+
+void
+Serial::SerialImpl::onDrained (DrainHandler &handler)
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException ("Serial::onDrained");
+  }
+  if (onDrainThread_ ()) {
+    // Called from the handler, the drain thread carries on with this.
+    pthread_mutex_lock (&drain_mutex_);
+    drain_handler_ = &handler;
+    drain_pending_ = true;
+    ++drain_generation_;
+    pthread_mutex_unlock (&drain_mutex_);
+    return;
+  }
+  cancelDrained ();
+  // The drain thread starts by taking the mutex, so it finds drain_thread_
+  // set.
+  pthread_mutex_lock (&drain_mutex_);
+  drain_handler_ = &handler;
+  drain_pending_ = true;
+  ++drain_generation_;
+  int result = pthread_create (&drain_thread_, NULL,
+                               &SerialImpl::drainThread_, this);
+  if (result) {
+    drain_pending_ = false;
+    pthread_mutex_unlock (&drain_mutex_);
+    THROW (IOException, result);
+  }
+  drain_started_ = true;
+  pthread_mutex_unlock (&drain_mutex_);
+}
+
+void
+Serial::SerialImpl::cancelDrained ()
+{
+  pthread_mutex_lock (&drain_mutex_);
+  drain_pending_ = false;
+  pthread_cond_signal (&drain_cond_);
+  pthread_mutex_unlock (&drain_mutex_);
+  // From the handler the drain thread stops once it returns.
+  if (drain_started_ && !onDrainThread_ ()) {
+    pthread_join (drain_thread_, NULL);
+    drain_started_ = false;
+  }
+}
+
+bool
+Serial::SerialImpl::onDrainThread_ () const
+{
+  return drain_started_ && pthread_equal (pthread_self (), drain_thread_);
+}
+
+void *
+Serial::SerialImpl::drainThread_ (void *arg)
+{
+  static_cast<SerialImpl *> (arg)->drain_ ();
+  return NULL;
+}
+
+void
+Serial::SerialImpl::drain_ ()
+{
+  pthread_mutex_lock (&drain_mutex_);
+  while (drain_pending_) {
+    pthread_mutex_unlock (&drain_mutex_);
+    size_t queued;
+    try {
+      queued = outputQueueBytes ();
+    } catch (const std::exception &) {
+      // The device went away, there is nothing left to drain into.
+      pthread_mutex_lock (&drain_mutex_);
+      break;
+    }
+    if (queued == 0) {
+      pthread_mutex_lock (&drain_mutex_);
+      if (drain_pending_) {
+        DrainHandler *handler = drain_handler_;
+        uint32_t generation = drain_generation_;
+        pthread_mutex_unlock (&drain_mutex_);
+        handler->onDrained ();
+        pthread_mutex_lock (&drain_mutex_);
+        if (drain_generation_ == generation) {
+          break; // The handler did not ask for another notification
+        }
+      }
+      continue;
+    }
+    // On the monotonic clock, whatever the clock of serial::setClock.
+    uint64_t deadline_ns = serial::stats::now_ns ()
+      + static_cast<uint64_t> (drainIntervalNs_ (queued));
+    pthread_mutex_lock (&drain_mutex_);
+    if (drain_pending_) {
+      serial::condition::wait_until (drain_cond_, drain_mutex_, deadline_ns);
+    }
+  }
+  drain_pending_ = false;
+  pthread_mutex_unlock (&drain_mutex_);
+}
+
 void
 Serial::SerialImpl::sendBreak (int duration)
 {
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::sendBreak");
   }
+  requirePort_ ("sendBreak");
   tcsendbreak (fd_, static_cast<int> (duration / 4));
 }
 
@@ -848,6 +1509,7 @@ Serial::SerialImpl::setBreak (bool level)
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::setBreak");
   }
+  requirePort_ ("setBreak");
 
   if (level) {
     if (-1 == ioctl (fd_, TIOCSBRK))
@@ -872,6 +1534,10 @@ Serial::SerialImpl::setRTS (bool level)
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::setRTS");
   }
+  if (transport_ != NULL) {
+    transport_->setRTS (level);
+    return;
+  }
 
   int command = TIOCM_RTS;
 
@@ -898,6 +1564,10 @@ Serial::SerialImpl::setDTR (bool level)
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::setDTR");
   }
+  if (transport_ != NULL) {
+    transport_->setDTR (level);
+    return;
+  }
 
   int command = TIOCM_DTR;
 
@@ -918,9 +1588,95 @@ Serial::SerialImpl::setDTR (bool level)
   }
 }
 
+void
+Serial::SerialImpl::setModemLines (uint32_t mask, uint32_t values)
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException ("Serial::setModemLines");
+  }
+  if (transport_ != NULL) {
+    // Not at once, a transport only sets one line at a time.
+    if (mask & modemline_rts) {
+      transport_->setRTS ((values & modemline_rts) != 0);
+    }
+    if (mask & modemline_dtr) {
+      transport_->setDTR ((values & modemline_dtr) != 0);
+    }
+    return;
+  }
+
+  int set = 0;
+  int clear = 0;
+  if (mask & modemline_rts) {
+    ((values & modemline_rts) ? set : clear) |= TIOCM_RTS;
+  }
+  if (mask & modemline_dtr) {
+    ((values & modemline_dtr) ? set : clear) |= TIOCM_DTR;
+  }
+
+  // Lines moving in the same direction take a single TIOCMBIS/TIOCMBIC,
+  // mixed changes read the current state and write it back with TIOCMSET.
+  if (set == 0 && clear == 0) {
+    return;
+  }
+  if (clear == 0) {
+    if (-1 == ioctl (fd_, TIOCMBIS, &set))
+    {
+      stringstream ss;
+      ss << "setModemLines failed on a call to ioctl(TIOCMBIS): " << errno << " " << strerror(errno);
+      throw(SerialException(ss.str().c_str()));
+    }
+  } else if (set == 0) {
+    if (-1 == ioctl (fd_, TIOCMBIC, &clear))
+    {
+      stringstream ss;
+      ss << "setModemLines failed on a call to ioctl(TIOCMBIC): " << errno << " " << strerror(errno);
+      throw(SerialException(ss.str().c_str()));
+    }
+  } else {
+    int status;
+    if (-1 == ioctl (fd_, TIOCMGET, &status))
+    {
+      stringstream ss;
+      ss << "setModemLines failed on a call to ioctl(TIOCMGET): " << errno << " " << strerror(errno);
+      throw(SerialException(ss.str().c_str()));
+    }
+    status = (status & ~clear) | set;
+    if (-1 == ioctl (fd_, TIOCMSET, &status))
+    {
+      stringstream ss;
+      ss << "setModemLines failed on a call to ioctl(TIOCMSET): " << errno << " " << strerror(errno);
+      throw(SerialException(ss.str().c_str()));
+    }
+  }
+}
+
+void
+Serial::SerialImpl::runLineSequence (const std::vector<ModemLineStep> &steps)
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException ("Serial::runLineSequence");
+  }
+
+  // Every step is scheduled relative to the start of the sequence, so time
+  // spent in the ioctls does not push back the following steps.
+  timespec deadline(DeadlineTimer::timespec_now ());
+  for (size_t i = 0; i < steps.size (); ++i) {
+    setModemLines (steps[i].mask, steps[i].values);
+    if (steps[i].hold_us == 0) {
+      continue;
+    }
+    timespec_add_ns (deadline, steps[i].hold_us * 1000ULL);
+    sleep_until (deadline);
+  }
+}
+
 bool
 Serial::SerialImpl::waitForChange ()
 {
+  if (transport_ != NULL) {
+    return is_open_ && transport_->waitForChange ();
+  }
 #ifndef TIOCMIWAIT
 
 while (is_open_ == true) {
@@ -967,6 +1723,9 @@ Serial::SerialImpl::getCTS ()
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::getCTS");
   }
+  if (transport_ != NULL) {
+    return transport_->getCTS ();
+  }
 
   int status;
 
@@ -988,6 +1747,9 @@ Serial::SerialImpl::getDSR ()
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::getDSR");
   }
+  if (transport_ != NULL) {
+    return transport_->getDSR ();
+  }
 
   int status;
 
@@ -1009,6 +1771,9 @@ Serial::SerialImpl::getRI ()
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::getRI");
   }
+  if (transport_ != NULL) {
+    return transport_->getRI ();
+  }
 
   int status;
 
@@ -1030,6 +1795,9 @@ Serial::SerialImpl::getCD ()
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::getCD");
   }
+  if (transport_ != NULL) {
+    return transport_->getCD ();
+  }
 
   int status;
 
@@ -1045,6 +1813,174 @@ Serial::SerialImpl::getCD ()
   }
 }
 
+Stats
+Serial::SerialImpl::getStats () const
+{
+  return stats::snapshot (stats_);
+}
+
+void
+Serial::SerialImpl::resetStats ()
+{
+  stats::reset (stats_);
+}
+
+void
+Serial::SerialImpl::enableFlightRecorder (size_t capacity)
+{
+  if (recorder_ != NULL && recorder_->capacity () == capacity) {
+    return;
+  }
+  FlightRecorder *recorder = new FlightRecorder (capacity);
+  delete recorder_;
+  recorder_ = recorder;
+}
+
+void
+Serial::SerialImpl::disableFlightRecorder ()
+{
+  delete recorder_;
+  recorder_ = NULL;
+}
+
+std::vector<RecordedChunk>
+Serial::SerialImpl::getFlightRecord () const
+{
+  return recorder_ != NULL ? recorder_->snapshot ()
+                            : std::vector<RecordedChunk> ();
+}
+
+void
+Serial::SerialImpl::setFlightRecordHandler (FlightRecordHandler *handler)
+{
+  record_handler_ = handler;
+}
+
+void
+Serial::SerialImpl::flightRecordError_ (const std::exception &error)
+{
+  FlightRecordHandler *handler = record_handler_;
+  if (handler != NULL) {
+    handler->onFlightRecord (recorder_->snapshot (), error);
+  }
+}
+
+ssize_t
+Serial::SerialImpl::readSome_ (uint8_t *buf, size_t size)
+{
+  if (transport_ != NULL) {
+    return static_cast<ssize_t> (transport_->read (buf, size));
+  }
+  return ::read (fd_, buf, size);
+}
+
+ssize_t
+Serial::SerialImpl::writeSome_ (const uint8_t *data, size_t length)
+{
+  if (transport_ != NULL) {
+    return static_cast<ssize_t> (transport_->write (data, length));
+  }
+  return ::write (fd_, data, length);
+}
+
+void
+Serial::SerialImpl::requirePort_ (const char *operation) const
+{
+  if (transport_ != NULL) {
+    stringstream ss;
+    ss << "Serial::" << operation << " is not supported by a transport";
+    THROW (IOException, ss.str ().c_str ());
+  }
+}
+
+LineCounters
+Serial::SerialImpl::getLineCounters (LineCounters &delta)
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException ("Serial::getLineCounters");
+  }
+  requirePort_ ("getLineCounters");
+  LineCounters counters = read_line_counters (fd_);
+  delta = counters.since (line_counters_);
+  line_counters_ = counters;
+  return counters;
+}
+
+void
+Serial::SerialImpl::startLineMonitor (LineMonitorHandler &handler,
+                                      uint32_t period_ms)
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException ("Serial::startLineMonitor");
+  }
+  requirePort_ ("startLineMonitor");
+  stopLineMonitor ();
+  // Take the first sample here, so an unsupported driver throws now.
+  monitor_counters_ = read_line_counters (fd_);
+  monitor_handler_ = &handler;
+  monitor_period_ms_ = period_ms;
+  monitor_running_ = true;
+  int result = pthread_create (&monitor_thread_, NULL,
+                               &SerialImpl::lineMonitorThread_, this);
+  if (result) {
+    monitor_running_ = false;
+    THROW (IOException, result);
+  }
+  monitor_started_ = true;
+}
+
+void
+Serial::SerialImpl::stopLineMonitor ()
+{
+  pthread_mutex_lock (&monitor_mutex_);
+  monitor_running_ = false;
+  pthread_cond_signal (&monitor_cond_);
+  pthread_mutex_unlock (&monitor_mutex_);
+  if (monitor_started_) {
+    pthread_join (monitor_thread_, NULL);
+    monitor_started_ = false;
+  }
+}
+
+void *
+Serial::SerialImpl::lineMonitorThread_ (void *arg)
+{
+  static_cast<SerialImpl *> (arg)->lineMonitor_ ();
+  return NULL;
+}
+
+void
+Serial::SerialImpl::lineMonitor_ ()
+{
+  // Samples are scheduled on the monotonic clock, whatever the clock of
+  // serial::setClock.
+  uint64_t period_ns = monitor_period_ms_ * 1000000ULL;
+  uint64_t deadline_ns = serial::stats::now_ns () + period_ns;
+  pthread_mutex_lock (&monitor_mutex_);
+  while (monitor_running_) {
+    if (serial::condition::wait_until (monitor_cond_, monitor_mutex_,
+                                       deadline_ns) != ETIMEDOUT) {
+      continue; // Stopped, or woken spuriously
+    }
+    pthread_mutex_unlock (&monitor_mutex_);
+    try {
+      LineCounters counters = read_line_counters (fd_);
+      LineCounters delta = counters.since (monitor_counters_);
+      monitor_counters_ = counters;
+      if (delta.overrun > 0 || delta.buf_overrun > 0) {
+        monitor_handler_->onOverrun (counters, delta);
+      }
+    } catch (const std::exception &) {
+      // The device went away or stopped answering, give up sampling.
+      pthread_mutex_lock (&monitor_mutex_);
+      break;
+    }
+    deadline_ns += period_ns;
+    pthread_mutex_lock (&monitor_mutex_);
+  }
+  pthread_mutex_unlock (&monitor_mutex_);
+}
+
 void
 Serial::SerialImpl::readLock ()
 {
@@ -1064,21 +2000,45 @@ Serial::SerialImpl::readUnlock ()
 }
 
 void
-Serial::SerialImpl::writeLock ()
+Serial::SerialImpl::writeLock (priority_t priority)
 {
+  // Writers sleep until the lock is free and no writer of a higher lane
+  // waits for it.
   int result = pthread_mutex_lock(&this->write_mutex);
   if (result) {
     THROW (IOException, result);
   }
+  ++lane_waiting_[priority];
+  while (write_held_ || higherLaneWaiting_ (priority)) {
+    pthread_cond_wait(&this->write_cond_, &this->write_mutex);
+  }
+  --lane_waiting_[priority];
+  write_held_ = true;
+  pthread_mutex_unlock(&this->write_mutex);
+}
+
+bool
+Serial::SerialImpl::higherLaneWaiting_ (priority_t priority) const
+{
+  for (int lane = priority_high; lane < priority; ++lane) {
+    if (lane_waiting_[lane] > 0) {
+      return true;
+    }
+  }
+  return false;
 }
 
 void
 Serial::SerialImpl::writeUnlock ()
 {
-  int result = pthread_mutex_unlock(&this->write_mutex);
+  int result = pthread_mutex_lock(&this->write_mutex);
   if (result) {
     THROW (IOException, result);
   }
+  write_held_ = false;
+  // Every lane waits on the one condition, the highest waiting goes next.
+  pthread_cond_broadcast(&this->write_cond_);
+  pthread_mutex_unlock(&this->write_mutex);
 }
 
 #endif // !defined(_WIN32)
@@ -5,6 +5,7 @@
 #include <sstream>
 
 #include "serial/impl/win.h"
+#include "serial/impl/stats.h"
 
 using std::string;
 using std::wstring;
@@ -19,6 +20,73 @@ using serial::flowcontrol_t;
 using serial::SerialException;
 using serial::PortNotOpenedException;
 using serial::IOException;
+using serial::Stats;
+using serial::LineCounters;
+using serial::LineMonitorHandler;
+using serial::DrainHandler;
+using serial::WriteRate;
+using serial::FlightRecorder;
+using serial::FlightRecordHandler;
+using serial::RecordedChunk;
+using serial::TimestampedChunk;
+using serial::Deadline;
+
+// Sleeps until deadline_ns on the clock of stats::now_ns, in whole
+// milliseconds and spinning out the remainder.
+static void
+sleep_until_ns (uint64_t deadline_ns)
+{
+  while (true) {
+    uint64_t now_ns = serial::stats::now_ns ();
+    if (now_ns >= deadline_ns) {
+      return;
+    }
+    DWORD remaining_ms = static_cast<DWORD> ((deadline_ns - now_ns) / 1000000);
+    Sleep (remaining_ms > 1 ? remaining_ms - 1 : 0);
+  }
+}
+
+// COMMTIMEOUTS are in milliseconds, round up so a timeout never expires
+// early.  Timeout::max() stays MAXDWORD.
+static DWORD
+timeout_ms (uint32_t value, uint32_t unit_ns)
+{
+  if (value == serial::Timeout::max ()) {
+    return MAXDWORD;
+  }
+  uint64_t ms = (static_cast<uint64_t> (value) * unit_ns + 999999) / 1000000;
+  return ms >= MAXDWORD ? MAXDWORD : static_cast<DWORD> (ms);
+}
+
+static COMMTIMEOUTS
+comm_timeouts (const serial::Timeout &timeout)
+{
+  COMMTIMEOUTS timeouts = {0};
+  timeouts.ReadIntervalTimeout =
+    timeout_ms (timeout.inter_byte_timeout, timeout.unit_ns);
+  timeouts.ReadTotalTimeoutConstant =
+    timeout_ms (timeout.read_timeout_constant, timeout.unit_ns);
+  timeouts.ReadTotalTimeoutMultiplier =
+    timeout_ms (timeout.read_timeout_multiplier, timeout.unit_ns);
+  timeouts.WriteTotalTimeoutConstant =
+    timeout_ms (timeout.write_timeout_constant, timeout.unit_ns);
+  timeouts.WriteTotalTimeoutMultiplier =
+    timeout_ms (timeout.write_timeout_multiplier, timeout.unit_ns);
+  return timeouts;
+}
+
+// Milliseconds until deadline_ns, rounded up.  Zero once it passed, and
+// at most MAXDWORD - 1 which has no special meaning in COMMTIMEOUTS.
+static DWORD
+deadline_ms (uint64_t deadline_ns)
+{
+  uint64_t now_ns = serial::stats::now_ns ();
+  if (deadline_ns <= now_ns) {
+    return 0;
+  }
+  uint64_t ms = (deadline_ns - now_ns + 999999) / 1000000;
+  return ms >= MAXDWORD ? MAXDWORD - 1 : static_cast<DWORD> (ms);
+}
 
 inline wstring
 _prefix_port_if_needed(const wstring &input)
@@ -36,20 +104,33 @@ Serial::SerialImpl::SerialImpl (const string &port, unsigned long baudrate,
                                 parity_t parity, stopbits_t stopbits,
                                 flowcontrol_t flowcontrol)
   : port_ (port.begin(), port.end()), fd_ (INVALID_HANDLE_VALUE), is_open_ (false),
-    baudrate_ (baudrate), parity_ (parity),
-    bytesize_ (bytesize), stopbits_ (stopbits), flowcontrol_ (flowcontrol)
+    baudrate_ (baudrate), byte_time_ns_ (0), parity_ (parity),
+    bytesize_ (bytesize), stopbits_ (stopbits), flowcontrol_ (flowcontrol),
+    bulk_latency_us_ (10000), recorder_ (NULL), record_handler_ (NULL)
 {
+  lane_waiting_[priority_high] = 0;
+  lane_waiting_[priority_normal] = 0;
+  lane_waiting_[priority_bulk] = 0;
+  write_held_ = false;
   if (port_.empty () == false)
     open ();
   read_mutex = CreateMutex(NULL, false, NULL);
-  write_mutex = CreateMutex(NULL, false, NULL);
+  InitializeCriticalSection(&write_mutex);
+  InitializeConditionVariable(&write_cond_);
+}
+
+Serial::SerialImpl::SerialImpl (Transport &)
+{
+  // Nothing was acquired, so throwing leaves nothing to release.
+  THROW (IOException, "transports are not supported on Windows yet");
 }
 
 Serial::SerialImpl::~SerialImpl ()
 {
   this->close();
+  delete recorder_;
   CloseHandle(read_mutex);
-  CloseHandle(write_mutex);
+  DeleteCriticalSection(&write_mutex);
 }
 
 void
@@ -263,15 +344,16 @@ Serial::SerialImpl::reconfigurePort ()
   }
 
   // Setup timeouts
-  COMMTIMEOUTS timeouts = {0};
-  timeouts.ReadIntervalTimeout = timeout_.inter_byte_timeout;
-  timeouts.ReadTotalTimeoutConstant = timeout_.read_timeout_constant;
-  timeouts.ReadTotalTimeoutMultiplier = timeout_.read_timeout_multiplier;
-  timeouts.WriteTotalTimeoutConstant = timeout_.write_timeout_constant;
-  timeouts.WriteTotalTimeoutMultiplier = timeout_.write_timeout_multiplier;
+  COMMTIMEOUTS timeouts = comm_timeouts (timeout_);
   if (!SetCommTimeouts(fd_, &timeouts)) {
     THROW (IOException, "Error setting timeouts.");
   }
+
+  // A pace given as a fraction of the line rate follows the new settings.
+  uint64_t bits = 1 + bytesize_ + (parity_ == parity_none ? 0 : 1)
+                  + (stopbits_ == stopbits_one ? 1 : 2);
+  byte_time_ns_ = static_cast<uint32_t> (bits * 1000000000ULL / baudrate_);
+  pacer_.configure (write_rate_, byte_time_ns_);
 }
 
 void
@@ -299,6 +381,13 @@ Serial::SerialImpl::isOpen () const
   return is_open_;
 }
 
+int
+Serial::SerialImpl::getFileDescriptor () const
+{
+  // A HANDLE is not a descriptor poll or select would take.
+  return -1;
+}
+
 size_t
 Serial::SerialImpl::available ()
 {
@@ -315,7 +404,7 @@ Serial::SerialImpl::available ()
 }
 
 bool
-Serial::SerialImpl::waitReadable (uint32_t /*timeout*/)
+Serial::SerialImpl::waitReadable (uint64_t /*timeout_ns*/)
 {
   THROW (IOException, "waitReadable is not implemented on Windows.");
   return false;
@@ -329,32 +418,206 @@ Serial::SerialImpl::waitByteTimes (size_t /*count*/)
 
 size_t
 Serial::SerialImpl::read (uint8_t *buf, size_t size)
+{
+  if (recorder_ == NULL) {
+    return readPort_ (buf, size);
+  }
+  try {
+    size_t bytes_read = readPort_ (buf, size);
+    recorder_->record (false, buf, bytes_read);
+    return bytes_read;
+  } catch (const std::exception &error) {
+    flightRecordError_ (error);
+    throw;
+  }
+}
+
+size_t
+Serial::SerialImpl::readPort_ (uint8_t *buf, size_t size)
 {
   if (!is_open_) {
     throw PortNotOpenedException ("Serial::read");
   }
+  SERIAL_STATS (uint64_t start_ns = stats::now_ns ());
+  SERIAL_STATS (stats::add (stats_.read_calls, 1));
+  SERIAL_STATS (stats::add (stats_.syscalls, 1));
   DWORD bytes_read;
   if (!ReadFile(fd_, buf, static_cast<DWORD>(size), &bytes_read, NULL)) {
     stringstream ss;
     ss << "Error while reading from the serial port: " << GetLastError();
     THROW (IOException, ss.str().c_str());
   }
+  // ReadFile waits for the whole read, so the time until the first byte
+  // can only be approximated by the time of the call.
+#if !defined(SERIAL_DISABLE_STATS)
+  if (bytes_read > 0) {
+    stats::record (stats_.read_wait, start_ns);
+  }
+  if (bytes_read < size) {
+    stats::add (stats_.timeouts, 1);
+  }
+  stats::add (stats_.bytes_read, bytes_read);
+#endif
   return (size_t) (bytes_read);
 }
 
+// ReadFile waits inside the driver, so there is no wake-up to time: the
+// whole read is one chunk, timed when ReadFile returns.
+size_t
+Serial::SerialImpl::readTimestamped (uint8_t *buf, size_t size,
+                                     std::vector<TimestampedChunk> *chunks)
+{
+  size_t bytes_read = read (buf, size);
+  timestampChunk_ (bytes_read, chunks);
+  return bytes_read;
+}
+
+size_t
+Serial::SerialImpl::readTimestamped (uint8_t *buf, size_t size,
+                                     uint64_t deadline_ns,
+                                     std::vector<TimestampedChunk> *chunks)
+{
+  size_t bytes_read = read (buf, size, deadline_ns);
+  timestampChunk_ (bytes_read, chunks);
+  return bytes_read;
+}
+
+void
+Serial::SerialImpl::timestampChunk_ (size_t bytes_read,
+                                     std::vector<TimestampedChunk> *chunks)
+{
+  if (chunks == NULL || bytes_read == 0) {
+    return;
+  }
+  TimestampedChunk chunk;
+  chunk.size = bytes_read;
+  chunk.timestamp_ns = Deadline::now ();
+  uint64_t arrival_ns = static_cast<uint64_t> (byte_time_ns_) * bytes_read;
+  chunk.first_byte_ns = arrival_ns < chunk.timestamp_ns
+                        ? chunk.timestamp_ns - arrival_ns : 0;
+  chunks->push_back (chunk);
+}
+
+// COMMTIMEOUTS belong to the device, so a deadline is applied by setting
+// timeouts for the one call and restoring those of timeout_ after it.
+size_t
+Serial::SerialImpl::read (uint8_t *buf, size_t size, uint64_t deadline_ns)
+{
+  if (!is_open_) {
+    throw PortNotOpenedException ("Serial::read");
+  }
+  COMMTIMEOUTS timeouts = comm_timeouts (timeout_);
+  timeouts.ReadTotalTimeoutMultiplier = 0;
+  timeouts.ReadTotalTimeoutConstant = deadline_ms (deadline_ns);
+  // Once the deadline passed, return what was already received.
+  timeouts.ReadIntervalTimeout =
+    timeouts.ReadTotalTimeoutConstant == 0 ? MAXDWORD : 0;
+  if (!SetCommTimeouts(fd_, &timeouts)) {
+    THROW (IOException, "Error setting timeouts.");
+  }
+  size_t bytes_read;
+  try {
+    bytes_read = read (buf, size);
+  } catch (...) {
+    timeouts = comm_timeouts (timeout_);
+    SetCommTimeouts(fd_, &timeouts);
+    throw;
+  }
+  timeouts = comm_timeouts (timeout_);
+  if (!SetCommTimeouts(fd_, &timeouts)) {
+    THROW (IOException, "Error setting timeouts.");
+  }
+  return bytes_read;
+}
+
+size_t
+Serial::SerialImpl::write (const uint8_t *data, size_t length,
+                           uint64_t deadline_ns)
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException ("Serial::write");
+  }
+  COMMTIMEOUTS timeouts = comm_timeouts (timeout_);
+  timeouts.WriteTotalTimeoutMultiplier = 0;
+  // A constant of zero would wait forever, one millisecond is the least.
+  DWORD write_ms = deadline_ms (deadline_ns);
+  timeouts.WriteTotalTimeoutConstant = write_ms > 0 ? write_ms : 1;
+  if (!SetCommTimeouts(fd_, &timeouts)) {
+    THROW (IOException, "Error setting timeouts.");
+  }
+  size_t bytes_written;
+  try {
+    bytes_written = write (data, length);
+  } catch (...) {
+    timeouts = comm_timeouts (timeout_);
+    SetCommTimeouts(fd_, &timeouts);
+    throw;
+  }
+  timeouts = comm_timeouts (timeout_);
+  if (!SetCommTimeouts(fd_, &timeouts)) {
+    THROW (IOException, "Error setting timeouts.");
+  }
+  return bytes_written;
+}
+
 size_t
 Serial::SerialImpl::write (const uint8_t *data, size_t length)
+{
+  if (recorder_ == NULL) {
+    return writePort_ (data, length);
+  }
+  try {
+    size_t bytes_written = writePort_ (data, length);
+    recorder_->record (true, data, bytes_written);
+    return bytes_written;
+  } catch (const std::exception &error) {
+    flightRecordError_ (error);
+    throw;
+  }
+}
+
+size_t
+Serial::SerialImpl::writePort_ (const uint8_t *data, size_t length)
 {
   if (is_open_ == false) {
     throw PortNotOpenedException ("Serial::write");
   }
-  DWORD bytes_written;
-  if (!WriteFile(fd_, data, static_cast<DWORD>(length), &bytes_written, NULL)) {
-    stringstream ss;
-    ss << "Error while writing to the serial port: " << GetLastError();
-    THROW (IOException, ss.str().c_str());
+  SERIAL_STATS (uint64_t start_ns = stats::now_ns ());
+  SERIAL_STATS (stats::add (stats_.write_calls, 1));
+  size_t bytes_written = 0;
+  do {
+    // Without pacing the whole buffer goes in a single WriteFile.
+    DWORD chunk = static_cast<DWORD>(length - bytes_written);
+    uint64_t release_ns = 0;
+    if (pacer_.enabled ()) {
+      chunk = static_cast<DWORD>(pacer_.chunk (chunk));
+      release_ns = pacer_.readyAt (chunk, stats::now_ns ());
+      sleep_until_ns (release_ns);
+    }
+    SERIAL_STATS (stats::add (stats_.syscalls, 1));
+    DWORD bytes_written_now;
+    if (!WriteFile(fd_, data + bytes_written, chunk, &bytes_written_now, NULL)) {
+      stringstream ss;
+      ss << "Error while writing to the serial port: " << GetLastError();
+      THROW (IOException, ss.str().c_str());
+    }
+    if (pacer_.enabled ()) {
+      pacer_.sent (bytes_written_now, release_ns);
+    }
+    bytes_written += bytes_written_now;
+    if (bytes_written_now < chunk) {
+      break;  // Timed out
+    }
+  } while (bytes_written < length);
+#if !defined(SERIAL_DISABLE_STATS)
+  if (bytes_written < length) {
+    stats::add (stats_.partial_writes, 1);
+    stats::add (stats_.timeouts, 1);
   }
-  return (size_t) (bytes_written);
+  stats::add (stats_.bytes_written, bytes_written);
+  stats::record (stats_.write_completion, start_ns);
+#endif
+  return bytes_written;
 }
 
 void
@@ -459,6 +722,56 @@ Serial::SerialImpl::getFlowcontrol () const
   return flowcontrol_;
 }
 
+void
+Serial::SerialImpl::setWriteRate (const WriteRate &rate)
+{
+  write_rate_ = rate;
+  if (is_open_) {
+    reconfigurePort ();
+  }
+}
+
+serial::WriteRate
+Serial::SerialImpl::getWriteRate () const
+{
+  return write_rate_;
+}
+
+void
+Serial::SerialImpl::setBulkLatency (uint32_t microseconds)
+{
+  bulk_latency_us_ = microseconds;
+}
+
+uint32_t
+Serial::SerialImpl::getBulkLatency () const
+{
+  return bulk_latency_us_;
+}
+
+size_t
+Serial::SerialImpl::bulkChunkSize () const
+{
+  // The chunk being written and the one left queued take the latency.
+  uint64_t chunk_time_ns = static_cast<uint64_t> (bulk_latency_us_) * 500;
+  if (byte_time_ns_ == 0 || chunk_time_ns <= byte_time_ns_) {
+    return 1;
+  }
+  return static_cast<size_t> (chunk_time_ns / byte_time_ns_);
+}
+
+void
+Serial::SerialImpl::waitOutputBelow (size_t bytes)
+{
+  while (is_open_) {
+    COMSTAT cs;
+    if (!ClearCommError(fd_, NULL, &cs) || cs.cbOutQue <= bytes) {
+      return;
+    }
+    Sleep(1);
+  }
+}
+
 void
 Serial::SerialImpl::flush ()
 {
@@ -486,6 +799,45 @@ Serial::SerialImpl::flushOutput ()
   PurgeComm(fd_, PURGE_TXCLEAR);
 }
 
+size_t
+Serial::SerialImpl::outputQueueBytes ()
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException("Serial::outputQueueBytes");
+  }
+  COMSTAT cs;
+  if (!ClearCommError(fd_, NULL, &cs)) {
+    stringstream ss;
+    ss << "Error while checking status of the serial port: " << GetLastError();
+    THROW (IOException, ss.str().c_str());
+  }
+  return static_cast<size_t>(cs.cbOutQue);
+}
+
+bool
+Serial::SerialImpl::waitDrained (uint32_t timeout)
+{
+  DWORD start = GetTickCount();
+  while (outputQueueBytes() != 0) {
+    if (GetTickCount() - start >= timeout) {
+      return false;
+    }
+    Sleep(1);
+  }
+  return true;
+}
+
+void
+Serial::SerialImpl::onDrained (DrainHandler &/*handler*/)
+{
+  THROW (IOException, "onDrained is not implemented on Windows.");
+}
+
+void
+Serial::SerialImpl::cancelDrained ()
+{
+}
+
 void
 Serial::SerialImpl::sendBreak (int /*duration*/)
 {
@@ -531,6 +883,48 @@ Serial::SerialImpl::setDTR (bool level)
   }
 }
 
+void
+Serial::SerialImpl::setModemLines (uint32_t mask, uint32_t values)
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException ("Serial::setModemLines");
+  }
+  // There is no way to change several lines in one call on Windows.
+  if (mask & modemline_rts) {
+    EscapeCommFunction (fd_, (values & modemline_rts) ? SETRTS : CLRRTS);
+  }
+  if (mask & modemline_dtr) {
+    EscapeCommFunction (fd_, (values & modemline_dtr) ? SETDTR : CLRDTR);
+  }
+}
+
+void
+Serial::SerialImpl::runLineSequence (const std::vector<ModemLineStep> &steps)
+{
+  if (is_open_ == false) {
+    throw PortNotOpenedException ("Serial::runLineSequence");
+  }
+  LARGE_INTEGER frequency, start, now;
+  QueryPerformanceFrequency (&frequency);
+  QueryPerformanceCounter (&start);
+  uint64_t deadline_us = 0;
+  for (size_t i = 0; i < steps.size (); ++i) {
+    setModemLines (steps[i].mask, steps[i].values);
+    deadline_us += steps[i].hold_us;
+    // Sleep in whole milliseconds and spin out the remainder.
+    while (true) {
+      QueryPerformanceCounter (&now);
+      uint64_t elapsed_us = static_cast<uint64_t> (now.QuadPart - start.QuadPart)
+                            * 1000000 / frequency.QuadPart;
+      if (elapsed_us >= deadline_us) {
+        break;
+      }
+      DWORD remaining_ms = static_cast<DWORD> ((deadline_us - elapsed_us) / 1000);
+      Sleep (remaining_ms > 1 ? remaining_ms - 1 : 0);
+    }
+  }
+}
+
 bool
 Serial::SerialImpl::waitForChange ()
 {
@@ -610,6 +1004,77 @@ Serial::SerialImpl::getCD()
   return (MS_RLSD_ON & dwModemStatus) != 0;
 }
 
+Stats
+Serial::SerialImpl::getStats () const
+{
+  return stats::snapshot (stats_);
+}
+
+void
+Serial::SerialImpl::resetStats ()
+{
+  stats::reset (stats_);
+}
+
+void
+Serial::SerialImpl::enableFlightRecorder (size_t capacity)
+{
+  if (recorder_ != NULL && recorder_->capacity () == capacity) {
+    return;
+  }
+  FlightRecorder *recorder = new FlightRecorder (capacity);
+  delete recorder_;
+  recorder_ = recorder;
+}
+
+void
+Serial::SerialImpl::disableFlightRecorder ()
+{
+  delete recorder_;
+  recorder_ = NULL;
+}
+
+std::vector<RecordedChunk>
+Serial::SerialImpl::getFlightRecord () const
+{
+  return recorder_ != NULL ? recorder_->snapshot ()
+                            : std::vector<RecordedChunk> ();
+}
+
+void
+Serial::SerialImpl::setFlightRecordHandler (FlightRecordHandler *handler)
+{
+  record_handler_ = handler;
+}
+
+void
+Serial::SerialImpl::flightRecordError_ (const std::exception &error)
+{
+  FlightRecordHandler *handler = record_handler_;
+  if (handler != NULL) {
+    handler->onFlightRecord (recorder_->snapshot (), error);
+  }
+}
+
+serial::LineCounters
+Serial::SerialImpl::getLineCounters (LineCounters &/*delta*/)
+{
+  THROW (IOException, "getLineCounters is not implemented on Windows.");
+  return LineCounters ();
+}
+
+void
+Serial::SerialImpl::startLineMonitor (LineMonitorHandler &/*handler*/,
+                                      uint32_t /*period_ms*/)
+{
+  THROW (IOException, "startLineMonitor is not implemented on Windows.");
+}
+
+void
+Serial::SerialImpl::stopLineMonitor ()
+{
+}
+
 void
 Serial::SerialImpl::readLock()
 {
@@ -627,19 +1092,39 @@ Serial::SerialImpl::readUnlock()
 }
 
 void
-Serial::SerialImpl::writeLock()
+Serial::SerialImpl::writeLock(priority_t priority)
+{
+  // Writers sleep until the lock is free and no writer of a higher lane
+  // waits for it.
+  EnterCriticalSection(&write_mutex);
+  ++lane_waiting_[priority];
+  while (write_held_ || higherLaneWaiting_ (priority)) {
+    SleepConditionVariableCS(&write_cond_, &write_mutex, INFINITE);
+  }
+  --lane_waiting_[priority];
+  write_held_ = true;
+  LeaveCriticalSection(&write_mutex);
+}
+
+bool
+Serial::SerialImpl::higherLaneWaiting_ (priority_t priority) const
 {
-  if (WaitForSingleObject(write_mutex, INFINITE) != WAIT_OBJECT_0) {
-    THROW (IOException, "Error claiming write mutex.");
+  for (int lane = priority_high; lane < priority; ++lane) {
+    if (lane_waiting_[lane] > 0) {
+      return true;
+    }
   }
+  return false;
 }
 
 void
 Serial::SerialImpl::writeUnlock()
 {
-  if (!ReleaseMutex(write_mutex)) {
-    THROW (IOException, "Error releasing write mutex.");
-  }
+  EnterCriticalSection(&write_mutex);
+  write_held_ = false;
+  // Every lane waits on the one condition, the highest waiting goes next.
+  WakeAllConditionVariable(&write_cond_);
+  LeaveCriticalSection(&write_mutex);
 }
 
 #endif // #if defined(_WIN32)
@@ -0,0 +1,264 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+
+#include "serial/loopback.h"
+#include "serial/impl/condition.h"
+#include "serial/impl/stats.h"
+
+using std::invalid_argument;
+using std::min;
+
+using serial::LoopbackPair;
+using serial::Transport;
+
+class LoopbackPair::End : public Transport {
+public:
+  explicit End (LoopbackPair &pair)
+    : pair_ (pair), peer_ (NULL), rts_ (false), dtr_ (false),
+      line_changes_ (0)
+  {}
+
+  virtual size_t
+  available ()
+  {
+    pthread_mutex_lock (&pair_.mutex_);
+    size_t count = input_.size ();
+    pthread_mutex_unlock (&pair_.mutex_);
+    return count;
+  }
+
+  virtual bool
+  waitReadable (uint64_t timeout_ns)
+  {
+    uint64_t deadline_ns = deadline (timeout_ns);
+    pthread_mutex_lock (&pair_.mutex_);
+    bool ready = true;
+    while (input_.empty () && pair_.connected_) {
+      if (!pair_.wait_ (deadline_ns)) {
+        ready = false;
+        break;
+      }
+    }
+    pthread_mutex_unlock (&pair_.mutex_);
+    return ready;
+  }
+
+  virtual bool
+  waitWritable (uint64_t timeout_ns)
+  {
+    uint64_t deadline_ns = deadline (timeout_ns);
+    pthread_mutex_lock (&pair_.mutex_);
+    bool ready = true;
+    while (peer_->input_.size () >= pair_.capacity_ && pair_.connected_) {
+      if (!pair_.wait_ (deadline_ns)) {
+        ready = false;
+        break;
+      }
+    }
+    pthread_mutex_unlock (&pair_.mutex_);
+    return ready;
+  }
+
+  virtual size_t
+  read (uint8_t *buffer, size_t size)
+  {
+    pthread_mutex_lock (&pair_.mutex_);
+    size_t count = min (size, input_.size ());
+    std::copy (input_.begin (), input_.begin () + count, buffer);
+    input_.erase (input_.begin (), input_.begin () + count);
+    if (count > 0) {
+      // The peer may be waiting for room.
+      pthread_cond_broadcast (&pair_.cond_);
+    }
+    pthread_mutex_unlock (&pair_.mutex_);
+    return count;
+  }
+
+  virtual size_t
+  write (const uint8_t *data, size_t size)
+  {
+    pthread_mutex_lock (&pair_.mutex_);
+    size_t count = 0;
+    if (pair_.connected_) {
+      std::deque<uint8_t> &input = peer_->input_;
+      count = min (size, pair_.capacity_ - min (pair_.capacity_,
+                                                input.size ()));
+      input.insert (input.end (), data, data + count);
+      if (count > 0) {
+        pthread_cond_broadcast (&pair_.cond_);
+      }
+    }
+    pthread_mutex_unlock (&pair_.mutex_);
+    return count;
+  }
+
+  virtual void
+  flushInput ()
+  {
+    pthread_mutex_lock (&pair_.mutex_);
+    input_.clear ();
+    pthread_cond_broadcast (&pair_.cond_);
+    pthread_mutex_unlock (&pair_.mutex_);
+  }
+
+  virtual void
+  flushOutput ()
+  {
+    // Writes go straight to the peer, nothing waits to be sent.
+  }
+
+  virtual void
+  setRTS (bool level)
+  {
+    setLine (rts_, level);
+  }
+
+  virtual void
+  setDTR (bool level)
+  {
+    setLine (dtr_, level);
+  }
+
+  virtual bool
+  waitForChange ()
+  {
+    pthread_mutex_lock (&pair_.mutex_);
+    uint64_t changes = line_changes_;
+    while (line_changes_ == changes && pair_.connected_) {
+      pthread_cond_wait (&pair_.cond_, &pair_.mutex_);
+    }
+    bool changed = line_changes_ != changes;
+    pthread_mutex_unlock (&pair_.mutex_);
+    return changed;
+  }
+
+  virtual bool
+  getCTS ()
+  {
+    return peerLine (peer_->rts_);
+  }
+
+  virtual bool
+  getDSR ()
+  {
+    return peerLine (peer_->dtr_);
+  }
+
+  virtual bool
+  getRI ()
+  {
+    return false;
+  }
+
+  virtual bool
+  getCD ()
+  {
+    return peerLine (peer_->dtr_);
+  }
+
+  LoopbackPair &pair_;
+  End *peer_;
+  std::deque<uint8_t> input_; // Written by the peer, guarded by the mutex
+  bool rts_;
+  bool dtr_;
+  uint64_t line_changes_;     // Changes of the lines the peer drives
+
+private:
+  static uint64_t
+  deadline (uint64_t timeout_ns)
+  {
+    uint64_t now_ns = serial::stats::now_ns ();
+    return timeout_ns > std::numeric_limits<uint64_t>::max () - now_ns
+           ? std::numeric_limits<uint64_t>::max () : now_ns + timeout_ns;
+  }
+
+  void
+  setLine (bool &line, bool level)
+  {
+    pthread_mutex_lock (&pair_.mutex_);
+    if (line != level) {
+      line = level;
+      peer_->line_changes_ += 1;
+      pthread_cond_broadcast (&pair_.cond_);
+    }
+    pthread_mutex_unlock (&pair_.mutex_);
+  }
+
+  bool
+  peerLine (const bool &line)
+  {
+    pthread_mutex_lock (&pair_.mutex_);
+    bool level = line && pair_.connected_;
+    pthread_mutex_unlock (&pair_.mutex_);
+    return level;
+  }
+};
+
+LoopbackPair::LoopbackPair (size_t capacity)
+  : first_ (NULL), second_ (NULL), capacity_ (capacity), connected_ (true)
+{
+  if (capacity == 0) {
+    throw invalid_argument ("the capacity of a loopback must be at least 1");
+  }
+  pthread_mutex_init (&mutex_, NULL);
+  serial::condition::init (cond_);
+  first_ = new End (*this);
+  second_ = new End (*this);
+  first_->peer_ = second_;
+  second_->peer_ = first_;
+}
+
+LoopbackPair::~LoopbackPair ()
+{
+  delete second_;
+  delete first_;
+  pthread_cond_destroy (&cond_);
+  pthread_mutex_destroy (&mutex_);
+}
+
+Transport &
+LoopbackPair::first ()
+{
+  return *first_;
+}
+
+Transport &
+LoopbackPair::second ()
+{
+  return *second_;
+}
+
+void
+LoopbackPair::hangup ()
+{
+  pthread_mutex_lock (&mutex_);
+  connected_ = false;
+  pthread_cond_broadcast (&cond_);
+  pthread_mutex_unlock (&mutex_);
+}
+
+bool
+LoopbackPair::isConnected () const
+{
+  pthread_mutex_lock (&mutex_);
+  bool connected = connected_;
+  pthread_mutex_unlock (&mutex_);
+  return connected;
+}
+
+bool
+LoopbackPair::wait_ (uint64_t deadline_ns)
+{
+  if (deadline_ns <= serial::stats::now_ns ()) {
+    return false;
+  }
+  serial::condition::wait_until (cond_, mutex_, deadline_ns);
+  return true;
+}
+
+#endif // !defined(_WIN32)
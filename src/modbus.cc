@@ -0,0 +1,432 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+#include <pthread.h>
+
+#include "serial/modbus.h"
+#include "serial/crc.h"
+
+using std::invalid_argument;
+using std::min;
+using std::vector;
+using std::string;
+
+using serial::Deadline;
+using serial::Serial;
+using serial::modbus::RtuMaster;
+using serial::modbus::RtuScheduler;
+using serial::modbus::Transaction;
+using serial::modbus::ModbusException;
+
+namespace {
+
+// Largest RTU frame: address, 253 byte PDU and CRC.
+const size_t max_adu_size = 256;
+
+inline void
+put_uint16 (vector<uint8_t> &buffer, uint16_t value)
+{
+  buffer.push_back (static_cast<uint8_t> (value >> 8));
+  buffer.push_back (static_cast<uint8_t> (value & 0xFF));
+}
+
+inline uint16_t
+get_uint16 (const uint8_t *data)
+{
+  return static_cast<uint16_t> ((data[0] << 8) | data[1]);
+}
+
+// Returns the length of a response frame from its first bytes, or 0 if
+// that cannot be determined (yet).
+size_t
+expected_frame_length (const vector<uint8_t> &frame)
+{
+  if (frame.size () < 2) {
+    return 0;
+  }
+  uint8_t function = frame[1];
+  if (function & 0x80) {
+    return 5; // address, function, exception code, CRC
+  }
+  switch (function) {
+  case serial::modbus::read_coils:
+  case serial::modbus::read_discrete_inputs:
+  case serial::modbus::read_holding_registers:
+  case serial::modbus::read_input_registers:
+    if (frame.size () < 3) {
+      return 0;
+    }
+    return 5 + frame[2]; // address, function, byte count, data, CRC
+  case serial::modbus::write_single_coil:
+  case serial::modbus::write_single_register:
+  case serial::modbus::write_multiple_coils:
+  case serial::modbus::write_multiple_registers:
+    return 8; // address, function, address, value or count, CRC
+  default:
+    return 0; // Unknown function, rely on the silent interval
+  }
+}
+
+struct WorkerArgs {
+  RtuMaster *master;
+  vector<Transaction*> transactions;
+};
+
+void *
+scheduler_worker (void *arg)
+{
+  WorkerArgs *args = static_cast<WorkerArgs*> (arg);
+  for (size_t i = 0; i < args->transactions.size (); ++i) {
+    Transaction &t = *args->transactions[i];
+    try {
+      args->master->transact (t.unit, t.request, t.response);
+      t.ok = true;
+      t.error.clear ();
+    } catch (const std::exception &e) {
+      t.ok = false;
+      t.error = e.what ();
+    }
+  }
+  return NULL;
+}
+
+} // namespace
+
+uint16_t
+serial::modbus::crc16 (const uint8_t *data, size_t length)
+{
+  return serial::crc::crc16_modbus (data, length);
+}
+
+RtuMaster::RtuMaster (Serial &port, uint32_t response_timeout)
+  : port_ (port), response_timeout_ (response_timeout),
+    t15_chars_ (2), t35_chars_ (4), gap_pending_ (true)
+{
+  adu_.reserve (max_adu_size);
+}
+
+RtuMaster::~RtuMaster ()
+{
+}
+
+void
+RtuMaster::setResponseTimeout (uint32_t response_timeout)
+{
+  response_timeout_ = response_timeout;
+}
+
+uint32_t
+RtuMaster::getResponseTimeout () const
+{
+  return response_timeout_;
+}
+
+void
+RtuMaster::updateFrameTiming_ ()
+{
+  uint32_t baudrate = port_.getBaudrate ();
+  if (baudrate <= 19200) {
+    // 1.5 and 3.5 character times, rounded up to whole characters.
+    t15_chars_ = 2;
+    t35_chars_ = 4;
+    return;
+  }
+  // Above 19200 baud the specification fixes t1.5 at 750us and t3.5 at
+  // 1750us, convert those into character times at the current settings.
+  uint32_t char_bits = 1 + port_.getBytesize ();
+  char_bits += (port_.getParity () == parity_none) ? 0 : 1;
+  char_bits += (port_.getStopbits () == stopbits_one) ? 1 : 2;
+  uint64_t char_ns = 1000000000ULL * char_bits / baudrate;
+  t15_chars_ = static_cast<uint32_t> ((750000 + char_ns - 1) / char_ns);
+  t35_chars_ = static_cast<uint32_t> ((1750000 + char_ns - 1) / char_ns);
+}
+
+void
+RtuMaster::receiveFrame_ (vector<uint8_t> &frame)
+{
+  uint8_t buffer[max_adu_size];
+  frame.clear ();
+
+  // The first byte is bounded by the response timeout.
+  if (port_.read (buffer, 1, Deadline::fromNow (response_timeout_)) == 0) {
+    throw ModbusException ("response timeout");
+  }
+  frame.push_back (buffer[0]);
+
+  size_t expected = 0;
+  uint32_t idle_chars = 0;
+  bool broken = false;
+  while (true) {
+    if (expected == 0) {
+      expected = expected_frame_length (frame);
+    }
+    if (expected != 0 && frame.size () >= expected) {
+      // The line still has to be silent for t3.5 before the next request.
+      gap_pending_ = true;
+      break;
+    }
+    size_t bytes_available = port_.available ();
+    if (bytes_available > 0) {
+      // A gap longer than t1.5 inside a frame makes it invalid.
+      if (idle_chars >= t15_chars_) {
+        broken = true;
+      }
+      size_t bytes_to_read = min (bytes_available,
+                                  max_adu_size - frame.size ());
+      if (bytes_to_read == 0) {
+        throw ModbusException ("response frame too long");
+      }
+      if (expected != 0) {
+        bytes_to_read = min (bytes_to_read, expected - frame.size ());
+      }
+      size_t bytes_read = port_.read (buffer, bytes_to_read,
+                                      Deadline::fromNow (response_timeout_));
+      frame.insert (frame.end (), buffer, buffer + bytes_read);
+      idle_chars = 0;
+      continue;
+    }
+    if (idle_chars >= t35_chars_) {
+      // End of frame, and the inter-frame gap has already passed.
+      gap_pending_ = false;
+      break;
+    }
+    port_.waitByteTimes (1);
+    ++idle_chars;
+  }
+
+  if (broken) {
+    throw ModbusException ("inter-character gap exceeded t1.5 in response");
+  }
+  if (frame.size () < 4) {
+    throw ModbusException ("response frame too short");
+  }
+  uint16_t crc = crc16 (&frame[0], frame.size () - 2);
+  if (frame[frame.size () - 2] != (crc & 0xFF)
+   || frame[frame.size () - 1] != (crc >> 8)) {
+    throw ModbusException ("response CRC mismatch");
+  }
+}
+
+void
+RtuMaster::transact (uint8_t unit, const vector<uint8_t> &request,
+                     vector<uint8_t> &response)
+{
+  if (request.empty () || request.size () > max_adu_size - 3) {
+    throw invalid_argument ("invalid request PDU length");
+  }
+  updateFrameTiming_ ();
+
+  adu_.clear ();
+  adu_.push_back (unit);
+  adu_.insert (adu_.end (), request.begin (), request.end ());
+  uint16_t crc = crc16 (&adu_[0], adu_.size ());
+  adu_.push_back (static_cast<uint8_t> (crc & 0xFF));
+  adu_.push_back (static_cast<uint8_t> (crc >> 8));
+
+  // Make sure the line has been idle for t3.5 and drop any late replies to
+  // an earlier request.
+  if (gap_pending_) {
+    port_.waitByteTimes (t35_chars_);
+  }
+  port_.flushInput ();
+
+  if (port_.write (adu_, Deadline::fromNow (response_timeout_))
+      != adu_.size ()) {
+    throw ModbusException ("timeout writing request");
+  }
+  // Wait for the request to leave the UART so the response timeout starts
+  // at the end of the transmission.
+  port_.flush ();
+  gap_pending_ = true;
+
+  response.clear ();
+  if (unit == 0) {
+    return; // Broadcasts are not answered
+  }
+
+  receiveFrame_ (adu_);
+  if (adu_[0] != unit) {
+    throw ModbusException ("response from unexpected unit");
+  }
+  if (adu_[1] == (request[0] | 0x80)) {
+    throw ModbusException ("slave returned an exception", adu_[2]);
+  }
+  if (adu_[1] != request[0]) {
+    throw ModbusException ("response function code mismatch");
+  }
+  response.assign (adu_.begin () + 1, adu_.end () - 2);
+}
+
+vector<bool>
+RtuMaster::readBits_ (uint8_t unit, uint8_t function, uint16_t address,
+                      uint16_t count)
+{
+  if (count == 0 || count > 2000) {
+    throw invalid_argument ("invalid number of bits to read");
+  }
+  vector<uint8_t> request, response;
+  request.push_back (function);
+  put_uint16 (request, address);
+  put_uint16 (request, count);
+  transact (unit, request, response);
+
+  size_t byte_count = (count + 7) / 8;
+  if (response.size () != 2 + byte_count || response[1] != byte_count) {
+    throw ModbusException ("unexpected response length");
+  }
+  vector<bool> bits (count);
+  for (size_t i = 0; i < count; ++i) {
+    bits[i] = (response[2 + i / 8] >> (i % 8)) & 0x1;
+  }
+  return bits;
+}
+
+vector<uint16_t>
+RtuMaster::readRegisters_ (uint8_t unit, uint8_t function, uint16_t address,
+                           uint16_t count)
+{
+  if (count == 0 || count > 125) {
+    throw invalid_argument ("invalid number of registers to read");
+  }
+  vector<uint8_t> request, response;
+  request.push_back (function);
+  put_uint16 (request, address);
+  put_uint16 (request, count);
+  transact (unit, request, response);
+
+  if (response.size () != 2 + 2 * static_cast<size_t> (count)
+   || response[1] != 2 * count) {
+    throw ModbusException ("unexpected response length");
+  }
+  vector<uint16_t> registers (count);
+  for (size_t i = 0; i < count; ++i) {
+    registers[i] = get_uint16 (&response[2 + 2 * i]);
+  }
+  return registers;
+}
+
+vector<bool>
+RtuMaster::readCoils (uint8_t unit, uint16_t address, uint16_t count)
+{
+  return readBits_ (unit, read_coils, address, count);
+}
+
+vector<bool>
+RtuMaster::readDiscreteInputs (uint8_t unit, uint16_t address, uint16_t count)
+{
+  return readBits_ (unit, read_discrete_inputs, address, count);
+}
+
+vector<uint16_t>
+RtuMaster::readHoldingRegisters (uint8_t unit, uint16_t address,
+                                 uint16_t count)
+{
+  return readRegisters_ (unit, read_holding_registers, address, count);
+}
+
+vector<uint16_t>
+RtuMaster::readInputRegisters (uint8_t unit, uint16_t address, uint16_t count)
+{
+  return readRegisters_ (unit, read_input_registers, address, count);
+}
+
+void
+RtuMaster::writeSingleCoil (uint8_t unit, uint16_t address, bool value)
+{
+  vector<uint8_t> request, response;
+  request.push_back (write_single_coil);
+  put_uint16 (request, address);
+  put_uint16 (request, value ? 0xFF00 : 0x0000);
+  transact (unit, request, response);
+  if (unit != 0 && response != request) {
+    throw ModbusException ("response does not echo the request");
+  }
+}
+
+void
+RtuMaster::writeSingleRegister (uint8_t unit, uint16_t address, uint16_t value)
+{
+  vector<uint8_t> request, response;
+  request.push_back (write_single_register);
+  put_uint16 (request, address);
+  put_uint16 (request, value);
+  transact (unit, request, response);
+  if (unit != 0 && response != request) {
+    throw ModbusException ("response does not echo the request");
+  }
+}
+
+void
+RtuMaster::writeMultipleRegisters (uint8_t unit, uint16_t address,
+                                   const vector<uint16_t> &values)
+{
+  if (values.empty () || values.size () > 123) {
+    throw invalid_argument ("invalid number of registers to write");
+  }
+  vector<uint8_t> request, response;
+  request.push_back (write_multiple_registers);
+  put_uint16 (request, address);
+  put_uint16 (request, static_cast<uint16_t> (values.size ()));
+  request.push_back (static_cast<uint8_t> (2 * values.size ()));
+  for (size_t i = 0; i < values.size (); ++i) {
+    put_uint16 (request, values[i]);
+  }
+  transact (unit, request, response);
+  if (unit != 0 && (response.size () != 5
+   || !std::equal (response.begin (), response.end (), request.begin ()))) {
+    throw ModbusException ("response does not echo the request");
+  }
+}
+
+RtuScheduler::RtuScheduler ()
+{
+}
+
+RtuScheduler::~RtuScheduler ()
+{
+}
+
+size_t
+RtuScheduler::addMaster (RtuMaster *master)
+{
+  masters_.push_back (master);
+  return masters_.size () - 1;
+}
+
+void
+RtuScheduler::execute (vector<Transaction> &transactions)
+{
+  vector<WorkerArgs> work (masters_.size ());
+  for (size_t i = 0; i < masters_.size (); ++i) {
+    work[i].master = masters_[i];
+  }
+  for (size_t i = 0; i < transactions.size (); ++i) {
+    if (transactions[i].master >= masters_.size ()) {
+      throw invalid_argument ("transaction refers to an unknown master");
+    }
+    work[transactions[i].master].transactions.push_back (&transactions[i]);
+  }
+
+  // One thread per busy port, each port works through its queue in order.
+  vector<pthread_t> threads;
+  for (size_t i = 0; i < work.size (); ++i) {
+    if (work[i].transactions.empty ()) {
+      continue;
+    }
+    pthread_t thread;
+    int result = pthread_create (&thread, NULL, scheduler_worker, &work[i]);
+    if (result != 0) {
+      // Fall back to running this port's queue on the calling thread.
+      scheduler_worker (&work[i]);
+      continue;
+    }
+    threads.push_back (thread);
+  }
+  for (size_t i = 0; i < threads.size (); ++i) {
+    pthread_join (threads[i], NULL);
+  }
+}
+
+#endif // !defined(_WIN32)
@@ -0,0 +1,296 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+#include <limits>
+
+#include <errno.h>
+#include <poll.h>
+
+#include "serial/multicapture.h"
+#include "serial/impl/stats.h"
+
+using std::invalid_argument;
+using std::max;
+using std::min;
+using std::numeric_limits;
+using std::vector;
+
+using serial::Deadline;
+using serial::IOException;
+using serial::Serial;
+using serial::TimestampedChunk;
+using serial::capture::Chunk;
+using serial::capture::ChunkHandler;
+using serial::capture::MultiCapture;
+using serial::capture::Writer;
+
+namespace {
+
+// Longest the capture thread waits before checking the ports without a
+// descriptor, and whether to stop.
+const int wake_ms = 10;
+
+} // namespace
+
+MultiCapture::MultiCapture (const vector<Serial *> &ports, Writer *writer,
+                            ChunkHandler *handler, size_t capacity)
+  : writer_ (writer), handler_ (handler), stopping_ (false),
+    running_ (true), started_ (false), bytes_captured_ (0)
+{
+  if (ports.empty () || ports.size () > 65536) {
+    throw invalid_argument ("a multi-port capture takes 1 to 65536 ports");
+  }
+  if (capacity == 0) {
+    throw invalid_argument ("the capacity of a capture must be at least 1");
+  }
+  ports_.resize (ports.size ());
+  for (size_t i = 0; i < ports.size (); ++i) {
+    Port &port = ports_[i];
+    port.serial = ports[i];
+    port.fd = ports[i]->getFileDescriptor ();
+    port.buffer.resize (capacity);
+    port.head = 0;
+    port.floor_ns = 0;
+    port.running = true;
+  }
+  heap_.reserve (ports.size ());
+  pthread_mutex_init (&mutex_, NULL);
+  int result = pthread_create (&capture_thread_, NULL,
+                               &MultiCapture::captureThread_, this);
+  if (result) {
+    pthread_mutex_destroy (&mutex_);
+    THROW (IOException, result);
+  }
+  started_ = true;
+}
+
+MultiCapture::~MultiCapture ()
+{
+  stop ();
+  pthread_mutex_destroy (&mutex_);
+}
+
+void
+MultiCapture::stop ()
+{
+  if (!started_) {
+    return;
+  }
+  stopping_ = true;
+  pthread_join (capture_thread_, NULL);
+  started_ = false;
+}
+
+bool
+MultiCapture::isRunning () const
+{
+  pthread_mutex_lock (&mutex_);
+  bool running = running_;
+  pthread_mutex_unlock (&mutex_);
+  return running;
+}
+
+bool
+MultiCapture::isPortRunning (uint16_t port) const
+{
+  if (port >= ports_.size ()) {
+    return false;
+  }
+  pthread_mutex_lock (&mutex_);
+  bool running = ports_[port].running;
+  pthread_mutex_unlock (&mutex_);
+  return running;
+}
+
+uint64_t
+MultiCapture::getBytesCaptured () const
+{
+  return serial::stats::load (bytes_captured_);
+}
+
+void *
+MultiCapture::captureThread_ (void *arg)
+{
+  static_cast<MultiCapture *> (arg)->capture_ ();
+  return NULL;
+}
+
+void
+MultiCapture::capture_ ()
+{
+  vector<pollfd> fds;
+  vector<uint16_t> polled;    // Index in ports_ of each of fds
+  fds.reserve (ports_.size ());
+  polled.reserve (ports_.size ());
+  try {
+    while (!stopping_) {
+      fds.clear ();
+      polled.clear ();
+      for (size_t i = 0; i < ports_.size (); ++i) {
+        if (ports_[i].running && ports_[i].fd != -1) {
+          pollfd fd;
+          fd.fd = ports_[i].fd;
+          fd.events = POLLIN;
+          fd.revents = 0;
+          fds.push_back (fd);
+          polled.push_back (static_cast<uint16_t> (i));
+        }
+      }
+      uint64_t poll_ns = Deadline::now ();
+      int result = ::poll (fds.empty () ? NULL : &fds[0],
+                           static_cast<nfds_t> (fds.size ()), wake_ms);
+      if (result == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        THROW (IOException, errno);
+      }
+      size_t next = 0;
+      for (size_t i = 0; i < ports_.size (); ++i) {
+        Port &port = ports_[i];
+        if (!port.running) {
+          continue;
+        }
+        bool ready = port.fd == -1;
+        if (next < polled.size () && polled[next] == i) {
+          ready = fds[next].revents != 0;
+          ++next;
+        }
+        if (ready) {
+          read_ (static_cast<uint16_t> (i), poll_ns);
+        } else {
+          // Whatever the port receives next arrives after the poll.
+          port.floor_ns = max (port.floor_ns, poll_ns);
+        }
+      }
+      // No port can produce a chunk before the least of their floors.
+      uint64_t merge_ns = numeric_limits<uint64_t>::max ();
+      for (size_t i = 0; i < ports_.size (); ++i) {
+        if (ports_[i].running) {
+          merge_ns = min (merge_ns, ports_[i].floor_ns);
+        }
+      }
+      merge_ (merge_ns);
+    }
+    merge_ (numeric_limits<uint64_t>::max ());
+  } catch (const std::exception &) {
+    // Appending failed, the chunks not passed on are lost.
+  }
+  pthread_mutex_lock (&mutex_);
+  running_ = false;
+  pthread_mutex_unlock (&mutex_);
+}
+
+void
+MultiCapture::read_ (uint16_t index, uint64_t poll_ns)
+{
+  Port &port = ports_[index];
+  size_t offset;
+  size_t room = room_ (port, offset);
+  if (room == 0) {
+    // The merge holds back a whole buffer of this port.
+    merge_ (port.pending.front ().timestamp_ns);
+    room = room_ (port, offset);
+  }
+  size_t available = 0;
+  size_t bytes_read = 0;
+  bool failed = false;
+  chunks_.clear ();
+  try {
+    available = port.serial->available ();
+    if (available > 0) {
+      bytes_read = port.serial->readTimestamped (&port.buffer[offset],
+                                                 min (available, room),
+                                                 chunks_,
+                                                 Deadline::fromNow (0));
+    }
+  } catch (const std::exception &) {
+    failed = true;
+  }
+  // Like Serial::read, take readable but empty for disconnected.
+  if (failed || (available == 0 && port.fd != -1)) {
+    pthread_mutex_lock (&mutex_);
+    port.running = false;
+    pthread_mutex_unlock (&mutex_);
+    return;
+  }
+  for (size_t i = 0; i < chunks_.size (); ++i) {
+    // Raising the estimates to the floor keeps the chunks of a port, and
+    // the merge, in order.
+    Pending pending;
+    pending.timestamp_ns = max (chunks_[i].first_byte_ns, port.floor_ns);
+    pending.offset = offset + chunks_[i].offset;
+    pending.size = chunks_[i].size;
+    port.floor_ns = pending.timestamp_ns;
+    if (port.pending.empty ()) {
+      Head head = { pending.timestamp_ns, index };
+      heap_.push_back (head);
+      std::push_heap (heap_.begin (), heap_.end ());
+    }
+    port.pending.push_back (pending);
+  }
+  port.head = offset + bytes_read;
+  if (bytes_read == available) {
+    port.floor_ns = max (port.floor_ns, poll_ns);
+  }
+}
+
+size_t
+MultiCapture::room_ (const Port &port, size_t &offset) const
+{
+  size_t capacity = port.buffer.size ();
+  if (port.pending.empty ()) {
+    offset = 0;
+    return capacity;
+  }
+  size_t tail = port.pending.front ().offset;
+  if (port.head > tail) {
+    // Chunks do not wrap, take the larger of the end and the start.
+    if (capacity - port.head >= tail) {
+      offset = port.head;
+      return capacity - port.head;
+    }
+    offset = 0;
+    return tail;
+  }
+  offset = port.head;
+  return tail - port.head;
+}
+
+void
+MultiCapture::merge_ (uint64_t timestamp_ns)
+{
+  while (!heap_.empty () && heap_.front ().timestamp_ns <= timestamp_ns) {
+    std::pop_heap (heap_.begin (), heap_.end ());
+    uint16_t index = heap_.back ().port;
+    heap_.pop_back ();
+    Port &port = ports_[index];
+    Pending pending = port.pending.front ();
+    port.pending.pop_front ();
+    if (!port.pending.empty ()) {
+      Head head = { port.pending.front ().timestamp_ns, index };
+      heap_.push_back (head);
+      std::push_heap (heap_.begin (), heap_.end ());
+    }
+    // Nothing reads into the buffer before this returns.
+    const uint8_t *data = &port.buffer[pending.offset];
+    if (writer_ != NULL) {
+      writer_->append (serial::capture::direction_rx, index, data,
+                       pending.size, pending.timestamp_ns);
+    }
+    if (handler_ != NULL) {
+      Chunk chunk;
+      chunk.timestamp_ns = pending.timestamp_ns;
+      chunk.port = index;
+      chunk.direction = serial::capture::direction_rx;
+      chunk.data = data;
+      chunk.size = pending.size;
+      handler_->onChunk (chunk);
+    }
+    serial::stats::add (bytes_captured_, pending.size);
+  }
+}
+
+#endif // !defined(_WIN32)
@@ -0,0 +1,624 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+#include <climits>
+#include <errno.h>
+#include <limits>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "serial/network.h"
+#include "serial/impl/stats.h"
+
+using std::invalid_argument;
+using std::min;
+using std::string;
+
+using serial::IOException;
+using serial::NetworkTransport;
+
+namespace {
+
+// Telnet, RFC 854 and RFC 855.
+const uint8_t telnet_se = 240;
+const uint8_t telnet_sb = 250;
+const uint8_t telnet_will = 251;
+const uint8_t telnet_wont = 252;
+const uint8_t telnet_do = 253;
+const uint8_t telnet_dont = 254;
+const uint8_t telnet_iac = 255;
+
+const uint8_t option_binary = 0;
+const uint8_t option_sga = 3;
+const uint8_t option_com_port = 44;
+
+// Com Port Control Option commands, RFC 2217.  Servers answer with the
+// command plus 100.
+const uint8_t com_set_baudrate = 1;
+const uint8_t com_set_datasize = 2;
+const uint8_t com_set_parity = 3;
+const uint8_t com_set_stopsize = 4;
+const uint8_t com_set_control = 5;
+const uint8_t com_set_modemstate_mask = 11;
+const uint8_t com_purge_data = 12;
+const uint8_t com_notify_modemstate = 7 + 100;
+
+const uint8_t control_flow_none = 1;
+const uint8_t control_dtr_on = 8;
+const uint8_t control_dtr_off = 9;
+const uint8_t control_rts_on = 11;
+const uint8_t control_rts_off = 12;
+
+const uint8_t purge_receive = 1;
+const uint8_t purge_transmit = 2;
+
+const uint8_t modemstate_cts = 0x10;
+const uint8_t modemstate_dsr = 0x20;
+const uint8_t modemstate_ri = 0x40;
+const uint8_t modemstate_cd = 0x80;
+
+// States of the parser of the received bytes.
+enum {
+  parse_data,
+  parse_iac,
+  parse_negotiation,
+  parse_sub,
+  parse_sub_iac
+};
+
+// Escaped bytes waiting to be sent before writes stop being taken.
+const size_t tx_capacity = 65536;
+
+// Longest subnegotiation kept, Com Port Control ones are a few bytes.
+const size_t max_sub = 64;
+
+// Longest wait for a modem line change before checking for a disconnect.
+const uint64_t change_poll_ns = 100000000;
+
+const char rfc2217_scheme[] = "rfc2217://";
+const char tcp_scheme[] = "tcp://";
+
+bool
+starts_with (const string &text, const char *prefix)
+{
+  return text.compare (0, strlen (prefix), prefix) == 0;
+}
+
+// Splits host:port, [v6 host]:port, ignoring any path or options after.
+void
+split_address (const string &address, string &host, string &port)
+{
+  string rest = address.substr (0, address.find_first_of ("/?"));
+  size_t colon = rest.rfind (':');
+  if (colon == string::npos || colon + 1 == rest.size ()) {
+    throw invalid_argument ("the url of a device server needs a port");
+  }
+  host = rest.substr (0, colon);
+  port = rest.substr (colon + 1);
+  if (host.size () >= 2 && host[0] == '[' && host[host.size () - 1] == ']') {
+    host = host.substr (1, host.size () - 2);
+  }
+  if (host.empty ()
+      || port.find_first_not_of ("0123456789") != string::npos) {
+    throw invalid_argument ("the url of a device server needs a host and "
+                            "a numeric port");
+  }
+}
+
+int
+poll_ms (uint64_t timeout_ns)
+{
+  uint64_t ms = timeout_ns / 1000000 + (timeout_ns % 1000000 != 0);
+  return ms > static_cast<uint64_t> (INT_MAX) ? INT_MAX
+                                              : static_cast<int> (ms);
+}
+
+uint64_t
+deadline_after (uint64_t timeout_ns)
+{
+  uint64_t now_ns = serial::stats::now_ns ();
+  uint64_t max = std::numeric_limits<uint64_t>::max ();
+  return timeout_ns > max - now_ns ? max : now_ns + timeout_ns;
+}
+
+uint64_t
+remaining_until (uint64_t deadline_ns)
+{
+  uint64_t now_ns = serial::stats::now_ns ();
+  return deadline_ns > now_ns ? deadline_ns - now_ns : 0;
+}
+
+} // namespace
+
+NetworkTransport::NetworkTransport (const string &url)
+  : fd_ (-1), rfc2217_ (false), connected_ (true), rx_offset_ (0),
+    parse_state_ (parse_data), negotiation_ (0), modem_state_ (0),
+    modem_changes_ (0), send_failed_ (false)
+{
+  string address;
+  if (starts_with (url, rfc2217_scheme)) {
+    rfc2217_ = true;
+    address = url.substr (strlen (rfc2217_scheme));
+  } else if (starts_with (url, tcp_scheme)) {
+    address = url.substr (strlen (tcp_scheme));
+  } else {
+    throw invalid_argument ("the url of a device server must start with "
+                            "rfc2217:// or tcp://");
+  }
+  string host, port;
+  split_address (address, host, port);
+
+  addrinfo hints;
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addresses = NULL;
+  int result = getaddrinfo (host.c_str (), port.c_str (), &hints, &addresses);
+  if (result != 0) {
+    THROW (IOException, gai_strerror (result));
+  }
+  int error = 0;
+  for (addrinfo *candidate = addresses; candidate != NULL && fd_ == -1;
+       candidate = candidate->ai_next) {
+    fd_ = socket (candidate->ai_family, candidate->ai_socktype,
+                  candidate->ai_protocol);
+    if (fd_ == -1) {
+      error = errno;
+      continue;
+    }
+    while ((result = connect (fd_, candidate->ai_addr,
+                              candidate->ai_addrlen)) == -1
+           && errno == EINTR) {}
+    if (result == -1) {
+      error = errno;
+      ::close (fd_);
+      fd_ = -1;
+    }
+  }
+  freeaddrinfo (addresses);
+  if (fd_ == -1) {
+    THROW (IOException, error);
+  }
+
+  // Requests go out as soon as they are written, not after the reply to
+  // the previous one.
+  int on = 1;
+  setsockopt (fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+#if defined(SO_NOSIGPIPE)
+  setsockopt (fd_, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof (on));
+#endif
+  fcntl (fd_, F_SETFL, fcntl (fd_, F_GETFL) | O_NONBLOCK);
+
+  pthread_mutex_init (&rx_mutex_, NULL);
+  pthread_mutex_init (&tx_mutex_, NULL);
+
+  if (rfc2217_) {
+    const uint8_t negotiation[] = {
+      telnet_iac, telnet_will, option_binary,
+      telnet_iac, telnet_do, option_binary,
+      telnet_iac, telnet_will, option_sga,
+      telnet_iac, telnet_do, option_sga,
+      telnet_iac, telnet_will, option_com_port
+    };
+    uint8_t mask = 0xff;
+    pthread_mutex_lock (&tx_mutex_);
+    tx_.insert (tx_.end (), negotiation,
+                negotiation + sizeof (negotiation));
+    command_ (com_set_modemstate_mask, &mask, 1);
+    send_ ();
+    pthread_mutex_unlock (&tx_mutex_);
+  }
+}
+
+NetworkTransport::~NetworkTransport ()
+{
+  ::close (fd_);
+  pthread_mutex_destroy (&tx_mutex_);
+  pthread_mutex_destroy (&rx_mutex_);
+}
+
+bool
+NetworkTransport::isUrl (const string &port)
+{
+  return starts_with (port, rfc2217_scheme) || starts_with (port, tcp_scheme);
+}
+
+size_t
+NetworkTransport::available ()
+{
+  receive_ (0);
+  pthread_mutex_lock (&rx_mutex_);
+  size_t count = rx_.size () - rx_offset_;
+  pthread_mutex_unlock (&rx_mutex_);
+  return count;
+}
+
+bool
+NetworkTransport::waitReadable (uint64_t timeout_ns)
+{
+  uint64_t deadline_ns = deadline_after (timeout_ns);
+  uint64_t wait_ns = 0;
+  while (true) {
+    // Writes the socket could not take go out while the reader waits.
+    pthread_mutex_lock (&tx_mutex_);
+    send_ ();
+    pthread_mutex_unlock (&tx_mutex_);
+    receive_ (wait_ns);
+    pthread_mutex_lock (&rx_mutex_);
+    bool ready = rx_offset_ < rx_.size () || !connected_;
+    pthread_mutex_unlock (&rx_mutex_);
+    if (ready) {
+      return true;
+    }
+    wait_ns = remaining_until (deadline_ns);
+    if (wait_ns == 0) {
+      return false;
+    }
+  }
+}
+
+bool
+NetworkTransport::waitWritable (uint64_t timeout_ns)
+{
+  uint64_t deadline_ns = deadline_after (timeout_ns);
+  while (true) {
+    pthread_mutex_lock (&tx_mutex_);
+    send_ ();
+    bool ready = send_failed_ || tx_.size () < tx_capacity;
+    pthread_mutex_unlock (&tx_mutex_);
+    uint64_t wait_ns = remaining_until (deadline_ns);
+    if (ready || wait_ns == 0) {
+      return ready;
+    }
+    pollfd poll_fd;
+    poll_fd.fd = fd_;
+    poll_fd.events = POLLOUT;
+    poll (&poll_fd, 1, poll_ms (wait_ns));
+  }
+}
+
+size_t
+NetworkTransport::read (uint8_t *buffer, size_t size)
+{
+  receive_ (0);
+  pthread_mutex_lock (&rx_mutex_);
+  size_t count = min (size, rx_.size () - rx_offset_);
+  std::copy (rx_.begin () + rx_offset_, rx_.begin () + rx_offset_ + count,
+             buffer);
+  rx_offset_ += count;
+  if (rx_offset_ == rx_.size ()) {
+    rx_.clear ();
+    rx_offset_ = 0;
+  }
+  pthread_mutex_unlock (&rx_mutex_);
+  return count;
+}
+
+size_t
+NetworkTransport::write (const uint8_t *data, size_t size)
+{
+  pthread_mutex_lock (&tx_mutex_);
+  send_ ();
+  size_t count = 0;
+  if (!send_failed_) {
+    // Escape into what is queued, so the whole write and any commands
+    // before it take one send.
+    while (count < size && tx_.size () + 2 <= tx_capacity) {
+      tx_.push_back (data[count]);
+      if (rfc2217_ && data[count] == telnet_iac) {
+        tx_.push_back (telnet_iac);
+      }
+      ++count;
+    }
+    send_ ();
+  }
+  pthread_mutex_unlock (&tx_mutex_);
+  return count;
+}
+
+void
+NetworkTransport::configure (unsigned long baudrate, bytesize_t bytesize,
+                             parity_t parity, stopbits_t stopbits,
+                             flowcontrol_t flowcontrol)
+{
+  if (!rfc2217_) {
+    return;
+  }
+  uint8_t baud[4] = {
+    static_cast<uint8_t> (baudrate >> 24), static_cast<uint8_t> (baudrate >> 16),
+    static_cast<uint8_t> (baudrate >> 8), static_cast<uint8_t> (baudrate)
+  };
+  uint8_t datasize = static_cast<uint8_t> (bytesize);
+  // The option counts parity and flow control from 1, stop sizes are the
+  // same as stopbits_t.
+  uint8_t parity_value = static_cast<uint8_t> (parity + 1);
+  uint8_t stopsize = static_cast<uint8_t> (stopbits);
+  uint8_t control = static_cast<uint8_t> (control_flow_none + flowcontrol);
+  pthread_mutex_lock (&tx_mutex_);
+  command_ (com_set_baudrate, baud, 4);
+  command_ (com_set_datasize, &datasize, 1);
+  command_ (com_set_parity, &parity_value, 1);
+  command_ (com_set_stopsize, &stopsize, 1);
+  command_ (com_set_control, &control, 1);
+  send_ ();
+  pthread_mutex_unlock (&tx_mutex_);
+}
+
+void
+NetworkTransport::flushInput ()
+{
+  receive_ (0);
+  pthread_mutex_lock (&rx_mutex_);
+  rx_.clear ();
+  rx_offset_ = 0;
+  pthread_mutex_unlock (&rx_mutex_);
+  if (rfc2217_) {
+    pthread_mutex_lock (&tx_mutex_);
+    command_ (com_purge_data, &purge_receive, 1);
+    send_ ();
+    pthread_mutex_unlock (&tx_mutex_);
+  }
+}
+
+void
+NetworkTransport::flushOutput ()
+{
+  if (rfc2217_) {
+    pthread_mutex_lock (&tx_mutex_);
+    command_ (com_purge_data, &purge_transmit, 1);
+    send_ ();
+    pthread_mutex_unlock (&tx_mutex_);
+  }
+}
+
+void
+NetworkTransport::setRTS (bool level)
+{
+  if (rfc2217_) {
+    uint8_t control = level ? control_rts_on : control_rts_off;
+    pthread_mutex_lock (&tx_mutex_);
+    command_ (com_set_control, &control, 1);
+    send_ ();
+    pthread_mutex_unlock (&tx_mutex_);
+  }
+}
+
+void
+NetworkTransport::setDTR (bool level)
+{
+  if (rfc2217_) {
+    uint8_t control = level ? control_dtr_on : control_dtr_off;
+    pthread_mutex_lock (&tx_mutex_);
+    command_ (com_set_control, &control, 1);
+    send_ ();
+    pthread_mutex_unlock (&tx_mutex_);
+  }
+}
+
+bool
+NetworkTransport::waitForChange ()
+{
+  pthread_mutex_lock (&rx_mutex_);
+  uint64_t changes = modem_changes_;
+  pthread_mutex_unlock (&rx_mutex_);
+  while (true) {
+    receive_ (change_poll_ns);
+    pthread_mutex_lock (&rx_mutex_);
+    bool changed = modem_changes_ != changes;
+    bool connected = connected_;
+    pthread_mutex_unlock (&rx_mutex_);
+    if (changed || !connected) {
+      return changed;
+    }
+  }
+}
+
+bool
+NetworkTransport::getCTS ()
+{
+  return modemLine_ (modemstate_cts);
+}
+
+bool
+NetworkTransport::getDSR ()
+{
+  return modemLine_ (modemstate_dsr);
+}
+
+bool
+NetworkTransport::getRI ()
+{
+  return rfc2217_ && modemLine_ (modemstate_ri);
+}
+
+bool
+NetworkTransport::getCD ()
+{
+  return modemLine_ (modemstate_cd);
+}
+
+void
+NetworkTransport::receive_ (uint64_t timeout_ns)
+{
+  if (timeout_ns > 0) {
+    pollfd poll_fd;
+    poll_fd.fd = fd_;
+    poll_fd.events = POLLIN;
+    if (poll (&poll_fd, 1, poll_ms (timeout_ns)) <= 0) {
+      return;
+    }
+  }
+  uint8_t buffer[4096];
+  pthread_mutex_lock (&rx_mutex_);
+  while (connected_) {
+    ssize_t received = recv (fd_, buffer, sizeof (buffer), 0);
+    if (received > 0) {
+      parse_ (buffer, static_cast<size_t> (received));
+      if (static_cast<size_t> (received) < sizeof (buffer)) {
+        break;
+      }
+    } else if (received == -1 && errno == EINTR) {
+      continue;
+    } else if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      // Closed by the server, or reset.
+      connected_ = false;
+    }
+  }
+  pthread_mutex_unlock (&rx_mutex_);
+}
+
+void
+NetworkTransport::parse_ (const uint8_t *data, size_t size)
+{
+  if (!rfc2217_) {
+    rx_.insert (rx_.end (), data, data + size);
+    return;
+  }
+  for (size_t i = 0; i < size; ++i) {
+    uint8_t byte = data[i];
+    switch (parse_state_) {
+    case parse_data:
+      if (byte == telnet_iac) {
+        parse_state_ = parse_iac;
+      } else {
+        rx_.push_back (byte);
+      }
+      break;
+    case parse_iac:
+      if (byte == telnet_iac) {
+        rx_.push_back (byte);
+        parse_state_ = parse_data;
+      } else if (byte >= telnet_will && byte <= telnet_dont) {
+        negotiation_ = byte;
+        parse_state_ = parse_negotiation;
+      } else if (byte == telnet_sb) {
+        sub_.clear ();
+        parse_state_ = parse_sub;
+      } else {
+        parse_state_ = parse_data; // Other commands carry nothing for us
+      }
+      break;
+    case parse_negotiation:
+      // The options asked for in the constructor are accepted already,
+      // refuse the others.
+      if (byte != option_binary && byte != option_sga
+          && byte != option_com_port
+          && (negotiation_ == telnet_do || negotiation_ == telnet_will)) {
+        uint8_t refusal[] = {
+          telnet_iac, negotiation_ == telnet_do ? telnet_wont : telnet_dont,
+          byte
+        };
+        pthread_mutex_lock (&tx_mutex_);
+        tx_.insert (tx_.end (), refusal, refusal + sizeof (refusal));
+        send_ ();
+        pthread_mutex_unlock (&tx_mutex_);
+      }
+      parse_state_ = parse_data;
+      break;
+    case parse_sub:
+      if (byte == telnet_iac) {
+        parse_state_ = parse_sub_iac;
+      } else if (sub_.size () < max_sub) {
+        sub_.push_back (byte);
+      }
+      break;
+    case parse_sub_iac:
+      if (byte == telnet_iac) {
+        if (sub_.size () < max_sub) {
+          sub_.push_back (byte);
+        }
+        parse_state_ = parse_sub;
+      } else {
+        if (byte == telnet_se) {
+          subnegotiation_ ();
+        }
+        parse_state_ = parse_data;
+      }
+      break;
+    }
+  }
+}
+
+void
+NetworkTransport::subnegotiation_ ()
+{
+  if (sub_.size () < 3 || sub_[0] != option_com_port
+      || sub_[1] != com_notify_modemstate) {
+    return;
+  }
+  // The low bits tell which lines changed, the high bits their state.
+  uint8_t lines = sub_[2] & 0xf0;
+  if (lines != modem_state_) {
+    modem_state_ = lines;
+    modem_changes_ += 1;
+  }
+}
+
+void
+NetworkTransport::command_ (uint8_t command, const uint8_t *data, size_t size)
+{
+  tx_.push_back (telnet_iac);
+  tx_.push_back (telnet_sb);
+  tx_.push_back (option_com_port);
+  tx_.push_back (command);
+  for (size_t i = 0; i < size; ++i) {
+    tx_.push_back (data[i]);
+    if (data[i] == telnet_iac) {
+      tx_.push_back (telnet_iac);
+    }
+  }
+  tx_.push_back (telnet_iac);
+  tx_.push_back (telnet_se);
+}
+
+void
+NetworkTransport::send_ ()
+{
+  size_t sent = 0;
+  while (sent < tx_.size () && !send_failed_) {
+#if defined(MSG_NOSIGNAL)
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    ssize_t result = ::send (fd_, &tx_[sent], tx_.size () - sent, flags);
+    if (result > 0) {
+      sent += static_cast<size_t> (result);
+    } else if (result == -1 && errno == EINTR) {
+      continue;
+    } else if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      send_failed_ = true;
+    }
+  }
+  if (send_failed_) {
+    tx_.clear ();
+  } else {
+    tx_.erase (tx_.begin (), tx_.begin () + sent);
+  }
+}
+
+bool
+NetworkTransport::modemLine_ (uint8_t bit)
+{
+  receive_ (0);
+  pthread_mutex_lock (&rx_mutex_);
+  bool level = connected_ && (!rfc2217_ || (modem_state_ & bit) != 0);
+  pthread_mutex_unlock (&rx_mutex_);
+  return level;
+}
+
+#endif // !defined(_WIN32)
@@ -0,0 +1,171 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#include <algorithm>
+
+#include "serial/nmea.h"
+
+using std::max;
+using std::min;
+using std::vector;
+
+using serial::Serial;
+using serial::nmea::Field;
+using serial::nmea::Handler;
+using serial::nmea::Parser;
+using serial::nmea::Sentence;
+
+namespace {
+
+inline int
+hex_value (uint8_t c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+} // namespace
+
+Parser::Parser (bool require_checksum)
+  : require_checksum_ (require_checksum), state_ (hunting), length_ (0),
+    checksum_ (0), received_checksum_ (0), has_checksum_ (false),
+    sentences_ (0), checksum_errors_ (0), overflow_errors_ (0)
+{
+  // Size everything for the longest sentence up front, so parsing never
+  // has to allocate.
+  commas_.reserve (max_sentence_);
+  sentence_.fields.reserve (max_sentence_);
+  sentence_.start = '$';
+  sentence_.has_checksum = false;
+}
+
+Parser::~Parser ()
+{
+}
+
+void
+Parser::reset ()
+{
+  state_ = hunting;
+}
+
+size_t
+Parser::parse (const uint8_t *data, size_t size, Handler &handler)
+{
+  size_t delivered = 0;
+  for (size_t i = 0; i < size; ++i) {
+    uint8_t c = data[i];
+    // '$' and '!' are reserved, they always start a new sentence.
+    if (c == '$' || c == '!') {
+      if (state_ != hunting) {
+        ++checksum_errors_; // Truncated sentence
+      }
+      sentence_.start = static_cast<char> (c);
+      length_ = 0;
+      checksum_ = 0;
+      has_checksum_ = false;
+      commas_.clear ();
+      state_ = body;
+      continue;
+    }
+    switch (state_) {
+    case hunting:
+      break;
+    case body:
+      if (c == '*') {
+        state_ = checksum_hi;
+      } else if (c == '\r' || c == '\n') {
+        // Sentence without a checksum
+        state_ = hunting;
+        if (require_checksum_) {
+          ++checksum_errors_;
+        } else {
+          deliver_ (handler);
+          ++delivered;
+        }
+      } else if (length_ == max_sentence_) {
+        ++overflow_errors_;
+        state_ = hunting;
+      } else {
+        checksum_ ^= c;
+        if (c == ',') {
+          commas_.push_back (length_);
+        }
+        buffer_[length_++] = static_cast<char> (c);
+      }
+      break;
+    case checksum_hi:
+      if (hex_value (c) < 0) {
+        ++checksum_errors_;
+        state_ = hunting;
+      } else {
+        received_checksum_ = static_cast<uint8_t> (hex_value (c) << 4);
+        state_ = checksum_lo;
+      }
+      break;
+    case checksum_lo:
+      state_ = hunting;
+      if (hex_value (c) < 0
+       || (received_checksum_ | hex_value (c)) != checksum_) {
+        ++checksum_errors_;
+      } else {
+        // Deliver without waiting for the CR LF, the hunting state skips it.
+        has_checksum_ = true;
+        deliver_ (handler);
+        ++delivered;
+      }
+      break;
+    }
+  }
+  return delivered;
+}
+
+size_t
+Parser::read (Serial &port, Handler &handler, size_t size)
+{
+  if (read_buffer_.size () < size) {
+    read_buffer_.resize (size);
+  }
+  size_t bytes_to_read = min (max (port.available (), size_t (1)), size);
+  size_t bytes_read = port.read (&read_buffer_[0], bytes_to_read);
+  return parse (&read_buffer_[0], bytes_read, handler);
+}
+
+void
+Parser::deliver_ (Handler &handler)
+{
+  // Terminate every field in place so they can be used as C strings.
+  buffer_[length_] = '\0';
+  for (size_t i = 0; i < commas_.size (); ++i) {
+    buffer_[commas_[i]] = '\0';
+  }
+
+  size_t address_length = commas_.empty () ? length_ : commas_[0];
+  if (address_length > 0 && buffer_[0] == 'P') {
+    sentence_.talker = Field (buffer_, 0);
+    sentence_.type = Field (buffer_, address_length);
+  } else {
+    size_t talker_length = min (address_length, size_t (2));
+    sentence_.talker = Field (buffer_, talker_length);
+    sentence_.type = Field (buffer_ + talker_length,
+                            address_length - talker_length);
+  }
+
+  sentence_.fields.resize (commas_.size ());
+  for (size_t i = 0; i < commas_.size (); ++i) {
+    size_t begin = commas_[i] + 1;
+    size_t end = (i + 1 < commas_.size ()) ? commas_[i + 1] : length_;
+    sentence_.fields[i] = Field (buffer_ + begin, end - begin);
+  }
+  sentence_.has_checksum = has_checksum_;
+
+  ++sentences_;
+  handler.onSentence (sentence_);
+}
@@ -0,0 +1,193 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#if !defined(_WIN32)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "serial/replay.h"
+#include "serial/impl/stats.h"
+
+using std::invalid_argument;
+using std::string;
+
+using serial::IOException;
+using serial::capture::Chunk;
+using serial::capture::Reader;
+using serial::capture::direction_t;
+using serial::replay::ReplayStats;
+using serial::replay::Replayer;
+
+namespace {
+
+// Longest sleep before checking for stop.
+const uint64_t max_sleep_ns = 100000000;
+
+} // namespace
+
+Replayer::Replayer (Reader &reader)
+  : reader_ (reader), master_fd_ (-1), slave_fd_ (-1), speed_ (1.0),
+    direction_ (serial::capture::direction_rx), port_ (-1),
+    stopping_ (false)
+{
+  master_fd_ = posix_openpt (O_RDWR | O_NOCTTY);
+  if (master_fd_ == -1) {
+    THROW (IOException, errno);
+  }
+  const char *name = NULL;
+  if (grantpt (master_fd_) == -1 || unlockpt (master_fd_) == -1
+      || (name = ptsname (master_fd_)) == NULL) {
+    int error = errno;
+    ::close (master_fd_);
+    THROW (IOException, error);
+  }
+  port_name_ = name;
+  // Holding the slave open keeps the master writable until a Serial opens
+  // it, and raw mode keeps the line discipline off the captured bytes.
+  slave_fd_ = ::open (port_name_.c_str (), O_RDWR | O_NOCTTY);
+  termios options;
+  if (slave_fd_ == -1 || tcgetattr (slave_fd_, &options) == -1) {
+    int error = errno;
+    if (slave_fd_ != -1) {
+      ::close (slave_fd_);
+    }
+    ::close (master_fd_);
+    THROW (IOException, error);
+  }
+  cfmakeraw (&options);
+  tcsetattr (slave_fd_, TCSANOW, &options);
+}
+
+Replayer::~Replayer ()
+{
+  ::close (slave_fd_);
+  ::close (master_fd_);
+}
+
+string
+Replayer::getPortName () const
+{
+  return port_name_;
+}
+
+void
+Replayer::setSpeed (double speed)
+{
+  if (speed < 0) {
+    throw invalid_argument ("the speed of a replay cannot be negative");
+  }
+  speed_ = speed;
+}
+
+double
+Replayer::getSpeed () const
+{
+  return speed_;
+}
+
+void
+Replayer::setDirection (direction_t direction)
+{
+  direction_ = direction;
+}
+
+void
+Replayer::setPort (int port)
+{
+  port_ = port;
+}
+
+ReplayStats
+Replayer::run ()
+{
+  stopping_ = false;
+  ReplayStats stats;
+  uint64_t start_ns = serial::stats::now_ns ();
+  uint64_t first_chunk_ns = 0;
+  Chunk chunk;
+  while (!stopping_ && reader_.next (chunk)) {
+    if (chunk.direction != direction_
+        || (port_ != -1 && chunk.port != port_)) {
+      continue;
+    }
+    if (stats.chunks == 0) {
+      first_chunk_ns = chunk.timestamp_ns;
+    }
+    if (speed_ > 0) {
+      uint64_t offset_ns = chunk.timestamp_ns > first_chunk_ns
+                           ? chunk.timestamp_ns - first_chunk_ns : 0;
+      uint64_t due_ns = start_ns
+                        + static_cast<uint64_t> (offset_ns / speed_);
+      sleepUntil_ (due_ns);
+      if (stopping_) {
+        break;
+      }
+      uint64_t now_ns = serial::stats::now_ns ();
+      uint64_t lateness_ns = now_ns > due_ns ? now_ns - due_ns : 0;
+      stats.total_lateness_ns += lateness_ns;
+      if (lateness_ns > stats.max_lateness_ns) {
+        stats.max_lateness_ns = lateness_ns;
+      }
+    }
+    write_ (chunk.data, chunk.size);
+    stats.chunks += 1;
+    stats.bytes += chunk.size;
+  }
+  stats.elapsed_ns = serial::stats::now_ns () - start_ns;
+  return stats;
+}
+
+void
+Replayer::stop ()
+{
+  stopping_ = true;
+}
+
+void
+Replayer::sleepUntil_ (uint64_t deadline_ns)
+{
+  while (!stopping_) {
+    uint64_t now_ns = serial::stats::now_ns ();
+    if (now_ns >= deadline_ns) {
+      return;
+    }
+#if defined(__linux__)
+    // Absolute, so time spent between the sleeps does not add up.
+    uint64_t wake_ns = deadline_ns - now_ns > max_sleep_ns
+                       ? now_ns + max_sleep_ns : deadline_ns;
+    timespec wake;
+    wake.tv_sec = static_cast<time_t> (wake_ns / 1000000000);
+    wake.tv_nsec = static_cast<long> (wake_ns % 1000000000);
+    clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+#else
+    uint64_t sleep_ns = deadline_ns - now_ns > max_sleep_ns
+                        ? max_sleep_ns : deadline_ns - now_ns;
+    timespec sleep_time;
+    sleep_time.tv_sec = static_cast<time_t> (sleep_ns / 1000000000);
+    sleep_time.tv_nsec = static_cast<long> (sleep_ns % 1000000000);
+    nanosleep (&sleep_time, NULL);
+#endif
+  }
+}
+
+void
+Replayer::write_ (const uint8_t *data, size_t size)
+{
+  size_t written = 0;
+  while (written < size) {
+    ssize_t result = ::write (master_fd_, data + written, size - written);
+    if (result == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      THROW (IOException, errno);
+    }
+    written += static_cast<size_t> (result);
+  }
+}
+
+#endif // !defined(_WIN32)
@@ -10,12 +10,15 @@
 #endif
 
 #include "serial/serial.h"
+#include "serial/clock.h"
+#include "serial/framing.h"
 
 #ifdef _WIN32
 #include "serial/impl/win.h"
 #else
 #include "serial/impl/unix.h"
 #endif
+#include "serial/impl/stats.h"
 
 using std::invalid_argument;
 using std::min;
@@ -24,6 +27,7 @@ using std::vector;
 using std::size_t;
 using std::string;
 
+using serial::Deadline;
 using serial::Serial;
 using serial::SerialException;
 using serial::IOException;
@@ -32,6 +36,9 @@ using serial::parity_t;
 using serial::stopbits_t;
 using serial::flowcontrol_t;
 
+// Largest encoded frame writeFrame keeps on the stack.
+static const size_t frame_stack_size = 1024;
+
 class Serial::ScopedReadLock {
 public:
   ScopedReadLock(SerialImpl *pimpl) : pimpl_(pimpl) {
@@ -50,8 +57,10 @@ private:
 
 class Serial::ScopedWriteLock {
 public:
-  ScopedWriteLock(SerialImpl *pimpl) : pimpl_(pimpl) {
-    this->pimpl_->writeLock();
+  ScopedWriteLock(SerialImpl *pimpl,
+                  serial::priority_t priority = serial::priority_normal)
+  : pimpl_(pimpl) {
+    this->pimpl_->writeLock(priority);
   }
   ~ScopedWriteLock() {
     this->pimpl_->writeUnlock();
@@ -72,6 +81,12 @@ Serial::Serial (const string &port, uint32_t baudrate, serial::Timeout timeout,
   pimpl_->setTimeout(timeout);
 }
 
+Serial::Serial (serial::Transport &transport, serial::Timeout timeout)
+ : pimpl_(new SerialImpl (transport))
+{
+  pimpl_->setTimeout(timeout);
+}
+
 Serial::~Serial ()
 {
   delete pimpl_;
@@ -95,6 +110,12 @@ Serial::isOpen () const
   return pimpl_->isOpen ();
 }
 
+int
+Serial::getFileDescriptor () const
+{
+  return pimpl_->getFileDescriptor ();
+}
+
 size_t
 Serial::available ()
 {
@@ -105,7 +126,8 @@ bool
 Serial::waitReadable ()
 {
   serial::Timeout timeout(pimpl_->getTimeout ());
-  return pimpl_->waitReadable(timeout.read_timeout_constant);
+  return pimpl_->waitReadable(static_cast<uint64_t> (
+    timeout.read_timeout_constant) * timeout.unit_ns);
 }
 
 void
@@ -114,12 +136,40 @@ Serial::waitByteTimes (size_t count)
   pimpl_->waitByteTimes(count);
 }
 
+Deadline
+Deadline::fromNow (uint32_t milliseconds)
+{
+  return fromNowNs (static_cast<uint64_t> (milliseconds) * 1000000);
+}
+
+Deadline
+Deadline::fromNowNs (uint64_t nanoseconds)
+{
+  uint64_t now_ns = now ();
+  // Saturate rather than wrap into the past.
+  return Deadline (nanoseconds > numeric_limits<uint64_t>::max () - now_ns
+                   ? numeric_limits<uint64_t>::max () : now_ns + nanoseconds);
+}
+
+uint64_t
+Deadline::now ()
+{
+  serial::Clock *clock = serial::getClock ();
+  return clock != NULL ? clock->now () : serial::stats::now_ns ();
+}
+
 size_t
 Serial::read_ (uint8_t *buffer, size_t size)
 {
   return this->pimpl_->read (buffer, size);
 }
 
+size_t
+Serial::read_ (uint8_t *buffer, size_t size, const Deadline &deadline)
+{
+  return this->pimpl_->read (buffer, size, deadline.ns);
+}
+
 size_t
 Serial::read (uint8_t *buffer, size_t size)
 {
@@ -127,6 +177,23 @@ Serial::read (uint8_t *buffer, size_t size)
   return this->pimpl_->read (buffer, size);
 }
 
+size_t
+Serial::readTimestamped (uint8_t *buffer, size_t size,
+                         std::vector<TimestampedChunk> &chunks)
+{
+  ScopedReadLock lock(this->pimpl_);
+  return this->pimpl_->readTimestamped (buffer, size, &chunks);
+}
+
+size_t
+Serial::readTimestamped (uint8_t *buffer, size_t size,
+                         std::vector<TimestampedChunk> &chunks,
+                         const Deadline &deadline)
+{
+  ScopedReadLock lock(this->pimpl_);
+  return this->pimpl_->readTimestamped (buffer, size, deadline.ns, &chunks);
+}
+
 size_t
 Serial::read (std::vector<uint8_t> &buffer, size_t size)
 {
@@ -165,6 +232,50 @@ Serial::read (std::string &buffer, size_t size)
   return bytes_read;
 }
 
+size_t
+Serial::read (uint8_t *buffer, size_t size, const Deadline &deadline)
+{
+  ScopedReadLock lock(this->pimpl_);
+  return this->read_ (buffer, size, deadline);
+}
+
+size_t
+Serial::read (std::vector<uint8_t> &buffer, size_t size,
+              const Deadline &deadline)
+{
+  ScopedReadLock lock(this->pimpl_);
+  uint8_t *buffer_ = new uint8_t[size];
+  size_t bytes_read = 0;
+  try {
+    bytes_read = this->read_ (buffer_, size, deadline);
+  }
+  catch (const std::exception &e) {
+    delete[] buffer_;
+    throw;
+  }
+  buffer.insert (buffer.end (), buffer_, buffer_+bytes_read);
+  delete[] buffer_;
+  return bytes_read;
+}
+
+size_t
+Serial::read (std::string &buffer, size_t size, const Deadline &deadline)
+{
+  ScopedReadLock lock(this->pimpl_);
+  uint8_t *buffer_ = new uint8_t[size];
+  size_t bytes_read = 0;
+  try {
+    bytes_read = this->read_ (buffer_, size, deadline);
+  }
+  catch (const std::exception &e) {
+    delete[] buffer_;
+    throw;
+  }
+  buffer.append (reinterpret_cast<const char*>(buffer_), bytes_read);
+  delete[] buffer_;
+  return bytes_read;
+}
+
 string
 Serial::read (size_t size)
 {
@@ -201,6 +312,32 @@ Serial::readline (string &buffer, size_t size, string eol)
   return read_so_far;
 }
 
+size_t
+Serial::readline (string &buffer, size_t size, string eol,
+                  const Deadline &deadline)
+{
+  ScopedReadLock lock(this->pimpl_);
+  size_t eol_len = eol.length ();
+  uint8_t *buffer_ = static_cast<uint8_t*>
+                              (alloca (size * sizeof (uint8_t)));
+  size_t read_so_far = 0;
+  while (read_so_far < size)
+  {
+    size_t bytes_read = this->read_ (buffer_ + read_so_far, 1, deadline);
+    read_so_far += bytes_read;
+    if (bytes_read == 0) {
+      break; // Deadline passed
+    }
+    if(read_so_far < eol_len) continue;
+    if (string (reinterpret_cast<const char*>
+         (buffer_ + read_so_far - eol_len), eol_len) == eol) {
+      break; // EOL found
+    }
+  }
+  buffer.append(reinterpret_cast<const char*> (buffer_), read_so_far);
+  return read_so_far;
+}
+
 string
 Serial::readline (size_t size, string eol)
 {
@@ -273,12 +410,185 @@ Serial::write (const uint8_t *data, size_t size)
   return this->write_(data, size);
 }
 
+size_t
+Serial::write (const string &data, const Deadline &deadline)
+{
+  ScopedWriteLock lock(this->pimpl_);
+  return this->pimpl_->write (reinterpret_cast<const uint8_t*>(data.c_str()),
+                              data.length(), deadline.ns);
+}
+
+size_t
+Serial::write (const std::vector<uint8_t> &data, const Deadline &deadline)
+{
+  ScopedWriteLock lock(this->pimpl_);
+  return this->pimpl_->write (&data[0], data.size(), deadline.ns);
+}
+
+size_t
+Serial::write (const uint8_t *data, size_t size, const Deadline &deadline)
+{
+  ScopedWriteLock lock(this->pimpl_);
+  return this->pimpl_->write (data, size, deadline.ns);
+}
+
+size_t
+Serial::write (const string &data, serial::priority_t priority)
+{
+  return this->write (reinterpret_cast<const uint8_t*>(data.c_str()),
+                      data.length(), priority);
+}
+
+size_t
+Serial::write (const std::vector<uint8_t> &data, serial::priority_t priority)
+{
+  return this->write (&data[0], data.size(), priority);
+}
+
+size_t
+Serial::write (const uint8_t *data, size_t size, serial::priority_t priority)
+{
+  if (priority != serial::priority_bulk) {
+    ScopedWriteLock lock(this->pimpl_, priority);
+    return this->write_ (data, size);
+  }
+  // Bulk data goes in chunks, the other lanes get the port between them.
+  size_t bytes_written = 0;
+  while (bytes_written < size) {
+    size_t chunk;
+    size_t bytes_written_now;
+    {
+      ScopedWriteLock lock(this->pimpl_, priority);
+      chunk = min (this->pimpl_->bulkChunkSize (), size - bytes_written);
+      bytes_written_now = this->write_ (data + bytes_written, chunk);
+    }
+    bytes_written += bytes_written_now;
+    if (bytes_written_now < chunk) {
+      break; // Timed out
+    }
+    // Leave one chunk queued in the driver, so a write from another lane
+    // does not queue behind more of the bulk data.
+    if (bytes_written < size) {
+      this->pimpl_->waitOutputBelow (chunk);
+    }
+  }
+  return bytes_written;
+}
+
+size_t
+Serial::writeFrame (const uint8_t *data, size_t size,
+                    const serial::framing::Encoder &encoder)
+{
+  ScopedWriteLock lock(this->pimpl_);
+  // Small frames are encoded on the stack, larger ones on the heap, so the
+  // size of a frame does not bound the stack.
+  uint8_t stack_buffer[frame_stack_size];
+  vector<uint8_t> heap_buffer;
+  uint8_t *buffer_ = stack_buffer;
+  size_t max_length = encoder.maxEncodedSize (size);
+  if (max_length > frame_stack_size) {
+    heap_buffer.resize (max_length);
+    buffer_ = &heap_buffer[0];
+  }
+  size_t length = encoder.encode (data, size, buffer_);
+  return this->write_ (buffer_, length);
+}
+
 size_t
 Serial::write_ (const uint8_t *data, size_t length)
 {
   return pimpl_->write (data, length);
 }
 
+size_t
+serial::LineMatcher::replySize (const uint8_t *data, size_t size) const
+{
+  const uint8_t *eol = reinterpret_cast<const uint8_t*> (eol_.data ());
+  const uint8_t *end = std::search (data, data + size,
+                                    eol, eol + eol_.length ());
+  return end == data + size ? 0 : end - data + eol_.length ();
+}
+
+string
+Serial::transact (const string &request, const serial::ReplyMatcher &matcher,
+                  const Deadline &deadline)
+{
+  vector<serial::Exchange> exchanges (1, serial::Exchange (request));
+  this->transact (exchanges, matcher, deadline, 1);
+  return exchanges[0].reply;
+}
+
+size_t
+Serial::transact (vector<serial::Exchange> &exchanges,
+                  const serial::ReplyMatcher &matcher,
+                  const Deadline &deadline, size_t window)
+{
+  if (window == 0) {
+    throw invalid_argument ("transact needs a window of at least 1");
+  }
+  ScopedReadLock rlock(this->pimpl_);
+  ScopedWriteLock wlock(this->pimpl_);
+  for (size_t i = 0; i < exchanges.size (); ++i) {
+    exchanges[i].reply.clear ();
+    exchanges[i].done = false;
+  }
+
+  vector<size_t> outstanding;       // Exchanges waiting, oldest first
+  vector<uint32_t> tags;            // Tags of the outstanding requests
+  vector<uint8_t> received;         // Bytes of the reply being read
+  size_t next = 0, completed = 0;
+  while (true) {
+    while (next < exchanges.size () && outstanding.size () < window) {
+      const string &request = exchanges[next].request;
+      const uint8_t *data = reinterpret_cast<const uint8_t*> (request.data ());
+      if (this->pimpl_->write (data, request.length (), deadline.ns)
+          < request.length ()) {
+        return completed;
+      }
+      outstanding.push_back (next++);
+      tags.push_back (matcher.requestTag (data, request.length ()));
+    }
+    if (outstanding.empty ()) {
+      break;
+    }
+
+    // Take whatever arrived in one read, so a reply costs few system calls
+    // and few scans by the matcher.  Bytes past the last reply are dropped.
+    size_t available = this->pimpl_->available ();
+    size_t size = available > 1 ? available : 1;
+    size_t offset = received.size ();
+    received.resize (offset + size);
+    size_t bytes_read = this->pimpl_->read (&received[offset], size,
+                                            deadline.ns);
+    received.resize (offset + bytes_read);
+    if (bytes_read == 0) {
+      break; // Deadline passed
+    }
+
+    size_t start = 0, reply_size;
+    while (start < received.size ()
+           && (reply_size = matcher.replySize (&received[start],
+                                               received.size () - start))) {
+      uint32_t tag = matcher.replyTag (&received[start], reply_size);
+      vector<uint32_t>::iterator found =
+        std::find (tags.begin (), tags.end (), tag);
+      if (found != tags.end ()) {
+        size_t slot = static_cast<size_t> (found - tags.begin ());
+        serial::Exchange &exchange = exchanges[outstanding[slot]];
+        exchange.reply.assign (reinterpret_cast<const char*> (&received[start]),
+                               reply_size);
+        exchange.done = true;
+        ++completed;
+        outstanding.erase (outstanding.begin () + slot);
+        tags.erase (found);
+      }
+      start += reply_size;
+    }
+    received.erase (received.begin (), received.begin () + start);
+  }
+  return completed;
+}
+
 void
 Serial::setPort (const string &port)
 {
@@ -367,6 +677,32 @@ Serial::getFlowcontrol () const
   return pimpl_->getFlowcontrol ();
 }
 
+void
+Serial::setWriteRate (const WriteRate &rate)
+{
+  ScopedWriteLock lock(this->pimpl_);
+  pimpl_->setWriteRate (rate);
+}
+
+serial::WriteRate
+Serial::getWriteRate () const
+{
+  return pimpl_->getWriteRate ();
+}
+
+void
+Serial::setBulkLatency (uint32_t microseconds)
+{
+  ScopedWriteLock lock(this->pimpl_);
+  pimpl_->setBulkLatency (microseconds);
+}
+
+uint32_t
+Serial::getBulkLatency () const
+{
+  return pimpl_->getBulkLatency ();
+}
+
 void Serial::flush ()
 {
   ScopedReadLock rlock(this->pimpl_);
@@ -386,6 +722,26 @@ void Serial::flushOutput ()
   pimpl_->flushOutput ();
 }
 
+size_t Serial::outputQueueBytes ()
+{
+  return pimpl_->outputQueueBytes ();
+}
+
+bool Serial::waitDrained (uint32_t timeout)
+{
+  return pimpl_->waitDrained (timeout);
+}
+
+void Serial::onDrained (DrainHandler &handler)
+{
+  pimpl_->onDrained (handler);
+}
+
+void Serial::cancelDrained ()
+{
+  pimpl_->cancelDrained ();
+}
+
 void Serial::sendBreak (int duration)
 {
   pimpl_->sendBreak (duration);
@@ -406,6 +762,16 @@ void Serial::setDTR (bool level)
   pimpl_->setDTR (level);
 }
 
+void Serial::setModemLines (uint32_t mask, uint32_t values)
+{
+  pimpl_->setModemLines (mask, values);
+}
+
+void Serial::runLineSequence (const vector<serial::ModemLineStep> &steps)
+{
+  pimpl_->runLineSequence (steps);
+}
+
 bool Serial::waitForChange()
 {
   return pimpl_->waitForChange();
@@ -430,3 +796,137 @@ bool Serial::getCD ()
 {
   return pimpl_->getCD ();
 }
+
+serial::Stats Serial::getStats () const
+{
+  return pimpl_->getStats ();
+}
+
+void Serial::resetStats ()
+{
+  pimpl_->resetStats ();
+}
+
+serial::LineCounters Serial::getLineCounters ()
+{
+  LineCounters delta;
+  return pimpl_->getLineCounters (delta);
+}
+
+serial::LineCounters Serial::getLineCounters (LineCounters &delta)
+{
+  return pimpl_->getLineCounters (delta);
+}
+
+void Serial::startLineMonitor (LineMonitorHandler &handler,
+                               uint32_t period_ms)
+{
+  pimpl_->startLineMonitor (handler, period_ms);
+}
+
+void Serial::stopLineMonitor ()
+{
+  pimpl_->stopLineMonitor ();
+}
+
+void Serial::enableFlightRecorder (size_t capacity)
+{
+  ScopedReadLock rlock(this->pimpl_);
+  ScopedWriteLock wlock(this->pimpl_);
+  pimpl_->enableFlightRecorder (capacity);
+}
+
+void Serial::disableFlightRecorder ()
+{
+  ScopedReadLock rlock(this->pimpl_);
+  ScopedWriteLock wlock(this->pimpl_);
+  pimpl_->disableFlightRecorder ();
+}
+
+vector<serial::RecordedChunk> Serial::getFlightRecord () const
+{
+  return pimpl_->getFlightRecord ();
+}
+
+void Serial::setFlightRecordHandler (FlightRecordHandler *handler)
+{
+  pimpl_->setFlightRecordHandler (handler);
+}
+
+serial::LineCounters
+serial::LineCounters::since (const LineCounters &earlier) const
+{
+  // Unsigned subtraction gives the right count across a wrap around.
+  LineCounters delta;
+  delta.rx = rx - earlier.rx;
+  delta.tx = tx - earlier.tx;
+  delta.frame = frame - earlier.frame;
+  delta.overrun = overrun - earlier.overrun;
+  delta.parity = parity - earlier.parity;
+  delta.brk = brk - earlier.brk;
+  delta.buf_overrun = buf_overrun - earlier.buf_overrun;
+  return delta;
+}
+
+const size_t serial::LatencyHistogram::bucket_count;
+
+serial::LatencyHistogram::LatencyHistogram ()
+  : count (0), total_ns (0), max_ns (0)
+{
+  std::fill (buckets, buckets + bucket_count, 0);
+}
+
+size_t
+serial::LatencyHistogram::bucketIndex (uint64_t ns)
+{
+  // Latencies below 8ns have a bucket each, above that every power of two
+  // is split into 8 sub-buckets by the 3 bits below the leading one.
+  if (ns < 8) {
+    return static_cast<size_t> (ns);
+  }
+#if defined(__GNUC__)
+  size_t exponent = 63 - static_cast<size_t> (__builtin_clzll (ns));
+#else
+  size_t exponent = 3;
+  while (exponent < 63 && (ns >> (exponent + 1)) != 0) {
+    ++exponent;
+  }
+#endif
+  size_t index = (exponent - 2) * 8
+               + static_cast<size_t> ((ns >> (exponent - 3)) & 7);
+  return min (index, bucket_count - 1);
+}
+
+uint64_t
+serial::LatencyHistogram::bucketLowerBound (size_t index)
+{
+  if (index < 8) {
+    return index;
+  }
+  size_t exponent = index / 8 + 2;
+  return static_cast<uint64_t> (8 + index % 8) << (exponent - 3);
+}
+
+uint64_t
+serial::LatencyHistogram::percentile (double fraction) const
+{
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t> (fraction * static_cast<double> (count));
+  rank = std::max (uint64_t (1), min (rank, count));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < bucket_count - 1; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return min (bucketLowerBound (i + 1) - 1, max_ns);
+    }
+  }
+  return max_ns;
+}
+
+uint64_t
+serial::LatencyHistogram::mean () const
+{
+  return count == 0 ? 0 : total_ns / count;
+}
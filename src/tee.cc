@@ -0,0 +1,368 @@
+/* Copyright 2012 William Woodall and John Harrison */
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+
+#include "serial/tee.h"
+#include "serial/impl/condition.h"
+#include "serial/impl/stats.h"
+
+using std::invalid_argument;
+using std::min;
+using std::string;
+using std::vector;
+
+using serial::Deadline;
+using serial::IOException;
+using serial::Serial;
+using serial::Tee;
+using serial::TeeReader;
+using serial::Timeout;
+using serial::tee_policy_t;
+
+namespace {
+
+// Longest the drain thread waits before checking whether to stop.
+const uint64_t max_wait_ns = 100000000;
+
+} // namespace
+
+Tee::Tee (Serial &port, size_t capacity)
+  : port_ (port), head_ (0), stopping_ (false), running_ (true),
+    started_ (false)
+{
+  if (capacity == 0) {
+    throw invalid_argument ("the capacity of a tee must be at least 1");
+  }
+  buffer_.resize (capacity);
+  pthread_mutex_init (&mutex_, NULL);
+  serial::condition::init (data_cond_);
+  serial::condition::init (space_cond_);
+  int result = pthread_create (&drain_thread_, NULL, &Tee::drainThread_,
+                               this);
+  if (result) {
+    pthread_cond_destroy (&space_cond_);
+    pthread_cond_destroy (&data_cond_);
+    pthread_mutex_destroy (&mutex_);
+    THROW (IOException, result);
+  }
+  started_ = true;
+}
+
+Tee::~Tee ()
+{
+  stop ();
+  pthread_cond_destroy (&space_cond_);
+  pthread_cond_destroy (&data_cond_);
+  pthread_mutex_destroy (&mutex_);
+}
+
+void
+Tee::stop ()
+{
+  if (!started_) {
+    return;
+  }
+  stopping_ = true;
+  pthread_mutex_lock (&mutex_);
+  pthread_cond_signal (&space_cond_);
+  pthread_mutex_unlock (&mutex_);
+  pthread_join (drain_thread_, NULL);
+  started_ = false;
+}
+
+bool
+Tee::isRunning () const
+{
+  pthread_mutex_lock (&mutex_);
+  bool running = running_;
+  pthread_mutex_unlock (&mutex_);
+  return running;
+}
+
+uint64_t
+Tee::getBytesReceived () const
+{
+  pthread_mutex_lock (&mutex_);
+  uint64_t head = head_;
+  pthread_mutex_unlock (&mutex_);
+  return head;
+}
+
+void *
+Tee::drainThread_ (void *arg)
+{
+  static_cast<Tee *> (arg)->drain_ ();
+  return NULL;
+}
+
+void
+Tee::drain_ ()
+{
+  size_t capacity = buffer_.size ();
+  try {
+    while (!stopping_) {
+      size_t want = port_.available ();
+      if (want == 0) {
+        // Wait for a byte outside the buffer, so no reader loses bytes
+        // to a read which may time out.
+        uint8_t byte;
+        if (port_.read (&byte, 1, Deadline::fromNow (100)) == 1) {
+          publish_ (byte);
+        }
+        continue;
+      }
+      pthread_mutex_lock (&mutex_);
+      size_t size = reserve_ (want);
+      if (size == 0) {
+        // A blocking reader is a whole buffer behind.
+        wait_ (space_cond_, serial::stats::now_ns () + max_wait_ns);
+        pthread_mutex_unlock (&mutex_);
+        continue;
+      }
+      size_t offset = static_cast<size_t> (head_ % capacity);
+      pthread_mutex_unlock (&mutex_);
+      // Only the drain thread writes there, and no reader reads there.
+      size_t bytes_read = port_.read (&buffer_[offset], size,
+                                      Deadline::fromNow (100));
+      pthread_mutex_lock (&mutex_);
+      head_ += bytes_read;
+      pthread_cond_broadcast (&data_cond_);
+      pthread_mutex_unlock (&mutex_);
+    }
+  } catch (const std::exception &) {
+    // The port failed, the readers time out once they read what is left.
+  }
+  pthread_mutex_lock (&mutex_);
+  running_ = false;
+  pthread_cond_broadcast (&data_cond_);
+  pthread_mutex_unlock (&mutex_);
+}
+
+void
+Tee::publish_ (uint8_t byte)
+{
+  pthread_mutex_lock (&mutex_);
+  while (reserve_ (1) == 0) {
+    if (stopping_) {
+      pthread_mutex_unlock (&mutex_);
+      return;
+    }
+    wait_ (space_cond_, serial::stats::now_ns () + max_wait_ns);
+  }
+  buffer_[static_cast<size_t> (head_ % buffer_.size ())] = byte;
+  head_ += 1;
+  pthread_cond_broadcast (&data_cond_);
+  pthread_mutex_unlock (&mutex_);
+}
+
+size_t
+Tee::reserve_ (size_t want)
+{
+  size_t capacity = buffer_.size ();
+  // Reads go into one contiguous part of the buffer.
+  size_t size = min (want, capacity - static_cast<size_t> (head_ % capacity));
+  for (size_t i = 0; i < readers_.size (); ++i) {
+    TeeReader &reader = *readers_[i];
+    if (reader.policy_ == tee_block) {
+      size = min (size, capacity - static_cast<size_t> (head_
+                                                        - reader.cursor_));
+    }
+  }
+  for (size_t i = 0; i < readers_.size (); ++i) {
+    TeeReader &reader = *readers_[i];
+    if (head_ + size - reader.cursor_ > capacity) {
+      uint64_t oldest = head_ + size - capacity;
+      reader.dropped_ += oldest - reader.cursor_;
+      reader.cursor_ = oldest;
+    }
+  }
+  return size;
+}
+
+void
+Tee::wait_ (pthread_cond_t &cond, uint64_t deadline_ns)
+{
+  uint64_t wake_ns = serial::stats::now_ns () + max_wait_ns;
+  serial::condition::wait_until (cond, mutex_, min (deadline_ns, wake_ns));
+}
+
+TeeReader::TeeReader (Tee &tee, tee_policy_t policy, Timeout timeout)
+  : tee_ (tee), policy_ (policy), timeout_ (timeout), cursor_ (0),
+    dropped_ (0)
+{
+  pthread_mutex_lock (&tee_.mutex_);
+  cursor_ = tee_.head_;
+  tee_.readers_.push_back (this);
+  pthread_mutex_unlock (&tee_.mutex_);
+}
+
+TeeReader::~TeeReader ()
+{
+  pthread_mutex_lock (&tee_.mutex_);
+  tee_.readers_.erase (std::find (tee_.readers_.begin (),
+                                  tee_.readers_.end (), this));
+  // The drain thread may have been waiting for this reader.
+  pthread_cond_signal (&tee_.space_cond_);
+  pthread_mutex_unlock (&tee_.mutex_);
+}
+
+size_t
+TeeReader::available ()
+{
+  pthread_mutex_lock (&tee_.mutex_);
+  size_t pending = static_cast<size_t> (min (tee_.head_ - cursor_,
+    static_cast<uint64_t> (tee_.buffer_.size ())));
+  pthread_mutex_unlock (&tee_.mutex_);
+  return pending;
+}
+
+size_t
+TeeReader::copy_ (uint8_t *buffer, size_t size)
+{
+  size_t capacity = tee_.buffer_.size ();
+  size_t count = static_cast<size_t> (min (static_cast<uint64_t> (size),
+                                           tee_.head_ - cursor_));
+  if (count == 0) {
+    return 0;
+  }
+  size_t offset = static_cast<size_t> (cursor_ % capacity);
+  size_t first = min (count, capacity - offset);
+  std::copy (tee_.buffer_.begin () + offset,
+             tee_.buffer_.begin () + offset + first, buffer);
+  std::copy (tee_.buffer_.begin (), tee_.buffer_.begin () + (count - first),
+             buffer + first);
+  cursor_ += count;
+  if (policy_ == tee_block) {
+    pthread_cond_signal (&tee_.space_cond_);
+  }
+  return count;
+}
+
+size_t
+TeeReader::read (uint8_t *buffer, size_t size)
+{
+  pthread_mutex_lock (&tee_.mutex_);
+  size_t bytes_read = copy_ (buffer, size);
+  if (bytes_read < size) {
+    uint64_t now_ns = serial::stats::now_ns ();
+    uint64_t total_timeout_ns = timeout_.read_timeout_constant;
+    total_timeout_ns += static_cast<uint64_t> (timeout_.read_timeout_multiplier)
+                        * size;
+    uint64_t deadline_ns = now_ns + total_timeout_ns * timeout_.unit_ns;
+    uint64_t inter_byte_timeout_ns =
+      timeout_.inter_byte_timeout == Timeout::max ()
+      ? 0 : static_cast<uint64_t> (timeout_.inter_byte_timeout)
+            * timeout_.unit_ns;
+    // Waits wake up at least every max_wait_ns, the inter-byte timeout
+    // runs from the last byte copied rather than from the last wake-up.
+    uint64_t last_byte_ns = now_ns;
+    while (bytes_read < size && tee_.running_) {
+      uint64_t wait_until = deadline_ns;
+      if (inter_byte_timeout_ns > 0 && bytes_read > 0) {
+        wait_until = min (wait_until, last_byte_ns + inter_byte_timeout_ns);
+      }
+      tee_.wait_ (tee_.data_cond_, wait_until);
+      size_t copied = copy_ (buffer + bytes_read, size - bytes_read);
+      now_ns = serial::stats::now_ns ();
+      if (copied == 0 && now_ns >= wait_until) {
+        break;
+      }
+      if (copied > 0) {
+        last_byte_ns = now_ns;
+      }
+      bytes_read += copied;
+    }
+  }
+  pthread_mutex_unlock (&tee_.mutex_);
+  return bytes_read;
+}
+
+size_t
+TeeReader::read (vector<uint8_t> &buffer, size_t size)
+{
+  size_t offset = buffer.size ();
+  buffer.resize (offset + size);
+  size_t bytes_read = size > 0 ? read (&buffer[offset], size) : 0;
+  buffer.resize (offset + bytes_read);
+  return bytes_read;
+}
+
+size_t
+TeeReader::read (string &buffer, size_t size)
+{
+  vector<uint8_t> bytes;
+  size_t bytes_read = read (bytes, size);
+  if (bytes_read > 0) {
+    buffer.append (reinterpret_cast<const char*> (&bytes[0]), bytes_read);
+  }
+  return bytes_read;
+}
+
+string
+TeeReader::read (size_t size)
+{
+  string buffer;
+  read (buffer, size);
+  return buffer;
+}
+
+size_t
+TeeReader::readline (string &buffer, size_t size, string eol)
+{
+  size_t eol_len = eol.length ();
+  size_t read_so_far = 0;
+  string line;
+  while (read_so_far < size) {
+    uint8_t byte;
+    if (read (&byte, 1) == 0) {
+      break; // Timeout occured on reading 1 byte
+    }
+    line.push_back (static_cast<char> (byte));
+    ++read_so_far;
+    if (read_so_far >= eol_len
+        && line.compare (read_so_far - eol_len, eol_len, eol) == 0) {
+      break; // EOL found
+    }
+  }
+  buffer.append (line);
+  return read_so_far;
+}
+
+string
+TeeReader::readline (size_t size, string eol)
+{
+  string buffer;
+  readline (buffer, size, eol);
+  return buffer;
+}
+
+void
+TeeReader::setTimeout (const Timeout &timeout)
+{
+  timeout_ = timeout;
+}
+
+Timeout
+TeeReader::getTimeout () const
+{
+  return timeout_;
+}
+
+tee_policy_t
+TeeReader::getPolicy () const
+{
+  return policy_;
+}
+
+uint64_t
+TeeReader::getDroppedBytes () const
+{
+  pthread_mutex_lock (&tee_.mutex_);
+  uint64_t dropped = dropped_;
+  pthread_mutex_unlock (&tee_.mutex_);
+  return dropped;
+}
+
+#endif // !defined(_WIN32)
@@ -0,0 +1,222 @@
+#include "gtest/gtest.h"
+#include "serial/broker.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <pty.h>
+#else
+#include <util.h>
+#endif
+
+using namespace serial;
+using namespace serial::broker;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+class BrokerTests : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    char name[100];
+    ASSERT_NE(openpty(&master_fd, &slave_fd, name, NULL, NULL), -1);
+    port = new Serial(string(name), 115200);
+    segment = "/serial_broker_test_" + std::to_string(getpid());
+  }
+
+  virtual void TearDown() {
+    delete port;
+    close(master_fd);
+    close(slave_fd);
+  }
+
+  // Reads what arrives on the master side within timeout_ms.
+  string readMaster(size_t size, int timeout_ms) {
+    string data;
+    while (data.size() < size) {
+      pollfd pfd = { master_fd, POLLIN, 0 };
+      if (poll(&pfd, 1, timeout_ms) <= 0) {
+        break;
+      }
+      char buffer[256];
+      ssize_t n = ::read(master_fd, buffer, sizeof(buffer));
+      if (n <= 0) {
+        break;
+      }
+      data.append(buffer, n);
+    }
+    return data;
+  }
+
+  Serial *port;
+  int master_fd;
+  int slave_fd;
+  string segment;
+};
+
+TEST_F(BrokerTests, everyClientReadsEveryLine) {
+  Broker broker(*port, segment);
+  SharedSerial a(segment, Timeout::simpleTimeout(500));
+  SharedSerial b(segment, Timeout::simpleTimeout(500));
+
+  ASSERT_EQ(6, write(master_fd, "hello\n", 6));
+  EXPECT_EQ("hello\n", a.readline());
+  EXPECT_EQ("hello\n", b.readline());
+  EXPECT_EQ(0u, a.available());
+
+  vector<ConsumerInfo> consumers = broker.getConsumers();
+  ASSERT_EQ(2u, consumers.size());
+  EXPECT_EQ(static_cast<uint32_t>(getpid()), consumers[0].pid);
+  EXPECT_EQ(0u, consumers[0].lag);
+  EXPECT_EQ(6u, broker.getBytesPublished());
+}
+
+TEST_F(BrokerTests, readTimesOut) {
+  Broker broker(*port, segment);
+  SharedSerial client(segment, Timeout::simpleTimeout(50));
+  EXPECT_EQ("", client.read(4));
+}
+
+TEST_F(BrokerTests, clientWritesReachThePort) {
+  Broker broker(*port, segment);
+  SharedSerial a(segment, Timeout::simpleTimeout(500));
+  SharedSerial b(segment, Timeout::simpleTimeout(500));
+
+  EXPECT_EQ(4u, a.write(string("abc\n")));
+  EXPECT_EQ(4u, b.write(string("def\n")));
+  EXPECT_EQ("abc\ndef\n", readMaster(8, 500));
+
+  // Larger than half the queue, so it goes as several records.
+  string bulk(5000, 'x');
+  EXPECT_EQ(bulk.size(), a.write(bulk));
+  EXPECT_EQ(bulk, readMaster(bulk.size(), 500));
+}
+
+TEST_F(BrokerTests, recordsLargerThanThePortBuffer) {
+  Broker broker(*port, segment, 1 << 20, 1 << 18);
+  SharedSerial client(segment, Timeout::simpleTimeout(500));
+
+  // One record, far larger than the pty buffer, read slowly.
+  string bulk;
+  for (size_t i = 0; i < 100000; i++) {
+    bulk.push_back(static_cast<char>('a' + i % 26));
+  }
+  EXPECT_EQ(bulk.size(), client.write(bulk));
+  string data;
+  while (data.size() < bulk.size()) {
+    usleep(1000);
+    string more = readMaster(1, 500);
+    if (more.empty()) {
+      break;
+    }
+    data += more;
+  }
+  EXPECT_EQ(bulk.size(), data.size());
+  EXPECT_TRUE(bulk == data);
+  EXPECT_TRUE(broker.isRunning());
+}
+
+TEST_F(BrokerTests, slowClientCountsDroppedBytes) {
+  Broker broker(*port, segment, 4096, 4096);
+  SharedSerial client(segment, Timeout::simpleTimeout(500));
+
+  string chunk(1000, 'y');
+  for (int i = 0; i < 6; i++) {
+    ASSERT_EQ(1000, write(master_fd, chunk.data(), chunk.size()));
+    for (int j = 0; j < 100 && broker.getBytesPublished() < 1000u * (i + 1);
+         j++) {
+      usleep(10000);
+    }
+  }
+  ASSERT_EQ(6000u, broker.getBytesPublished());
+  EXPECT_EQ(4096u, client.available());
+  EXPECT_EQ(4096u, client.read(8192).size());
+  EXPECT_EQ(6000u - 4096u, client.getDroppedBytes());
+  EXPECT_EQ(6000u - 4096u, broker.getConsumers()[0].dropped);
+}
+
+TEST_F(BrokerTests, otherProcessesRead) {
+  Broker broker(*port, segment);
+  int ready[2];
+  ASSERT_EQ(0, pipe(ready));
+  pid_t child = fork();
+  ASSERT_NE(-1, child);
+  if (child == 0) {
+    SharedSerial client(segment, Timeout::simpleTimeout(1000));
+    char c = 'r';
+    if (write(ready[1], &c, 1) != 1) {
+      _exit(2);
+    }
+    _exit(client.readline() == "from afar\n" ? 0 : 1);
+  }
+  char c;
+  ASSERT_EQ(1, read(ready[0], &c, 1));
+  ASSERT_EQ(10, write(master_fd, "from afar\n", 10));
+  int status;
+  ASSERT_EQ(child, waitpid(child, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+  close(ready[0]);
+  close(ready[1]);
+}
+
+TEST_F(BrokerTests, writeFailsOnceStopped) {
+  Broker broker(*port, segment);
+  SharedSerial client(segment);
+  broker.stop();
+  EXPECT_FALSE(broker.isRunning());
+  EXPECT_THROW(client.write(string("late")), SerialException);
+}
+
+TEST_F(BrokerTests, segmentOfARunningBroker) {
+  Broker broker(*port, segment);
+  EXPECT_THROW(Broker other(*port, segment), SerialException);
+  // The refused broker left the segment alone.
+  SharedSerial client(segment, Timeout::simpleTimeout(500));
+  ASSERT_EQ(6, write(master_fd, "still\n", 6));
+  EXPECT_EQ("still\n", client.readline());
+
+  int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+  ASSERT_NE(-1, fd);
+  struct stat info;
+  ASSERT_EQ(0, fstat(fd, &info));
+  EXPECT_EQ(0600u, info.st_mode & 0777u);
+  close(fd);
+}
+
+TEST_F(BrokerTests, segmentOfADeadBroker) {
+  pid_t child = fork();
+  ASSERT_NE(-1, child);
+  if (child == 0) {
+    // Exits without removing the segment.
+    new Broker(*port, segment);
+    _exit(0);
+  }
+  int status;
+  ASSERT_EQ(child, waitpid(child, &status, 0));
+  ASSERT_TRUE(WIFEXITED(status));
+
+  Broker broker(*port, segment);
+  SharedSerial client(segment, Timeout::simpleTimeout(500));
+  ASSERT_EQ(6, write(master_fd, "fresh\n", 6));
+  EXPECT_EQ("fresh\n", client.readline());
+}
+
+TEST_F(BrokerTests, noBrokerNoClient) {
+  EXPECT_THROW(SharedSerial client(segment), SerialException);
+  EXPECT_THROW(Broker broker(*port, segment, 5000), std::invalid_argument);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,146 @@
+#include "gtest/gtest.h"
+#include "serial/capture.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+using namespace serial;
+using namespace serial::capture;
+
+using std::string;
+
+namespace {
+
+class CaptureTests : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    char name[] = "/tmp/serial_capture_XXXXXX";
+    int fd = mkstemp(name);
+    ASSERT_NE(-1, fd);
+    close(fd);
+    path = name;
+    page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  }
+
+  virtual void TearDown() {
+    unlink(path.c_str());
+  }
+
+  string path;
+  size_t page;
+};
+
+TEST_F(CaptureTests, chunksReadBack) {
+  {
+    Writer writer(path);
+    writer.append(direction_tx, 3, string("AT\r"), 100);
+    writer.append(direction_rx, 3, string("OK\r\n"), 200);
+    writer.append(direction_rx, 7, string(""), 300);
+    EXPECT_EQ(7u, writer.getBytesWritten());
+  }
+  Reader reader(path);
+  EXPECT_EQ(1u, reader.getSegmentCount());
+  EXPECT_GT(reader.getStartRealtime(), 0u);
+  Chunk chunk;
+  ASSERT_TRUE(reader.next(chunk));
+  EXPECT_EQ(100u, chunk.timestamp_ns);
+  EXPECT_EQ(3, chunk.port);
+  EXPECT_EQ(direction_tx, chunk.direction);
+  EXPECT_EQ("AT\r", string(reinterpret_cast<const char*>(chunk.data),
+                           chunk.size));
+  ASSERT_TRUE(reader.next(chunk));
+  EXPECT_EQ(direction_rx, chunk.direction);
+  EXPECT_EQ("OK\r\n", string(reinterpret_cast<const char*>(chunk.data),
+                             chunk.size));
+  ASSERT_TRUE(reader.next(chunk));
+  EXPECT_EQ(7, chunk.port);
+  EXPECT_EQ(0u, chunk.size);
+  EXPECT_FALSE(reader.next(chunk));
+
+  reader.rewind();
+  ASSERT_TRUE(reader.next(chunk));
+  EXPECT_EQ(100u, chunk.timestamp_ns);
+}
+
+TEST_F(CaptureTests, timestampsDefaultToNow) {
+  Writer writer(path);
+  writer.append(direction_rx, 0, string("a"));
+  writer.append(direction_rx, 0, string("b"));
+  writer.close();
+  EXPECT_THROW(writer.append(direction_rx, 0, string("c")), IOException);
+
+  Reader reader(path);
+  Chunk first, second;
+  ASSERT_TRUE(reader.next(first));
+  ASSERT_TRUE(reader.next(second));
+  EXPECT_GE(first.timestamp_ns, reader.getStartMonotonic());
+  EXPECT_LE(first.timestamp_ns, second.timestamp_ns);
+}
+
+TEST_F(CaptureTests, chunksSpanSegments) {
+  string payload(page + page / 2, 'p');
+  {
+    Writer writer(path, page);
+    for (uint64_t t = 1; t <= 100; t++) {
+      writer.append(direction_rx, 0, string(100, 'a' + t % 26), t);
+    }
+    // Larger than a segment, so split.
+    writer.append(direction_tx, 1, payload, 101);
+  }
+  Reader reader(path);
+  EXPECT_GT(reader.getSegmentCount(), 3u);
+  Chunk chunk;
+  for (uint64_t t = 1; t <= 100; t++) {
+    ASSERT_TRUE(reader.next(chunk));
+    EXPECT_EQ(t, chunk.timestamp_ns);
+    EXPECT_EQ(100u, chunk.size);
+    EXPECT_EQ('a' + t % 26, chunk.data[99]);
+  }
+  string split;
+  while (reader.next(chunk)) {
+    EXPECT_EQ(101u, chunk.timestamp_ns);
+    split.append(reinterpret_cast<const char*>(chunk.data), chunk.size);
+  }
+  EXPECT_EQ(payload, split);
+}
+
+TEST_F(CaptureTests, seekFindsTheFirstChunkAtOrAfter) {
+  {
+    Writer writer(path, page);
+    for (uint64_t t = 10; t <= 5000; t += 10) {
+      writer.append(direction_rx, 0, string(40, 'x'), t);
+    }
+  }
+  Reader reader(path);
+  Chunk chunk;
+  reader.seek(2345);
+  ASSERT_TRUE(reader.next(chunk));
+  EXPECT_EQ(2350u, chunk.timestamp_ns);
+  reader.seek(10);
+  ASSERT_TRUE(reader.next(chunk));
+  EXPECT_EQ(10u, chunk.timestamp_ns);
+  reader.seek(1);
+  ASSERT_TRUE(reader.next(chunk));
+  EXPECT_EQ(10u, chunk.timestamp_ns);
+  reader.seek(4990);
+  ASSERT_TRUE(reader.next(chunk));
+  EXPECT_EQ(4990u, chunk.timestamp_ns);
+  reader.seek(6000);
+  EXPECT_FALSE(reader.next(chunk));
+}
+
+TEST_F(CaptureTests, rejectsOtherFiles) {
+  FILE *file = fopen(path.c_str(), "w");
+  ASSERT_TRUE(file != NULL);
+  fputs("not a capture, but long enough to hold a file header", file);
+  fclose(file);
+  EXPECT_THROW(Reader reader(path), SerialException);
+  EXPECT_THROW(Writer writer(path, page + 1), std::invalid_argument);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
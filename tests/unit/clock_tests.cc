@@ -0,0 +1,160 @@
+#include "gtest/gtest.h"
+#include "serial/clock.h"
+#include "serial/loopback.h"
+#include "serial/impl/stats.h"
+
+#include <vector>
+
+using namespace serial;
+
+using std::string;
+
+namespace {
+
+const uint64_t ms = 1000000;
+
+class ClockTests : public ::testing::Test {
+protected:
+  ClockTests() : clock(1000 * ms), pair(4), host(pair.first()),
+                 device(pair.second()) {}
+
+  virtual void SetUp() {
+    setClock(&clock);
+    wall_start = stats::now_ns();
+    start = clock.now();
+  }
+
+  virtual void TearDown() {
+    setClock(NULL);
+    // However long the timeouts, no test waits for them.
+    EXPECT_LT(stats::now_ns() - wall_start, 100 * ms);
+  }
+
+  uint64_t elapsed() {
+    return clock.now() - start;
+  }
+
+  VirtualClock clock;
+  LoopbackPair pair;
+  Serial host;
+  Serial device;
+  uint64_t wall_start;
+  uint64_t start;
+};
+
+TEST_F(ClockTests, totalTimeout) {
+  Timeout timeout = Timeout::simpleTimeout(5000);
+  host.setTimeout(timeout);
+  EXPECT_EQ("", host.read(10));
+  EXPECT_EQ(5000 * ms, elapsed());
+}
+
+TEST_F(ClockTests, multiplierTimeout) {
+  Timeout timeout(Timeout::max(), 100, 10);
+  host.setTimeout(timeout);
+  device.write("ab");
+  EXPECT_EQ("ab", host.read(5));
+  EXPECT_EQ(150 * ms, elapsed());
+}
+
+TEST_F(ClockTests, zeroTimeoutDoesNotWait) {
+  device.write("abc");
+  EXPECT_EQ("abc", host.read(10));
+  EXPECT_EQ(0u, elapsed());
+  EXPECT_EQ(0u, clock.getSleeps());
+}
+
+TEST_F(ClockTests, interByteTimeoutBoundsEachWait) {
+  Timeout timeout(10, 100, 0);
+  host.setTimeout(timeout);
+  device.write("abc");
+  EXPECT_EQ("abc", host.read(10));
+  // The read waits in steps of the inter-byte timeout until the total
+  // timeout.
+  EXPECT_EQ(100 * ms, elapsed());
+  EXPECT_EQ(10u, clock.getSleeps());
+}
+
+TEST_F(ClockTests, multiplierDoesNotOverflow) {
+  Timeout timeout(Timeout::max(), 0, Timeout::max());
+  host.setTimeout(timeout);
+  // (2^32 - 1) ms per byte overflows 64 bits of nanoseconds, so the
+  // timeout saturates rather than wrapping to almost nothing.
+  string data;
+  EXPECT_EQ(0u, host.read(data, 1 << 20));
+  EXPECT_EQ(static_cast<uint64_t>(1) << 62, elapsed());
+}
+
+TEST_F(ClockTests, deadlinesAreOnTheClock) {
+  Deadline deadline = Deadline::fromNow(250);
+  EXPECT_EQ(start + 250 * ms, deadline.ns);
+  uint8_t byte;
+  EXPECT_EQ(0u, host.read(&byte, 1, deadline));
+  EXPECT_EQ(250 * ms, elapsed());
+  EXPECT_TRUE(deadline.expired());
+}
+
+// Records the lines the device sees at every sleep of a line sequence,
+// and takes a millisecond longer than asked to wake up.
+class LineProbe : public VirtualClock {
+public:
+  LineProbe(uint64_t start_ns, Serial &device)
+    : VirtualClock(start_ns), device_(device) {}
+
+  virtual void sleepUntil(uint64_t deadline_ns) {
+    deadlines.push_back(deadline_ns);
+    cts.push_back(device_.getCTS());
+    dsr.push_back(device_.getDSR());
+    VirtualClock::sleepUntil(deadline_ns);
+    advance(ms);
+  }
+
+  std::vector<uint64_t> deadlines;
+  std::vector<bool> cts;
+  std::vector<bool> dsr;
+
+private:
+  Serial &device_;
+};
+
+TEST_F(ClockTests, lineSequence) {
+  LineProbe probe(start, device);
+  setClock(&probe);
+  // The reset sequence of an ESP32, RTS and DTR cross over to CTS and DSR.
+  std::vector<ModemLineStep> steps;
+  steps.push_back(ModemLineStep(modemline_dtr | modemline_rts,
+                                modemline_rts, 100000));
+  steps.push_back(ModemLineStep(modemline_dtr | modemline_rts,
+                                modemline_dtr, 50000));
+  steps.push_back(ModemLineStep(modemline_dtr, 0));
+  host.runLineSequence(steps);
+
+  ASSERT_EQ(2u, probe.deadlines.size());
+  EXPECT_TRUE(probe.cts[0]);
+  EXPECT_FALSE(probe.dsr[0]);
+  EXPECT_FALSE(probe.cts[1]);
+  EXPECT_TRUE(probe.dsr[1]);
+  EXPECT_FALSE(device.getCTS());
+  EXPECT_FALSE(device.getDSR());
+  // The late wake-ups do not push back the following steps.
+  EXPECT_EQ(start + 100 * ms, probe.deadlines[0]);
+  EXPECT_EQ(start + 150 * ms, probe.deadlines[1]);
+  EXPECT_EQ(start + 151 * ms, probe.now());
+}
+
+TEST_F(ClockTests, writeTimeout) {
+  Timeout timeout = Timeout::simpleTimeout(1000);
+  host.setTimeout(timeout);
+  // The loopback holds four bytes.
+  EXPECT_EQ(4u, host.write("abcdefgh"));
+  EXPECT_EQ(1000 * ms, elapsed());
+  clock.advance(ms);
+  EXPECT_EQ(1001 * ms, elapsed());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
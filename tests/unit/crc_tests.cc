@@ -0,0 +1,86 @@
+#include "gtest/gtest.h"
+#include "serial/crc.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+using std::vector;
+
+namespace {
+
+const uint8_t check[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+
+// Bitwise reference implementation of the reflected 32 bit CRCs.
+uint32_t reference_crc32 (uint32_t poly, const uint8_t *data, size_t size) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < size; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? ((crc >> 1) ^ poly) : (crc >> 1);
+    }
+  }
+  return ~crc;
+}
+
+TEST(CrcTests, check_values) {
+  EXPECT_EQ(0xF4, serial::crc::crc8(check, sizeof(check)));
+  EXPECT_EQ(0x4B37, serial::crc::crc16_modbus(check, sizeof(check)));
+  EXPECT_EQ(0x29B1, serial::crc::crc16_ccitt(check, sizeof(check)));
+  EXPECT_EQ(0xCBF43926u, serial::crc::crc32(check, sizeof(check)));
+  EXPECT_EQ(0xE3069283u, serial::crc::crc32c(check, sizeof(check)));
+  EXPECT_EQ(0u, serial::crc::crc32(NULL, 0));
+}
+
+TEST(CrcTests, incremental_matches_one_shot) {
+  vector<uint8_t> data(1000);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<uint8_t> (rand());
+  }
+  uint8_t c8 = 0;
+  uint16_t modbus = 0xFFFF, ccitt = 0xFFFF;
+  uint32_t c32 = 0, c32c = 0;
+  // Uneven chunks, as they would come from Serial::read.
+  for (size_t offset = 0, chunk = 1; offset < data.size(); chunk = chunk * 3 % 97 + 1) {
+    size_t n = std::min(chunk, data.size() - offset);
+    c8 = serial::crc::crc8(&data[offset], n, c8);
+    modbus = serial::crc::crc16_modbus(&data[offset], n, modbus);
+    ccitt = serial::crc::crc16_ccitt(&data[offset], n, ccitt);
+    c32 = serial::crc::crc32(&data[offset], n, c32);
+    c32c = serial::crc::crc32c(&data[offset], n, c32c);
+    offset += n;
+  }
+  EXPECT_EQ(serial::crc::crc8(&data[0], data.size()), c8);
+  EXPECT_EQ(serial::crc::crc16_modbus(&data[0], data.size()), modbus);
+  EXPECT_EQ(serial::crc::crc16_ccitt(&data[0], data.size()), ccitt);
+  EXPECT_EQ(serial::crc::crc32(&data[0], data.size()), c32);
+  EXPECT_EQ(serial::crc::crc32c(&data[0], data.size()), c32c);
+}
+
+// Covers the alignment prologue, the bulk loops and the tails of whichever
+// implementation was selected for this machine.
+TEST(CrcTests, bulk_matches_reference) {
+  vector<uint8_t> data(4096 + 16);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<uint8_t> (rand());
+  }
+  const size_t sizes[] = { 0, 1, 7, 8, 15, 16, 63, 64, 65, 127, 128, 200, 1000, 4096 };
+  for (size_t align = 0; align < 16; ++align) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      const uint8_t *p = &data[align];
+      size_t n = sizes[i];
+      EXPECT_EQ(reference_crc32(0xEDB88320, p, n), serial::crc::crc32(p, n))
+        << serial::crc::crc32Implementation() << " size " << n << " align " << align;
+      EXPECT_EQ(reference_crc32(0x82F63B78, p, n), serial::crc::crc32c(p, n))
+        << serial::crc::crc32cImplementation() << " size " << n << " align " << align;
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
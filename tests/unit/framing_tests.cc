@@ -0,0 +1,251 @@
+#include "gtest/gtest.h"
+#include "serial/framing.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <pty.h>
+#else
+#include <util.h>
+#endif
+
+using namespace serial;
+using namespace serial::framing;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+vector<uint8_t> random_frame (size_t size) {
+  vector<uint8_t> frame(size);
+  for (size_t i = 0; i < size; i++) {
+    // Bias towards the bytes which need special handling.
+    switch (rand() % 4) {
+    case 0: frame[i] = 0x00; break;
+    case 1: frame[i] = (rand() % 2) ? 0xC0 : 0xDB; break;
+    default: frame[i] = static_cast<uint8_t> (rand());
+    }
+  }
+  return frame;
+}
+
+vector<uint8_t> encode (const Encoder &encoder, const vector<uint8_t> &frame) {
+  vector<uint8_t> out(encoder.maxEncodedSize(frame.size()));
+  out.resize(encoder.encode(frame.empty() ? NULL : &frame[0], frame.size(),
+                            &out[0]));
+  return out;
+}
+
+/**
+ * Encode a few hundred random frames, including sizes around the 254 byte
+ * COBS block, and decode the stream in random sized chunks.
+ */
+void round_trip (const Encoder &encoder, Decoder &decoder, FramePool &pool,
+                 size_t min_size) {
+  vector<vector<uint8_t> > sent;
+  vector<uint8_t> stream;
+  for (size_t n = 0; n < 300; n++) {
+    size_t size = min_size + (n < 20 ? 250 + n : rand() % 600);
+    sent.push_back(random_frame(size));
+    vector<uint8_t> encoded = encode(encoder, sent.back());
+    EXPECT_LE(encoded.size(), encoder.maxEncodedSize(size));
+    stream.insert(stream.end(), encoded.begin(), encoded.end());
+  }
+  vector<Frame*> frames;
+  for (size_t offset = 0; offset < stream.size(); ) {
+    size_t chunk = std::min(stream.size() - offset, size_t(rand() % 700 + 1));
+    decoder.decode(&stream[offset], chunk, frames);
+    offset += chunk;
+  }
+  ASSERT_EQ(sent.size(), frames.size());
+  for (size_t i = 0; i < sent.size(); i++) {
+    EXPECT_TRUE(sent[i] == *frames[i]) << "frame " << i;
+  }
+  EXPECT_EQ(0u, decoder.getErrorCount());
+  pool.release(frames);
+}
+
+TEST(framing_tests, cobs_known_vectors) {
+  CobsEncoder encoder;
+  const uint8_t data[] = { 0x11, 0x22, 0x00, 0x33 };
+  const uint8_t expected[] = { 0x03, 0x11, 0x22, 0x02, 0x33, 0x00 };
+  vector<uint8_t> out = encode(encoder, vector<uint8_t>(data, data + 4));
+  EXPECT_TRUE(out == vector<uint8_t>(expected, expected + 6));
+
+  const uint8_t empty[] = { 0x01, 0x00 };
+  out = encode(encoder, vector<uint8_t>());
+  EXPECT_TRUE(out == vector<uint8_t>(empty, empty + 2));
+}
+
+TEST(framing_tests, cobs_round_trip) {
+  FramePool pool;
+  CobsDecoder decoder(pool);
+  round_trip(CobsEncoder(), decoder, pool, 0);
+}
+
+TEST(framing_tests, slip_round_trip) {
+  FramePool pool;
+  SlipDecoder decoder(pool);
+  round_trip(SlipEncoder(), decoder, pool, 1);
+}
+
+TEST(framing_tests, corrupt_frames_are_dropped) {
+  FramePool pool;
+  vector<Frame*> frames;
+
+  CobsDecoder cobs(pool);
+  // The code byte promises four more bytes, but the delimiter comes first.
+  const uint8_t bad_cobs[] = { 0x05, 0x11, 0x00, 0x02, 0x42, 0x00 };
+  cobs.decode(bad_cobs, sizeof(bad_cobs), frames);
+  ASSERT_EQ(1u, frames.size());
+  EXPECT_EQ(1u, frames[0]->size());
+  EXPECT_EQ(1u, cobs.getErrorCount());
+  pool.release(frames);
+
+  SlipDecoder slip(pool, 4);
+  const uint8_t bad_slip[] = { 0xC0, 0x01, 0xDB, 0x02, 0xC0,
+                               0x01, 0x02, 0x03, 0x04, 0x05, 0xC0,
+                               0x01, 0xDB, 0xDC, 0xC0 };
+  slip.decode(bad_slip, sizeof(bad_slip), frames);
+  ASSERT_EQ(1u, frames.size());
+  EXPECT_EQ(0xC0, (*frames[0])[1]);
+  EXPECT_EQ(2u, slip.getErrorCount());
+  pool.release(frames);
+}
+
+class FrameCollector : public FrameHandler {
+public:
+  virtual void onFrame (const uint8_t *frame, size_t size) {
+    frames.push_back(vector<uint8_t>(frame, frame + size));
+  }
+  vector<vector<uint8_t> > frames;
+};
+
+/**
+ * Frames of the form [AA 55][length][payload][CRC] where the payload is
+ * "123456789", so the CRC is the standard check value of each algorithm.
+ */
+vector<uint8_t> check_frame (uint32_t crc, size_t crc_size) {
+  const char payload[] = "123456789";
+  vector<uint8_t> frame;
+  frame.push_back(0xAA);
+  frame.push_back(0x55);
+  frame.push_back(9);
+  frame.insert(frame.end(), payload, payload + 9);
+  for (size_t i = 0; i < crc_size; i++) {
+    frame.push_back((crc >> (8 * i)) & 0xFF);
+  }
+  return frame;
+}
+
+FrameFormat check_format (crc_t crc, size_t crc_size) {
+  FrameFormat format;
+  format.sync.push_back(0xAA);
+  format.sync.push_back(0x55);
+  format.length_offset = 2;
+  format.length_adjust = 3 + crc_size;
+  format.crc = crc;
+  format.crc_offset = 3;
+  format.max_frame_size = 64;
+  return format;
+}
+
+TEST(framing_tests, frame_reader_check_values) {
+  const crc_t types[] = { crc_8, crc_16_modbus, crc_16_ccitt, crc_32 };
+  const uint32_t values[] = { 0xF4, 0x4B37, 0x29B1, 0xCBF43926 };
+  const size_t sizes[] = { 1, 2, 2, 4 };
+  for (size_t i = 0; i < 4; i++) {
+    FrameReader reader(check_format(types[i], sizes[i]));
+    FrameCollector collector;
+    vector<uint8_t> frame = check_frame(values[i], sizes[i]);
+    EXPECT_EQ(1u, reader.feed(&frame[0], frame.size(), collector)) << i;
+    frame.back() ^= 0x01;
+    EXPECT_EQ(0u, reader.feed(&frame[0], frame.size(), collector)) << i;
+    EXPECT_EQ(1u, reader.getCrcErrors()) << i;
+  }
+}
+
+TEST(framing_tests, frame_reader_resynchronizes) {
+  FrameReader reader(check_format(crc_16_ccitt, 2));
+  FrameCollector collector;
+  vector<uint8_t> good = check_frame(0x29B1, 2);
+
+  vector<uint8_t> stream;
+  const uint8_t garbage[] = { 0x00, 0xAA, 0x55, 0xFF, 0xAA, 0xAA, 0x55, 0x01 };
+  for (int n = 0; n < 50; n++) {
+    stream.insert(stream.end(), garbage, garbage + (n % 8));
+    stream.insert(stream.end(), good.begin(), good.end());
+  }
+  for (size_t offset = 0; offset < stream.size(); ) {
+    size_t chunk = std::min(stream.size() - offset, size_t(rand() % 40 + 1));
+    reader.feed(&stream[offset], chunk, collector);
+    offset += chunk;
+  }
+  ASSERT_EQ(50u, collector.frames.size());
+  for (size_t i = 0; i < collector.frames.size(); i++) {
+    EXPECT_TRUE(good == collector.frames[i]);
+  }
+  EXPECT_EQ(stream.size() - 50 * good.size(), reader.getSkippedBytes());
+}
+
+// Reads everything written to the master of a pty until the slave closes.
+struct PtyDrain {
+  int fd;
+  vector<uint8_t> data;
+};
+
+void *drain_pty(void *arg) {
+  PtyDrain *drain = static_cast<PtyDrain *>(arg);
+  uint8_t buffer[4096];
+  ssize_t r;
+  while ((r = read(drain->fd, buffer, sizeof(buffer))) > 0) {
+    drain->data.insert(drain->data.end(), buffer, buffer + r);
+  }
+  return NULL;
+}
+
+void check_write_frame(size_t size) {
+  int master_fd, slave_fd;
+  char name[100];
+  ASSERT_NE(openpty(&master_fd, &slave_fd, name, NULL, NULL), -1);
+  PtyDrain drain = { master_fd, vector<uint8_t>() };
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, drain_pty, &drain));
+  {
+    Serial port(string(name), 115200, Timeout::simpleTimeout(1000));
+    vector<uint8_t> frame = random_frame(size);
+    size_t written = port.writeFrame(&frame[0], frame.size(), CobsEncoder());
+    port.close();
+    close(slave_fd);
+    pthread_join(thread, NULL);
+    EXPECT_EQ(written, drain.data.size());
+
+    FramePool pool;
+    CobsDecoder decoder(pool, size);
+    vector<Frame*> frames;
+    decoder.decode(&drain.data[0], drain.data.size(), frames);
+    ASSERT_EQ(1u, frames.size());
+    EXPECT_TRUE(frame == *frames[0]);
+    pool.release(frames);
+  }
+  close(master_fd);
+}
+
+TEST(framing_tests, write_frame) {
+  check_write_frame(1000);
+}
+
+TEST(framing_tests, write_large_frame) {
+  // Encoded on the heap rather than the stack.
+  check_write_frame(1 << 20);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,183 @@
+#include "gtest/gtest.h"
+#include "serial/loopback.h"
+#include "serial/impl/stats.h"
+
+#include <pthread.h>
+
+using namespace serial;
+
+using std::string;
+
+namespace {
+
+// Answers every line read on the device with the line and "ok".
+struct Responder {
+  Serial *device;
+  size_t lines;
+};
+
+void *respond(void *arg) {
+  Responder *responder = static_cast<Responder *>(arg);
+  for (size_t i = 0; i < responder->lines; ++i) {
+    string line = responder->device->readline();
+    if (line.empty()) {
+      break;
+    }
+    responder->device->write(line.substr(0, line.size() - 1) + " ok\n");
+  }
+  return NULL;
+}
+
+void *raise_cts(void *arg) {
+  usleep(20000);
+  static_cast<Serial *>(arg)->setRTS(true);
+  return NULL;
+}
+
+TEST(LoopbackTests, bytesCrossOver) {
+  LoopbackPair pair;
+  Serial host(pair.first(), Timeout::simpleTimeout(100));
+  Serial device(pair.second(), Timeout::simpleTimeout(100));
+  EXPECT_TRUE(host.isOpen());
+
+  EXPECT_EQ(5u, host.write("hello"));
+  EXPECT_EQ(5u, device.available());
+  EXPECT_EQ(0u, host.available());
+  EXPECT_EQ("hello", device.read(5));
+  device.write("world\n");
+  EXPECT_EQ("world\n", host.readline());
+
+  host.write("dropped");
+  device.flushInput();
+  EXPECT_EQ(0u, device.available());
+  EXPECT_EQ(0u, host.outputQueueBytes());
+  EXPECT_TRUE(host.waitDrained(0));
+}
+
+TEST(LoopbackTests, bulkAndPacedWrites) {
+  LoopbackPair pair(1 << 16);
+  Serial host(pair.first(), Timeout::simpleTimeout(1000));
+  Serial device(pair.second(), Timeout::simpleTimeout(1000));
+  host.setBaudrate(115200);
+
+  // Bulk chunks take 5ms of the line, about 57 bytes at 115200.
+  string data(5700, 'x');
+  EXPECT_EQ(data.size(), host.write(data, priority_bulk));
+  Stats stats = host.getStats();
+  EXPECT_GE(stats.write_calls, 90u);
+  EXPECT_LE(stats.write_calls, 110u);
+  EXPECT_EQ(data, device.read(data.size()));
+
+  // At half the line rate 1152 bytes take 200ms.
+  host.setWriteRate(WriteRate::lineFraction(0.5));
+  data.assign(1152, 'y');
+  uint64_t start_ns = stats::now_ns();
+  EXPECT_EQ(data.size(), host.write(data));
+  uint64_t elapsed_ns = stats::now_ns() - start_ns;
+  EXPECT_GE(elapsed_ns, 190000000u);
+  EXPECT_LT(elapsed_ns, 400000000u);
+  EXPECT_EQ(data, device.read(data.size()));
+}
+
+TEST(LoopbackTests, readsTimeOut) {
+  LoopbackPair pair;
+  Serial host(pair.first(), Timeout::simpleTimeout(50));
+  Serial device(pair.second(), Timeout::simpleTimeout(50));
+
+  uint64_t start_ns = stats::now_ns();
+  EXPECT_EQ("", host.read(1));
+  uint64_t elapsed_ns = stats::now_ns() - start_ns;
+  EXPECT_GE(elapsed_ns, 50000000u);
+  EXPECT_LT(elapsed_ns, 80000000u);
+
+  // Bytes on the way do not wait out the timeout.
+  device.write("ab");
+  start_ns = stats::now_ns();
+  EXPECT_EQ("ab", host.read(2));
+  EXPECT_LT(stats::now_ns() - start_ns, 10000000u);
+}
+
+TEST(LoopbackTests, writesWaitForRoom) {
+  LoopbackPair pair(4);
+  Serial host(pair.first(), Timeout::simpleTimeout(20));
+  Serial device(pair.second(), Timeout::simpleTimeout(20));
+
+  EXPECT_EQ(4u, host.write("abcdef"));
+  EXPECT_EQ("ab", device.read(2));
+  EXPECT_EQ(2u, host.write("ef"));
+  EXPECT_EQ("cdef", device.read(4));
+}
+
+TEST(LoopbackTests, modemLinesAreCrossed) {
+  LoopbackPair pair;
+  Serial host(pair.first());
+  Serial device(pair.second());
+
+  EXPECT_FALSE(device.getCTS());
+  host.setRTS(true);
+  EXPECT_TRUE(device.getCTS());
+  EXPECT_FALSE(host.getCTS());
+  host.setDTR(true);
+  EXPECT_TRUE(device.getDSR());
+  EXPECT_TRUE(device.getCD());
+  EXPECT_FALSE(device.getRI());
+  host.setModemLines(modemline_rts | modemline_dtr, modemline_dtr);
+  EXPECT_FALSE(device.getCTS());
+  EXPECT_TRUE(device.getDSR());
+
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, raise_cts, &device));
+  EXPECT_TRUE(host.waitForChange());
+  EXPECT_TRUE(host.getCTS());
+  pthread_join(thread, NULL);
+
+  EXPECT_THROW(host.sendBreak(10), IOException);
+  EXPECT_THROW(host.setBreak(true), IOException);
+}
+
+TEST(LoopbackTests, thousandsOfTransactions) {
+  const size_t count = 5000;
+  LoopbackPair pair;
+  Serial host(pair.first(), Timeout::simpleTimeout(1000));
+  Serial device(pair.second(), Timeout::simpleTimeout(1000));
+  Responder responder = { &device, count };
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, respond, &responder));
+
+  uint64_t start_ns = stats::now_ns();
+  size_t answered = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (host.transact("get\n", LineMatcher(), Deadline::fromNow(1000))
+        == "get ok\n") {
+      ++answered;
+    }
+  }
+  uint64_t elapsed_ns = stats::now_ns() - start_ns;
+  pthread_join(thread, NULL);
+  EXPECT_EQ(count, answered);
+  // At least a thousand a second, even on a loaded machine.
+  EXPECT_LT(elapsed_ns, 5000000000u);
+}
+
+TEST(LoopbackTests, hangupLooksLikeDisconnect) {
+  LoopbackPair pair;
+  Serial host(pair.first(), Timeout::simpleTimeout(100));
+  Serial device(pair.second(), Timeout::simpleTimeout(100));
+  host.setDTR(true);
+
+  device.write("last");
+  pair.hangup();
+  EXPECT_FALSE(pair.isConnected());
+  EXPECT_FALSE(device.getDSR());
+  EXPECT_EQ("last", host.read(4));
+  EXPECT_THROW(host.read(1), SerialException);
+  EXPECT_THROW(host.write("more"), SerialException);
+  EXPECT_FALSE(host.waitForChange());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
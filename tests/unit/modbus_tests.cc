@@ -0,0 +1,256 @@
+#include "gtest/gtest.h"
+#include "serial/modbus.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <pty.h>
+#else
+#include <util.h>
+#endif
+
+using namespace serial;
+using namespace serial::modbus;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+/**
+ * Minimal RTU slave on the master side of a pty.  Unit 1 answers read and
+ * write register requests for addresses 0 to 99, any other address gets an
+ * illegal data address exception.  Other units never answer.
+ */
+class SlaveSimulator {
+public:
+  SlaveSimulator (int fd) : corrupt_crc_(false), fd_(fd), running_(true) {
+    for (int i = 0; i < 100; i++) {
+      registers_[i] = static_cast<uint16_t> (i);
+    }
+    pthread_create(&thread_, NULL, &SlaveSimulator::run, this);
+  }
+
+  ~SlaveSimulator () {
+    running_ = false;
+    pthread_join(thread_, NULL);
+  }
+
+  volatile bool corrupt_crc_;
+  uint16_t registers_[100];
+
+private:
+  static void * run (void *arg) {
+    static_cast<SlaveSimulator*> (arg)->loop();
+    return NULL;
+  }
+
+  void loop () {
+    vector<uint8_t> frame;
+    while (running_) {
+      pollfd pfd = { fd_, POLLIN, 0 };
+      if (poll(&pfd, 1, 10) <= 0) {
+        continue;
+      }
+      uint8_t buffer[256];
+      ssize_t n = ::read(fd_, buffer, sizeof(buffer));
+      if (n <= 0) {
+        continue;
+      }
+      frame.insert(frame.end(), buffer, buffer + n);
+      size_t length = requestLength(frame);
+      if (length == 0 || frame.size() < length) {
+        continue;
+      }
+      vector<uint8_t> request(frame.begin(), frame.begin() + length);
+      frame.erase(frame.begin(), frame.begin() + length);
+      respond(request);
+    }
+  }
+
+  static size_t requestLength (const vector<uint8_t> &frame) {
+    if (frame.size() < 2) return 0;
+    if (frame[1] == write_multiple_registers) {
+      return frame.size() < 7 ? 0 : 9 + frame[6];
+    }
+    return 8;
+  }
+
+  void respond (const vector<uint8_t> &request) {
+    uint16_t crc = crc16(&request[0], request.size() - 2);
+    if (request[request.size() - 2] != (crc & 0xFF) ||
+        request[request.size() - 1] != (crc >> 8) || request[0] != 1) {
+      return;
+    }
+    uint8_t function = request[1];
+    uint16_t address = (request[2] << 8) | request[3];
+    uint16_t value = (request[4] << 8) | request[5];
+    vector<uint8_t> response(request.begin(), request.begin() + 2);
+    if (function == read_holding_registers) {
+      if (address + value > 100) {
+        exception(response, 0x02);
+      } else {
+        response.push_back(static_cast<uint8_t> (2 * value));
+        for (uint16_t i = 0; i < value; i++) {
+          response.push_back(registers_[address + i] >> 8);
+          response.push_back(registers_[address + i] & 0xFF);
+        }
+      }
+    } else if (function == write_single_register) {
+      if (address >= 100) {
+        exception(response, 0x02);
+      } else {
+        registers_[address] = value;
+        response.assign(request.begin(), request.begin() + 6);
+      }
+    } else if (function == write_multiple_registers) {
+      if (address + value > 100) {
+        exception(response, 0x02);
+      } else {
+        for (uint16_t i = 0; i < value; i++) {
+          registers_[address + i] =
+            (request[7 + 2 * i] << 8) | request[8 + 2 * i];
+        }
+        response.assign(request.begin(), request.begin() + 6);
+      }
+    } else {
+      exception(response, 0x01);
+    }
+    crc = crc16(&response[0], response.size());
+    response.push_back(crc & 0xFF);
+    response.push_back((crc >> 8) ^ (corrupt_crc_ ? 0xFF : 0x00));
+    ::write(fd_, &response[0], response.size());
+  }
+
+  static void exception (vector<uint8_t> &response, uint8_t code) {
+    response[1] |= 0x80;
+    response.push_back(code);
+  }
+
+  int fd_;
+  volatile bool running_;
+  pthread_t thread_;
+};
+
+class ModbusTests : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    for (int i = 0; i < 3; i++) {
+      char name[100];
+      ASSERT_NE(openpty(&master_fd[i], &slave_fd[i], name, NULL, NULL), -1);
+      port[i] = new Serial(string(name), 115200);
+      slave[i] = new SlaveSimulator(master_fd[i]);
+      master[i] = new RtuMaster(*port[i], 100);
+    }
+  }
+
+  virtual void TearDown() {
+    for (int i = 0; i < 3; i++) {
+      delete master[i];
+      delete slave[i];
+      delete port[i];
+      close(master_fd[i]);
+      close(slave_fd[i]);
+    }
+  }
+
+  Serial *port[3];
+  SlaveSimulator *slave[3];
+  RtuMaster *master[3];
+  int master_fd[3];
+  int slave_fd[3];
+};
+
+TEST(crc16_tests, known_frame) {
+  // Read holding registers, unit 1, address 0, count 1.
+  const uint8_t frame[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x01 };
+  EXPECT_EQ(0x0A84, crc16(frame, sizeof(frame)));
+}
+
+TEST_F(ModbusTests, readHoldingRegisters) {
+  vector<uint16_t> r = master[0]->readHoldingRegisters(1, 10, 5);
+  ASSERT_EQ(5u, r.size());
+  for (uint16_t i = 0; i < 5; i++) {
+    EXPECT_EQ(10 + i, r[i]);
+  }
+}
+
+TEST_F(ModbusTests, writeRegisters) {
+  master[0]->writeSingleRegister(1, 3, 0xBEEF);
+  vector<uint16_t> values;
+  values.push_back(0x1234);
+  values.push_back(0x5678);
+  master[0]->writeMultipleRegisters(1, 4, values);
+  vector<uint16_t> r = master[0]->readHoldingRegisters(1, 3, 3);
+  EXPECT_EQ(0xBEEF, r[0]);
+  EXPECT_EQ(0x1234, r[1]);
+  EXPECT_EQ(0x5678, r[2]);
+}
+
+TEST_F(ModbusTests, exceptionResponse) {
+  try {
+    master[0]->readHoldingRegisters(1, 99, 2);
+    FAIL() << "expected a ModbusException";
+  } catch (const ModbusException &e) {
+    EXPECT_EQ(0x02, e.getExceptionCode());
+  }
+  // The master recovers for the next transaction.
+  EXPECT_EQ(7, master[0]->readHoldingRegisters(1, 7, 1)[0]);
+}
+
+TEST_F(ModbusTests, timeoutAndCrcError) {
+  EXPECT_THROW(master[0]->readHoldingRegisters(2, 0, 1), ModbusException);
+  slave[0]->corrupt_crc_ = true;
+  EXPECT_THROW(master[0]->readHoldingRegisters(1, 0, 1), ModbusException);
+  slave[0]->corrupt_crc_ = false;
+  EXPECT_EQ(1, master[0]->readHoldingRegisters(1, 1, 1)[0]);
+}
+
+TEST_F(ModbusTests, portTimeoutIsLeftAlone) {
+  Timeout timeout(5, 1234, 2, 0, 0);
+  port[0]->setTimeout(timeout);
+  RtuMaster other(*port[0], 50);
+  EXPECT_EQ(3, other.readHoldingRegisters(1, 3, 1)[0]);
+  EXPECT_THROW(other.readHoldingRegisters(2, 0, 1), ModbusException);
+  other.setResponseTimeout(80);
+
+  Timeout after = port[0]->getTimeout();
+  EXPECT_EQ(5u, after.inter_byte_timeout);
+  EXPECT_EQ(1234u, after.read_timeout_constant);
+  EXPECT_EQ(2u, after.read_timeout_multiplier);
+}
+
+TEST_F(ModbusTests, schedulerRunsPortsInParallel) {
+  RtuScheduler scheduler;
+  for (int i = 0; i < 3; i++) {
+    scheduler.addMaster(master[i]);
+  }
+  vector<Transaction> transactions;
+  for (int n = 0; n < 30; n++) {
+    Transaction t(n % 3, 1);
+    t.request.push_back(read_holding_registers);
+    t.request.push_back(0x00);
+    t.request.push_back(static_cast<uint8_t> (n));
+    t.request.push_back(0x00);
+    t.request.push_back(0x01);
+    transactions.push_back(t);
+  }
+  transactions[29].unit = 2; // never answered
+  scheduler.execute(transactions);
+  for (int n = 0; n < 29; n++) {
+    ASSERT_TRUE(transactions[n].ok) << transactions[n].error;
+    ASSERT_EQ(4u, transactions[n].response.size());
+    EXPECT_EQ(n, transactions[n].response[3]);
+  }
+  EXPECT_FALSE(transactions[29].ok);
+  EXPECT_FALSE(transactions[29].error.empty());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
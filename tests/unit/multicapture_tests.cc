@@ -0,0 +1,226 @@
+#include "gtest/gtest.h"
+#include "serial/multicapture.h"
+#include "serial/loopback.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <pty.h>
+#else
+#include <util.h>
+#endif
+
+using namespace serial;
+using namespace serial::capture;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Keeps the chunks passed on, checking they come in order.
+class Collector : public ChunkHandler {
+public:
+  Collector() : out_of_order(0) {}
+
+  virtual void onChunk(const Chunk &chunk) {
+    if (!chunks.empty() && chunk.timestamp_ns < chunks.back().timestamp_ns) {
+      ++out_of_order;
+    }
+    chunks.push_back(chunk);
+    data.push_back(string(reinterpret_cast<const char*>(chunk.data),
+                          chunk.size));
+  }
+
+  // Everything received on one port.
+  string received(uint16_t port) const {
+    string bytes;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+      if (chunks[i].port == port) {
+        bytes += data[i];
+      }
+    }
+    return bytes;
+  }
+
+  vector<Chunk> chunks;
+  vector<string> data;
+  size_t out_of_order;
+};
+
+struct Burst {
+  int fd;
+  size_t size;
+};
+
+void *write_burst(void *arg) {
+  Burst *burst = static_cast<Burst *>(arg);
+  string data;
+  for (size_t i = 0; i < burst->size; ++i) {
+    data.push_back(static_cast<char>('a' + i % 26));
+  }
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t result = write(burst->fd, data.data() + written,
+                           data.size() - written);
+    if (result <= 0) {
+      break;
+    }
+    written += result;
+  }
+  return NULL;
+}
+
+class MultiCaptureTests : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    for (size_t i = 0; i < 4; ++i) {
+      int master, slave;
+      char name[100];
+      ASSERT_NE(-1, openpty(&master, &slave, name, NULL, NULL));
+      masters.push_back(master);
+      slaves.push_back(slave);
+      ports.push_back(new Serial(name, 115200, Timeout::simpleTimeout(100)));
+    }
+  }
+
+  virtual void TearDown() {
+    for (size_t i = 0; i < ports.size(); ++i) {
+      delete ports[i];
+      close(slaves[i]);
+      if (masters[i] != -1) {
+        close(masters[i]);
+      }
+    }
+  }
+
+  vector<Serial *> ports;
+  vector<int> masters;
+  vector<int> slaves;
+};
+
+TEST_F(MultiCaptureTests, mergesInArrivalOrder) {
+  char name[] = "/tmp/serial_multicapture_XXXXXX";
+  int fd = mkstemp(name);
+  ASSERT_NE(-1, fd);
+  close(fd);
+  Collector collector;
+  {
+    Writer writer(name);
+    MultiCapture capture(ports, &writer, &collector);
+    const char *lines[] = { "one\n", "two\n", "three\n", "four\n", "five\n" };
+    for (size_t i = 0; i < 5; ++i) {
+      write(masters[i % 4], lines[i], strlen(lines[i]));
+      usleep(5000);
+    }
+    capture.stop();
+    EXPECT_FALSE(capture.isRunning());
+    EXPECT_EQ(24u, capture.getBytesCaptured());
+  }
+
+  ASSERT_EQ(5u, collector.chunks.size());
+  EXPECT_EQ(0u, collector.out_of_order);
+  EXPECT_EQ("one\n", collector.data[0]);
+  EXPECT_EQ(2, collector.chunks[2].port);
+  EXPECT_EQ("three\n", collector.data[2]);
+  EXPECT_EQ(0, collector.chunks[4].port);
+  EXPECT_EQ("five\n", collector.data[4]);
+
+  // The capture file holds the same stream.
+  Reader reader(name);
+  Chunk chunk;
+  for (size_t i = 0; i < 5; ++i) {
+    ASSERT_TRUE(reader.next(chunk));
+    EXPECT_EQ(collector.chunks[i].timestamp_ns, chunk.timestamp_ns);
+    EXPECT_EQ(collector.chunks[i].port, chunk.port);
+    EXPECT_EQ(direction_rx, chunk.direction);
+    EXPECT_EQ(collector.data[i],
+              string(reinterpret_cast<const char*>(chunk.data), chunk.size));
+  }
+  EXPECT_FALSE(reader.next(chunk));
+  unlink(name);
+}
+
+TEST_F(MultiCaptureTests, allPortsAtOnce) {
+  // Small buffers, so every port wraps its buffer many times.
+  Collector collector;
+  MultiCapture capture(ports, NULL, &collector, 4096);
+  const size_t size = 1 << 18;
+  vector<Burst> bursts(4);
+  vector<pthread_t> threads(4);
+  for (size_t i = 0; i < 4; ++i) {
+    bursts[i].fd = masters[i];
+    bursts[i].size = size;
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, write_burst, &bursts[i]));
+  }
+  for (size_t i = 0; i < 4; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  for (int i = 0; i < 1000 && capture.getBytesCaptured() < 4 * size; ++i) {
+    usleep(1000);
+  }
+  capture.stop();
+  EXPECT_EQ(4 * size, capture.getBytesCaptured());
+  EXPECT_EQ(0u, collector.out_of_order);
+
+  string data;
+  for (size_t i = 0; i < size; ++i) {
+    data.push_back(static_cast<char>('a' + i % 26));
+  }
+  for (uint16_t i = 0; i < 4; ++i) {
+    EXPECT_EQ(size, collector.received(i).size());
+    EXPECT_TRUE(data == collector.received(i));
+  }
+}
+
+TEST_F(MultiCaptureTests, transportsAndDisconnects) {
+  LoopbackPair pair;
+  Serial device(pair.second());
+  Serial host(pair.first());
+  vector<Serial *> mixed;
+  mixed.push_back(ports[0]);
+  mixed.push_back(&host);
+  EXPECT_EQ(-1, host.getFileDescriptor());
+  EXPECT_NE(-1, ports[0]->getFileDescriptor());
+
+  Collector collector;
+  MultiCapture capture(mixed, NULL, &collector);
+  device.write("over the loopback");
+  write(masters[0], "over the pty", 12);
+  usleep(50000);
+
+  // Hanging up the pty ends its capture, not that of the others.
+  close(masters[0]);
+  masters[0] = -1;
+  usleep(50000);
+  EXPECT_FALSE(capture.isPortRunning(0));
+  EXPECT_TRUE(capture.isPortRunning(1));
+  EXPECT_FALSE(capture.isPortRunning(2));
+  device.write("!");
+  usleep(50000);
+  EXPECT_TRUE(capture.isRunning());
+  capture.stop();
+
+  EXPECT_EQ("over the pty", collector.received(0));
+  EXPECT_EQ("over the loopback!", collector.received(1));
+  EXPECT_EQ(0u, collector.out_of_order);
+}
+
+TEST(MultiCaptureArgumentTests, badArguments) {
+  vector<Serial *> none;
+  EXPECT_THROW(MultiCapture(none, NULL), std::invalid_argument);
+  LoopbackPair pair;
+  Serial host(pair.first());
+  vector<Serial *> one(1, &host);
+  EXPECT_THROW(MultiCapture(one, NULL, NULL, 0), std::invalid_argument);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
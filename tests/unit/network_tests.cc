@@ -0,0 +1,279 @@
+#include "gtest/gtest.h"
+#include "serial/network.h"
+#include "serial/impl/stats.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <vector>
+
+using namespace serial;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+const uint8_t IAC = 255, SB = 250, SE = 240, WILL = 251, WONT = 252,
+              DO = 253, DONT = 254, COM_PORT = 44;
+
+// A stand-in for a serial device server on the loopback interface.  It
+// echoes data back and, speaking RFC 2217, records the settings it is
+// sent and wires RTS to CTS and DTR to DSR and CD like a null modem.
+class DeviceServer {
+public:
+  explicit DeviceServer(bool rfc2217, bool hang_up = false)
+    : rfc2217_(rfc2217), hang_up_(hang_up), refused_(0), modem_state_(0) {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = sockaddr_in();
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    socklen_t length = sizeof(address);
+    getsockname(listener_, reinterpret_cast<sockaddr*>(&address), &length);
+    port_ = ntohs(address.sin_port);
+    listen(listener_, 1);
+    pthread_create(&thread_, NULL, &DeviceServer::run, this);
+  }
+
+  ~DeviceServer() {
+    join();
+    close(listener_);
+  }
+
+  string url() const {
+    std::ostringstream url;
+    url << (rfc2217_ ? "rfc2217://" : "tcp://") << "127.0.0.1:" << port_;
+    return url.str();
+  }
+
+  // Waits for the client to disconnect.
+  void join() {
+    if (thread_ != pthread_t()) {
+      pthread_join(thread_, NULL);
+      thread_ = pthread_t();
+    }
+  }
+
+  vector<uint32_t> baudrates;
+  vector<uint8_t> datasizes;
+  vector<uint8_t> parities;
+
+  int refused() const { return refused_; }
+
+private:
+  static void *run(void *arg) {
+    static_cast<DeviceServer *>(arg)->serve();
+    return NULL;
+  }
+
+  void serve() {
+    int client = accept(listener_, NULL, NULL);
+    if (hang_up_) {
+      close(client);
+      return;
+    }
+    // An option the client does not know, which it should refuse.
+    const uint8_t ask[] = { IAC, DO, COM_PORT, IAC, DO, 24 };
+    if (rfc2217_) {
+      send(client, ask, sizeof(ask), 0);
+    }
+    uint8_t buffer[1024];
+    string pending;
+    ssize_t received;
+    while ((received = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+      pending.append(reinterpret_cast<char*>(buffer), received);
+      string reply = rfc2217_ ? parse(pending) : pending;
+      if (!rfc2217_) {
+        pending.clear();
+      }
+      if (!reply.empty()) {
+        send(client, reply.data(), reply.size(), 0);
+      }
+    }
+    close(client);
+  }
+
+  // Consumes the complete sequences at the front of pending and returns
+  // what to send back.
+  string parse(string &pending) {
+    string reply;
+    size_t i = 0;
+    while (i < pending.size()) {
+      uint8_t byte = pending[i];
+      if (byte != IAC) {
+        reply.push_back(byte);
+        ++i;
+        continue;
+      }
+      if (i + 1 >= pending.size()) {
+        break;
+      }
+      uint8_t command = pending[i + 1];
+      if (command == IAC) {
+        reply.append(2, static_cast<char>(IAC));
+        i += 2;
+      } else if (command >= WILL && command <= DONT) {
+        if (i + 2 >= pending.size()) {
+          break;
+        }
+        if (command == WONT && static_cast<uint8_t>(pending[i + 2]) == 24) {
+          ++refused_;
+        }
+        i += 3;
+      } else if (command == SB) {
+        size_t end = pending.find(string() + char(IAC) + char(SE), i + 2);
+        if (end == string::npos) {
+          break;
+        }
+        subnegotiation(pending.substr(i + 2, end - i - 2), reply);
+        i = end + 2;
+      } else {
+        i += 2;
+      }
+    }
+    pending.erase(0, i);
+    return reply;
+  }
+
+  void subnegotiation(const string &sub, string &reply) {
+    if (sub.size() < 3 || static_cast<uint8_t>(sub[0]) != COM_PORT) {
+      return;
+    }
+    const uint8_t *data = reinterpret_cast<const uint8_t*>(sub.data()) + 2;
+    switch (sub[1]) {
+    case 1:
+      baudrates.push_back(data[0] << 24 | data[1] << 16 | data[2] << 8
+                          | data[3]);
+      break;
+    case 2:
+      datasizes.push_back(data[0]);
+      break;
+    case 3:
+      parities.push_back(data[0]);
+      break;
+    case 5: {
+      uint8_t state = modem_state_;
+      switch (data[0]) {
+      case 8: state |= 0x20 | 0x80; break;
+      case 9: state &= ~(0x20 | 0x80); break;
+      case 11: state |= 0x10; break;
+      case 12: state &= ~0x10; break;
+      }
+      if (state != modem_state_) {
+        modem_state_ = state;
+        const char notify[] = { char(IAC), char(SB), char(COM_PORT), 107,
+                                char(state), char(IAC), char(SE) };
+        reply.append(notify, sizeof(notify));
+      }
+      break;
+    }
+    }
+  }
+
+  bool rfc2217_;
+  bool hang_up_;
+  int listener_;
+  int port_;
+  int refused_;
+  uint8_t modem_state_;
+  pthread_t thread_;
+};
+
+TEST(NetworkTests, rfc2217DataAndSettings) {
+  DeviceServer server(true);
+  {
+    Serial port(server.url(), 57600, Timeout::simpleTimeout(1000));
+    ASSERT_TRUE(port.isOpen());
+    string data("a\xff" "b\n", 4);
+    EXPECT_EQ(4u, port.write(data));
+    EXPECT_EQ(data, port.readline());
+
+    port.setBaudrate(115200);
+    port.setBytesize(sevenbits);
+    port.setParity(parity_even);
+    port.write("c\n");
+    EXPECT_EQ("c\n", port.readline());
+  }
+  server.join();
+  // Opening and every change send all the settings.
+  ASSERT_EQ(4u, server.baudrates.size());
+  EXPECT_EQ(57600u, server.baudrates[0]);
+  EXPECT_EQ(115200u, server.baudrates.back());
+  EXPECT_EQ(7, server.datasizes.back());
+  EXPECT_EQ(3, server.parities.back()); // even
+  EXPECT_EQ(1, server.refused());
+}
+
+TEST(NetworkTests, rfc2217ModemLines) {
+  DeviceServer server(true);
+  Serial port(server.url(), 9600, Timeout::simpleTimeout(1000));
+  EXPECT_FALSE(port.getCTS());
+  port.setRTS(true);
+  EXPECT_TRUE(port.waitForChange());
+  EXPECT_TRUE(port.getCTS());
+  EXPECT_FALSE(port.getDSR());
+  port.setModemLines(modemline_rts | modemline_dtr, modemline_dtr);
+  // Two notifications, one per line.
+  while (port.getCTS() || !port.getCD()) {
+    ASSERT_TRUE(port.waitForChange());
+  }
+  EXPECT_TRUE(port.getDSR());
+  EXPECT_FALSE(port.getRI());
+}
+
+TEST(NetworkTests, rawTcp) {
+  DeviceServer server(false);
+  Serial port(server.url(), 9600, Timeout::simpleTimeout(50));
+  string data("\xff\xfe", 2);
+  port.write(data);
+  EXPECT_EQ(data, port.read(2));
+  EXPECT_TRUE(port.getCTS());
+  EXPECT_TRUE(port.getCD());
+
+  uint64_t start_ns = stats::now_ns();
+  EXPECT_EQ("", port.read(1));
+  uint64_t elapsed_ns = stats::now_ns() - start_ns;
+  EXPECT_GE(elapsed_ns, 50000000u);
+  EXPECT_LT(elapsed_ns, 100000000u);
+}
+
+TEST(NetworkTests, serverHangUp) {
+  DeviceServer server(false, true);
+  Serial port(server.url(), 9600, Timeout::simpleTimeout(1000));
+  server.join();
+  EXPECT_THROW(port.read(1), SerialException);
+  EXPECT_FALSE(port.getCTS());
+}
+
+TEST(NetworkTests, badUrls) {
+  EXPECT_TRUE(NetworkTransport::isUrl("rfc2217://localhost:2217"));
+  EXPECT_TRUE(NetworkTransport::isUrl("tcp://[::1]:4001"));
+  EXPECT_FALSE(NetworkTransport::isUrl("/dev/ttyS0"));
+  EXPECT_THROW(Serial port("rfc2217://localhost"), std::invalid_argument);
+  EXPECT_THROW(Serial port("tcp://:4001"), std::invalid_argument);
+
+  // Nothing listens on a port bound and closed again.
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = sockaddr_in();
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+  socklen_t length = sizeof(address);
+  getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length);
+  close(fd);
+  std::ostringstream url;
+  url << "tcp://127.0.0.1:" << ntohs(address.sin_port);
+  EXPECT_THROW(Serial port(url.str()), IOException);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
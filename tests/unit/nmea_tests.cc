@@ -0,0 +1,93 @@
+#include "gtest/gtest.h"
+#include "serial/nmea.h"
+
+#include <stdlib.h>
+
+using serial::nmea::Field;
+using serial::nmea::Handler;
+using serial::nmea::Parser;
+using serial::nmea::Sentence;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+class Recorder : public Handler {
+public:
+  virtual void onSentence (const Sentence &sentence) {
+    string s = sentence.talker.str() + "|" + sentence.type.str();
+    for (size_t i = 0; i < sentence.fields.size(); i++) {
+      s += "|" + sentence.fields[i].str();
+    }
+    sentences.push_back(s);
+    if (sentence.type == "GGA") {
+      latitude = strtod(sentence.fields[1].data, NULL);
+    }
+  }
+
+  vector<string> sentences;
+  double latitude;
+};
+
+const char gga[] =
+  "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n";
+
+size_t feed (Parser &parser, Handler &handler, const string &data) {
+  return parser.parse(reinterpret_cast<const uint8_t*> (data.c_str()),
+                      data.size(), handler);
+}
+
+TEST(nmea_tests, parses_fields) {
+  Parser parser;
+  Recorder recorder;
+  EXPECT_EQ(1u, feed(parser, recorder, gga));
+  ASSERT_EQ(1u, recorder.sentences.size());
+  EXPECT_EQ("GP|GGA|123519|4807.038|N|01131.000|E|1|08|0.9|545.4|M|46.9|M||",
+            recorder.sentences[0]);
+  EXPECT_DOUBLE_EQ(4807.038, recorder.latitude);
+}
+
+TEST(nmea_tests, byte_at_a_time) {
+  Parser parser;
+  Recorder recorder;
+  string data = string("garbage") + gga + gga;
+  for (size_t i = 0; i < data.size(); i++) {
+    feed(parser, recorder, data.substr(i, 1));
+  }
+  EXPECT_EQ(2u, recorder.sentences.size());
+  EXPECT_EQ(2u, parser.getSentenceCount());
+}
+
+TEST(nmea_tests, rejects_bad_checksums) {
+  Parser parser;
+  Recorder recorder;
+  string bad(gga);
+  bad[8] = '9';
+  feed(parser, recorder, bad + "$GPGGA,1,2\r\n" + "$GPGSA,A,3*" + gga);
+  ASSERT_EQ(1u, recorder.sentences.size());
+  EXPECT_EQ(3u, parser.getChecksumErrors());
+}
+
+TEST(nmea_tests, optional_checksum_and_proprietary) {
+  Parser parser(false);
+  Recorder recorder;
+  feed(parser, recorder, "$PUBX,00,1\r\n!AIVDM,1,1*\r\n");
+  ASSERT_EQ(1u, recorder.sentences.size());
+  EXPECT_EQ("|PUBX|00|1", recorder.sentences[0]);
+}
+
+TEST(nmea_tests, overflow) {
+  Parser parser;
+  Recorder recorder;
+  feed(parser, recorder, "$GP" + string(300, 'x') + "\r\n" + gga);
+  EXPECT_EQ(1u, recorder.sentences.size());
+  EXPECT_EQ(1u, parser.getOverflowErrors());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,101 @@
+#include "gtest/gtest.h"
+#include "serial/replay.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace serial;
+using namespace serial::capture;
+using namespace serial::replay;
+
+using std::string;
+
+namespace {
+
+class ReplayTests : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    char name[] = "/tmp/serial_replay_XXXXXX";
+    int fd = mkstemp(name);
+    ASSERT_NE(-1, fd);
+    close(fd);
+    path = name;
+
+    // A device answering a command, with 100 ms between its lines.
+    Writer writer(path);
+    writer.append(direction_tx, 0, string("status\r\n"), 1000000000);
+    writer.append(direction_rx, 0, string("temp 21\r\n"), 1000000000);
+    writer.append(direction_rx, 0, string("temp 22\r\n"), 1050000000);
+    writer.append(direction_rx, 1, string("other port\r\n"), 1060000000);
+    writer.append(direction_rx, 0, string("temp 23\r\n"), 1100000000);
+  }
+
+  virtual void TearDown() {
+    unlink(path.c_str());
+  }
+
+  string path;
+};
+
+TEST_F(ReplayTests, originalTiming) {
+  Reader reader(path);
+  Replayer replayer(reader);
+  replayer.setPort(0);
+  Serial port(replayer.getPortName(), 115200,
+              Timeout::simpleTimeout(1000));
+
+  ReplayStats stats = replayer.run();
+  EXPECT_EQ(3u, stats.chunks);
+  EXPECT_EQ(27u, stats.bytes);
+  EXPECT_GE(stats.elapsed_ns, 100000000u);
+  EXPECT_LT(stats.elapsed_ns, 150000000u);
+  EXPECT_LT(stats.max_lateness_ns, 20000000u);
+  EXPECT_GT(stats.bytesPerSecond(), 0.0);
+
+  EXPECT_EQ("temp 21\r\n", port.readline());
+  EXPECT_EQ("temp 22\r\n", port.readline());
+  EXPECT_EQ("temp 23\r\n", port.readline());
+  EXPECT_EQ(0u, port.available());
+}
+
+TEST_F(ReplayTests, scaledAndFastest) {
+  Reader reader(path);
+  Replayer replayer(reader);
+  Serial port(replayer.getPortName(), 115200,
+              Timeout::simpleTimeout(1000));
+
+  replayer.setSpeed(10.0);
+  ReplayStats stats = replayer.run();
+  EXPECT_EQ(4u, stats.chunks);
+  EXPECT_GE(stats.elapsed_ns, 10000000u);
+  EXPECT_LT(stats.elapsed_ns, 60000000u);
+  EXPECT_EQ(39u, port.read(39).size());
+
+  reader.rewind();
+  replayer.setSpeed(0);
+  stats = replayer.run();
+  EXPECT_EQ(4u, stats.chunks);
+  EXPECT_LT(stats.elapsed_ns, 10000000u);
+  EXPECT_EQ(0u, stats.max_lateness_ns);
+  EXPECT_EQ(39u, port.read(39).size());
+  EXPECT_THROW(replayer.setSpeed(-1), std::invalid_argument);
+}
+
+TEST_F(ReplayTests, replaysTheOtherDirection) {
+  Reader reader(path);
+  Replayer replayer(reader);
+  replayer.setDirection(direction_tx);
+  replayer.setSpeed(0);
+  Serial port(replayer.getPortName(), 115200,
+              Timeout::simpleTimeout(1000));
+
+  EXPECT_EQ(1u, replayer.run().chunks);
+  EXPECT_EQ("status\r\n", port.readline());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,145 @@
+#include "gtest/gtest.h"
+#include "serial/tee.h"
+#include "serial/impl/stats.h"
+
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <pty.h>
+#else
+#include <util.h>
+#endif
+
+using namespace serial;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+class TeeTests : public ::testing::Test {
+protected:
+  virtual void SetUp() {
+    char name[100];
+    ASSERT_NE(openpty(&master_fd, &slave_fd, name, NULL, NULL), -1);
+    port = new Serial(string(name), 115200);
+  }
+
+  virtual void TearDown() {
+    delete port;
+    close(master_fd);
+    close(slave_fd);
+  }
+
+  // Writes size bytes on the master side and waits for the tee to take
+  // received bytes in total.
+  void feed(Tee &tee, size_t size, uint64_t received) {
+    string chunk(size, 'z');
+    ASSERT_EQ(static_cast<ssize_t>(size),
+              write(master_fd, chunk.data(), chunk.size()));
+    for (int i = 0; i < 100 && tee.getBytesReceived() < received; i++) {
+      usleep(10000);
+    }
+  }
+
+  Serial *port;
+  int master_fd;
+  int slave_fd;
+};
+
+TEST_F(TeeTests, everyReaderReadsEveryLine) {
+  Tee tee(*port);
+  TeeReader logger(tee, tee_drop_oldest, Timeout::simpleTimeout(500));
+  TeeReader parser(tee, tee_block, Timeout::simpleTimeout(500));
+
+  ASSERT_EQ(12, write(master_fd, "one\ntwo\nend\n", 12));
+  EXPECT_EQ("one\n", logger.readline());
+  EXPECT_EQ("one\n", parser.readline());
+  EXPECT_EQ("two\nend\n", parser.read(8));
+  EXPECT_EQ("two\n", logger.readline());
+  EXPECT_EQ(4u, logger.available());
+  EXPECT_EQ(0u, parser.available());
+  EXPECT_EQ(12u, tee.getBytesReceived());
+}
+
+TEST_F(TeeTests, readerSeesOnlyLaterBytes) {
+  Tee tee(*port);
+  TeeReader early(tee, tee_drop_oldest, Timeout::simpleTimeout(500));
+  ASSERT_EQ(4, write(master_fd, "old\n", 4));
+  EXPECT_EQ("old\n", early.readline());
+
+  TeeReader late(tee, tee_drop_oldest, Timeout::simpleTimeout(500));
+  ASSERT_EQ(4, write(master_fd, "new\n", 4));
+  EXPECT_EQ("new\n", late.readline());
+  EXPECT_EQ("new\n", early.readline());
+}
+
+TEST_F(TeeTests, readTimesOut) {
+  Tee tee(*port);
+  TeeReader reader(tee, tee_drop_oldest, Timeout::simpleTimeout(50));
+  EXPECT_EQ("", reader.read(4));
+}
+
+TEST_F(TeeTests, interByteTimeoutAboveAWakeUp) {
+  Tee tee(*port);
+  // Longer than the longest single wait of a reader.
+  TeeReader reader(tee, tee_drop_oldest, Timeout(250, 5000, 0, 0, 0));
+  feed(tee, 2, 2);
+  uint64_t start_ns = stats::now_ns();
+  EXPECT_EQ("zz", reader.read(10));
+  uint64_t elapsed_ns = stats::now_ns() - start_ns;
+  EXPECT_GE(elapsed_ns, 240000000u);
+  EXPECT_LT(elapsed_ns, 1000000000u);
+}
+
+TEST_F(TeeTests, stalledReaderDropsOldest) {
+  Tee tee(*port, 1024);
+  TeeReader stalled(tee, tee_drop_oldest, Timeout::simpleTimeout(500));
+  TeeReader fast(tee, tee_drop_oldest, Timeout::simpleTimeout(500));
+
+  for (int i = 1; i <= 3; i++) {
+    feed(tee, 1000, 1000u * i);
+    EXPECT_EQ(1000u, fast.read(1000).size());
+  }
+  ASSERT_EQ(3000u, tee.getBytesReceived());
+  EXPECT_EQ(0u, fast.getDroppedBytes());
+  EXPECT_EQ(1024u, stalled.available());
+  EXPECT_EQ(1024u, stalled.read(4096).size());
+  EXPECT_EQ(3000u - 1024u, stalled.getDroppedBytes());
+}
+
+TEST_F(TeeTests, stalledBlockingReaderHoldsBackTheTee) {
+  Tee tee(*port, 1024);
+  TeeReader stalled(tee, tee_block, Timeout::simpleTimeout(500));
+
+  feed(tee, 2000, 2000);
+  // The rest waits in the port until the reader makes room.
+  EXPECT_EQ(1024u, tee.getBytesReceived());
+  EXPECT_EQ(2000u, stalled.read(2000).size());
+  EXPECT_EQ(0u, stalled.getDroppedBytes());
+  EXPECT_EQ(2000u, tee.getBytesReceived());
+}
+
+TEST_F(TeeTests, stopEndsReads) {
+  Tee tee(*port);
+  TeeReader reader(tee, tee_drop_oldest, Timeout::simpleTimeout(5000));
+  ASSERT_EQ(2, write(master_fd, "ab", 2));
+  EXPECT_EQ("a", reader.read(1));
+  tee.stop();
+  EXPECT_FALSE(tee.isRunning());
+  // What was buffered, then nothing without waiting for the timeout.
+  EXPECT_EQ("b", reader.read(10));
+  EXPECT_EQ(0u, tee.getBytesReceived() - 2);
+}
+
+TEST(TeeArguments, zeroCapacity) {
+  Serial port;
+  EXPECT_THROW(Tee tee(port, 0), std::invalid_argument);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -3,11 +3,19 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 
-using serial::MillisecondTimer;
+#include <algorithm>
+#include <vector>
+
+using serial::DeadlineTimer;
 
 namespace {
 
+double remaining_ms(const DeadlineTimer &timer) {
+  return timer.remaining() / 1e6;
+}
+
 /**
  * Do 100 trials of timing gaps between 0 and 19 milliseconds.
  * Expect accuracy within one millisecond.
@@ -16,9 +24,9 @@ TEST(timer_tests, short_intervals) {
   for (int trial = 0; trial < 100; trial++)
   {
     uint32_t ms = rand() % 20;
-    MillisecondTimer mt(ms);
+    DeadlineTimer mt(ms * 1000000ULL);
     usleep(1000 * ms);
-    int32_t r = mt.remaining(); 
+    double r = remaining_ms(mt);
 
     // 1ms slush, for the cost of calling usleep.
     EXPECT_NEAR(r+1, 0, 1);
@@ -26,7 +34,7 @@ TEST(timer_tests, short_intervals) {
 }
 
 TEST(timer_tests, overlapping_long_intervals) {
-  MillisecondTimer* timers[10];
+  DeadlineTimer* timers[10];
 
   // Experimentally determined. Corresponds to the extra time taken by the loops,
   // the big usleep, and the test infrastructure itself.
@@ -35,7 +43,7 @@ TEST(timer_tests, overlapping_long_intervals) {
   // Set up the timers to each time one second, 1ms apart.
   for (int t = 0; t < 10; t++)
   {
-    timers[t] = new MillisecondTimer(1000);
+    timers[t] = new DeadlineTimer(1000000000ULL);
     usleep(1000);
   }
 
@@ -43,18 +51,55 @@ TEST(timer_tests, overlapping_long_intervals) {
   usleep(500000);
   for (int t = 0; t < 10; t++)
   {
-    EXPECT_NEAR(timers[t]->remaining(), 500 - slush_factor + t, 5);
+    EXPECT_NEAR(remaining_ms(*timers[t]), 500 - slush_factor + t, 5);
   }
 
   // Check in on them again after another 500ms and free them.
   usleep(500000);
   for (int t = 0; t < 10; t++)
   {
-    EXPECT_NEAR(timers[t]->remaining(), -slush_factor + t, 5);
+    EXPECT_NEAR(remaining_ms(*timers[t]), -slush_factor + t, 5);
     delete timers[t];
   }
 }
 
+/**
+ * Sleep to the absolute expiry of deadlines between 0 and 999 microseconds,
+ * which no millisecond timer could express.  Expect the deadline to have
+ * passed every time, and by less than 200 microseconds typically.
+ */
+TEST(timer_tests, sub_millisecond_deadlines) {
+  std::vector<int64_t> late;
+  for (int trial = 0; trial < 100; trial++)
+  {
+    uint64_t ns = (rand() % 1000) * 1000ULL;
+    DeadlineTimer deadline(ns);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline.expiry(),
+                           NULL) != 0) {}
+    int64_t r = deadline.remaining();
+
+    EXPECT_LE(r, 0);
+    late.push_back(-r);
+  }
+  std::sort(late.begin(), late.end());
+  EXPECT_LT(late[late.size() / 2], 200000);
+}
+
+TEST(timer_tests, remaining_timespec) {
+  DeadlineTimer later(2500000000ULL);
+  timespec left = later.remaining_timespec();
+  EXPECT_EQ(2, left.tv_sec);
+  EXPECT_GT(left.tv_nsec, 400000000);
+  EXPECT_LT(left.tv_nsec, 1000000000);
+
+  // Zero once passed, so it can go straight to pselect.
+  DeadlineTimer now(0);
+  usleep(100);
+  left = now.remaining_timespec();
+  EXPECT_EQ(0, left.tv_sec);
+  EXPECT_EQ(0, left.tv_nsec);
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {
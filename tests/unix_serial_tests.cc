@@ -17,6 +17,7 @@ void loop()
  
 */
 
+#include <algorithm>
 #include <string>
 #include "gtest/gtest.h"
 
@@ -26,6 +27,12 @@ void loop()
 // #define protected public
 
 #include "serial/serial.h"
+#include "serial/impl/pacer.h"
+#include "serial/impl/recorder.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #if defined(__linux__)
 #include <pty.h>
@@ -36,6 +43,7 @@ void loop()
 using namespace serial;
 
 using std::string;
+using std::vector;
 
 namespace {
 
@@ -89,6 +97,260 @@ TEST_F(SerialTests, timeoutWorks) {
   EXPECT_EQ(r, string("abc\n"));
 }
 
+long elapsed_us(const timeval &start) {
+  timeval end;
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+}
+
+TEST_F(SerialTests, timeoutNeverEarly) {
+  port1->setTimeout(Timeout::max(), 10, 0, 10, 0);
+  for (int i = 0; i < 20; i++) {
+    timeval start;
+    gettimeofday(&start, NULL);
+    EXPECT_EQ(string(""), port1->read());
+    EXPECT_GE(elapsed_us(start), 10000);
+  }
+}
+
+TEST_F(SerialTests, subMillisecondTimeout) {
+  // 500us, with the unit set to microseconds.
+  Timeout timeout(Timeout::max(), 500, 0, 500, 0, 1000);
+  port1->setTimeout(timeout);
+  EXPECT_EQ(1000u, port1->getTimeout().unit_ns);
+  timeval start;
+  gettimeofday(&start, NULL);
+  EXPECT_EQ(string(""), port1->read());
+  long elapsed = elapsed_us(start);
+  EXPECT_GE(elapsed, 500);
+  EXPECT_LT(elapsed, 5000);
+}
+
+#if __cplusplus >= 201103L
+TEST(TimeoutTests, chronoDurations) {
+  Timeout simple = Timeout::simpleTimeout(std::chrono::microseconds(1500));
+  EXPECT_EQ(Timeout::max(), simple.inter_byte_timeout);
+  EXPECT_EQ(1500000u, simple.read_timeout_constant);
+  EXPECT_EQ(1u, simple.unit_ns);
+
+  // Too long for nanoseconds, kept in microseconds, rounded up.
+  Timeout mixed(std::chrono::nanoseconds(1001), std::chrono::seconds(10),
+                std::chrono::microseconds(87), std::chrono::milliseconds(5),
+                std::chrono::nanoseconds::zero());
+  EXPECT_EQ(1000u, mixed.unit_ns);
+  EXPECT_EQ(2u, mixed.inter_byte_timeout);
+  EXPECT_EQ(10000000u, mixed.read_timeout_constant);
+  EXPECT_EQ(87u, mixed.read_timeout_multiplier);
+  EXPECT_EQ(5000u, mixed.write_timeout_constant);
+  EXPECT_EQ(0u, mixed.write_timeout_multiplier);
+}
+#endif
+
+TEST_F(SerialTests, readDeadline) {
+  // The port's timeout is 250ms, the deadline bounds the call instead.
+  timeval start;
+  gettimeofday(&start, NULL);
+  string r;
+  EXPECT_EQ(0u, port1->read(r, 4, Deadline::fromNow(20)));
+  long elapsed = elapsed_us(start);
+  EXPECT_GE(elapsed, 20000);
+  EXPECT_LT(elapsed, 200000);
+  EXPECT_EQ(250u, port1->getTimeout().read_timeout_constant);
+
+  // A passed deadline still returns what was already received.
+  write(master_fd, "ab", 2);
+  usleep(1000);
+  EXPECT_EQ(2u, port1->read(r, 4, Deadline::fromNow(0)));
+  EXPECT_EQ(string("ab"), r);
+}
+
+void *write_cd_later(void *arg) {
+  usleep(20000);
+  write(*static_cast<int *>(arg), "cd", 2);
+  return NULL;
+}
+
+TEST_F(SerialTests, readTimestamped) {
+  // Ten bits of 8680 ns each, at 115200 baud.
+  const uint64_t byte_time_ns = 86800;
+  write(master_fd, "ab", 2);
+  usleep(1000);
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, write_cd_later, &master_fd));
+  uint64_t start_ns = Deadline::now();
+  uint8_t buffer[4];
+  vector<TimestampedChunk> chunks;
+  EXPECT_EQ(4u, port1->readTimestamped(buffer, 4, chunks));
+  pthread_join(thread, NULL);
+  EXPECT_EQ(string("abcd"), string(reinterpret_cast<char *>(buffer), 4));
+
+  ASSERT_EQ(2u, chunks.size());
+  // Bytes which were waiting already only get a bound.
+  EXPECT_FALSE(chunks[0].waited);
+  EXPECT_EQ(0u, chunks[0].offset);
+  EXPECT_EQ(2u, chunks[0].size);
+  EXPECT_LT(chunks[0].timestamp_ns - start_ns, 10000000u);
+  EXPECT_EQ(chunks[0].timestamp_ns - 2 * byte_time_ns,
+            chunks[0].first_byte_ns);
+
+  EXPECT_TRUE(chunks[1].waited);
+  EXPECT_EQ(2u, chunks[1].offset);
+  EXPECT_EQ(2u, chunks[1].size);
+  EXPECT_GE(chunks[1].timestamp_ns - start_ns, 15000000u);
+  EXPECT_EQ(chunks[1].timestamp_ns - 2 * byte_time_ns,
+            chunks[1].first_byte_ns);
+}
+
+TEST_F(SerialTests, readlineDeadline) {
+  // The deadline covers the whole line, not each byte.
+  write(master_fd, "abc", 3);
+  timeval start;
+  gettimeofday(&start, NULL);
+  string line;
+  EXPECT_EQ(3u, port1->readline(line, 65536, "\n", Deadline::fromNow(30)));
+  EXPECT_LT(elapsed_us(start), 200000);
+  EXPECT_EQ(string("abc"), line);
+
+  write(master_fd, "de\nf", 4);
+  line.clear();
+  EXPECT_EQ(3u, port1->readline(line, 65536, "\n", Deadline::fromNow(100)));
+  EXPECT_EQ(string("de\n"), line);
+  EXPECT_EQ(string("f"), port1->read(1));
+}
+
+TEST_F(SerialTests, writeDeadline) {
+  // Pacing counts against a deadline, so only part of the data goes out.
+  port1->setWriteRate(WriteRate::bytesPerSecond(1000));
+  string data(100, 'x');
+  timeval start;
+  gettimeofday(&start, NULL);
+  size_t written = port1->write(data, Deadline::fromNow(20));
+  EXPECT_LT(elapsed_us(start), 60000);
+  EXPECT_GT(written, 0u);
+  EXPECT_LT(written, 40u);
+
+  port1->setWriteRate(WriteRate::unlimited());
+  EXPECT_EQ(data.size(), port1->write(data, Deadline::never()));
+}
+
+TEST_F(SerialTests, transactWaitsForReply) {
+  // The pty keeps the reply until transact has written the request.
+  write(master_fd, "OK\r\nnext", 8);
+  EXPECT_EQ(string("OK\r\n"),
+            port1->transact("AT\r\n", LineMatcher("\r\n"),
+                            Deadline::fromNow(100)));
+  char buf[5] = "";
+  EXPECT_EQ(4, read(master_fd, buf, 4));
+  EXPECT_EQ(string("AT\r\n"), string(buf, 4));
+  // Bytes which were there with the reply are read with it and dropped.
+  EXPECT_EQ(0u, port1->available());
+
+  EXPECT_EQ(string(""), port1->transact("AT\r\n", LineMatcher("\r\n"),
+                                        Deadline::fromNow(20)));
+
+  // A long reply which is there at once takes a single read.
+  string reply = string(1000, 'r') + "\r\n";
+  write(master_fd, reply.data(), reply.size());
+  port1->resetStats();
+  EXPECT_EQ(reply, port1->transact("AT\r\n", LineMatcher("\r\n"),
+                                   Deadline::fromNow(100)));
+  EXPECT_EQ(1u, port1->getStats().read_calls);
+}
+
+// Requests and replies are lines starting with a one character tag.
+class TagMatcher : public LineMatcher {
+public:
+  virtual uint32_t requestTag (const uint8_t *request, size_t) const {
+    return request[0];
+  }
+  virtual uint32_t replyTag (const uint8_t *reply, size_t) const {
+    return reply[0];
+  }
+};
+
+// Answers the requests it has seen each time the line goes quiet, newest
+// first, after an unsolicited line.  Request 5 gets no reply.
+struct Responder {
+  int fd;
+  volatile bool stop;
+  size_t most_outstanding;
+  string requests;
+};
+
+void *respond(void *arg) {
+  Responder &r = *static_cast<Responder*>(arg);
+  string received;
+  vector<string> pending;
+  while (!r.stop) {
+    pollfd pfd = { r.fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 5) > 0) {
+      char buf[64];
+      ssize_t n = read(r.fd, buf, sizeof(buf));
+      if (n <= 0) {
+        break;
+      }
+      received.append(buf, n);
+      r.requests.append(buf, n);
+      size_t eol;
+      while ((eol = received.find('\n')) != string::npos) {
+        pending.push_back(received.substr(0, eol + 1));
+        received.erase(0, eol + 1);
+      }
+      r.most_outstanding = std::max(r.most_outstanding, pending.size());
+    } else if (!pending.empty()) {
+      string replies = "9 unsolicited\n";
+      for (size_t i = pending.size(); i-- > 0;) {
+        if (pending[i][0] != '5') {
+          replies += pending[i][0] + string(" ok\n");
+        }
+      }
+      write(r.fd, replies.data(), replies.size());
+      pending.clear();
+    }
+  }
+  return NULL;
+}
+
+TEST_F(SerialTests, transactRoutesPipelinedReplies) {
+  vector<Exchange> exchanges;
+  exchanges.push_back(Exchange("1 get\n"));
+  exchanges.push_back(Exchange("2 get\n"));
+  exchanges.push_back(Exchange("3 get\n"));
+  exchanges.push_back(Exchange("4 get\n"));
+  exchanges.push_back(Exchange("5 get\n"));
+  exchanges.push_back(Exchange("6 get\n"));
+
+  Responder responder = { master_fd, false, 0, "" };
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, respond, &responder));
+  timeval start;
+  gettimeofday(&start, NULL);
+  size_t completed = port1->transact(exchanges, TagMatcher(),
+                                     Deadline::fromNow(100), 3);
+  long elapsed = elapsed_us(start);
+  responder.stop = true;
+  pthread_join(thread, NULL);
+
+  EXPECT_EQ(5u, completed);
+  EXPECT_GE(elapsed, 100000);
+  EXPECT_LE(responder.most_outstanding, 3u);
+  EXPECT_EQ(string("1 get\n2 get\n3 get\n4 get\n5 get\n6 get\n"),
+            responder.requests);
+  for (size_t i = 0; i < exchanges.size(); ++i) {
+    if (i == 4) {
+      EXPECT_FALSE(exchanges[i].done);
+      EXPECT_EQ(string(""), exchanges[i].reply);
+    } else {
+      EXPECT_TRUE(exchanges[i].done);
+      EXPECT_EQ(exchanges[i].request[0] + string(" ok\n"), exchanges[i].reply);
+    }
+  }
+
+  EXPECT_THROW(port1->transact(exchanges, TagMatcher(),
+                               Deadline::fromNow(0), 0),
+               std::invalid_argument);
+}
+
 TEST_F(SerialTests, partialRead) {
   // Write some data, but request more than was written.
   write(master_fd, "abc\n", 4);
@@ -103,6 +365,424 @@ TEST_F(SerialTests, partialRead) {
   EXPECT_EQ(r, string("abc\n"));
 }
 
+TEST_F(SerialTests, statsCountReadsAndWrites) {
+  port1->resetStats();
+  write(master_fd, "abc\n", 4);
+  EXPECT_EQ(port1->read(4), string("abc\n"));
+  // Times out after returning what was there.
+  write(master_fd, "de", 2);
+  EXPECT_EQ(port1->read(4), string("de"));
+  port1->write("xyz\n");
+
+  Stats stats = port1->getStats();
+  EXPECT_EQ(6u, stats.bytes_read);
+  EXPECT_EQ(4u, stats.bytes_written);
+  EXPECT_EQ(2u, stats.read_calls);
+  EXPECT_EQ(1u, stats.write_calls);
+  EXPECT_EQ(1u, stats.timeouts);
+  EXPECT_LE(4u, stats.syscalls);
+  EXPECT_EQ(2u, stats.read_wait.count);
+  EXPECT_EQ(1u, stats.write_completion.count);
+  EXPECT_GE(stats.write_completion.max_ns,
+            stats.write_completion.percentile(0.5));
+
+  port1->resetStats();
+  stats = port1->getStats();
+  EXPECT_EQ(0u, stats.bytes_read);
+  EXPECT_EQ(0u, stats.read_wait.count);
+}
+
+TEST(LatencyHistogramTests, buckets) {
+  // Every bucket starts right after the previous one ends.
+  for (size_t i = 0; i + 1 < LatencyHistogram::bucket_count; i++) {
+    uint64_t lower = LatencyHistogram::bucketLowerBound(i);
+    uint64_t next = LatencyHistogram::bucketLowerBound(i + 1);
+    ASSERT_LT(lower, next);
+    EXPECT_EQ(i, LatencyHistogram::bucketIndex(lower));
+    EXPECT_EQ(i, LatencyHistogram::bucketIndex(next - 1));
+    // Sub-buckets are at most 1/8th of the values they hold.
+    EXPECT_LE((next - lower) * 8, std::max(next, uint64_t(8)));
+  }
+  EXPECT_EQ(LatencyHistogram::bucket_count - 1,
+            LatencyHistogram::bucketIndex(~uint64_t(0)));
+
+  LatencyHistogram h;
+  for (uint64_t ns = 1000; ns <= 100000; ns += 1000) {
+    h.buckets[LatencyHistogram::bucketIndex(ns)]++;
+    h.count++;
+    h.total_ns += ns;
+    h.max_ns = ns;
+  }
+  EXPECT_EQ(50500u, h.mean());
+  EXPECT_NEAR(50000.0, static_cast<double>(h.percentile(0.5)), 50000 / 8.0);
+  EXPECT_NEAR(99000.0, static_cast<double>(h.percentile(0.99)), 99000 / 8.0);
+  EXPECT_EQ(100000u, h.percentile(1.0));
+}
+
+class OverrunCounter : public LineMonitorHandler {
+public:
+  virtual void onOverrun (const LineCounters &, const LineCounters &) {}
+};
+
+TEST_F(SerialTests, lineCountersNeedDriverSupport) {
+  // Pseudo terminals have no UART, so the driver keeps no counters.
+  OverrunCounter handler;
+  EXPECT_THROW(port1->getLineCounters(), SerialException);
+  EXPECT_THROW(port1->startLineMonitor(handler), SerialException);
+  port1->stopLineMonitor();
+}
+
+TEST(LineCountersTests, sinceHandlesWrapAround) {
+  LineCounters earlier, later;
+  earlier.rx = 0xFFFFFFF0u;
+  later.rx = 0x10;
+  earlier.overrun = 3;
+  later.overrun = 5;
+  LineCounters delta = later.since(earlier);
+  EXPECT_EQ(0x20u, delta.rx);
+  EXPECT_EQ(2u, delta.overrun);
+  EXPECT_EQ(0u, delta.buf_overrun);
+}
+
+class DrainCounter : public DrainHandler {
+public:
+  DrainCounter() : calls(0) {}
+  virtual void onDrained () { ++calls; }
+  volatile int calls;
+};
+
+TEST_F(SerialTests, drainNotification) {
+  // A pty hands written bytes straight to the master side, so the output
+  // queue is empty as soon as write returns.
+  port1->write("abc\n");
+  EXPECT_EQ(0u, port1->outputQueueBytes());
+  EXPECT_TRUE(port1->waitDrained(100));
+
+  DrainCounter handler;
+  port1->onDrained(handler);
+  for (int i = 0; i < 100 && handler.calls == 0; ++i) {
+    usleep(1000);
+  }
+  port1->cancelDrained();
+  EXPECT_EQ(1, handler.calls);
+
+  port1->close();
+  EXPECT_THROW(port1->outputQueueBytes(), PortNotOpenedException);
+  EXPECT_THROW(port1->onDrained(handler), PortNotOpenedException);
+}
+
+// Queues a block each time the output drains, for a number of blocks.
+class BlockQueuer : public DrainHandler {
+public:
+  BlockQueuer(Serial *port, int blocks)
+    : port(port), blocks(blocks), calls(0) {}
+  virtual void onDrained () {
+    port->write("block\n");
+    if (++calls < blocks) {
+      port->onDrained(*this);
+    } else {
+      port->cancelDrained();
+    }
+  }
+  Serial *port;
+  int blocks;
+  volatile int calls;
+};
+
+TEST_F(SerialTests, drainNotificationRearmedFromHandler) {
+  BlockQueuer queuer(port1, 5);
+  port1->onDrained(queuer);
+  for (int i = 0; i < 1000 && queuer.calls < 5; ++i) {
+    usleep(1000);
+  }
+  usleep(20000);
+  EXPECT_EQ(5, queuer.calls);
+  port1->cancelDrained();
+
+  string received;
+  pollfd pfd = { master_fd, POLLIN, 0 };
+  while (received.size() < 30 && poll(&pfd, 1, 100) > 0) {
+    char buffer[64];
+    ssize_t n = read(master_fd, buffer, sizeof(buffer));
+    if (n <= 0) {
+      break;
+    }
+    received.append(buffer, n);
+  }
+  EXPECT_EQ("block\nblock\nblock\nblock\nblock\n", received);
+
+  // A new notification after the re-armed ones works as before.
+  DrainCounter handler;
+  port1->onDrained(handler);
+  for (int i = 0; i < 100 && handler.calls == 0; ++i) {
+    usleep(1000);
+  }
+  port1->cancelDrained();
+  EXPECT_EQ(1, handler.calls);
+}
+
+TEST(WritePacerTests, tokenBucket) {
+  WritePacer pacer;
+  pacer.configure(WriteRate::bytesPerSecond(1000, 4), 0);
+  ASSERT_TRUE(pacer.enabled());
+  EXPECT_EQ(4u, pacer.chunk(10));
+  EXPECT_EQ(3u, pacer.chunk(3));
+
+  // A full bucket lets the burst through at once.
+  uint64_t now = 5000000000ULL;
+  EXPECT_EQ(now, pacer.readyAt(4, now));
+  pacer.sent(4, now);
+  // Then a byte per millisecond, without drifting with late writes.
+  EXPECT_EQ(now + 1000000, pacer.readyAt(1, now));
+  EXPECT_EQ(now + 4000000, pacer.readyAt(4, now));
+  pacer.sent(4, now + 4000000);
+  EXPECT_EQ(now + 8000000, pacer.readyAt(4, now + 4000100));
+  // Idle time refills the bucket.
+  EXPECT_EQ(now + 60000000, pacer.readyAt(4, now + 60000000));
+
+  pacer.configure(WriteRate::lineFraction(0.5), 86806);
+  pacer.sent(1, now);
+  EXPECT_EQ(now + 173612, pacer.readyAt(1, now));
+
+  pacer.configure(WriteRate::unlimited(), 86806);
+  EXPECT_FALSE(pacer.enabled());
+}
+
+TEST_F(SerialTests, writeRateLimits) {
+  port1->setWriteRate(WriteRate::bytesPerSecond(20000, 100));
+  EXPECT_EQ(20000u, port1->getWriteRate().bytes_per_second);
+  EXPECT_EQ(100u, port1->getWriteRate().burst);
+
+  // The first 100 bytes go at once, the other 1000 take 50ms.
+  string data(1100, 'x');
+  timeval start;
+  gettimeofday(&start, NULL);
+  EXPECT_EQ(data.size(), port1->write(data));
+  long elapsed = elapsed_us(start);
+  EXPECT_GE(elapsed, 49000);
+  EXPECT_LT(elapsed, 150000);
+
+  port1->setWriteRate(WriteRate::unlimited());
+  EXPECT_EQ(data.size(), port1->write(data));
+}
+
+// Reads the master side in 4KB pieces, a millisecond apart.
+struct SlowReader {
+  int fd;
+  volatile bool stop;
+  string received;
+};
+
+void *read_slowly(void *arg) {
+  SlowReader &r = *static_cast<SlowReader*>(arg);
+  while (!r.stop) {
+    pollfd pfd = { r.fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 5) > 0) {
+      char buf[4096];
+      ssize_t n = read(r.fd, buf, sizeof(buf));
+      if (n <= 0) {
+        break;
+      }
+      r.received.append(buf, n);
+      usleep(1000);
+    }
+  }
+  return NULL;
+}
+
+struct BulkWrite {
+  Serial *port;
+  string data;
+  size_t written;
+};
+
+void *write_bulk(void *arg) {
+  BulkWrite &w = *static_cast<BulkWrite*>(arg);
+  w.written = w.port->write(w.data, priority_bulk);
+  return NULL;
+}
+
+TEST_F(SerialTests, highPriorityWriteBypassesBulk) {
+  EXPECT_EQ(10000u, port1->getBulkLatency());
+  port1->setTimeout(Timeout::max(), 250, 0, 5000, 0);
+  SlowReader reader = { master_fd, false, "" };
+  BulkWrite bulk = { port1, string(400000, 'x'), 0 };
+  pthread_t reader_thread, bulk_thread;
+  ASSERT_EQ(0, pthread_create(&reader_thread, NULL, read_slowly, &reader));
+  ASSERT_EQ(0, pthread_create(&bulk_thread, NULL, write_bulk, &bulk));
+
+  usleep(20000);
+  timeval start;
+  gettimeofday(&start, NULL);
+  EXPECT_EQ(4u, port1->write(string("STOP"), priority_high));
+  long elapsed = elapsed_us(start);
+
+  pthread_join(bulk_thread, NULL);
+  while (reader.received.size() < bulk.data.size() + 4) {
+    usleep(1000);
+  }
+  reader.stop = true;
+  pthread_join(reader_thread, NULL);
+
+  EXPECT_EQ(bulk.data.size(), bulk.written);
+  // The urgent write went in between two chunks, long before the bulk
+  // transfer was done.
+  EXPECT_LT(elapsed, 20000);
+  size_t at = reader.received.find("STOP");
+  ASSERT_NE(string::npos, at);
+  EXPECT_EQ(string::npos, reader.received.find_first_not_of('x', at + 4));
+  EXPECT_LT(at, bulk.data.size() / 2);
+}
+
+struct LaneWrite {
+  Serial *port;
+  string data;
+  priority_t priority;
+  size_t written;
+};
+
+void *write_in_lane(void *arg) {
+  LaneWrite &w = *static_cast<LaneWrite*>(arg);
+  w.written = w.port->write(w.data, w.priority);
+  return NULL;
+}
+
+TEST_F(SerialTests, lanesWaitWithoutSpinning) {
+  port1->setTimeout(Timeout::max(), 250, 0, 300, 0);
+  // Nothing reads yet, so this holds the write lock for its whole timeout.
+  LaneWrite hog = { port1, string(1 << 20, 'a'), priority_normal, 0 };
+  pthread_t hog_thread;
+  ASSERT_EQ(0, pthread_create(&hog_thread, NULL, write_in_lane, &hog));
+  usleep(20000);
+
+  vector<LaneWrite> writes;
+  LaneWrite high = { port1, "HIGH", priority_high, 0 };
+  LaneWrite normal = { port1, "norm", priority_normal, 0 };
+  LaneWrite bulk = { port1, string(100, 'b'), priority_bulk, 0 };
+  writes.push_back(normal);
+  writes.push_back(bulk);
+  writes.push_back(high);
+  writes.push_back(normal);
+  writes.push_back(bulk);
+  vector<pthread_t> threads(writes.size());
+  for (size_t i = 0; i < writes.size(); ++i) {
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, write_in_lane,
+                                &writes[i]));
+  }
+  usleep(20000);
+
+  // The waiting writers sleep, they do not take turns at the lock.
+  timespec cpu_start, cpu_end;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+  usleep(150000);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+  long cpu_us = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000
+                + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1000;
+  EXPECT_LT(cpu_us, 30000);
+
+  SlowReader reader = { master_fd, false, "" };
+  pthread_t reader_thread;
+  ASSERT_EQ(0, pthread_create(&reader_thread, NULL, read_slowly, &reader));
+  pthread_join(hog_thread, NULL);
+  size_t total = hog.written;
+  for (size_t i = 0; i < writes.size(); ++i) {
+    pthread_join(threads[i], NULL);
+    EXPECT_EQ(writes[i].data.size(), writes[i].written);
+    total += writes[i].written;
+  }
+  for (int i = 0; i < 1000 && reader.received.size() < total; ++i) {
+    usleep(1000);
+  }
+  reader.stop = true;
+  pthread_join(reader_thread, NULL);
+
+  // The high lane went first, then the normal lane, then the bulk lane.
+  string rest = reader.received.substr(hog.written);
+  EXPECT_EQ(0u, rest.find("HIGHnormnorm"));
+  EXPECT_EQ(string(200, 'b'), rest.substr(12));
+}
+
+TEST_F(SerialTests, flightRecorderKeepsRecentTraffic) {
+  EXPECT_TRUE(port1->getFlightRecord().empty());
+  port1->enableFlightRecorder();
+  port1->write(string("AT\r"));
+  write(master_fd, "OK\r\n", 4);
+  EXPECT_EQ("OK\r\n", port1->read(4));
+
+  vector<RecordedChunk> record = port1->getFlightRecord();
+  ASSERT_EQ(2u, record.size());
+  EXPECT_LE(record[0].timestamp_ns, record[1].timestamp_ns);
+  // Within one clock tick the directions may come in either order.
+  size_t tx = record[0].written ? 0 : 1;
+  EXPECT_TRUE(record[tx].written);
+  EXPECT_EQ("AT\r", record[tx].data);
+  EXPECT_FALSE(record[1 - tx].written);
+  EXPECT_EQ("OK\r\n", record[1 - tx].data);
+
+  port1->disableFlightRecorder();
+  EXPECT_TRUE(port1->getFlightRecord().empty());
+}
+
+class RecordKeeper : public FlightRecordHandler {
+public:
+  virtual void onFlightRecord(const vector<RecordedChunk> &record,
+                              const std::exception &error) {
+    this->record = record;
+    this->error = error.what();
+  }
+
+  vector<RecordedChunk> record;
+  string error;
+};
+
+TEST_F(SerialTests, flightRecordOnDisconnect) {
+  RecordKeeper keeper;
+  port1->enableFlightRecorder(4096);
+  port1->setFlightRecordHandler(&keeper);
+  write(master_fd, "last words", 10);
+  EXPECT_EQ("last words", port1->read(10));
+  close(master_fd);
+
+  EXPECT_THROW(port1->read(1), SerialException);
+  EXPECT_NE(string::npos, keeper.error.find("disconnected"));
+  ASSERT_EQ(1u, keeper.record.size());
+  EXPECT_EQ("last words", keeper.record[0].data);
+  port1->setFlightRecordHandler(NULL);
+}
+
+TEST(FlightRecorderTests, keepsTheLastBytes) {
+  FlightRecorder recorder(64);
+  for (int i = 0; i < 20; i++) {
+    recorder.record(i % 2 == 1, reinterpret_cast<const uint8_t *>(
+                      string(10, 'a' + i).data()), 10);
+  }
+  vector<RecordedChunk> record = recorder.snapshot();
+  // 64 bytes per direction: 4 whole chunks and the end of a fifth.
+  size_t received = 0, written = 0;
+  for (size_t i = 0; i < record.size(); i++) {
+    (record[i].written ? written : received) += record[i].data.size();
+  }
+  EXPECT_EQ(64u, received);
+  EXPECT_EQ(64u, written);
+  ASSERT_FALSE(record.empty());
+  EXPECT_EQ(string(10, 'a' + 19), record.back().data);
+
+  // A chunk larger than the ring keeps its end.
+  string big(100, 'x');
+  big[99] = 'y';
+  recorder.record(false, reinterpret_cast<const uint8_t *>(big.data()),
+                  big.size());
+  record = recorder.snapshot();
+  bool found = false;
+  for (size_t i = 0; i < record.size(); i++) {
+    if (!record[i].written) {
+      EXPECT_EQ(big.substr(36), record[i].data);
+      found = true;
+    }
+  }
+  EXPECT_TRUE(found);
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {